@@ -66,16 +66,23 @@ extern char	*gsUserFlags;
 extern int	giNumItems;
 extern tItem	*gaItems;
 
+extern const char	*gsDispenseServer;
+extern int	giDispensePort;
+
 extern int	RunRegex(regex_t *regex, const char *str, int nMatches, regmatch_t *matches, const char *errmsg);
 
-extern int	ShowNCursesUI(void);
+extern int	ShowNCursesUI(int WatchSocket);
 
 extern int	OpenConnection(const char *Host, int Port);
 extern int	Authenticate(int Socket);
 extern int	GetUserBalance(int Socket);
 extern void	PopulateItemList(int Socket);
+extern int	Dispense_WatchItems(int Socket);
+extern int	Dispense_ReadItemUpdate(int Socket);
+extern int	ReadLine_HasBuffered(void);
 extern int	Dispense_ItemInfo(int Socket, const char *Type, int ID);
 extern int	DispenseItem(int Socket, const char *Type, int ID);
+extern int	DispenseItems(int Socket, const char *Type, int ID, int Count, int *Dispensed);
 extern int	Dispense_AlterBalance(int Socket, const char *Username, int Ammount, const char *Reason);
 extern int	Dispense_SetBalance(int Socket, const char *Username, int Balance, const char *Reason);
 extern int	Dispense_Give(int Socket, const char *Username, int Ammount, const char *Reason);
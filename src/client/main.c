@@ -714,7 +714,14 @@ int main(int argc, char *argv[])
 			
 			ret = Authenticate(sock);
 			if(ret)	return ret;
-			ret = DispenseItem(sock, ident, id);
+			if( giDispenseCount == 1 ) {
+				ret = DispenseItem(sock, ident, id);
+			}
+			else {
+				 int	count;
+				ret = DispenseItems(sock, ident, id, giDispenseCount, &count);
+				printf("%i items dispensed\n", count);
+			}
 			close(sock);
 			return ret;
 		}
@@ -773,7 +780,17 @@ int main(int argc, char *argv[])
 	}
 	else if( giUIMode != UI_MODE_BASIC )
 	{
-		i = ShowNCursesUI();
+		// Keep a connection open so the menu can show live item updates
+		 int	watchSock = OpenConnection(gsDispenseServer, giDispensePort);
+		if( watchSock >= 0 && Dispense_WatchItems(watchSock) ) {
+			close(watchSock);
+			watchSock = -1;
+		}
+		
+		i = ShowNCursesUI(watchSock);
+		
+		if( watchSock >= 0 )
+			close(watchSock);
 	}
 	else
 	{
@@ -827,9 +844,13 @@ int main(int argc, char *argv[])
 		ret = Authenticate(sock);
 		if(ret)	return ret;
 		
-		for( j = 0; j < giDispenseCount; j ++ ) {
+		if( giDispenseCount == 1 ) {
 			ret = DispenseItem(sock, gaItems[i].Type, gaItems[i].ID);
-			if( ret )	break;
+			j = 1;
+		}
+		else {
+			// All or nothing
+			ret = DispenseItems(sock, gaItems[i].Type, gaItems[i].ID, giDispenseCount, &j);
 		}
 		if( j > 1 ) {
 			printf("%i items dispensed\n", j);
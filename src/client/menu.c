@@ -12,6 +12,7 @@
 #include <ncurses.h>
 #include <pwd.h>	// getpwuids
 #include <unistd.h>	// getuid
+#include <poll.h>
 #include "common.h"
 
 // === CONSTANTS ===
@@ -20,6 +21,7 @@
 #define COLOURPAIR_SELECTED	2
 
 // === PROTOTYPES ===
+ int	WaitForInput(int WatchSocket);
  int	ShowItemAt(int Row, int Col, int Width, int Index, int bHilighted);
 void	PrintAlign(int Row, int Col, int Width, const char *Left, char Pad1, const char *Mid, char Pad2, const char *Right, ...);
 
@@ -28,8 +30,10 @@ void	PrintAlign(int Row, int Col, int Width, const char *Left, char Pad1, const
 // -------------------
 /**
  * \brief Render the NCurses UI
+ * \param WatchSocket	Connection with WATCH_ITEMS active (or -1), used to
+ *                   	update item statuses while the menu is open
  */
-int ShowNCursesUI(void)
+int ShowNCursesUI(int WatchSocket)
 {
 	 int	ch;
 	 int	i, times;
@@ -40,11 +44,10 @@ int ShowNCursesUI(void)
 	 int	maxItemIndex;
 	 int	itemBase = 0;
 	 int	currentItem;
-	 int	itemQuantity[];	// Number of items of [currentItem]
-	 			// Do I need to bother initializing to 0?
+	 int	*_ItemQuantity = NULL;	// Number of items of [currentItem]
 	 int	ret = -2;	// -2: Used for marking "no return yet"
 	
-	char	balance_str[5+1+2+1];	// If $9999.99 is too little, something's wrong
+	char	balance_str[1+9+1+2+1];	// $<int/100>.<cents> (sized for any int, keeps gcc happy)
 	char	*username;
 	struct passwd *pwd;
 	 
@@ -98,6 +101,32 @@ int ShowNCursesUI(void)
 		}
 	}
 
+	void _Layout(void)
+	{
+		// Get max index
+		maxItemIndex = ShowItemAt(0, 0, 0, -1, 0);
+		free(_ItemQuantity);
+		_ItemQuantity = calloc(maxItemIndex, sizeof(int));
+		// Get item count per screen
+		// - 6: randomly chosen (Need at least 3)
+		items_in_view = LINES - 6;
+		if( items_in_view > maxItemIndex )
+			items_in_view = maxItemIndex;
+		// Get first index
+		currentItem = 0;
+		itemBase = 0;
+		while( ShowItemAt(0, 0, 0, currentItem, 0) == -1 )
+			currentItem ++;
+		
+		// Get dimensions
+		height = items_in_view + 3;
+		width = displayMinWidth;
+		
+		// Get positions
+		xBase = COLS/2 - width/2;
+		yBase = LINES/2 - height/2;
+	}
+
 	// Get Username
 	if( gsEffectiveUser )
 		username = gsEffectiveUser;
@@ -117,26 +146,7 @@ int ShowNCursesUI(void)
 	init_pair(COLOURPAIR_SELECTED, COLOR_GREEN,  -1);	// Selected
 	cbreak(); noecho();
 	
-	// Get max index
-	maxItemIndex = ShowItemAt(0, 0, 0, -1, 0);
-	// Get item count per screen
-	// - 6: randomly chosen (Need at least 3)
-	items_in_view = LINES - 6;
-	if( items_in_view > maxItemIndex )
-		items_in_view = maxItemIndex;
-	// Get first index
-	currentItem = 0;
-	while( ShowItemAt(0, 0, 0, currentItem, 0) == -1 )
-		currentItem ++;
-	
-	
-	// Get dimensions
-	height = items_in_view + 3;
-	width = displayMinWidth;
-	
-	// Get positions
-	xBase = COLS/2 - width/2;
-	yBase = LINES/2 - height/2;
+	_Layout();
 	
 	for( ;; )
 	{
@@ -207,7 +217,25 @@ int ShowNCursesUI(void)
 			"q: Quit", ' ', "Arrows: Select", ' ', "Enter: Buy");
 		
 		
-		// Get input
+		// Get input (redrawing if the server sends an item update first)
+		if( WatchSocket != -1 )
+		{
+			refresh();	// getch() would normally do this
+			switch( WaitForInput(WatchSocket) )
+			{
+			case 0:	break;
+			case 1:
+				// Item list was replaced, redo the layout
+				if( ShowItemAt(0, 0, 0, -1, 0) != maxItemIndex ) {
+					_Layout();
+					clear();
+				}
+				continue;
+			default:
+				WatchSocket = -1;	// Lost the connection, stop watching
+				break;
+			}
+		}
 		ch = getch();
 		
 		if( ch == '\x1B' ) {
@@ -268,9 +296,47 @@ int ShowNCursesUI(void)
 	
 	// Leave
 	endwin();
+	free(_ItemQuantity);
 	return ret;
 }
 
+/**
+ * \brief Wait for a keypress, applying any item updates that arrive first
+ * \return 0 if a key is ready, 1 if items were updated, -1 if the watch connection failed
+ */
+int WaitForInput(int WatchSocket)
+{
+	struct pollfd	fds[2];
+	 int	bUpdated = 0;
+	
+	for( ;; )
+	{
+		// Apply updates that have already been read
+		while( ReadLine_HasBuffered() ) {
+			if( Dispense_ReadItemUpdate(WatchSocket) == -1 )
+				return -1;
+			bUpdated = 1;
+		}
+		if( bUpdated )
+			return 1;
+		
+		fds[0].fd = STDIN_FILENO;	fds[0].events = POLLIN;	fds[0].revents = 0;
+		fds[1].fd = WatchSocket;	fds[1].events = POLLIN;	fds[1].revents = 0;
+		if( poll(fds, 2, -1) < 0 )
+			return -1;
+		
+		if( fds[0].revents & POLLIN )
+			return 0;
+		
+		if( fds[1].revents )
+		{
+			if( Dispense_ReadItemUpdate(WatchSocket) == -1 )
+				return -1;
+			bUpdated = 1;
+		}
+	}
+}
+
 #define COKE_LABEL	"Coke Machine"
 #define NCOKESLOTS	7	// slots 0 -- 6
 #define EPS_LABEL	"Electronic Payment System"
@@ -22,11 +22,20 @@
 #include <limits.h>	// INT_MIN/INT_MAX
 #include <stdarg.h>
 #include <ctype.h>	// isdigit
+#include <sys/stat.h>	// mkdir
 #include "common.h"
 
+#define ENUM_USERS_PAGE_SIZE	100	// Users asked for at a time by Dispense_EnumUsers
+
 // === PROTOTYPES ===
 char	*ReadLine(int Socket);
  int	sendf(int Socket, const char *Format, ...);
+ int	ParseItemInfo(char *Line, tItem *Dest);
+ int	ReadItemList(int Socket, char *Header);
+ int	ItemCache_GetPath(char *Dest, size_t DestSize);
+ int	ItemCache_Load(const char *Path);
+void	ItemCache_Save(const char *Path, int Version);
+ int	_DispenseResponse(const char *Line);
 
 // ---------------------
 // --- Coke Protocol ---
@@ -355,14 +364,22 @@ int GetUserBalance(int Socket)
  */
 int ReadItemInfo(int Socket, tItem *Dest)
 {
-	char	*buf;
+	return ParseItemInfo( ReadLine(Socket), Dest );
+}
+
+/**
+ * \brief Parse an item info line
+ * \param Line	Line from the server (heap, will be free'd)
+ * \param Dest	Destination for the read item (strings will be on the heap)
+ */
+int ParseItemInfo(char *Line, tItem *Dest)
+{
+	char	*buf = Line;
 	 int	responseCode;
 	
 	regmatch_t	matches[8];
 	char	*statusStr;
 	
-	// Get item info
-	buf = ReadLine(Socket);
 	responseCode = atoi(buf);
 	
 	switch(responseCode)
@@ -420,49 +437,105 @@ int ReadItemInfo(int Socket, tItem *Dest)
 /**
  * \brief Fill the item information structure
  * \return Boolean Failure
+ * 
+ * Uses the on-disk item cache if the server reports that it is current
  */
 void PopulateItemList(int Socket)
 {
 	char	*buf;
 	 int	responseCode;
 	
-	char	*arrayType;
-	 int	count, i;
-	regmatch_t	matches[4];
+	 int	version;
+	char	cachePath[PATH_MAX];
+	 int	cacheVersion = -1;
+	
+	if( ItemCache_GetPath(cachePath, sizeof(cachePath)) == 0 )
+		cacheVersion = ItemCache_Load(cachePath);
 	
 	// Ask server for stock list
-	send(Socket, "ENUM_ITEMS\n", 11, 0);
+	if( cacheVersion != -1 )
+		sendf(Socket, "ENUM_ITEMS IF_NEWER %i\n", cacheVersion);
+	else
+		send(Socket, "ENUM_ITEMS\n", 11, 0);
 	buf = ReadLine(Socket);
 	
 	//printf("Output: %s\n", buf);
 	
 	responseCode = atoi(buf);
+	if( cacheVersion != -1 )
+	{
+		// Cached list is still current
+		if( responseCode == 200 ) {
+			free(buf);
+			return ;
+		}
+		
+		// Server doesn't do versions, ask again without one
+		if( responseCode == 407 ) {
+			free(buf);
+			send(Socket, "ENUM_ITEMS\n", 11, 0);
+			buf = ReadLine(Socket);
+			responseCode = atoi(buf);
+		}
+	}
 	if( responseCode != 201 ) {
 		fprintf(stderr, "Unknown response from dispense server (Response Code %i)\n", responseCode);
 		exit(RV_UNKNOWN_ERROR);
 	}
 	
-	// - Get item list -
+	version = ReadItemList(Socket, buf);
+	if( version < 0 )
+		exit(RV_UNKNOWN_ERROR);
+	
+	if( version > 0 && cachePath[0] )
+		ItemCache_Save(cachePath, version);
+}
+
+/**
+ * \brief Read an item list from the server, replacing the current list
+ * \param Header	The "201 Items" line that started the list (heap, will be free'd)
+ * \return Item table version (0 if not sent), -1 on error
+ */
+int ReadItemList(int Socket, char *Header)
+{
+	char	*buf = Header;
+	 int	responseCode;
+	
+	char	*arrayType;
+	 int	count, version, i;
+	regmatch_t	matches[4];
 	
 	// Expected format:
-	//  201 Items <count>
+	//  201 Items <count> [<version>]
 	//  202 Item <count>
-	RunRegex(&gArrayRegex, buf, 4, matches, "Malformed server response");
+	if( RunRegex(&gArrayRegex, buf, 4, matches, "Malformed server response") ) {
+		free(buf);
+		return -1;
+	}
 		
 	arrayType = &buf[ matches[2].rm_so ];	buf[ matches[2].rm_eo ] = '\0';
 	count = atoi( &buf[ matches[3].rm_so ] );
+	version = atoi( &buf[ matches[3].rm_eo ] );	// 0 if not sent
 		
 	// Check array type
 	if( strcmp(arrayType, "Items") != 0 ) {
 		// What the?!
 		fprintf(stderr, "Unexpected array type, expected 'Items', got '%s'\n",
 			arrayType);
-		exit(RV_UNKNOWN_ERROR);
+		free(buf);
+		return -1;
 	}
 	free(buf);
 	
+	// Clear out the old list
+	for( i = 0; i < giNumItems; i ++ ) {
+		free(gaItems[i].Type);
+		free(gaItems[i].Desc);
+	}
+	free(gaItems);
+	
 	giNumItems = count;
-	gaItems = malloc( giNumItems * sizeof(tItem) );
+	gaItems = calloc( giNumItems, sizeof(tItem) );
 	
 	// Fetch item information
 	for( i = 0; i < giNumItems; i ++ )
@@ -478,12 +551,205 @@ void PopulateItemList(int Socket)
 		fprintf(stderr, "Unknown response from dispense server %i\n'%s'",
 			responseCode, buf
 			);
-		exit(-1);
+		free(buf);
+		return -1;
 	}
 	
 	free(buf);
+	
+	return version;
+}
+
+/**
+ * \brief Subscribe to item updates (replacing the item list)
+ * \return Boolean Failure
+ */
+int Dispense_WatchItems(int Socket)
+{
+	char	*buf;
+	
+	sendf(Socket, "WATCH_ITEMS\n");
+	buf = ReadLine(Socket);
+	if( atoi(buf) != 201 ) {
+		free(buf);
+		return 1;
+	}
+	
+	return ReadItemList(Socket, buf) < 0;
+}
+
+/**
+ * \brief Read an update pushed by the server (after Dispense_WatchItems)
+ * \return Index of the updated item, -2 if the whole list changed, -1 on error
+ */
+int Dispense_ReadItemUpdate(int Socket)
+{
+	char	*buf;
+	tItem	item;
+	 int	i;
+	
+	buf = ReadLine(Socket);
+	switch( atoi(buf) )
+	{
+	case 201:
+		if( ReadItemList(Socket, buf) < 0 )
+			return -1;
+		return -2;
+	case 202:
+		if( ParseItemInfo(buf, &item) )
+			return -1;
+		break;
+	default:
+		free(buf);
+		return -1;
+	}
+	
+	for( i = 0; i < giNumItems; i ++ )
+	{
+		if( gaItems[i].ID != item.ID )	continue;
+		if( strcmp(gaItems[i].Type, item.Type) != 0 )	continue;
+		
+		free(gaItems[i].Desc);
+		gaItems[i].Desc = item.Desc;
+		gaItems[i].Price = item.Price;
+		gaItems[i].Status = item.Status;
+		free(item.Type);
+		return i;
+	}
+	
+	// Not an item we know about, the list will be resent if it changed
+	free(item.Type);
+	free(item.Desc);
+	return -2;
 }
 
+/**
+ * \brief Get the item cache file for the current server
+ * \return Boolean Failure (caching unavaliable)
+ * 
+ * The cache lives in $XDG_CACHE_HOME/opendispense2/ (defaulting to
+ * ~/.cache/), one file per server/port.
+ */
+int ItemCache_GetPath(char *Dest, size_t DestSize)
+{
+	const char	*base = getenv("XDG_CACHE_HOME");
+	char	dir[PATH_MAX];
+	char	*pos;
+	
+	Dest[0] = '\0';
+	
+	// Don't write files into the user's home with someone else's privileges
+	if( geteuid() != getuid() )
+		return 1;
+	
+	if( base && base[0] == '/' ) {
+		mkdir(base, 0700);
+		snprintf(dir, sizeof(dir), "%s/opendispense2", base);
+	}
+	else {
+		const char	*home = getenv("HOME");
+		if( !home || !home[0] )
+			return 1;
+		snprintf(dir, sizeof(dir), "%s/.cache", home);
+		mkdir(dir, 0700);
+		snprintf(dir, sizeof(dir), "%s/.cache/opendispense2", home);
+	}
+	mkdir(dir, 0700);
+	
+	if( snprintf(Dest, DestSize, "%s/items-%s-%i", dir, gsDispenseServer, giDispensePort) >= (int)DestSize ) {
+		Dest[0] = '\0';
+		return 1;
+	}
+	
+	// Server names shouldn't have slashes, but be safe
+	for( pos = Dest + strlen(dir) + 1; *pos; pos ++ )
+		if( *pos == '/' )	*pos = '_';
+	
+	return 0;
+}
+
+/**
+ * \brief Load the cached item list into gaItems
+ * \return Item table version of the cached list, -1 if there's no usable cache
+ */
+int ItemCache_Load(const char *Path)
+{
+	FILE	*fp;
+	char	line[BUFSIZ];
+	 int	version, count, i;
+	tItem	*items;
+	
+	fp = fopen(Path, "r");
+	if( !fp )	return -1;
+	
+	if( fscanf(fp, "%i %i\n", &version, &count) != 2 || version <= 0 || count < 0 ) {
+		fclose(fp);
+		return -1;
+	}
+	
+	items = calloc( count, sizeof(tItem) );
+	for( i = 0; i < count; i ++ )
+	{
+		char	type[64];
+		 int	ofs = -1;
+		char	*desc;
+		
+		if( !fgets(line, sizeof(line), fp) )	break;
+		
+		// <type>\t<id>\t<status>\t<price>\t<description>
+		if( sscanf(line, "%63[^\t]\t%i\t%i\t%i\t%n", type,
+				&items[i].ID, &items[i].Status, &items[i].Price, &ofs) != 4 || ofs == -1 )
+			break;
+		desc = line + ofs;
+		desc[ strcspn(desc, "\n") ] = '\0';
+		
+		items[i].Type = strdup(type);
+		items[i].Desc = strdup(desc);
+	}
+	fclose(fp);
+	
+	// Truncated/corrupt cache
+	if( i != count ) {
+		while( i -- ) {
+			free(items[i].Type);
+			free(items[i].Desc);
+		}
+		free(items);
+		return -1;
+	}
+	
+	giNumItems = count;
+	gaItems = items;
+	return version;
+}
+
+/**
+ * \brief Save the current item list to the cache
+ */
+void ItemCache_Save(const char *Path, int Version)
+{
+	char	tmpPath[PATH_MAX];
+	FILE	*fp;
+	 int	i;
+	
+	// Write to a temporary and rename, so readers never see a partial file
+	if( snprintf(tmpPath, sizeof(tmpPath), "%s.%i", Path, getpid()) >= (int)sizeof(tmpPath) )
+		return ;
+	fp = fopen(tmpPath, "w");
+	if( !fp )	return ;
+	
+	fprintf(fp, "%i %i\n", Version, giNumItems);
+	for( i = 0; i < giNumItems; i ++ )
+	{
+		fprintf(fp, "%s\t%i\t%i\t%i\t%s\n",
+			gaItems[i].Type, gaItems[i].ID, gaItems[i].Status,
+			gaItems[i].Price, gaItems[i].Desc
+			);
+	}
+	
+	if( fclose(fp) != 0 || rename(tmpPath, Path) != 0 )
+		unlink(tmpPath);
+}
 
 /**
  * \brief Get information on an item
@@ -616,7 +882,7 @@ int DispenseSetPin(int Socket, const char *Pin)
  */
 int DispenseItem(int Socket, const char *Type, int ID)
 {
-	 int	ret, responseCode;
+	 int	ret;
 	char	*buf;
 	
 	// Check for a dry run
@@ -629,6 +895,119 @@ int DispenseItem(int Socket, const char *Type, int ID)
 	sendf(Socket, "DISPENSE %s:%i\n", Type, ID);
 	buf = ReadLine(Socket);
 	
+	ret = _DispenseResponse(buf);
+	free(buf);
+	return ret;
+}
+
+/**
+ * \brief Dispense several of an item as a single transaction (MULTI/EXEC)
+ * \param Count	Number of items to dispense
+ * \param Dispensed	Number actually dispensed
+ *
+ * Either all of the items are paid for, or none are. Falls back to
+ * dispensing one at a time if the server does not support MULTI.
+ */
+int DispenseItems(int Socket, const char *Type, int ID, int Count, int *Dispensed)
+{
+	 int	ret, i, responseCode;
+	char	*buf;
+	
+	*Dispensed = 0;
+	
+	// Check for a dry run
+	if( gbDryRun ) {
+		printf("Dry Run - No action\n");
+		return 0;
+	}
+	
+	sendf(Socket, "MULTI\n");
+	buf = ReadLine(Socket);
+	responseCode = atoi(buf);
+	free(buf);
+	if( responseCode != 200 )
+	{
+		// Old server, one at a time
+		for( i = 0; i < Count; i ++ ) {
+			ret = DispenseItem(Socket, Type, ID);
+			if( ret )	break;
+		}
+		*Dispensed = i;
+		return ret;
+	}
+	
+	// Queue the dispenses (written in one go, the replies are all "100 Queued")
+	{
+		 int	len = snprintf(NULL, 0, "DISPENSE %s:%i\n", Type, ID);
+		char	cmds[len*Count + sizeof("EXEC\n")];
+		for( i = 0; i < Count; i ++ )
+			sprintf(cmds + len*i, "DISPENSE %s:%i\n", Type, ID);
+		strcpy(cmds + len*Count, "EXEC\n");
+		send(Socket, cmds, len*Count + 5, 0);
+	}
+	ret = 0;
+	for( i = 0; i < Count; i ++ )
+	{
+		buf = ReadLine(Socket);
+		if( atoi(buf) != 100 ) {
+			printf("Unexpected response to MULTI: '%s'\n", buf);
+			ret = RV_UNKNOWN_ERROR;
+		}
+		free(buf);
+	}
+	
+	// Per-dispense replies, then the batch status
+	{
+		char	*replies[Count];
+		
+		for( i = 0; i < Count; i ++ )
+		{
+			replies[i] = ReadLine(Socket);
+			if( atoi(replies[i]) == 407 ) {
+				// Batch was discarded, no further replies
+				printf("Batch rejected: '%s'\n", replies[i]);
+				while( i >= 0 )	free(replies[i--]);
+				return ret ? ret : RV_UNKNOWN_ERROR;
+			}
+		}
+		buf = ReadLine(Socket);
+		responseCode = atoi(buf);
+		
+		for( i = 0; i < Count; i ++ )
+		{
+			 int	rv;
+			// Rolled back - only the failure matters
+			if( responseCode == 501 && replies[i][0] == '2' )
+				continue ;
+			rv = _DispenseResponse(replies[i]);
+			if( rv == 0 )
+				(*Dispensed) ++;
+			else if( !ret )
+				ret = rv;
+			if( responseCode == 501 )
+				break;
+		}
+		for( i = 0; i < Count; i ++ )
+			free(replies[i]);
+		
+		if( responseCode == 501 ) {
+			printf("Nothing was charged\n");
+			if( !ret )	ret = RV_SERVER_ERROR;
+		}
+		free(buf);
+	}
+	
+	return ret;
+}
+
+/**
+ * \brief Print the result of a DISPENSE command
+ * \return Return value for the dispense
+ */
+int _DispenseResponse(const char *buf)
+{
+	 int	ret, responseCode;
+	
 	responseCode = atoi(buf);
 	switch( responseCode )
 	{
@@ -662,7 +1041,6 @@ int DispenseItem(int Socket, const char *Type, int ID)
 		break;
 	}
 	
-	free(buf);
 	return ret;
 }
 
@@ -908,70 +1286,84 @@ int Dispense_Donate(int Socket, int Ammount, const char *Reason)
 
 /**
  * \brief Enumerate users
+ * \note Asks for a page at a time, so users are shown as they arrive
  */
 int Dispense_EnumUsers(int Socket)
 {
-	char	*buf;
+	char	*buf, *cursor = NULL;
+	char	filter[64] = "";
 	 int	responseCode;
-	 int	nUsers;
-	regmatch_t	matches[4];
+	 int	nUsers = 0;
+	 int	bPaged = 1;
 	
-	if( giMinimumBalance != INT_MIN ) {
-		if( giMaximumBalance != INT_MAX ) {
-			sendf(Socket, "ENUM_USERS min_balance:%i max_balance:%i\n", giMinimumBalance, giMaximumBalance);
-		}
-		else {
-			sendf(Socket, "ENUM_USERS min_balance:%i\n", giMinimumBalance);
-		}
-	}
-	else {
-		if( giMaximumBalance != INT_MAX ) {
-			sendf(Socket, "ENUM_USERS max_balance:%i\n", giMaximumBalance);
-		}
-		else {
-			sendf(Socket, "ENUM_USERS\n");
-		}
-	}
-	buf = ReadLine(Socket);
-	responseCode = atoi(buf);
+	if( giMinimumBalance != INT_MIN )
+		snprintf(filter, sizeof(filter), " min_balance:%i", giMinimumBalance);
+	if( giMaximumBalance != INT_MAX )
+		snprintf(filter + strlen(filter), sizeof(filter) - strlen(filter), " max_balance:%i", giMaximumBalance);
 	
-	switch(responseCode)
+	for( ;; )
 	{
-	case 201:	break;	// Ok, length follows
-	
-	default:
-		fprintf(stderr, "Unknown response code %i\n%s\n", responseCode, buf);
-		free(buf);
-		return -1;
-	}
-	
-	// Get count (not actually used)
-	RunRegex(&gArrayRegex, buf, 4, matches, "Malformed server response");
-	nUsers = atoi( buf + matches[3].rm_so );
-	printf("%i users returned\n", nUsers);
-	
-	// Free string
-	free(buf);
-	
-	// Read returned users
-	do {
+		if( !bPaged )
+			sendf(Socket, "ENUM_USERS%s\n", filter);
+		else if( cursor )
+			sendf(Socket, "ENUM_USERS%s limit:%i after:%s\n", filter, ENUM_USERS_PAGE_SIZE, cursor);
+		else
+			sendf(Socket, "ENUM_USERS%s limit:%i\n", filter, ENUM_USERS_PAGE_SIZE);
+		
 		buf = ReadLine(Socket);
 		responseCode = atoi(buf);
 		
-		if( responseCode != 202 )	break;
+		switch(responseCode)
+		{
+		case 201:	break;	// Ok, everything follows
+		case 203:	break;	// Ok, a page follows
 		
-		_PrintUserLine(buf);
+		case 407:
+			// Older server, doesn't do paging
+			if( bPaged && !cursor ) {
+				bPaged = 0;
+				free(buf);
+				continue ;
+			}
+			// Fall through
+		default:
+			fprintf(stderr, "Unknown response code %i\n%s\n", responseCode, buf);
+			free(buf);
+			free(cursor);
+			return -1;
+		}
 		free(buf);
-	} while(responseCode == 202);
-	
-	// Check final response
-	if( responseCode != 200 ) {
-		fprintf(stderr, "Unknown response code %i\n%s\n", responseCode, buf);
+		free(cursor);
+		cursor = NULL;
+		
+		// Read returned users
+		do {
+			buf = ReadLine(Socket);
+			responseCode = atoi(buf);
+			
+			if( responseCode != 202 )	break;
+			
+			_PrintUserLine(buf);
+			nUsers ++;
+			free(buf);
+		} while(responseCode == 202);
+		
+		// Check final response
+		if( responseCode != 200 ) {
+			fprintf(stderr, "Unknown response code %i\n%s\n", responseCode, buf);
+			free(buf);
+			return -1;
+		}
+		
+		// "200 List End <cursor>" - The page was full, there are more
+		if( bPaged && strncmp(buf, "200 List End ", 13) == 0 )
+			cursor = strdup(buf + 13);
 		free(buf);
-		return -1;
+		
+		if( !cursor )	break;
 	}
 	
-	free(buf);
+	printf("%i users returned\n", nUsers);
 	
 	return 0;
 }
@@ -1176,11 +1568,21 @@ int Dispense_SetItem(int Socket, const char *Type, int ID, int NewPrice, const c
 // ===
 // Helpers
 // ===
+static char	gsReadLine_Buf[BUFSIZ];
+static int	giReadLine_BufPos = 0;
+static int	giReadLine_BufValid = 0;
+
+/**
+ * \brief Check if ReadLine has data buffered (that a poll() wouldn't see)
+ */
+int ReadLine_HasBuffered(void)
+{
+	return giReadLine_BufValid > 0;
+}
+
 char *ReadLine(int Socket)
 {
-	static char	buf[BUFSIZ];
-	static int	bufPos = 0;
-	static int	bufValid = 0;
+	char	*buf = gsReadLine_Buf;
 	 int	len;
 	char	*newline = NULL;
 	 int	retLen = 0;
@@ -1195,34 +1597,37 @@ char *ReadLine(int Socket)
 	
 	while( !newline )
 	{
-		if( bufValid ) {
-			len = bufValid;
+		if( giReadLine_BufValid ) {
+			len = giReadLine_BufValid;
 		}
 		else {
-			len = recv(Socket, buf+bufPos, BUFSIZ-1-bufPos, 0);
+			len = recv(Socket, buf+giReadLine_BufPos, BUFSIZ-1-giReadLine_BufPos, 0);
 			if( len <= 0 ) {
 				free(ret);
 				return strdup("599 Client Connection Error\n");
 			}
 		}
-		buf[bufPos+len] = '\0';
+		buf[giReadLine_BufPos+len] = '\0';
 		
-		newline = strchr( buf+bufPos, '\n' );
+		newline = strchr( buf+giReadLine_BufPos, '\n' );
 		if( newline ) {
 			*newline = '\0';
 		}
 		
-		retLen += strlen(buf+bufPos);
+		retLen += strlen(buf+giReadLine_BufPos);
 		ret = realloc(ret, retLen + 1);
-		strcat( ret, buf+bufPos );
+		strcat( ret, buf+giReadLine_BufPos );
 		
 		if( newline ) {
-			 int	newLen = newline - (buf+bufPos) + 1;
-			bufValid = len - newLen;
+			 int	newLen = newline - (buf+giReadLine_BufPos) + 1;
+			giReadLine_BufValid = len - newLen;
 			len = newLen;
 		}
-		if( len + bufPos == BUFSIZ - 1 )	bufPos = 0;
-		else	bufPos += len;
+		else {
+			giReadLine_BufValid = 0;	// Partial line consumed, wait for more
+		}
+		if( len + giReadLine_BufPos == BUFSIZ - 1 )	giReadLine_BufPos = 0;
+		else	giReadLine_BufPos += len;
 	}
 	
 	#if DEBUG_TRACE_SERVER
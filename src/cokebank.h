@@ -15,6 +15,8 @@
 #define _COKEBANK_H_
 
 #include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
 
 #define COKEBANK_SALES_ACCT	">sales"	//!< Sales made into
 #define COKEBANK_SALES_PREFIX	">sales:"	//!< Sales made into
@@ -23,6 +25,7 @@
 #define COKEBANK_FREE_ACCT	">freeitems"	//!< ODay drink costs taken out of
 #define COKEBANK_DONATE_ACCT	">donations"	//!< Donations go here
 #define COKEBANK_GRAT_ACCR	">gratuities"	//!< Coke runs and new users
+#define COKEBANK_ROOT_ACCT	"root"	//!< Superuser (can't spend)
 
 /**
  * \brief Account iterator opaque structure
@@ -32,6 +35,83 @@
  */
 typedef struct sAcctIterator	tAcctIterator;
 
+/**
+ * \brief Account record returned by Bank_IteratorNextRecord
+ */
+typedef struct sAcctRecord
+{
+	 int	AcctID;
+	const char	*Name;	//!< Owned by the iterator, valid until it next moves
+	 int	Balance;
+	 int	Flags;	//!< As returned by Bank_GetFlags
+	time_t	LastSeen;	//!< 0 if not recorded by the backend
+	uint64_t	ChangeSeq;	//!< Seq of the last change (only set by Bank_ChangedSince)
+}	tAcctRecord;
+
+/**
+ * \brief Ledger iterator opaque structure (\see Bank_HistoryIterator)
+ */
+typedef struct sLedgerIterator	tLedgerIterator;
+
+/**
+ * \brief One transfer from the ledger
+ */
+typedef struct sLedgerEntry
+{
+	int64_t	Seq;	//!< Position in the ledger (increases with each transfer)
+	time_t	Time;
+	 int	SourceAcct;
+	 int	DestAcct;
+	 int	Ammount;
+	 int	Actor;	//!< Account that made the transfer (-1 if unknown)
+	const char	*Reason;	//!< Owned by the iterator, valid until it next moves
+}	tLedgerEntry;
+
+/**
+ * \brief Sales rollup iterator opaque structure (\see Bank_SalesIterator)
+ */
+typedef struct sSalesIterator	tSalesIterator;
+
+/**
+ * \brief Sales made in one hour, for one item or handler
+ */
+typedef struct sSalesRollup
+{
+	const char	*Series;	//!< "<handler>:<id>" or "<handler>", owned by the iterator
+	time_t	Hour;	//!< Start of the hour
+	 int	Count;	//!< Items sold (less refunds)
+	 int	Revenue;	//!< Cents taken (less refunds)
+}	tSalesRollup;
+
+/**
+ * \brief Kinds of account change (\see tBankChange)
+ */
+enum eBank_ChangeKinds
+{
+	BANK_CHANGE_BALANCE,	//!< Bank_Transfer (one change for each account)
+	BANK_CHANGE_FLAGS,	//!< Bank_SetFlags
+	BANK_CHANGE_CREATE,	//!< Bank_CreateAcct (or Bank_GetAcctByName creating it)
+	BANK_CHANGE_PIN	//!< Bank_SetPin
+};
+
+/**
+ * \brief Account change passed to listeners (\see Bank_AddChangeListener)
+ */
+typedef struct sBankChange
+{
+	uint64_t	Seq;	//!< Increases with each change (\see Bank_GetChangeSeq)
+	 int	Kind;	//!< eBank_ChangeKinds
+	 int	AcctID;
+	 int	Balance;	//!< Balance after the change
+	 int	Flags;	//!< Flags after the change (as returned by Bank_GetFlags)
+}	tBankChange;
+
+/**
+ * \brief Called for each committed change
+ * \param Data	Value passed to Bank_AddChangeListener
+ */
+typedef void	(*tBankChangeCallback)(void *Data, const tBankChange *Change);
+
 #if 0
 /**
  * \brief Iterator for a collection of items
@@ -108,9 +188,29 @@ extern int	Bank_Initialise(const char *Argument);
  * \param SourceAcct	UID (from \a Bank_GetUserID) to take the money from
  * \param DestAcct	UID (from \a Bank_GetUserID) give money to
  * \param Ammount	Amount of money (in cents) to transfer
+ * \param Actor	Account that asked for the transfer (-1 if none)
  * \param Reason	Reason for the transfer
+ * \note Backends with a ledger record the transfer in the same transaction
+ */
+extern int	Bank_Transfer(int SourceAcct, int DestAcct, int Ammount, int Actor, const char *Reason);
+/**
+ * \brief Start a bank transaction
+ *
+ * All changes made until the matching Bank_CommitTransaction or
+ * Bank_AbortTransaction are applied (or discarded) as a unit.
+ * Transactions can be nested, Bank_Transfer uses one internally.
+ * \return Boolean failure
+ */
+extern int	Bank_StartTransaction(void);
+/**
+ * \brief Commit the innermost transaction
+ * \return Boolean failure (the transaction has been rolled back)
+ */
+extern int	Bank_CommitTransaction(void);
+/**
+ * \brief Discard all changes made in the innermost transaction
  */
-extern int	Bank_Transfer(int SourceAcct, int DestAcct, int Ammount, const char *Reason);
+extern void	Bank_AbortTransaction(void);
 /**
  * \brief Get flags on an account
  * \param AcctID	UID to get flags from
@@ -124,6 +224,33 @@ extern int	Bank_GetFlags(int AcctID);
  * \param Value	Final value of changed flags
  */
 extern int	Bank_SetFlags(int AcctID, int Mask, int Value);
+/**
+ * \brief Get the flags epoch
+ * \return Counter that changes whenever any account's flags may have changed
+ * \note Lets callers keep flags from Bank_GetFlags until the epoch moves
+ */
+extern unsigned int	Bank_GetFlagsEpoch(void);
+/**
+ * \brief Get the data version
+ * \return Value that changes when another program modifies the bank
+ * \note Backends that can't be modified from outside always return 0
+ */
+extern unsigned int	Bank_GetDataVersion(void);
+/**
+ * \brief Register a function to be told about account changes
+ * \param Callback	Called once for each change, after it has been committed
+ * \param Data	Passed to \a Callback
+ * \return Boolean failure
+ * \note Changes made in a transaction are held until the outermost commit
+ *       (and dropped if it is aborted). Only changes made through this
+ *       process are reported, see Bank_GetDataVersion for the others.
+ */
+extern int	Bank_AddChangeListener(tBankChangeCallback Callback, void *Data);
+/**
+ * \brief Get the sequence number of the last committed change
+ * \note Numbers only increase (even across restarts), but may skip values
+ */
+extern uint64_t	Bank_GetChangeSeq(void);
 /**
  * \brief Get an account's balance
  * \param AcctID	Account to query
@@ -159,6 +286,27 @@ extern int	Bank_CreateAcct(const char *Name);
 extern tAcctIterator	*Bank_Iterator(int FlagMask, int FlagValues,
 	int Flags, int MinMaxBalance, time_t LastSeen);
 
+/**
+ * \brief Create an account iterator that starts after a given account
+ * \param After	Account to start after (only the fields used by the sort are
+ *              checked, plus AcctID to break ties). NULL starts at the beginning.
+ * \note Used for keyset paging, the iterator can be re-created from the last
+ *       record returned without holding it open.
+ * \see Bank_Iterator
+ */
+extern tAcctIterator	*Bank_IteratorAfter(int FlagMask, int FlagValues,
+	int Flags, int MinMaxBalance, time_t LastSeen, const tAcctRecord *After);
+
+/**
+ * \brief Iterate over the accounts changed after \a Seq, oldest change first
+ * \param Seq	Value from Bank_GetChangeSeq (or a tBankChange)
+ * \return Iterator, or NULL if the backend can't tell what changed since
+ *         \a Seq (e.g. it is newer than Bank_GetChangeSeq, or from before
+ *         the backend started counting)
+ * \note Each account is returned once, with the Seq of its last change
+ */
+extern tAcctIterator	*Bank_ChangedSince(uint64_t Seq);
+
 /**
  * \brief Get the current entry in the iterator and move to the next
  * \param It	Iterator returned by Bank_Iterator
@@ -166,21 +314,136 @@ extern tAcctIterator	*Bank_Iterator(int FlagMask, int FlagValues,
  */
 extern int	Bank_IteratorNext(tAcctIterator *It);
 
+/**
+ * \brief Get the whole of the current account and move to the next
+ * \param It	Iterator returned by Bank_Iterator
+ * \param Record	Filled with the account
+ * \return Account ID, or -1 for end of list
+ * \note Saves looking up each field of every account separately
+ */
+extern int	Bank_IteratorNextRecord(tAcctIterator *It, tAcctRecord *Record);
+
 /**
  * \brief Free an allocated iterator
  * \param It	Iterator returned by Bank_Iterator
  */
 extern void	Bank_DelIterator(tAcctIterator *It);
 
+/**
+ * \brief Iterate over the transfers into and out of an account, newest first
+ * \param AcctID	Account to list
+ * \param Since	Only transfers at or after this time (0 for all)
+ * \param Limit	Most entries to return (-1 for no limit)
+ * \return Iterator, or NULL if the backend keeps no ledger
+ */
+extern tLedgerIterator	*Bank_HistoryIterator(int AcctID, time_t Since, int Limit);
+
+/**
+ * \brief Get the next ledger entry
+ * \return Boolean end of list
+ */
+extern int	Bank_HistoryNext(tLedgerIterator *It, tLedgerEntry *Entry);
+
+/**
+ * \brief Free an iterator from Bank_HistoryIterator
+ */
+extern void	Bank_DelHistoryIterator(tLedgerIterator *It);
+
+/**
+ * \brief Store the sales totals for one series and hour
+ * \param Series	Item ("<handler>:<id>") or handler name
+ * \param Hour	Start of the hour
+ * \param Count	Items sold in the hour (replaces the stored value)
+ * \param Revenue	Cents taken in the hour (replaces the stored value)
+ * \return Boolean failure (backends that keep no rollups always fail)
+ * \note The server keeps the running totals, this is only their store
+ */
+extern int	Bank_SaveSalesRollup(const char *Series, time_t Hour, int Count, int Revenue);
+
+/**
+ * \brief Iterate over all stored sales rollups, by series then hour
+ * \return Iterator, or NULL if the backend keeps no rollups
+ */
+extern tSalesIterator	*Bank_SalesIterator(void);
+
+/**
+ * \brief Get the next sales rollup
+ * \return Boolean end of list
+ */
+extern int	Bank_SalesNext(tSalesIterator *It, tSalesRollup *Rollup);
+
+/**
+ * \brief Free an iterator from Bank_SalesIterator
+ */
+extern void	Bank_DelSalesIterator(tSalesIterator *It);
+
+/**
+ * \brief Get the stored stock count of an item
+ * \param Item	"<handler>:<id>"
+ * \return Units left, or -1 if not counted (or the backend keeps no stock)
+ */
+extern int	Bank_GetItemStock(const char *Item);
+
+/**
+ * \brief Store the stock count of an item
+ * \param Item	"<handler>:<id>"
+ * \param Count	Units left
+ * \return Boolean failure (backends that keep no stock always fail)
+ * \note Made in the current transaction (if any), so it is rolled back with it
+ */
+extern int	Bank_SetItemStock(const char *Item, int Count);
+
+/**
+ * \brief Set aside money in an account, to be taken later by Bank_CommitHold
+ * \param AcctID	Account to take the money from
+ * \param Ammount	Cents to set aside
+ * \param MinBalance	Lowest the balance may go, less everything held
+ * \return Hold ID, or -1 if the account can't cover it
+ * \note Made (and committed) in its own short transaction, so slow work
+ *       between reserving and committing never holds one open.
+ */
+extern int	Bank_ReserveFunds(int AcctID, int Ammount, int MinBalance);
+
+/**
+ * \brief Transfer held money and remove the hold (in one transaction)
+ * \param HoldID	Value returned by Bank_ReserveFunds
+ * \param DestAcct	Account to give the money to
+ * \param Actor	Account that asked for the transfer (-1 if none)
+ * \param Reason	Reason for the transfer
+ * \return Boolean failure (the hold is left in place)
+ */
+extern int	Bank_CommitHold(int HoldID, int DestAcct, int Actor, const char *Reason);
+
+/**
+ * \brief Remove a hold without taking the money
+ */
+extern void	Bank_ReleaseHold(int HoldID);
+
+/**
+ * \brief Get the total held against an account
+ * \note Not available to spend, Bank_Transfer callers should allow for it
+ */
+extern int	Bank_GetHeldFunds(int AcctID);
+
 /**
  * \brief Validates a user's authentication
  * \param Salt	Salt given to the client for hashing the password
  * \param Username	Username used
  * \param Password	Password sent by the client
  * \return User ID
+ * \note Called from the server's auth worker threads (several at once),
+ *       so must not change bank state or race with the main thread
  */
 extern int	Bank_GetUserAuth(const char *Salt, const char *Username, const char *Password);
 
+/**
+ * \brief Set the password checked by Bank_GetUserAuth
+ * \param AcctID	Account
+ * \param Password	Hex-encoded hash as sent by PASS (with an empty salt)
+ * \return Boolean failure (including backends where passwords are kept elsewhere)
+ */
+extern int	Bank_SetPassword(int AcctID, const char *Password);
+
 /**
  * \brief Checks the validity of a pin against a username
  * \param AcctID	Account ID
@@ -203,6 +466,16 @@ extern void	Bank_SetPin(int AcctID, int NewPin);
  */
 extern int	Bank_GetAcctByCard(const char *CardID);
 
+/**
+ * \brief Look up a card for logging in
+ * \param CardID	MIFARE card ID (hex)
+ * \param Flags	Set to the account's flags
+ * \param Name	Set to the account name (heap string)
+ * \return Account ID, or -1 if the card is unknown
+ * \note Answered from memory, so a card tap never waits on the database
+ */
+extern int	Bank_GetCardLogin(const char *CardID, int *Flags, char **Name);
+
 /**
  * \brief Add a card to an account
  * \param AcctID	Account ID
@@ -211,9 +484,28 @@ extern int	Bank_GetAcctByCard(const char *CardID);
  * \retval 0	Success
  * \retval 1	Bad account ID
  * \retval 2	Card in use
+ * \retval -1	Invalid card ID (not hex, or too long)
  */
 extern int	Bank_AddAcctCard(int AcctID, const char *CardID);
 
+/**
+ * \brief Look up the stored result of an earlier request
+ * \param AcctID	Account that made the request
+ * \param Token	Client supplied request ID
+ * \return Heap string (the reply sent for the request), or NULL if unknown/expired
+ */
+extern char	*Bank_GetRequestResult(int AcctID, const char *Token);
+
+/**
+ * \brief Record the result of a request (so a retry gets the same reply)
+ * \param AcctID	Account that made the request
+ * \param Token	Client supplied request ID
+ * \param Result	Reply sent to the client
+ * \return Boolean failure
+ * \note Should be called in the same transaction as the request's changes
+ */
+extern int	Bank_SaveRequestResult(int AcctID, const char *Token, const char *Result);
+
 // === Item Manipulation ===
 #if 0
 extern tItem	*Items_GetItem(char *Handler, int ID);
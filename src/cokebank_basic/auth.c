@@ -0,0 +1,320 @@
+/*
+ * OpenDispense 2
+ * UCC (University [of WA] Computer Club) Electronic Accounting System
+ *
+ * auth.c - LDAP password lookups for the basic cokebank
+ * > A small pool of LDAP connections, each owned by a worker thread, serves
+ *   userPassword lookups from a queue. Results are cached for a short time
+ *   so repeated logins do not go back to the directory.
+ *
+ * This file is licenced under the 3-clause BSD Licence. See the file COPYING
+ * for full details.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include <ldap.h>
+#include "common.h"
+
+#define LDAP_POOL_SIZE	4	// Connections (one worker thread each)
+#define LDAP_TIMEOUT	5	// Seconds allowed for a search
+#define MAX_QUEUED_LOOKUPS	32	// Lookups waiting for a worker (more are refused)
+#define PASSWORD_CACHE_SIZE	64
+#define PASSWORD_CACHE_TTL	60	// Seconds a fetched userPassword is trusted for
+
+// === TYPES ===
+typedef struct sLookup
+{
+	struct sLookup	*Next;
+	char	*Username;
+	char	*Result;	// userPassword, NULL if not found
+	 int	bDone;
+	 int	bAbandoned;	// Caller timed out, worker frees the lookup
+}	tLookup;
+
+typedef struct sCachedPassword
+{
+	char	*Username;
+	char	*Password;
+	time_t	Expires;
+}	tCachedPassword;
+
+// === PROTOTYPES ===
+static void	*Bank_int_LDAPWorker(void *Unused);
+static LDAP	*Bank_int_LDAPConnect(void);
+static char	*Bank_int_LDAPSearch(LDAP *Conn, const char *Username);
+static char	*Bank_int_EscapeFilter(const char *Value);
+
+// === GLOBALS ===
+char	*gsLDAPPath = "ldapi:///";
+char	*gsLDAPBaseDN = "dc=ucc,dc=gu,dc=uwa,dc=edu,dc=au";
+char	*gsLDAPBindDN = "cn=admin,dc=ucc,dc=gu,dc=uwa,dc=edu,dc=au";
+char	*gsLDAPBindPass = "secret";
+pthread_t	gaLDAP_Workers[LDAP_POOL_SIZE];
+pthread_mutex_t	gLDAP_Lock = PTHREAD_MUTEX_INITIALIZER;	// Protects everything below
+pthread_cond_t	gLDAP_QueueCond = PTHREAD_COND_INITIALIZER;	// Signalled when a lookup is queued
+pthread_cond_t	gLDAP_DoneCond = PTHREAD_COND_INITIALIZER;	// Broadcast when a lookup completes
+tLookup	*gpLDAP_QueueHead;
+tLookup	*gpLDAP_QueueTail;
+ int	giLDAP_QueueLength;
+tCachedPassword	gaLDAP_PasswordCache[PASSWORD_CACHE_SIZE];
+
+// === CODE ===
+/**
+ * \brief Start the LDAP workers
+ * \note Connections are made by the workers (and remade if they drop)
+ */
+int Bank_int_InitLDAP(void)
+{
+	for( int i = 0; i < LDAP_POOL_SIZE; i ++ )
+	{
+		if( pthread_create(&gaLDAP_Workers[i], NULL, Bank_int_LDAPWorker, NULL) ) {
+			perror("Bank_int_InitLDAP - pthread_create");
+			return 1;
+		}
+		pthread_detach(gaLDAP_Workers[i]);
+	}
+	return 0;
+}
+
+/**
+ * \brief Get the userPassword attribute of a user
+ * \return Heap string, or NULL if not found (or the directory is unavailable)
+ * \note Safe to call from several threads, lookups run concurrently
+ */
+char *Bank_int_GetLDAPPassword(const char *Username)
+{
+	tLookup	*lookup;
+	struct timespec	deadline;
+	char	*ret = NULL;
+	 int	freeSlot = 0;
+	time_t	now = time(NULL);
+
+	pthread_mutex_lock(&gLDAP_Lock);
+
+	// Check the cache
+	for( int i = 0; i < PASSWORD_CACHE_SIZE; i ++ )
+	{
+		tCachedPassword	*ent = &gaLDAP_PasswordCache[i];
+		if( !ent->Username || ent->Expires < now ) {
+			freeSlot = i;
+			continue ;
+		}
+		if( strcmp(ent->Username, Username) == 0 ) {
+			ret = strdup(ent->Password);
+			pthread_mutex_unlock(&gLDAP_Lock);
+			return ret;
+		}
+	}
+
+	// Hand it to a worker
+	if( giLDAP_QueueLength >= MAX_QUEUED_LOOKUPS ) {
+		pthread_mutex_unlock(&gLDAP_Lock);
+		fprintf(stderr, "Bank_int_GetLDAPPassword: Too many pending lookups, refusing '%s'\n", Username);
+		return NULL;
+	}
+	lookup = calloc(1, sizeof(tLookup));
+	if( !lookup ) {
+		pthread_mutex_unlock(&gLDAP_Lock);
+		return NULL;
+	}
+	lookup->Username = strdup(Username);
+	if( gpLDAP_QueueTail )
+		gpLDAP_QueueTail->Next = lookup;
+	else
+		gpLDAP_QueueHead = lookup;
+	gpLDAP_QueueTail = lookup;
+	giLDAP_QueueLength ++;
+	pthread_cond_signal(&gLDAP_QueueCond);
+
+	// Wait for the result (queueing time plus the search itself)
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += LDAP_TIMEOUT * 2;
+	while( !lookup->bDone )
+	{
+		if( pthread_cond_timedwait(&gLDAP_DoneCond, &gLDAP_Lock, &deadline) == ETIMEDOUT )
+			break;
+	}
+	if( !lookup->bDone ) {
+		lookup->bAbandoned = 1;
+		pthread_mutex_unlock(&gLDAP_Lock);
+		fprintf(stderr, "Bank_int_GetLDAPPassword: Lookup of '%s' timed out\n", Username);
+		return NULL;
+	}
+
+	ret = lookup->Result;
+	// Cache it (replacing an expired entry, or the first one)
+	if( ret )
+	{
+		tCachedPassword	*ent = &gaLDAP_PasswordCache[freeSlot];
+		free(ent->Username);
+		free(ent->Password);
+		ent->Username = strdup(Username);
+		ent->Password = strdup(ret);
+		ent->Expires = now + PASSWORD_CACHE_TTL;
+	}
+	pthread_mutex_unlock(&gLDAP_Lock);
+
+	free(lookup->Username);
+	free(lookup);
+	return ret;
+}
+
+/**
+ * \brief Worker thread, owns one connection from the pool
+ */
+static void *Bank_int_LDAPWorker(void *Unused)
+{
+	LDAP	*conn = NULL;
+
+	(void)Unused;
+	for( ;; )
+	{
+		tLookup	*lookup;
+		char	*result = NULL;
+
+		pthread_mutex_lock(&gLDAP_Lock);
+		while( !gpLDAP_QueueHead )
+			pthread_cond_wait(&gLDAP_QueueCond, &gLDAP_Lock);
+		lookup = gpLDAP_QueueHead;
+		gpLDAP_QueueHead = lookup->Next;
+		if( !gpLDAP_QueueHead )
+			gpLDAP_QueueTail = NULL;
+		giLDAP_QueueLength --;
+		pthread_mutex_unlock(&gLDAP_Lock);
+
+		if( !conn )
+			conn = Bank_int_LDAPConnect();
+		if( conn )
+		{
+			 int	err;
+			result = Bank_int_LDAPSearch(conn, lookup->Username);
+			// Reconnect next time if the connection has gone away
+			if( !result
+			 && ldap_get_option(conn, LDAP_OPT_RESULT_CODE, &err) == LDAP_OPT_SUCCESS
+			 && (err == LDAP_SERVER_DOWN || err == LDAP_CONNECT_ERROR) )
+			{
+				ldap_unbind_ext_s(conn, NULL, NULL);
+				conn = NULL;
+			}
+		}
+
+		pthread_mutex_lock(&gLDAP_Lock);
+		if( lookup->bAbandoned ) {
+			free(result);
+			free(lookup->Username);
+			free(lookup);
+		}
+		else {
+			lookup->Result = result;
+			lookup->bDone = 1;
+			pthread_cond_broadcast(&gLDAP_DoneCond);
+		}
+		pthread_mutex_unlock(&gLDAP_Lock);
+	}
+	return NULL;
+}
+
+/**
+ * \brief Open and bind a connection
+ */
+static LDAP *Bank_int_LDAPConnect(void)
+{
+	LDAP	*ret;
+	 int	rv;
+	struct berval	cred;
+	struct timeval	timeout = {LDAP_TIMEOUT, 0};
+	 int	ver = LDAP_VERSION3;
+
+	rv = ldap_initialize(&ret, gsLDAPPath);
+	if(rv) {
+		fprintf(stderr, "ldap_initialize: %s\n", ldap_err2string(rv));
+		return NULL;
+	}
+	ldap_set_option(ret, LDAP_OPT_PROTOCOL_VERSION, &ver);
+	ldap_set_option(ret, LDAP_OPT_NETWORK_TIMEOUT, &timeout);
+
+	cred.bv_val = gsLDAPBindPass;
+	cred.bv_len = strlen(gsLDAPBindPass);
+	rv = ldap_sasl_bind_s(ret, gsLDAPBindDN, LDAP_SASL_SIMPLE, &cred, NULL, NULL, NULL);
+	if(rv) {
+		fprintf(stderr, "ldap_sasl_bind_s: %s\n", ldap_err2string(rv));
+		ldap_unbind_ext_s(ret, NULL, NULL);
+		return NULL;
+	}
+	return ret;
+}
+
+/**
+ * \brief Read a user's userPassword
+ * \return Heap string, or NULL
+ */
+static char *Bank_int_LDAPSearch(LDAP *Conn, const char *Username)
+{
+	LDAPMessage	*res = NULL, *entry;
+	struct berval	**attrValues;
+	char	*attrNames[] = {"userPassword", NULL};
+	char	*escaped, *filter;
+	char	*ret = NULL;
+	struct timeval	timeout = {LDAP_TIMEOUT, 0};
+	 int	rv;
+
+	escaped = Bank_int_EscapeFilter(Username);
+	if( !escaped )	return NULL;
+	filter = mkstr("(uid=%s)", escaped);
+	free(escaped);
+
+	rv = ldap_search_ext_s(Conn, gsLDAPBaseDN, LDAP_SCOPE_SUBTREE, filter,
+		attrNames, 0, NULL, NULL, &timeout, 1, &res
+		);
+	if(rv) {
+		fprintf(stderr, "LDAP Error reading userPassword with filter '%s'\n%s\n",
+			filter, ldap_err2string(rv)
+			);
+		free(filter);
+		if( res )	ldap_msgfree(res);
+		return NULL;
+	}
+	free(filter);
+
+	entry = ldap_first_entry(Conn, res);
+	if( entry )
+	{
+		attrValues = ldap_get_values_len(Conn, entry, "userPassword");
+		if( attrValues && attrValues[0] )
+			ret = strndup(attrValues[0]->bv_val, attrValues[0]->bv_len);
+		if( attrValues )
+			ldap_value_free_len(attrValues);
+	}
+	ldap_msgfree(res);
+
+	return ret;
+}
+
+/**
+ * \brief Escape a value for use in a search filter (RFC 4515)
+ */
+static char *Bank_int_EscapeFilter(const char *Value)
+{
+	char	*ret = malloc(strlen(Value)*3 + 1);
+	char	*out = ret;
+
+	if( !ret )	return NULL;
+	for( ; *Value; Value ++ )
+	{
+		switch(*Value)
+		{
+		case '*':	case '(':	case ')':	case '\\':
+			out += sprintf(out, "\\%02x", (unsigned char)*Value);
+			break;
+		default:
+			*out++ = *Value;
+			break;
+		}
+	}
+	*out = '\0';
+	return ret;
+}
@@ -1,5 +1,5 @@
 /*
- * OpenDispense 2 
+ * OpenDispense 2
  * UCC (University [of WA] Computer Club) Electronic Accounting System
  *
  * cokebank_basic/common.h - Coke-Bank management
@@ -10,21 +10,100 @@
 #ifndef _COKEBANK_COMMON_H_
 #define _COKEBANK_COMMON_H_
 
+#include <stdint.h>
 #include "../cokebank.h"
 
+#define BANK_NAME_LEN	32	//!< Space for internal account names in the file
+
+/**
+ * \brief On-disk account record
+ */
 typedef struct sFileUser {
+	int32_t	UnixID;	//!< Unix UID, or negative for internal accounts
+	int32_t	Balance;
+	int32_t	Flags;
+	int32_t	Pin;	//!< -1 if not set
+	char	Name[BANK_NAME_LEN];	//!< Name of internal accounts (unused for unix users)
+}	tFileUser;
+
+/**
+ * \brief Original (headerless) record format, converted on load
+ */
+typedef struct sFileUserV1 {
 	 int	UnixID;
 	 int	Balance;
 	 int	Flags;
-}	tFileUser;
+}	tFileUserV1;
 
+/**
+ * \brief In-memory account (working copy, committed copies live in the store)
+ */
 typedef struct sUser {
 	 int	UnixID;
-	const char	*Name;
+	char	*Name;
 	 int	Balance;
 	 int	Flags;
+	 int	Pin;
+	 int	BalanceIndex;	//!< Position in gaBank_UsersByBalance
+	uint64_t	ChangeSeq;	//!< Seq of the last change (0 = not changed since startup)
+	 int	ChangePrev, ChangeNext;	//!< Change order list (-1 = none)
 }	tUser;
 
+// --- store.c ---
+/**
+ * \brief Open (and recover) the record file
+ * \return Number of records, or -1 on error
+ */
+extern int	Bank_int_OpenStore(const char *Path);
+/**
+ * \brief Get a committed record
+ */
+extern const tFileUser	*Bank_int_GetStoredRecord(int ID);
+/**
+ * \brief Queue a record to be written by the next Bank_int_CommitStore
+ */
+extern int	Bank_int_QueueStore(int ID, const tFileUser *Record);
+/**
+ * \brief Journal all queued records as one unit, then apply them to the file
+ * \return Boolean failure
+ */
+extern int	Bank_int_CommitStore(void);
+
+// --- ident.c ---
+/**
+ * \brief Bits returned by Ident_GetGroups
+ */
+enum eIdentGroups {
+	IDENT_GROUP_COKE	= 0x01,	//!< "coke"
+	IDENT_GROUP_WHEEL	= 0x02,	//!< "wheel"
+	IDENT_GROUP_DOOR	= 0x04,	//!< "door"
+};
+/**
+ * \brief Load the passwd/group cache and start refreshing it
+ * \param RefreshInterval	Seconds between reloads (0 disables)
+ */
+extern int	Ident_Initialise(int RefreshInterval);
+extern int	Ident_GetUID(const char *Name);
+extern char	*Ident_GetName(int UID);
+extern uint32_t	Ident_GetGroups(int UID);
+/**
+ * \brief Number of times the cache has been reloaded
+ */
+extern unsigned int	Ident_GetGeneration(void);
+
+#if USE_LDAP
+// --- auth.c ---
+/**
+ * \brief Start the LDAP lookup workers
+ */
+extern int	Bank_int_InitLDAP(void);
+/**
+ * \brief Get a user's userPassword from LDAP (cached for a short time)
+ * \return Heap string, or NULL if unavailable
+ */
+extern char	*Bank_int_GetLDAPPassword(const char *Username);
+#endif
+
 #if 0
 typedef struct sUser
 {
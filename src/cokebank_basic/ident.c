@@ -0,0 +1,333 @@
+/*
+ * OpenDispense 2
+ * UCC (University [of WA] Computer Club) Electronic Accounting System
+ *
+ * ident.c - Unix user/group cache for the basic cokebank
+ * > Loads the whole passwd and group databases (which may be LDAP backed)
+ *   into hashes, and reloads them in the background every so often, so
+ *   lookups made while handling a request never wait on the directory.
+ *
+ * This file is licenced under the 3-clause BSD Licence. See the file COPYING
+ * for full details.
+ */
+#define _GNU_SOURCE	// getgrent_r
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pwd.h>
+#include <grp.h>
+#include <pthread.h>
+#include <time.h>
+#include "common.h"
+
+#define IDENT_BUFSIZE	16384	// Buffer for the getpwent_r/getgrent_r family
+
+// === TYPES ===
+typedef struct sIdentUser
+{
+	 int	UID;
+	 int	GID;	// Primary group
+	uint32_t	Groups;	// IDENT_GROUP_* bits
+	char	*Name;
+}	tIdentUser;
+
+typedef struct sIdentCache
+{
+	 int	NumUsers;
+	tIdentUser	*Users;
+	 int	HashSize;	// Power of two, at least twice NumUsers
+	 int	*UIDHash;	// Entries are index + 1 (0 = empty)
+	 int	*NameHash;
+	time_t	LoadTime;
+}	tIdentCache;
+
+// === PROTOTYPES ===
+static tIdentCache	*Ident_int_Load(void);
+static void	Ident_int_Free(tIdentCache *Cache);
+static int	Ident_int_FindUID(const tIdentCache *Cache, int UID);
+static int	Ident_int_FindName(const tIdentCache *Cache, const char *Name);
+static unsigned int	Ident_int_HashString(const char *String);
+static void	*Ident_int_RefreshThread(void *Unused);
+
+// === CONSTANTS ===
+// Groups tracked in tIdentUser.Groups (bit N is casIdent_Groups[N])
+const char	*casIdent_Groups[] = {"coke", "wheel", "door"};
+#define NUM_IDENT_GROUPS	((int)(sizeof(casIdent_Groups)/sizeof(casIdent_Groups[0])))
+
+// === GLOBALS ===
+tIdentCache	*gpIdent_Cache;	// Current cache (swapped atomically by the refresh thread)
+tIdentCache	*gpIdent_OldCache;	// Previous cache, freed one refresh later (may still be in use)
+ int	giIdent_RefreshInterval;
+pthread_t	gIdent_RefreshThread;
+unsigned int	giIdent_Generation;	// Bumped after each reload
+
+// === CODE ===
+/**
+ * \brief Load the cache and start the refresh thread
+ * \param RefreshInterval	Seconds between reloads (0 to never reload)
+ */
+int Ident_Initialise(int RefreshInterval)
+{
+	gpIdent_Cache = Ident_int_Load();
+	if( !gpIdent_Cache )
+		return 1;
+
+	giIdent_RefreshInterval = RefreshInterval;
+	if( RefreshInterval > 0 )
+	{
+		if( pthread_create(&gIdent_RefreshThread, NULL, Ident_int_RefreshThread, NULL) ) {
+			perror("Ident_Initialise - pthread_create");
+			return 1;
+		}
+		pthread_detach(gIdent_RefreshThread);
+	}
+	return 0;
+}
+
+/**
+ * \brief Get the UID of a unix user
+ * \return UID, or -1 if the user does not exist
+ */
+int Ident_GetUID(const char *Name)
+{
+	tIdentCache	*cache = __atomic_load_n(&gpIdent_Cache, __ATOMIC_ACQUIRE);
+	 int	idx;
+
+	idx = Ident_int_FindName(cache, Name);
+	if( idx != -1 )
+		return cache->Users[idx].UID;
+
+	// Could be newer than the cache (e.g. USER_ADD of a new member), ask directly
+	{
+		struct passwd	pwd, *result = NULL;
+		char	buf[IDENT_BUFSIZE];
+		getpwnam_r(Name, &pwd, buf, sizeof(buf), &result);
+		if( !result )	return -1;
+		return result->pw_uid;
+	}
+}
+
+/**
+ * \brief Get the name of a unix user
+ * \return Heap string, or NULL if the user does not exist
+ */
+char *Ident_GetName(int UID)
+{
+	tIdentCache	*cache = __atomic_load_n(&gpIdent_Cache, __ATOMIC_ACQUIRE);
+	 int	idx;
+
+	idx = Ident_int_FindUID(cache, UID);
+	if( idx != -1 )
+		return strdup(cache->Users[idx].Name);
+
+	{
+		struct passwd	pwd, *result = NULL;
+		char	buf[IDENT_BUFSIZE];
+		getpwuid_r(UID, &pwd, buf, sizeof(buf), &result);
+		if( !result )	return NULL;
+		return strdup(result->pw_name);
+	}
+}
+
+/**
+ * \brief Get the tracked groups a user is in
+ * \return Set of IDENT_GROUP_* bits (0 if unknown)
+ * \note Only uses the cache, never blocks
+ */
+uint32_t Ident_GetGroups(int UID)
+{
+	tIdentCache	*cache = __atomic_load_n(&gpIdent_Cache, __ATOMIC_ACQUIRE);
+	 int	idx;
+
+	idx = Ident_int_FindUID(cache, UID);
+	if( idx == -1 )
+		return 0;
+	return cache->Users[idx].Groups;
+}
+
+/**
+ * \brief Number of reloads so far (changes whenever group membership may have)
+ */
+unsigned int Ident_GetGeneration(void)
+{
+	return __atomic_load_n(&giIdent_Generation, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * \brief Read the passwd and group databases into a new cache
+ */
+static tIdentCache *Ident_int_Load(void)
+{
+	tIdentCache	*ret;
+	 int	maxUsers = 256;
+	char	*buf;
+	 int	groupIDs[NUM_IDENT_GROUPS];
+
+	buf = malloc(IDENT_BUFSIZE);
+	ret = calloc(1, sizeof(tIdentCache));
+	if( !ret || !buf ) {
+		free(buf);
+		free(ret);
+		return NULL;
+	}
+	ret->Users = malloc(maxUsers * sizeof(tIdentUser));
+
+	// Users
+	{
+		struct passwd	pwd, *result;
+		setpwent();
+		while( getpwent_r(&pwd, buf, IDENT_BUFSIZE, &result) == 0 )
+		{
+			if( ret->NumUsers == maxUsers ) {
+				maxUsers *= 2;
+				ret->Users = realloc(ret->Users, maxUsers * sizeof(tIdentUser));
+			}
+			ret->Users[ret->NumUsers].UID = pwd.pw_uid;
+			ret->Users[ret->NumUsers].GID = pwd.pw_gid;
+			ret->Users[ret->NumUsers].Groups = 0;
+			ret->Users[ret->NumUsers].Name = strdup(pwd.pw_name);
+			ret->NumUsers ++;
+		}
+		endpwent();
+	}
+
+	// Hashes (duplicate entries keep the first, as getpwnam would)
+	ret->HashSize = 64;
+	while( ret->HashSize < ret->NumUsers * 2 )
+		ret->HashSize *= 2;
+	ret->UIDHash = calloc(ret->HashSize, sizeof(int));
+	ret->NameHash = calloc(ret->HashSize, sizeof(int));
+	for( int i = 0; i < ret->NumUsers; i ++ )
+	{
+		unsigned int	mask = ret->HashSize - 1;
+		unsigned int	pos;
+
+		pos = (unsigned int)ret->Users[i].UID * 2654435761u;
+		while( ret->UIDHash[pos & mask] )	pos ++;
+		ret->UIDHash[pos & mask] = i + 1;
+
+		pos = Ident_int_HashString(ret->Users[i].Name);
+		while( ret->NameHash[pos & mask] )	pos ++;
+		ret->NameHash[pos & mask] = i + 1;
+	}
+
+	// Group membership
+	for( int i = 0; i < NUM_IDENT_GROUPS; i ++ )
+		groupIDs[i] = -1;
+	{
+		struct group	grp, *result;
+		setgrent();
+		while( getgrent_r(&grp, buf, IDENT_BUFSIZE, &result) == 0 )
+		{
+			 int	bit;
+			for( bit = 0; bit < NUM_IDENT_GROUPS; bit ++ )
+			{
+				if( strcmp(grp.gr_name, casIdent_Groups[bit]) == 0 )
+					break;
+			}
+			if( bit == NUM_IDENT_GROUPS )
+				continue ;
+
+			groupIDs[bit] = grp.gr_gid;
+			for( int j = 0; grp.gr_mem[j]; j ++ )
+			{
+				 int	idx = Ident_int_FindName(ret, grp.gr_mem[j]);
+				if( idx != -1 )
+					ret->Users[idx].Groups |= 1 << bit;
+			}
+		}
+		endgrent();
+	}
+	// - Primary groups
+	for( int i = 0; i < ret->NumUsers; i ++ )
+	{
+		for( int bit = 0; bit < NUM_IDENT_GROUPS; bit ++ )
+		{
+			if( ret->Users[i].GID == groupIDs[bit] )
+				ret->Users[i].Groups |= 1 << bit;
+		}
+	}
+
+	free(buf);
+	ret->LoadTime = time(NULL);
+	return ret;
+}
+
+static void Ident_int_Free(tIdentCache *Cache)
+{
+	if( !Cache )	return ;
+	for( int i = 0; i < Cache->NumUsers; i ++ )
+		free(Cache->Users[i].Name);
+	free(Cache->Users);
+	free(Cache->UIDHash);
+	free(Cache->NameHash);
+	free(Cache);
+}
+
+static int Ident_int_FindUID(const tIdentCache *Cache, int UID)
+{
+	unsigned int	mask = Cache->HashSize - 1;
+	unsigned int	pos = (unsigned int)UID * 2654435761u;
+
+	for( ; Cache->UIDHash[pos & mask]; pos ++ )
+	{
+		 int	idx = Cache->UIDHash[pos & mask] - 1;
+		if( Cache->Users[idx].UID == UID )
+			return idx;
+	}
+	return -1;
+}
+
+static int Ident_int_FindName(const tIdentCache *Cache, const char *Name)
+{
+	unsigned int	mask = Cache->HashSize - 1;
+	unsigned int	pos = Ident_int_HashString(Name);
+
+	for( ; Cache->NameHash[pos & mask]; pos ++ )
+	{
+		 int	idx = Cache->NameHash[pos & mask] - 1;
+		if( strcmp(Cache->Users[idx].Name, Name) == 0 )
+			return idx;
+	}
+	return -1;
+}
+
+static unsigned int Ident_int_HashString(const char *String)
+{
+	unsigned int	hash = 2166136261u;
+	while( *String ) {
+		hash ^= (uint8_t)*String++;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+/**
+ * \brief Periodically reload the cache
+ *
+ * The new cache is swapped in atomically. Lookups are short, so the old one
+ * is only freed at the following refresh (when nothing can still hold it).
+ */
+static void *Ident_int_RefreshThread(void *Unused)
+{
+	(void)Unused;
+	for( ;; )
+	{
+		tIdentCache	*new, *old;
+
+		sleep(giIdent_RefreshInterval);
+
+		new = Ident_int_Load();
+		if( !new ) {
+			fprintf(stderr, "Ident_int_RefreshThread: Reload failed, keeping old cache\n");
+			continue ;
+		}
+
+		Ident_int_Free(gpIdent_OldCache);
+		old = __atomic_exchange_n(&gpIdent_Cache, new, __ATOMIC_ACQ_REL);
+		gpIdent_OldCache = old;
+		__atomic_add_fetch(&giIdent_Generation, 1, __ATOMIC_RELEASE);
+	}
+	return NULL;
+}
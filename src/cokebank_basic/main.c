@@ -1,5 +1,5 @@
 /*
- * OpenDispense 2 
+ * OpenDispense 2
  * UCC (University [of WA] Computer Club) Electronic Accounting System
  *
  * cokebank.c - Coke-Bank management
@@ -12,67 +12,164 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
-#include <string.h>
 #include <limits.h>
-#include <pwd.h>
-#include <grp.h>
+#include <time.h>
+#include <pthread.h>
 #include <openssl/sha.h>
+#include <openssl/evp.h>
 #include "common.h"
-#if USE_LDAP
-# include <ldap.h>
-#endif
+#include "../common/config.h"
 
 /*
  * NOTES:
- * 
+ *
  * http://linuxdevcenter.com/pub/a/linux/2003/08/14/libldap.html
- * - Using libldap, the LDAP Client Library 
- * 
+ * - Using libldap, the LDAP Client Library
+ *
+ * Accounts are kept in memory (gaBank_Users), with committed copies in the
+ * record file managed by store.c. Account IDs are indexes into gaBank_Users.
+ * Accounts with a unix user are named by it, others (internal accounts, and
+ * names with no unix user) get a negative UnixID and keep their name in the
+ * record.
  */
 
 #define USE_UNIX_GROUPS	1
 #define HACK_TPG_NOAUTH	1
 #define HACK_ROOT_NOAUTH	1
 
-#define indexof(array, ent)	(((intptr_t)(ent)-(intptr_t)(array))/sizeof((array)[0]))
+#define MAX_TRANSACTION_DEPTH	8
+#define MAX_REQUESTS	256	// Remembered request IDs (oldest is replaced)
+#define MAX_HOLDS	32	// Funds held at once (one per dispense in progress)
+#define REQUEST_TTL	(24*60*60)
+#define MIN_HASH_SIZE	64	// Initial size of the lookup hashes (power of two)
+#define DEF_NSS_REFRESH	300	// Seconds between reloads of the passwd/group cache
 
 // === TYPES ===
 struct sAcctIterator
 {
 	 int	CurUser;
-	 
+
 	 int	Sort;
-	 
+
 	 int	MinBalance;
 	 int	MaxBalance;
-	 
+
 	 int	FlagMask;
 	 int	FlagValue;
+
+	 int	bChanges;	// From Bank_ChangedSince, CurUser follows the change list
+
+	char	*RecordName;	// Name returned by the last Bank_IteratorNextRecord
 };
 
+typedef struct sHold
+{
+	 int	HoldID;	// 0 = empty slot
+	 int	AcctID;
+	 int	Ammount;
+}	tHold;
+
+typedef struct sUndoEntry
+{
+	 int	ID;	// -1 for a hold
+	 int	Balance;
+	 int	Flags;
+	 int	Pin;
+	tHold	*Hold;	// Hold slot changed (if ID is -1)
+	tHold	OldHold;
+}	tUndoEntry;
+
+typedef struct sPendingChange
+{
+	 int	ID;
+	 int	Kind;
+}	tPendingChange;
+
+typedef struct sChangeListener
+{
+	tBankChangeCallback	Callback;
+	void	*Data;
+}	tChangeListener;
+
+typedef struct sRequest
+{
+	 int	AcctID;
+	time_t	Time;
+	char	*Token;
+	char	*Result;
+}	tRequest;
+
 // === PROTOTYPES ===
-static int Bank_int_ReadDatabase(void);
-static int Bank_int_WriteEntry(int ID);
+static int	Bank_int_LoadUsers(int NumRecords);
+static int	Bank_int_WriteEntry(int ID);
+static void	Bank_int_RecordUndo(int ID);
+static void	Bank_int_RecordHoldUndo(tHold *Hold);
+static tUndoEntry	*Bank_int_AddUndo(void);
+static void	Bank_int_Undo(int Start, int bWrite);
+static void	Bank_int_QueueChange(int ID, int Kind);
+static void	Bank_int_SendChanges(void);
+static void	Bank_int_StoreRequest(int AcctID, const char *Token, const char *Result);
+static void	Bank_int_DropPendingRequests(int Start);
+static unsigned int	Bank_int_HashString(const char *String);
+static void	Bank_int_IndexUser(int ID);
+static void	Bank_int_RebuildHashes(int NewSize);
+static int	Bank_int_FindByNameLocked(const char *Name);
+static int	Bank_int_FindByUnixID(int UnixID);
+static int	Bank_int_FindByName(const char *Name);
+static void	Bank_int_SetBalance(int ID, int Balance);
+static void	Bank_int_InsertSorted(int *Array, int Count, int ID, int (*Compare)(int,int));
+static int	Bank_int_CompareNames(int ID1, int ID2);
+static int	Bank_int_CompareBalance(int ID1, int ID2);
+static int	Bank_int_CompareToRecord(int ID, int Sort, const tAcctRecord *Record);
+ int	Bank_StartTransaction(void);
+ int	Bank_CommitTransaction(void);
+void	Bank_AbortTransaction(void);
+ int	Bank_AddChangeListener(tBankChangeCallback Callback, void *Data);
+uint64_t	Bank_GetChangeSeq(void);
+tAcctIterator	*Bank_ChangedSince(uint64_t Seq);
+char	*Bank_GetRequestResult(int AcctID, const char *Token);
+ int	Bank_SaveRequestResult(int AcctID, const char *Token, const char *Result);
  int	Bank_int_AlterUserBalance(int ID, int Delta);
  int	Bank_int_GetMinAllowedBalance(int ID);
  int	Bank_int_AddUser(const char *Username);
  int	Bank_int_GetUnixID(const char *Username);
-#if USE_LDAP
-char	*ReadLDAPValue(const char *Filter, char *Value);
-#endif
 void	HexBin(uint8_t *Dest, int BufSize, const char *Src);
 
 // === GLOBALS ===
 FILE	*gBank_LogFile;
-#if USE_LDAP
-char	*gsLDAPPath = "ldapi:///";
-LDAP	*gpLDAP;
-#endif
 tUser	*gaBank_Users;
  int	giBank_NumUsers;
-FILE	*gBank_File;
-tUser	**gaBank_UsersByName;
-tUser	**gaBank_UsersByBalance;
+ int	giBank_MaxUsers;	// Allocated size of gaBank_Users and the sorted indexes
+ int	giBank_LowestUnixID;	// For allocating IDs to accounts with no unix user
+ int	*gaBank_UsersByName;	// Account IDs sorted by name
+ int	*gaBank_UsersByBalance;	// Account IDs sorted by balance (kept sorted as balances change)
+ int	*gaBank_UnixIDHash;	// Open addressing, entries are Account ID + 1 (0 = empty)
+ int	*gaBank_NameHash;
+ int	giBank_HashSize;
+pthread_rwlock_t	gBank_IndexLock = PTHREAD_RWLOCK_INITIALIZER;	// Write locked while the above move (for Bank_GetUserAuth)
+tUndoEntry	*gaBank_UndoLog;	// Previous values of entries changed in a transaction
+ int	giBank_UndoLogSize;
+ int	giBank_UndoLogUsed;
+ int	giBank_TransactionDepth;
+ int	gaBank_TransactionStart[MAX_TRANSACTION_DEPTH];	// Undo log position of each level
+ int	gaBank_ChangeStart[MAX_TRANSACTION_DEPTH];	// Pending change position of each level
+tPendingChange	*gaBank_PendingChanges;	// Made, but not yet committed
+ int	giBank_PendingChangesSize;
+ int	giBank_NumPendingChanges;
+tChangeListener	*gaBank_ChangeListeners;
+ int	giBank_NumChangeListeners;
+uint64_t	giBank_FirstChangeSeq;	// Seq when this process started
+uint64_t	giBank_ChangeSeq;	// Seq of the last change sent
+ int	giBank_FirstChanged = -1;	// Least recently changed account (change order list)
+ int	giBank_LastChanged = -1;
+unsigned int	giBank_FlagsEpoch;	// Bumped by Bank_SetFlags
+tRequest	gaBank_Requests[MAX_REQUESTS];	// Request ID results (memory only)
+tRequest	*gaBank_PendingRequests;	// Saved in a transaction, stored by the outermost commit
+ int	giBank_PendingRequestsSize;
+ int	giBank_NumPendingRequests;
+ int	gaBank_RequestStart[MAX_TRANSACTION_DEPTH];	// Pending request position of each level
+tHold	gaBank_Holds[MAX_HOLDS];	// Memory only, they don't outlive the server
+ int	giBank_LastHoldID;
 
 // === CODE ===
 /*
@@ -80,151 +177,310 @@ tUser	**gaBank_UsersByBalance;
  */
 int Bank_Initialise(const char *Argument)
 {
-	#if USE_LDAP
-	 int	rv;
-	#endif
-	
-	// Open Cokebank
-	gBank_File = fopen(Argument, "rb+");
-	if( !gBank_File )	gBank_File = fopen(Argument, "wb+");
-	if( !gBank_File ) {
-		perror("Opening coke bank");
-		return -1;
-	}
-	Bank_int_ReadDatabase();
+	 int	numRecords;
+	 int	refresh = DEF_NSS_REFRESH;
+
+	// Change numbers aren't stored, so start above any from an earlier run
+	// (Bank_ChangedSince refuses numbers from before this)
+	giBank_FirstChangeSeq = (uint64_t)time(NULL) << 20;
+	giBank_ChangeSeq = giBank_FirstChangeSeq;
 
 	// Open log file
 	// TODO: Do I need this?
 	gBank_LogFile = fopen("cokebank.log", "a");
 	if( !gBank_LogFile )	gBank_LogFile = stdout;
-	
-	
+
+	// Load unix users and groups (before the accounts, which are named from it)
+	if( Config_GetValueCount("cokebank_nss_refresh") > 0 )
+		refresh = Config_GetValue_Int("cokebank_nss_refresh", 0);
+	if( Ident_Initialise(refresh) )
+		return -1;
+
+	// Open Cokebank
+	numRecords = Bank_int_OpenStore(Argument);
+	if( numRecords < 0 )
+		return -1;
+	if( Bank_int_LoadUsers(numRecords) )
+		return -1;
+
 	#if USE_LDAP
-	// Connect to LDAP
-	rv = ldap_create(&gpLDAP);
-	if(rv) {
-		fprintf(stderr, "ldap_create: %s\n", ldap_err2string(rv));
-		return 1;
-	}
-	rv = ldap_initialize(&gpLDAP, gsLDAPPath);
-	if(rv) {
-		fprintf(stderr, "ldap_initialize: %s\n", ldap_err2string(rv));
+	// Start the LDAP lookup workers
+	if( Bank_int_InitLDAP() )
 		return 1;
-	}
-	{ int ver = LDAP_VERSION3; ldap_set_option(gpLDAP, LDAP_OPT_PROTOCOL_VERSION, &ver); }
-	# if 0
-	rv = ldap_start_tls_s(gpLDAP, NULL, NULL);
-	if(rv) {
-		fprintf(stderr, "ldap_start_tls_s: %s\n", ldap_err2string(rv));
+	#endif
+
+	return 0;
+}
+
+/**
+ * \brief Create the in-memory accounts and indexes from the record file
+ */
+static int Bank_int_LoadUsers(int NumRecords)
+{
+	giBank_MaxUsers = NumRecords < MIN_HASH_SIZE ? MIN_HASH_SIZE : NumRecords;
+	gaBank_Users = malloc( giBank_MaxUsers * sizeof(tUser) );
+	gaBank_UsersByName = malloc( giBank_MaxUsers * sizeof(int) );
+	gaBank_UsersByBalance = malloc( giBank_MaxUsers * sizeof(int) );
+	if( !gaBank_Users || !gaBank_UsersByName || !gaBank_UsersByBalance ) {
+		perror("Bank_int_LoadUsers");
 		return 1;
 	}
-	# endif
+
+	giBank_NumUsers = NumRecords;
+	giBank_LowestUnixID = -1;
+	for( int i = 0; i < NumRecords; i ++ )
 	{
-		struct berval	cred;
-		struct berval	*servcred;
-		cred.bv_val = "secret";
-		cred.bv_len = 6;
-		rv = ldap_sasl_bind_s(gpLDAP, "cn=admin,dc=ucc,dc=gu,dc=uwa,dc=edu,dc=au",
-			"", &cred, NULL, NULL, &servcred);
-		if(rv) {
-			fprintf(stderr, "ldap_start_tls_s: %s\n", ldap_err2string(rv));
-			return 1;
+		const tFileUser	*fu = Bank_int_GetStoredRecord(i);
+		tUser	*user = &gaBank_Users[i];
+
+		user->UnixID = fu->UnixID;
+		user->Balance = fu->Balance;
+		user->Flags = fu->Flags;
+		user->Pin = fu->Pin;
+		user->ChangeSeq = 0;
+		user->ChangePrev = user->ChangeNext = -1;
+		user->Name = NULL;
+		if( fu->UnixID < 0 ) {
+			user->Name = strndup(fu->Name, BANK_NAME_LEN);
+			if( fu->UnixID <= giBank_LowestUnixID )
+				giBank_LowestUnixID = fu->UnixID - 1;
+		}
+		else {
+			user->Name = Bank_GetAcctName(i);
+			if( !user->Name )	user->Name = mkstr("#%i", user->UnixID);
 		}
+
+		gaBank_UsersByName[i] = i;
+		gaBank_UsersByBalance[i] = i;
 	}
-	#endif
-	
+
+	// Build indexes (kept up to date from here on)
+	Bank_int_RebuildHashes(MIN_HASH_SIZE);
+
+	// Insertion sort is fine, this is the only time it is done on the whole set
+	for( int i = 1; i < NumRecords; i ++ )
+	{
+		Bank_int_InsertSorted(gaBank_UsersByName, i, gaBank_UsersByName[i], Bank_int_CompareNames);
+		Bank_int_InsertSorted(gaBank_UsersByBalance, i, gaBank_UsersByBalance[i], Bank_int_CompareBalance);
+	}
+	for( int i = 0; i < NumRecords; i ++ )
+		gaBank_Users[ gaBank_UsersByBalance[i] ].BalanceIndex = i;
+
+	// New bank, create the standard accounts
+	if( NumRecords == 0 )
+	{
+		Bank_int_AddUser("root");
+		Bank_int_AddUser(COKEBANK_SALES_ACCT);
+		Bank_int_AddUser(COKEBANK_DEBT_ACCT);
+		Bank_int_AddUser(COKEBANK_FREE_ACCT);
+	}
+
 	return 0;
 }
 
+// ---
+// Indexes
+// ---
+static unsigned int Bank_int_HashString(const char *String)
+{
+	unsigned int	hash = 2166136261u;
+	while( *String ) {
+		hash ^= (uint8_t)*String++;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
 /**
- * \brief Name compare function for qsort
+ * \brief Add an account to the UnixID and name hashes
  */
-static int Bank_int_CompareNames(const void *Ent1, const void *Ent2)
+static void Bank_int_IndexUser(int ID)
 {
-	const tUser	*user1 = *(const tUser**)Ent1;
-	const tUser	*user2 = *(const tUser**)Ent2;
-	
-	return strcmp(user1->Name, user2->Name);
+	unsigned int	mask;
+	unsigned int	pos;
+
+	// Keep under half full
+	if( (ID + 1) * 2 > giBank_HashSize ) {
+		Bank_int_RebuildHashes(giBank_HashSize * 2);
+		return ;	// (includes this user)
+	}
+	mask = giBank_HashSize - 1;
+
+	pos = (unsigned int)gaBank_Users[ID].UnixID * 2654435761u;
+	while( gaBank_UnixIDHash[pos & mask] )	pos ++;
+	gaBank_UnixIDHash[pos & mask] = ID + 1;
+
+	pos = Bank_int_HashString(gaBank_Users[ID].Name);
+	while( gaBank_NameHash[pos & mask] )	pos ++;
+	gaBank_NameHash[pos & mask] = ID + 1;
+}
+
+static void Bank_int_RebuildHashes(int NewSize)
+{
+	while( NewSize < giBank_NumUsers * 2 )
+		NewSize *= 2;
+
+	free(gaBank_UnixIDHash);
+	free(gaBank_NameHash);
+	gaBank_UnixIDHash = calloc(NewSize, sizeof(int));
+	gaBank_NameHash = calloc(NewSize, sizeof(int));
+	giBank_HashSize = NewSize;
+
+	for( int i = 0; i < giBank_NumUsers; i ++ )
+		Bank_int_IndexUser(i);
+}
+
+static int Bank_int_FindByUnixID(int UnixID)
+{
+	unsigned int	mask = giBank_HashSize - 1;
+	unsigned int	pos = (unsigned int)UnixID * 2654435761u;
+
+	for( ; gaBank_UnixIDHash[pos & mask]; pos ++ )
+	{
+		 int	id = gaBank_UnixIDHash[pos & mask] - 1;
+		if( gaBank_Users[id].UnixID == UnixID )
+			return id;
+	}
+	return -1;
+}
+
+static int Bank_int_FindByName(const char *Name)
+{
+	unsigned int	mask = giBank_HashSize - 1;
+	unsigned int	pos = Bank_int_HashString(Name);
+
+	for( ; gaBank_NameHash[pos & mask]; pos ++ )
+	{
+		 int	id = gaBank_NameHash[pos & mask] - 1;
+		if( strcmp(gaBank_Users[id].Name, Name) == 0 )
+			return id;
+	}
+	return -1;
 }
 
 /**
- * \brief Name compare function for qsort
+ * \brief Bank_int_FindByName for use off the main thread (see Bank_GetUserAuth)
  */
-static int Bank_int_CompareBalance(const void *Ent1, const void *Ent2)
+static int Bank_int_FindByNameLocked(const char *Name)
 {
-	const tUser	*user1 = *(const tUser**)Ent1;
-	const tUser	*user2 = *(const tUser**)Ent2;
-	
-	return user1->Balance - user2->Balance;
+	 int	ret;
+	pthread_rwlock_rdlock(&gBank_IndexLock);
+	ret = Bank_int_FindByName(Name);
+	pthread_rwlock_unlock(&gBank_IndexLock);
+	return ret;
 }
 
-#if 1
-static int Bank_int_ReadDatabase(void)
+static int Bank_int_CompareNames(int ID1, int ID2)
 {
-	 int	i;
-	if( gaBank_Users )	return 1;
-	
-	// Get size
-	fseek(gBank_File, 0, SEEK_END);
-	giBank_NumUsers = ftell(gBank_File) / sizeof(tFileUser);
-	fseek(gBank_File, 0, SEEK_SET);
-	
-	// Allocate structures
-	gaBank_Users = malloc( giBank_NumUsers * sizeof(tUser) );
-	gaBank_UsersByName = malloc( giBank_NumUsers * sizeof(tUser*) );
-	gaBank_UsersByBalance = malloc( giBank_NumUsers * sizeof(tUser*) );
-	// Read data
-	for( i = 0; i < giBank_NumUsers; i ++ )
-	{
-		tFileUser	fu;
-		fread(&fu, sizeof(tFileUser), 1, gBank_File);
-		gaBank_Users[i].Name = NULL;
-		gaBank_Users[i].UnixID = fu.UnixID;
-		gaBank_Users[i].Balance = fu.Balance;
-		gaBank_Users[i].Flags = fu.Flags;
-		gaBank_Users[i].Name = Bank_GetAcctName(i);
-		gaBank_UsersByName[i] = &gaBank_Users[i];	// Add to name index
-		gaBank_UsersByBalance[i] = &gaBank_Users[i];	// Add to balance index
+	return strcmp(gaBank_Users[ID1].Name, gaBank_Users[ID2].Name);
+}
+
+static int Bank_int_CompareBalance(int ID1, int ID2)
+{
+	if( gaBank_Users[ID1].Balance < gaBank_Users[ID2].Balance )	return -1;
+	if( gaBank_Users[ID1].Balance > gaBank_Users[ID2].Balance )	return 1;
+	// Equal balances are kept in ID order, so iterators can resume from any account
+	return (ID1 > ID2) - (ID1 < ID2);
+}
+
+/**
+ * \brief Compare an account with a record in the (ascending) order of \a Sort
+ */
+static int Bank_int_CompareToRecord(int ID, int Sort, const tAcctRecord *Record)
+{
+	 int	rv = 0;
+	switch( Sort & BANK_ITFLAG_SORTMASK )
+	{
+	case BANK_ITFLAG_SORT_NAME:
+		rv = strcmp(gaBank_Users[ID].Name, Record->Name ? Record->Name : "");
+		break;
+	case BANK_ITFLAG_SORT_BAL:
+		rv = (gaBank_Users[ID].Balance > Record->Balance) - (gaBank_Users[ID].Balance < Record->Balance);
+		break;
 	}
-	
-	// Sort indexes
-	qsort(gaBank_UsersByName, giBank_NumUsers, sizeof(tUser*), Bank_int_CompareNames);
-	qsort(gaBank_UsersByBalance, giBank_NumUsers, sizeof(tUser*), Bank_int_CompareBalance);
-	
-	return 0;
+	if( rv == 0 )
+		rv = (ID > Record->AcctID) - (ID < Record->AcctID);
+	return rv;
+}
+
+/**
+ * \brief Insert \a ID into a sorted array of \a Count entries
+ */
+static void Bank_int_InsertSorted(int *Array, int Count, int ID, int (*Compare)(int,int))
+{
+	 int	min = 0, max = Count;
+
+	// Binary search for the position
+	while( min < max )
+	{
+		 int	mid = (min + max) / 2;
+		if( Compare(Array[mid], ID) <= 0 )
+			min = mid + 1;
+		else
+			max = mid;
+	}
+	memmove(&Array[min+1], &Array[min], (Count - min) * sizeof(int));
+	Array[min] = ID;
 }
-#else
-static int Bank_int_ReadDatabase(void)
+
+/**
+ * \brief Change a balance, moving the account within the balance index
+ *
+ * Balances change by small amounts, so the account only moves a few places.
+ */
+static void Bank_int_SetBalance(int ID, int Balance)
 {
-	char	buf[BUFSIZ];
-	// Alternate data format
-	// > Plain Text
-	// <username>,<uid>,<pin>,<lastused>,<balance>,<flags>,<altlogins...>
-	fseek(gBank_File, 0, SEEK_SET);
-	
-	while(1)
+	 int	pos = gaBank_Users[ID].BalanceIndex;
+
+	gaBank_Users[ID].Balance = Balance;
+
+	while( pos > 0 && Bank_int_CompareBalance(gaBank_UsersByBalance[pos-1], ID) > 0 )
+	{
+		gaBank_UsersByBalance[pos] = gaBank_UsersByBalance[pos-1];
+		gaBank_Users[ gaBank_UsersByBalance[pos] ].BalanceIndex = pos;
+		pos --;
+	}
+	while( pos < giBank_NumUsers-1 && Bank_int_CompareBalance(gaBank_UsersByBalance[pos+1], ID) < 0 )
 	{
-		fgets(buf, BUFSIZ-1, gBank_File);
+		gaBank_UsersByBalance[pos] = gaBank_UsersByBalance[pos+1];
+		gaBank_Users[ gaBank_UsersByBalance[pos] ].BalanceIndex = pos;
+		pos ++;
 	}
+	gaBank_UsersByBalance[pos] = ID;
+	gaBank_Users[ID].BalanceIndex = pos;
 }
-#endif
 
+/**
+ * \brief Queue an account to be written to the file
+ *
+ * Outside a transaction it is written (journaled) immediately, otherwise
+ * it is written with the rest of the transaction by Bank_CommitTransaction
+ */
 static int Bank_int_WriteEntry(int ID)
 {
 	tFileUser	fu;
 	if( ID < 0 || ID >= giBank_NumUsers ) {
 		return -1;
 	}
-	
-	// Commit to file
-	fseek(gBank_File, ID*sizeof(fu), SEEK_SET);
-	
+
+	memset(&fu, 0, sizeof(fu));
 	fu.UnixID = gaBank_Users[ID].UnixID;
 	fu.Balance = gaBank_Users[ID].Balance;
 	fu.Flags = gaBank_Users[ID].Flags;
-	
-	fwrite(&fu, sizeof(fu), 1, gBank_File);
-	
+	fu.Pin = gaBank_Users[ID].Pin;
+	if( fu.UnixID < 0 )
+		strncpy(fu.Name, gaBank_Users[ID].Name, BANK_NAME_LEN);
+
+	if( Bank_int_QueueStore(ID, &fu) )
+		return -1;
+	if( giBank_TransactionDepth == 0 )
+	{
+		if( Bank_int_CommitStore() ) {
+			giBank_NumPendingChanges = 0;
+			return -1;
+		}
+		Bank_int_SendChanges();
+	}
 	return 0;
 }
 
@@ -233,73 +489,469 @@ static int Bank_int_WriteEntry(int ID)
  * \param SourceUser	Source user
  * \param DestUser	Destination user
  * \param Ammount	Ammount of cents to move from \a SourceUser to \a DestUser
+ * \param Actor	Account that made the transfer
  * \param Reason	Reason for the transfer (essentially a comment)
  * \return Boolean failure
  */
-int Bank_Transfer(int SourceUser, int DestUser, int Ammount, const char *Reason)
+int Bank_Transfer(int SourceUser, int DestUser, int Ammount, int Actor, const char *Reason)
+{
+	 int	srcBal = Bank_GetBalance(SourceUser);
+	 int	dstBal = Bank_GetBalance(DestUser);
+
+	if( srcBal - Ammount < Bank_int_GetMinAllowedBalance(SourceUser) )
+		return 1;
+	if( dstBal + Ammount < Bank_int_GetMinAllowedBalance(DestUser) )
+		return 1;
+	// Both records go in one journal entry
+	if( Bank_StartTransaction() )
+		return 1;
+	Bank_int_AlterUserBalance(DestUser, Ammount);
+	Bank_int_AlterUserBalance(SourceUser, -Ammount);
+	if( Bank_CommitTransaction() )
+		return 1;
+	fprintf(gBank_LogFile, "Transfer %ic #%i{%i} > #%i{%i} [%i, %i] by #%i (%s)\n",
+		Ammount, SourceUser, srcBal, DestUser, dstBal,
+		srcBal - Ammount, dstBal + Ammount, Actor, Reason);
+	return 0;
+}
+
+/*
+ * Transactions
+ * - Changes are made in memory and queued, the queue is journaled as one
+ *   write when the outermost transaction commits. Aborting restores the old
+ *   values from the undo log.
+ */
+int Bank_StartTransaction(void)
+{
+	if( giBank_TransactionDepth == MAX_TRANSACTION_DEPTH )
+		return 1;
+	gaBank_ChangeStart[giBank_TransactionDepth] = giBank_NumPendingChanges;
+	gaBank_RequestStart[giBank_TransactionDepth] = giBank_NumPendingRequests;
+	gaBank_TransactionStart[giBank_TransactionDepth++] = giBank_UndoLogUsed;
+	return 0;
+}
+
+int Bank_CommitTransaction(void)
+{
+	if( giBank_TransactionDepth == 0 )
+		return 1;
+	giBank_TransactionDepth --;
+	if( giBank_TransactionDepth > 0 )
+		return 0;
+
+	// Outermost commit
+	if( Bank_int_CommitStore() ) {
+		// Nothing reached the file, put the old values back in memory too
+		Bank_int_Undo(0, 0);
+		giBank_NumPendingChanges = 0;
+		Bank_int_DropPendingRequests(0);
+		return 1;
+	}
+	giBank_UndoLogUsed = 0;	// No longer needed
+	Bank_int_SendChanges();
+
+	for( int i = 0; i < giBank_NumPendingRequests; i ++ )
+	{
+		tRequest	*req = &gaBank_PendingRequests[i];
+		Bank_int_StoreRequest(req->AcctID, req->Token, req->Result);
+	}
+	Bank_int_DropPendingRequests(0);
+	return 0;
+}
+
+void Bank_AbortTransaction(void)
+{
+	 int	start;
+
+	if( giBank_TransactionDepth == 0 )
+		return ;
+	start = gaBank_TransactionStart[giBank_TransactionDepth-1];
+	giBank_NumPendingChanges = gaBank_ChangeStart[giBank_TransactionDepth-1];
+	Bank_int_DropPendingRequests(gaBank_RequestStart[giBank_TransactionDepth-1]);
+
+	// The restored values are queued too
+	Bank_int_Undo(start, 1);
+
+	giBank_TransactionDepth --;
+	if( giBank_TransactionDepth == 0 )
+		Bank_int_CommitStore();
+}
+
+/*
+ * Change listeners
+ * - Changes are queued as they are made, and sent once they are in the
+ *   record file (Bank_int_WriteEntry, or the outermost commit).
+ * - Sending a change numbers it and moves the account to the end of the
+ *   change order list, which Bank_ChangedSince walks.
+ */
+int Bank_AddChangeListener(tBankChangeCallback Callback, void *Data)
+{
+	void	*tmp = realloc(gaBank_ChangeListeners, (giBank_NumChangeListeners+1)*sizeof(tChangeListener));
+	if( !tmp )	return 1;
+	gaBank_ChangeListeners = tmp;
+	gaBank_ChangeListeners[giBank_NumChangeListeners].Callback = Callback;
+	gaBank_ChangeListeners[giBank_NumChangeListeners].Data = Data;
+	giBank_NumChangeListeners ++;
+	return 0;
+}
+
+/**
+ * \brief Remember a change to send after commit
+ */
+static void Bank_int_QueueChange(int ID, int Kind)
+{
+	if( giBank_NumPendingChanges == giBank_PendingChangesSize )
+	{
+		 int	newSize = giBank_PendingChangesSize ? giBank_PendingChangesSize * 2 : 16;
+		void	*tmp = realloc(gaBank_PendingChanges, newSize * sizeof(tPendingChange));
+		if( !tmp ) {
+			perror("Bank_int_QueueChange");
+			return ;
+		}
+		gaBank_PendingChanges = tmp;
+		giBank_PendingChangesSize = newSize;
+	}
+	gaBank_PendingChanges[giBank_NumPendingChanges].ID = ID;
+	gaBank_PendingChanges[giBank_NumPendingChanges].Kind = Kind;
+	giBank_NumPendingChanges ++;
+}
+
+/**
+ * \brief Pass committed changes to the listeners
+ */
+static void Bank_int_SendChanges(void)
+{
+	 int	num = giBank_NumPendingChanges;
+
+	// Cleared first, so listeners can make changes of their own
+	giBank_NumPendingChanges = 0;
+	for( int i = 0; i < num; i ++ )
+	{
+		tBankChange	change;
+		tUser	*user = &gaBank_Users[ gaBank_PendingChanges[i].ID ];
+
+		change.Seq = ++ giBank_ChangeSeq;
+		change.Kind = gaBank_PendingChanges[i].Kind;
+		change.AcctID = gaBank_PendingChanges[i].ID;
+
+		// Move to the end of the change list
+		if( user->ChangeSeq ) {
+			if( user->ChangePrev != -1 )
+				gaBank_Users[user->ChangePrev].ChangeNext = user->ChangeNext;
+			else
+				giBank_FirstChanged = user->ChangeNext;
+			if( user->ChangeNext != -1 )
+				gaBank_Users[user->ChangeNext].ChangePrev = user->ChangePrev;
+			else
+				giBank_LastChanged = user->ChangePrev;
+		}
+		user->ChangePrev = giBank_LastChanged;
+		user->ChangeNext = -1;
+		if( giBank_LastChanged != -1 )
+			gaBank_Users[giBank_LastChanged].ChangeNext = change.AcctID;
+		else
+			giBank_FirstChanged = change.AcctID;
+		giBank_LastChanged = change.AcctID;
+		user->ChangeSeq = change.Seq;
+
+		change.Balance = gaBank_Users[change.AcctID].Balance;
+		change.Flags = Bank_GetFlags(change.AcctID);
+		for( int j = 0; j < giBank_NumChangeListeners; j ++ )
+			gaBank_ChangeListeners[j].Callback(gaBank_ChangeListeners[j].Data, &change);
+	}
+}
+
+uint64_t Bank_GetChangeSeq(void)
+{
+	return giBank_ChangeSeq;
+}
+
+/*
+ * Walks back from the most recent change, so the cost is the number of
+ * accounts changed since \a Seq
+ */
+tAcctIterator *Bank_ChangedSince(uint64_t Seq)
+{
+	tAcctIterator	*ret;
+	 int	id;
+
+	if( Seq < giBank_FirstChangeSeq || Seq > giBank_ChangeSeq )
+		return NULL;
+
+	ret = calloc( 1, sizeof(tAcctIterator) );
+	if( !ret )
+		return NULL;
+	ret->bChanges = 1;
+	ret->MinBalance = INT_MIN;
+	ret->MaxBalance = INT_MAX;
+
+	ret->CurUser = -1;
+	for( id = giBank_LastChanged; id != -1 && gaBank_Users[id].ChangeSeq > Seq; id = gaBank_Users[id].ChangePrev )
+		ret->CurUser = id;
+
+	return ret;
+}
+
+/**
+ * \brief Save the current state of an entry before changing it
+ */
+static void Bank_int_RecordUndo(int ID)
+{
+	tUndoEntry	*ent = Bank_int_AddUndo();
+	if( !ent )
+		return ;
+	ent->ID = ID;
+	ent->Balance = gaBank_Users[ID].Balance;
+	ent->Flags = gaBank_Users[ID].Flags;
+	ent->Pin = gaBank_Users[ID].Pin;
+	ent->Hold = NULL;
+}
+
+/**
+ * \brief Save a hold slot's old value before it is changed
+ */
+static void Bank_int_RecordHoldUndo(tHold *Hold)
+{
+	tUndoEntry	*ent = Bank_int_AddUndo();
+	if( !ent )
+		return ;
+	ent->ID = -1;
+	ent->Hold = Hold;
+	ent->OldHold = *Hold;
+}
+
+/**
+ * \brief Get a new undo log entry (NULL outside a transaction)
+ */
+static tUndoEntry *Bank_int_AddUndo(void)
+{
+	if( giBank_TransactionDepth == 0 )
+		return NULL;
+
+	if( giBank_UndoLogUsed == giBank_UndoLogSize )
+	{
+		 int	newSize = giBank_UndoLogSize ? giBank_UndoLogSize * 2 : 16;
+		void	*tmp = realloc(gaBank_UndoLog, newSize * sizeof(tUndoEntry));
+		if( !tmp ) {
+			perror("Bank_int_AddUndo");
+			return NULL;
+		}
+		gaBank_UndoLog = tmp;
+		giBank_UndoLogSize = newSize;
+	}
+
+	return &gaBank_UndoLog[giBank_UndoLogUsed++];
+}
+
+/**
+ * \brief Put back the values saved in the undo log since \a Start (newest first)
+ * \param bWrite	Queue the restored records to be written
+ */
+static void Bank_int_Undo(int Start, int bWrite)
+{
+	while( giBank_UndoLogUsed > Start )
+	{
+		tUndoEntry	*ent = &gaBank_UndoLog[--giBank_UndoLogUsed];
+		if( ent->Hold ) {
+			*ent->Hold = ent->OldHold;
+			continue ;
+		}
+		Bank_int_SetBalance(ent->ID, ent->Balance);
+		gaBank_Users[ent->ID].Flags = ent->Flags;
+		gaBank_Users[ent->ID].Pin = ent->Pin;
+		if( bWrite )
+			Bank_int_WriteEntry(ent->ID);
+	}
+}
+
+/*
+ * Request IDs
+ * - Only kept in memory, so a restart forgets them
+ * - Results saved in a transaction are held back until the outermost
+ *   commit (and dropped if it is aborted)
+ */
+char *Bank_GetRequestResult(int AcctID, const char *Token)
+{
+	// Saved earlier in this transaction
+	for( int i = giBank_NumPendingRequests; i --; )
+	{
+		tRequest	*req = &gaBank_PendingRequests[i];
+		if( req->AcctID == AcctID && strcmp(req->Token, Token) == 0 )
+			return strdup(req->Result);
+	}
+
+	for( int i = 0; i < MAX_REQUESTS; i ++ )
+	{
+		tRequest	*req = &gaBank_Requests[i];
+		if( !req->Token || req->AcctID != AcctID )
+			continue ;
+		if( req->Time < time(NULL) - REQUEST_TTL )
+			continue ;
+		if( strcmp(req->Token, Token) == 0 )
+			return strdup(req->Result);
+	}
+	return NULL;
+}
+
+int Bank_SaveRequestResult(int AcctID, const char *Token, const char *Result)
+{
+	tRequest	*req;
+
+	if( giBank_TransactionDepth == 0 ) {
+		Bank_int_StoreRequest(AcctID, Token, Result);
+		return 0;
+	}
+
+	if( giBank_NumPendingRequests == giBank_PendingRequestsSize )
+	{
+		 int	newSize = giBank_PendingRequestsSize ? giBank_PendingRequestsSize * 2 : 4;
+		void	*tmp = realloc(gaBank_PendingRequests, newSize * sizeof(tRequest));
+		if( !tmp ) {
+			perror("Bank_SaveRequestResult");
+			return 1;
+		}
+		gaBank_PendingRequests = tmp;
+		giBank_PendingRequestsSize = newSize;
+	}
+
+	req = &gaBank_PendingRequests[giBank_NumPendingRequests++];
+	req->AcctID = AcctID;
+	req->Time = time(NULL);
+	req->Token = strdup(Token);
+	req->Result = strdup(Result);
+	return 0;
+}
+
+/**
+ * \brief Put a request result in the table (replacing the same token, or the oldest entry)
+ */
+static void Bank_int_StoreRequest(int AcctID, const char *Token, const char *Result)
+{
+	tRequest	*slot = &gaBank_Requests[0];
+
+	for( int i = 0; i < MAX_REQUESTS; i ++ )
+	{
+		tRequest	*req = &gaBank_Requests[i];
+		if( req->Token && req->AcctID == AcctID && strcmp(req->Token, Token) == 0 ) {
+			slot = req;
+			break;
+		}
+		if( req->Time < slot->Time )
+			slot = req;
+	}
+
+	free(slot->Token);
+	free(slot->Result);
+	slot->AcctID = AcctID;
+	slot->Time = time(NULL);
+	slot->Token = strdup(Token);
+	slot->Result = strdup(Result);
+}
+
+/**
+ * \brief Forget the request results saved since pending position \a Start
+ */
+static void Bank_int_DropPendingRequests(int Start)
 {
-	 int	srcBal = Bank_GetBalance(SourceUser);
-	 int	dstBal = Bank_GetBalance(DestUser);
-	
-	if( srcBal - Ammount < Bank_int_GetMinAllowedBalance(SourceUser) )
-		return 1;
-	if( dstBal + Ammount < Bank_int_GetMinAllowedBalance(DestUser) )
-		return 1;
-	Bank_int_AlterUserBalance(DestUser, Ammount);
-	Bank_int_AlterUserBalance(SourceUser, -Ammount);
-	fprintf(gBank_LogFile, "Transfer %ic #%i{%i} > #%i{%i} [%i, %i] (%s)\n",
-		Ammount, SourceUser, srcBal, DestUser, dstBal,
-		srcBal - Ammount, dstBal + Ammount, Reason);
-	return 0;
+	while( giBank_NumPendingRequests > Start )
+	{
+		tRequest	*req = &gaBank_PendingRequests[--giBank_NumPendingRequests];
+		free(req->Token);
+		free(req->Result);
+	}
 }
 
 int Bank_CreateAcct(const char *Name)
 {
-	 int	ret;
-	
-	ret = Bank_GetAcctByName(Name);
-	if( ret != -1 )	return -1;
-	
+	if( Name && Bank_int_FindByName(Name) != -1 )
+		return -1;
+
 	return Bank_int_AddUser(Name);
 }
 
 tAcctIterator *Bank_Iterator(int FlagMask, int FlagValues, int Flags, int MinMaxBalance, time_t LastSeen)
+{
+	return Bank_IteratorAfter(FlagMask, FlagValues, Flags, MinMaxBalance, LastSeen, NULL);
+}
+
+tAcctIterator *Bank_IteratorAfter(int FlagMask, int FlagValues, int Flags, int MinMaxBalance, time_t LastSeen, const tAcctRecord *After)
 {
 	tAcctIterator	*ret;
-	
+
 	ret = calloc( 1, sizeof(tAcctIterator) );
 	if( !ret )
 		return NULL;
 	ret->MinBalance = INT_MIN;
 	ret->MaxBalance = INT_MAX;
-	
+
 	ret->FlagMask = FlagMask;
 	ret->FlagValue = FlagValues & FlagMask;
-	
+
 	if(Flags & BANK_ITFLAG_MINBALANCE)
 		ret->MinBalance = MinMaxBalance;
 	if(Flags & BANK_ITFLAG_MAXBALANCE)
 		ret->MaxBalance = MinMaxBalance;
-	
+
 	ret->Sort = Flags & (BANK_ITFLAG_SORTMASK|BANK_ITFLAG_REVSORT);
-	
-	// Shut up GCC
-	LastSeen = 0;
-	
+
+	// Last seen times are not stored by this backend
+	(void)LastSeen;
+
 	//if(Flags & BANK_ITFLAG_SEENBEFORE)
 	//	ret->MinBalance = MinMaxBalance;
 	//if(Flags & BANK_ITFLAG_SEENAFTER)
 	//	ret->MinBalance = MinMaxBalance;
-	
+
+	// Find where to resume (binary search of the sorted list)
+	if( After )
+	{
+		const int	*list = NULL;
+		 int	lo = 0, hi = giBank_NumUsers;
+		 int	bRev = !!(ret->Sort & BANK_ITFLAG_REVSORT);
+
+		switch( ret->Sort & BANK_ITFLAG_SORTMASK )
+		{
+		case BANK_ITFLAG_SORT_NAME:	list = gaBank_UsersByName;	break;
+		case BANK_ITFLAG_SORT_BAL:	list = gaBank_UsersByBalance;	break;
+		}
+
+		if( !list ) {
+			// Unsorted, in ID order
+			ret->CurUser = After->AcctID + 1;
+		}
+		else {
+			// Count entries before the record (ascending), or up to and including it
+			while( lo < hi )
+			{
+				 int	mid = (lo + hi) / 2;
+				 int	cmp = Bank_int_CompareToRecord(list[mid], ret->Sort, After);
+				if( cmp < 0 || (!bRev && cmp == 0) )
+					lo = mid + 1;
+				else
+					hi = mid;
+			}
+			ret->CurUser = bRev ? giBank_NumUsers - lo : lo;
+		}
+	}
+
 	return ret;
 }
 
 int Bank_IteratorNext(tAcctIterator *It)
 {
 	 int	ret;
-	
+
+	if( It->bChanges )
+	{
+		ret = It->CurUser;
+		if( ret != -1 )
+			It->CurUser = gaBank_Users[ret].ChangeNext;
+		return ret;
+	}
+
 	while(It->CurUser < giBank_NumUsers)
 	{
+		 int	rev = giBank_NumUsers - 1 - It->CurUser;
 		switch(It->Sort)
 		{
 		case BANK_ITFLAG_SORT_NONE:
@@ -307,79 +959,204 @@ int Bank_IteratorNext(tAcctIterator *It)
 			ret = It->CurUser;
 			break;
 		case BANK_ITFLAG_SORT_NAME:
-			ret = indexof(gaBank_Users, gaBank_UsersByName[It->CurUser]);
+			ret = gaBank_UsersByName[It->CurUser];
 			break;
 		case BANK_ITFLAG_SORT_NAME | BANK_ITFLAG_REVSORT:
-			ret = indexof(gaBank_Users, gaBank_UsersByName[giBank_NumUsers-It->CurUser]);
+			ret = gaBank_UsersByName[rev];
 			break;
 		case BANK_ITFLAG_SORT_BAL:
-			ret = indexof(gaBank_Users, gaBank_UsersByBalance[It->CurUser]);
-			printf("Sort by balance (ret = %i)\n", ret);
+			ret = gaBank_UsersByBalance[It->CurUser];
 			break;
 		case BANK_ITFLAG_SORT_BAL | BANK_ITFLAG_REVSORT:
-			ret = indexof(gaBank_Users, gaBank_UsersByBalance[giBank_NumUsers-It->CurUser]);
+			ret = gaBank_UsersByBalance[rev];
 			break;
 		default:
 			fprintf(stderr, "BUG: Unsupported sort in Bank_IteratorNext\n");
 			return -1;
 		}
 		It->CurUser ++;
-		
-		if( gaBank_Users[ret].Balance < It->MinBalance )
+
+		// Balance sorted iterators can stop early
+		if( gaBank_Users[ret].Balance < It->MinBalance ) {
+			if( It->Sort == (BANK_ITFLAG_SORT_BAL | BANK_ITFLAG_REVSORT) )
+				break;
 			continue;
-		if( gaBank_Users[ret].Balance > It->MaxBalance )
+		}
+		if( gaBank_Users[ret].Balance > It->MaxBalance ) {
+			if( It->Sort == BANK_ITFLAG_SORT_BAL )
+				break;
 			continue;
+		}
 		if( (gaBank_Users[ret].Flags & It->FlagMask) != It->FlagValue )
 			continue;
-		
+
 		return ret;
 	}
 	return -1;
 }
 
+int Bank_IteratorNextRecord(tAcctIterator *It, tAcctRecord *Record)
+{
+	 int	ret;
+
+	ret = Bank_IteratorNext(It);
+	if( ret == -1 )
+		return -1;
+
+	free(It->RecordName);
+	It->RecordName = Bank_GetAcctName(ret);
+	Record->AcctID = ret;
+	Record->Name = It->RecordName;
+	Record->Balance = gaBank_Users[ret].Balance;
+	Record->Flags = Bank_GetFlags(ret);
+	Record->LastSeen = 0;	// Not stored
+	Record->ChangeSeq = It->bChanges ? gaBank_Users[ret].ChangeSeq : 0;
+	return ret;
+}
+
 void Bank_DelIterator(tAcctIterator *It)
 {
+	free(It->RecordName);
 	free(It);
 }
 
 /*
- * \brief Get the User ID of the named user
- */
-int Bank_GetAcctByName(const char *Username)
-{	
-	#if 0
-	 int	i, size;
-	i = giBank_NumUsers / 2;
-	size = giBank_NumUsers;
-	for(;;)
-	{
-		cmp = strcmp(gaBank_UsersByName[i]->Name, Username);
-		if( cmp == 0 )
-			return indexof(gaBank_Users, gaBank_UsersByName[i];
-		
-		// Not found
-		if( size == 0 )
-			return -1;
-		
-		if( cmp < 0 )
-			i += size;
-		else
-			i -= size;
-		size /= 2;
+ * History - this backend keeps no ledger (transfers only go to the log file)
+ */
+tLedgerIterator *Bank_HistoryIterator(int AcctID, time_t Since, int Limit)
+{
+	(void)AcctID;	(void)Since;	(void)Limit;
+	return NULL;
+}
+
+int Bank_HistoryNext(tLedgerIterator *It, tLedgerEntry *Entry)
+{
+	(void)It;	(void)Entry;
+	return 1;
+}
+
+void Bank_DelHistoryIterator(tLedgerIterator *It)
+{
+	(void)It;
+}
+
+/*
+ * Sales rollups - not stored by this backend (the server's totals start
+ * again each run)
+ */
+int Bank_SaveSalesRollup(const char *Series, time_t Hour, int Count, int Revenue)
+{
+	(void)Series;	(void)Hour;	(void)Count;	(void)Revenue;
+	return 1;
+}
+
+tSalesIterator *Bank_SalesIterator(void)
+{
+	return NULL;
+}
+
+int Bank_SalesNext(tSalesIterator *It, tSalesRollup *Rollup)
+{
+	(void)It;	(void)Rollup;
+	return 1;
+}
+
+void Bank_DelSalesIterator(tSalesIterator *It)
+{
+	(void)It;
+}
+
+/*
+ * Item stock - not stored by this backend (counts start again each run)
+ */
+int Bank_GetItemStock(const char *Item)
+{
+	(void)Item;
+	return -1;
+}
+
+int Bank_SetItemStock(const char *Item, int Count)
+{
+	(void)Item;	(void)Count;
+	return 1;
+}
+
+/*
+ * Holds - kept in memory, accounts are only ever changed by this process
+ */
+int Bank_ReserveFunds(int AcctID, int Ammount, int MinBalance)
+{
+	 int	slot = -1;
+
+	if( AcctID < 0 || AcctID >= giBank_NumUsers )
+		return -1;
+	if( (long long)Bank_GetBalance(AcctID) - Bank_GetHeldFunds(AcctID) - Ammount < MinBalance )
+		return -1;
+
+	for( int i = 0; i < MAX_HOLDS && slot == -1; i ++ )
+	{
+		if( gaBank_Holds[i].HoldID == 0 )
+			slot = i;
 	}
-	#else
-	 int	i, uid;
-	uid = Bank_int_GetUnixID(Username);
-	
-	// Expensive search :(
-	for( i = 0; i < giBank_NumUsers; i ++ )
+	if( slot == -1 )
+		return -1;
+
+	if( ++giBank_LastHoldID <= 0 )
+		giBank_LastHoldID = 1;
+	gaBank_Holds[slot].HoldID = giBank_LastHoldID;
+	gaBank_Holds[slot].AcctID = AcctID;
+	gaBank_Holds[slot].Ammount = Ammount;
+	return giBank_LastHoldID;
+}
+
+int Bank_CommitHold(int HoldID, int DestAcct, int Actor, const char *Reason)
+{
+	for( int i = 0; i < MAX_HOLDS; i ++ )
 	{
-		if( gaBank_Users[i].UnixID == uid )
-			return i;
+		tHold	*hold = &gaBank_Holds[i];
+		if( hold->HoldID != HoldID )
+			continue;
+		if( Bank_Transfer(hold->AcctID, DestAcct, hold->Ammount, Actor, Reason) )
+			return 1;
+		// Back if the caller's transaction is aborted
+		Bank_int_RecordHoldUndo(hold);
+		hold->HoldID = 0;
+		return 0;
 	}
-	#endif
+	return 1;
+}
 
-	return -1;
+void Bank_ReleaseHold(int HoldID)
+{
+	for( int i = 0; i < MAX_HOLDS; i ++ )
+	{
+		if( gaBank_Holds[i].HoldID == HoldID )
+			gaBank_Holds[i].HoldID = 0;
+	}
+}
+
+int Bank_GetHeldFunds(int AcctID)
+{
+	 int	ret = 0;
+	for( int i = 0; i < MAX_HOLDS; i ++ )
+	{
+		if( gaBank_Holds[i].HoldID && gaBank_Holds[i].AcctID == AcctID )
+			ret += gaBank_Holds[i].Ammount;
+	}
+	return ret;
+}
+
+/*
+ * \brief Get the ID of the named account
+ */
+int Bank_GetAcctByName(const char *Username, int bCreate)
+{
+	 int	ret;
+
+	ret = Bank_int_FindByName(Username);
+	if( ret == -1 && bCreate )
+		ret = Bank_CreateAcct(Username);
+	return ret;
 }
 
 int Bank_GetBalance(int ID)
@@ -401,41 +1178,17 @@ int Bank_GetFlags(int ID)
 	}
 
 	#if USE_UNIX_GROUPS
-	// TODO: Implement checking the PAM groups and status instead, then
-	// fall back on the database. (and update if there is a difference)
+	// Additions from unix groups (cached, so no directory lookup here)
 	if( gaBank_Users[ID].UnixID > 0 )
 	{
-		struct passwd	*pwd;
-		struct group	*grp;
-		 int	i;
+		uint32_t	groups = Ident_GetGroups( gaBank_Users[ID].UnixID );
 		
-		// Get username
-		pwd = getpwuid( gaBank_Users[ID].UnixID );
-		
-		// Check for additions to the "coke" group
-		grp = getgrnam("coke");
-		if( grp ) {
-			for( i = 0; grp->gr_mem[i]; i ++ )
-			{
-				if( strcmp(grp->gr_mem[i], pwd->pw_name) == 0 ) {
-					gaBank_Users[ID].Flags |= USER_FLAG_COKE;
-					break ;
-				}
-			}
-		}
+		if( groups & IDENT_GROUP_COKE )
+			gaBank_Users[ID].Flags |= USER_FLAG_COKE;
 		
 		#if 0
-		// Check for additions to the "wheel" group
-		grp = getgrnam("wheel");
-		if( grp ) {
-			for( i = 0; grp->gr_mem[i]; i ++ )
-			{
-				if( strcmp(grp->gr_mem[i], pwd->pw_name) == 0 ) {
-					gaBank_Users[ID].Flags |= USER_FLAG_ADMIN;
-					break ;
-				}
-			}
-		}
+		if( groups & IDENT_GROUP_WHEEL )
+			gaBank_Users[ID].Flags |= USER_FLAG_ADMIN;
 		#endif
 	}
 	#endif
@@ -448,18 +1201,38 @@ int Bank_SetFlags(int ID, int Mask, int Value)
 	// Sanity
 	if( ID < 0 || ID >= giBank_NumUsers )
 		return -1;
-	
+
 	// Silently ignore changes to root and meta accounts
-	if( gaBank_Users[ID].UnixID <= 0 )	return 0;
-	
+	if( gaBank_Users[ID].UnixID == 0 || (gaBank_Users[ID].Flags & USER_FLAG_INTERNAL) )	return 0;
+
+	Bank_int_RecordUndo(ID);
 	gaBank_Users[ID].Flags &= ~Mask;
 	gaBank_Users[ID].Flags |= Value;
 
+	Bank_int_QueueChange(ID, BANK_CHANGE_FLAGS);
 	Bank_int_WriteEntry(ID);
-	
+	giBank_FlagsEpoch ++;
+
+	return 0;
+}
+
+/*
+ * The record file is only changed by this process
+ */
+unsigned int Bank_GetDataVersion(void)
+{
 	return 0;
 }
 
+/*
+ * Group membership is part of the flags, so a passwd/group reload also
+ * counts as a change
+ */
+unsigned int Bank_GetFlagsEpoch(void)
+{
+	return giBank_FlagsEpoch + Ident_GetGeneration();
+}
+
 int Bank_int_AlterUserBalance(int ID, int Delta)
 {
 	// Sanity
@@ -467,10 +1240,12 @@ int Bank_int_AlterUserBalance(int ID, int Delta)
 		return -1;
 
 	// Update
-	gaBank_Users[ID].Balance += Delta;
+	Bank_int_RecordUndo(ID);
+	Bank_int_SetBalance(ID, gaBank_Users[ID].Balance + Delta);
 
+	Bank_int_QueueChange(ID, BANK_CHANGE_BALANCE);
 	Bank_int_WriteEntry(ID);
-	
+
 	return 0;
 }
 
@@ -489,7 +1264,7 @@ int Bank_int_GetMinAllowedBalance(int ID)
 	// Wheel is allowed to go to -$100
 	if( (flags & USER_FLAG_ADMIN) )
 		return -10000;
-	
+
 	// Coke is allowed to go to -$20
 	if( (flags & USER_FLAG_COKE) )
 		return -2000;
@@ -500,218 +1275,249 @@ int Bank_int_GetMinAllowedBalance(int ID)
 
 /*
  * Create a new user in our database
+ * - Names with a unix user are attached to it, anything else (e.g. internal
+ *   accounts) get an ID of their own and the name is saved in the file.
  */
 int Bank_int_AddUser(const char *Username)
 {
-	void	*tmp;
-	 int	uid = Bank_int_GetUnixID(Username);
+	 int	uid = -1, id;
+	tUser	*user;
+
+	if( Username )
+		uid = Bank_int_GetUnixID(Username);
+	if( uid == -1 )
+	{
+		if( Username && strlen(Username) >= BANK_NAME_LEN )
+			return -1;
+		uid = giBank_LowestUnixID --;
+	}
+	else if( Bank_int_FindByUnixID(uid) != -1 )
+		return -1;
+
+	pthread_rwlock_wrlock(&gBank_IndexLock);
 
 	// Can has moar space plz?
-	// - Structures
-	tmp = realloc(gaBank_Users, (giBank_NumUsers+1)*sizeof(gaBank_Users[0]));
-	if( !tmp )	return -1;
-	gaBank_Users = tmp;
-	// - Name index
-	tmp = realloc(gaBank_UsersByName, (giBank_NumUsers+1)*sizeof(tUser*));
-	if( !tmp )	return -1;
-	gaBank_UsersByName = tmp;
-	// - Balance index
-	tmp = realloc(gaBank_UsersByBalance, (giBank_NumUsers+1)*sizeof(tUser*));
-	if( !tmp )	return -1;
-	gaBank_UsersByBalance = tmp;
+	if( giBank_NumUsers == giBank_MaxUsers )
+	{
+		 int	newMax = giBank_MaxUsers * 2;
+		void	*tmp;
+		tmp = realloc(gaBank_Users, newMax*sizeof(tUser));
+		if( !tmp )	goto _nomem;
+		gaBank_Users = tmp;
+		tmp = realloc(gaBank_UsersByName, newMax*sizeof(int));
+		if( !tmp )	goto _nomem;
+		gaBank_UsersByName = tmp;
+		tmp = realloc(gaBank_UsersByBalance, newMax*sizeof(int));
+		if( !tmp )	goto _nomem;
+		gaBank_UsersByBalance = tmp;
+		giBank_MaxUsers = newMax;
+	}
 
 	// Crete new user
-	gaBank_Users[giBank_NumUsers].Name = NULL;
-	gaBank_Users[giBank_NumUsers].UnixID = uid;
-	gaBank_Users[giBank_NumUsers].Balance = 0;
-	gaBank_Users[giBank_NumUsers].Flags = 0;
-	gaBank_UsersByName[giBank_NumUsers] = &gaBank_Users[giBank_NumUsers];
-	gaBank_UsersByBalance[giBank_NumUsers] = &gaBank_Users[giBank_NumUsers];
-	
+	id = giBank_NumUsers;
+	user = &gaBank_Users[id];
+	user->UnixID = uid;
+	user->Balance = 0;
+	user->Flags = 0;
+	user->Pin = -1;
+	user->ChangeSeq = 0;
+	user->ChangePrev = user->ChangeNext = -1;
+	if( uid >= 0 )
+		user->Name = strdup(Username);
+	else if( Username )
+		user->Name = strdup(Username);
+	else
+		user->Name = mkstr("#%i", id);
+
 	// Set default flags
-	if( strcmp(Username, COKEBANK_DEBT_ACCT) == 0 ) {
-		gaBank_Users[giBank_NumUsers].Flags = USER_FLAG_INTERNAL;
+	if( Username && Username[0] == '>' ) {
+		user->Flags = USER_FLAG_INTERNAL;
 	}
-	else if( strcmp(Username, COKEBANK_SALES_ACCT) == 0 ) {
-		gaBank_Users[giBank_NumUsers].Flags = USER_FLAG_INTERNAL;
-	}
-	else if( strcmp(Username, "root") == 0 ) {
-		gaBank_Users[giBank_NumUsers].Flags = USER_FLAG_ADMIN|USER_FLAG_COKE;
+	else if( uid == 0 ) {
+		user->Flags = USER_FLAG_ADMIN|USER_FLAG_COKE;
 	}
 
 	// Increment count
 	giBank_NumUsers ++;
-	
-	// Get name
-	gaBank_Users[giBank_NumUsers-1].Name = Bank_GetAcctName(giBank_NumUsers-1);
-	
+
 	// Update indexes
-	qsort(gaBank_UsersByName, giBank_NumUsers, sizeof(tUser*), Bank_int_CompareNames);
-	qsort(gaBank_UsersByBalance, giBank_NumUsers, sizeof(tUser*), Bank_int_CompareBalance);
-	
+	Bank_int_IndexUser(id);
+	Bank_int_InsertSorted(gaBank_UsersByName, id, id, Bank_int_CompareNames);
+	Bank_int_InsertSorted(gaBank_UsersByBalance, id, id, Bank_int_CompareBalance);
+	for( int i = 0; i < giBank_NumUsers; i ++ )
+		gaBank_Users[ gaBank_UsersByBalance[i] ].BalanceIndex = i;
+
+	pthread_rwlock_unlock(&gBank_IndexLock);
+
 	// Save
-	Bank_int_WriteEntry(giBank_NumUsers - 1);
+	Bank_int_QueueChange(id, BANK_CHANGE_CREATE);
+	Bank_int_WriteEntry(id);
 
-	return 0;
+	return id;
+_nomem:
+	pthread_rwlock_unlock(&gBank_IndexLock);
+	return -1;
+}
+
+int Bank_IsPinValid(int ID, int Pin)
+{
+	if( ID < 0 || ID >= giBank_NumUsers )
+		return 0;
+	if( gaBank_Users[ID].Pin < 0 )
+		return 0;
+	return gaBank_Users[ID].Pin == Pin;
+}
+
+void Bank_SetPin(int ID, int Pin)
+{
+	if( ID < 0 || ID >= giBank_NumUsers )
+		return ;
+	Bank_int_RecordUndo(ID);
+	gaBank_Users[ID].Pin = Pin;
+	Bank_int_QueueChange(ID, BANK_CHANGE_PIN);
+	Bank_int_WriteEntry(ID);
+}
+
+/*
+ * Cards are not supported by this backend
+ */
+int Bank_GetAcctByCard(const char *CardID)
+{
+	(void)CardID;
+	return -1;
+}
+
+int Bank_GetCardLogin(const char *CardID, int *Flags, char **Name)
+{
+	(void)CardID;	(void)Flags;	(void)Name;
+	return -1;
+}
+
+int Bank_AddAcctCard(int AcctID, const char *CardID)
+{
+	(void)CardID;
+	if( AcctID < 0 || AcctID >= giBank_NumUsers )
+		return 1;
+	return 2;
 }
 
 // ---
 // Unix user dependent code
-// TODO: Modify to keep its own list of usernames
 // ---
 char *Bank_GetAcctName(int ID)
 {
-	struct passwd	*pwd;
-	
 	if( ID < 0 || ID >= giBank_NumUsers )
 		return NULL;
-	
+
 	if( gaBank_Users[ID].Name ) {
 		return strdup(gaBank_Users[ID].Name);
 	}
-	
-	if( gaBank_Users[ID].UnixID == -1 )
-		return strdup(COKEBANK_SALES_ACCT);
 
-	if( gaBank_Users[ID].UnixID == -2 )
-		return strdup(COKEBANK_DEBT_ACCT);
-
-	pwd = getpwuid(gaBank_Users[ID].UnixID);
-	if( !pwd )	return NULL;
-
-	return strdup(pwd->pw_name);
+	return Ident_GetName(gaBank_Users[ID].UnixID);
 }
 
 int Bank_int_GetUnixID(const char *Username)
 {
-	 int	uid;
+	// Internal accounts
+	if( Username[0] == '>' )
+		return -1;
 
-	if( strcmp(Username, COKEBANK_SALES_ACCT) == 0 ) {	// Pseudo account that sales are made into
-		uid = -1;
-	}
-	else if( strcmp(Username, COKEBANK_DEBT_ACCT) == 0 ) {	// Pseudo acount that money is added from
-		uid = -2;
-	}
-	else {
-		struct passwd	*pwd;
-		// Get user ID
-		pwd = getpwnam(Username);
-		if( !pwd )	return -1;
-		uid = pwd->pw_uid;
-	}
-	return uid;
+	return Ident_GetUID(Username);
 }
 
 
 /*
  * Authenticate a user
+ * - Password is the hex SHA-1 of <username><salt><SHA-1 of password>, so
+ *   the user's userPassword in LDAP needs to be {SHA} or cleartext
  */
 int Bank_GetUserAuth(const char *Salt, const char *Username, const char *Password)
 {
 	#if USE_LDAP
 	uint8_t	hash[20];
+	uint8_t	passhash[20];
 	uint8_t	h[20];
-	 int	ofs = strlen(Username) + strlen(Salt);
-	char	input[ ofs + 40 + 1];
-	char	tmp[4 + strlen(Username) + 1];	// uid=%s
-	char	*passhash;
+	uint8_t	diff = 0;
+	char	*passwd;
+	 int	ulen, slen;
 	#endif
 	
-	#if 1
-	// Only here to shut GCC up (until password auth is implemented)
-	if( Salt == NULL )
-		return -1;
-	if( Password == NULL )
+	if( Salt == NULL || Password == NULL )
 		return -1;
-	#endif
 	
 	#if HACK_TPG_NOAUTH
 	if( strcmp(Username, "tpg") == 0 )
-		return Bank_GetAcctByName("tpg");
+		return Bank_int_FindByNameLocked("tpg");
 	#endif
 	#if HACK_ROOT_NOAUTH
-	if( strcmp(Username, "root") == 0 ) {
-		int ret = Bank_GetAcctByName("root");
-		if( ret == -1 )
-			return Bank_CreateAcct("root");
-		return ret;
-	}
+	// (root is created with the bank)
+	if( strcmp(Username, "root") == 0 )
+		return Bank_int_FindByNameLocked("root");
 	#endif
 	
 	#if USE_LDAP
 	HexBin(hash, 20, Password);
 	
-	// Build string to hash
-	strcpy(input, Username);
-	strcpy(input, Salt);
+	passwd = Bank_int_GetLDAPPassword(Username);
+	if( !passwd )
+		return -1;
 	
-	// TODO: Get user's SHA-1 hash
-	sprintf(tmp, "uid=%s", Username);
-	printf("tmp = '%s'\n", tmp);
-	passhash = ReadLDAPValue(tmp, "userPassword");
-	if( !passhash ) {
+	// Get SHA-1 of the password
+	if( strncmp(passwd, "{SHA}", 5) == 0 ) {
+		uint8_t	raw[24];
+		// 20 bytes is 28 base64 characters (decoded with one padding byte)
+		if( strlen(passwd+5) != 28 || EVP_DecodeBlock(raw, (unsigned char*)passwd+5, 28) != 21 ) {
+			fprintf(stderr, "Bank_GetUserAuth: Malformed {SHA} password for '%s'\n", Username);
+			free(passwd);
+			return -1;
+		}
+		memcpy(passhash, raw, 20);
+	}
+	else if( strncmp(passwd, "{CLEARTEXT}", 11) == 0 ) {
+		SHA1((unsigned char*)passwd+11, strlen(passwd+11), passhash);
+	}
+	else if( passwd[0] != '{' ) {
+		SHA1((unsigned char*)passwd, strlen(passwd), passhash);
+	}
+	else {
+		fprintf(stderr, "Bank_GetUserAuth: Unsupported password scheme for '%s'\n", Username);
+		free(passwd);
 		return -1;
 	}
-	printf("LDAP hash '%s'\n", passhash);
+	memset(passwd, 0, strlen(passwd));
+	free(passwd);
 	
-	sprintf(input+ofs, "%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x",
-		h[ 0], h[ 1], h[ 2], h[ 3], h[ 4], h[ 5], h[ 6], h[ 7], h[ 8], h[ 9],
-		h[10], h[11], h[12], h[13], h[14], h[15], h[16], h[17], h[18], h[19]
-		);
-	// Then create the hash from the provided salt
-	// Compare that with the provided hash
-
-	# if 1
-	{
-		 int	i;
-		printf("Password hash ");
-		for(i=0;i<20;i++)
-			printf("%02x", hash[i]&0xFF);
-		printf("\n");
-	}
-	# endif
+	// Hash <username><salt><passhash> and compare (without an early exit)
+	ulen = strlen(Username);
+	slen = strlen(Salt);
+	{
+		uint8_t	input[ulen + slen + 20];
+		memcpy(input, Username, ulen);
+		memcpy(input + ulen, Salt, slen);
+		memcpy(input + ulen + slen, passhash, 20);
+		SHA1(input, ulen + slen + 20, h);
+	}
 	
-	#endif
+	for( int i = 0; i < 20; i ++ )
+		diff |= h[i] ^ hash[i];
+	if( diff )
+		return -1;
 	
+	return Bank_int_FindByNameLocked(Username);
+	#else
 	return -1;
+	#endif
 }
 
-#if USE_LDAP
-char *ReadLDAPValue(const char *Filter, char *Value)
+/*
+ * Passwords are kept in LDAP
+ */
+int Bank_SetPassword(int ID, const char *Password)
 {
-	LDAPMessage	*res, *res2;
-	struct berval **attrValues;
-	char	*attrNames[] = {Value,NULL};
-	char	*ret;
-	struct timeval	timeout;
-	 int	rv;
-	
-	timeout.tv_sec = 5;
-	timeout.tv_usec = 0;
-	
-	rv = ldap_search_ext_s(gpLDAP, "", LDAP_SCOPE_BASE, Filter,
-		attrNames, 0, NULL, NULL, &timeout, 1, &res
-		);
-	printf("ReadLDAPValue: rv = %i\n", rv);
-	if(rv) {
-		fprintf(stderr, "LDAP Error reading '%s' with filter '%s'\n%s\n",
-			Value, Filter,
-			ldap_err2string(rv)
-			);
-		return NULL;
-	}
-	
-	res2 = ldap_first_entry(gpLDAP, res);
-	attrValues = ldap_get_values_len(gpLDAP, res2, Value);
-	
-	ret = strndup(attrValues[0]->bv_val, attrValues[0]->bv_len);
-	
-	ldap_value_free_len(attrValues);
-	
-	
-	return ret;
+	(void)ID;
+	(void)Password;
+	return 1;
 }
-#endif
 
 // TODO: Move to another file
 void HexBin(uint8_t *Dest, int BufSize, const char *Src)
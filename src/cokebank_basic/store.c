@@ -0,0 +1,401 @@
+/*
+ * OpenDispense 2
+ * UCC (University [of WA] Computer Club) Electronic Accounting System
+ *
+ * store.c - Record file for the basic cokebank
+ * > Records are kept in a memory mapped file, changes go to an append-only
+ *   journal first (and are replayed from it after a crash).
+ *
+ * This file is licenced under the 3-clause BSD Licence. See the file COPYING
+ * for full details.
+ */
+#define _GNU_SOURCE	// mremap
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "common.h"
+
+#define STORE_MAGIC	0x324B4243	// "CBK2"
+#define STORE_MIN_CAPACITY	64	// Records allocated in a new file
+#define JOURNAL_CHECKPOINT	1024	// Journal entries before the file is synced and the journal reset
+#define MAX_QUEUED_RECORDS	128	// Accounts written by one commit (a full MULTI changes up to 2 per command, see MAX_BATCH_COMMANDS)
+
+// === TYPES ===
+typedef struct sFileHeader
+{
+	uint32_t	Magic;
+	uint32_t	NumRecords;
+	uint32_t	Capacity;
+	uint32_t	Reserved;
+	uint64_t	Sequence;	// Last journal batch that is safely in the file
+}	tFileHeader;
+
+typedef struct sJournalEntry
+{
+	uint64_t	Sequence;	// Batch number
+	uint32_t	Count;	// Number of entries in the batch
+	uint32_t	ID;
+	uint32_t	Checksum;
+	uint32_t	Reserved;
+	tFileUser	Record;
+}	tJournalEntry;
+
+// === PROTOTYPES ===
+static int	Bank_int_ConvertV1(const char *Path, int FD);
+static int	Bank_int_MapStore(size_t Capacity);
+static void	Bank_int_ApplyRecord(uint32_t ID, const tFileUser *Record);
+static int	Bank_int_ReplayJournal(void);
+static void	Bank_int_Checkpoint(void);
+static uint32_t	Bank_int_JournalChecksum(const tJournalEntry *Entry);
+
+// === GLOBALS ===
+ int	giBank_StoreFD = -1;
+ int	giBank_JournalFD = -1;
+tFileHeader	*gpBank_StoreHeader;	// Start of the mapping
+tFileUser	*gaBank_StoreRecords;	// Follows the header
+ int	giBank_JournalEntries;	// Entries since the last checkpoint
+tJournalEntry	gaBank_QueuedRecords[MAX_QUEUED_RECORDS];
+ int	giBank_NumQueuedRecords;
+
+// === CODE ===
+int Bank_int_OpenStore(const char *Path)
+{
+	struct stat	st;
+	char	journalPath[strlen(Path) + sizeof(".journal")];
+
+	giBank_StoreFD = open(Path, O_RDWR|O_CREAT, 0600);
+	if( giBank_StoreFD < 0 ) {
+		perror("Opening coke bank");
+		return -1;
+	}
+	fstat(giBank_StoreFD, &st);
+
+	if( st.st_size == 0 )
+	{
+		// New file
+		if( Bank_int_MapStore(STORE_MIN_CAPACITY) )	return -1;
+		gpBank_StoreHeader->Magic = STORE_MAGIC;
+	}
+	else if( (size_t)st.st_size < sizeof(tFileHeader) )
+	{
+		fprintf(stderr, "Coke bank file '%s' is truncated\n", Path);
+		return -1;
+	}
+	else
+	{
+		tFileHeader	hdr;
+		if( pread(giBank_StoreFD, &hdr, sizeof(hdr), 0) != sizeof(hdr) ) {
+			perror("Reading coke bank");
+			return -1;
+		}
+		if( hdr.Magic != STORE_MAGIC )
+		{
+			// Old format, just an array of records
+			if( st.st_size % sizeof(tFileUserV1) != 0 ) {
+				fprintf(stderr, "Coke bank file '%s' is not a bank\n", Path);
+				return -1;
+			}
+			if( Bank_int_ConvertV1(Path, giBank_StoreFD) )
+				return -1;
+			fstat(giBank_StoreFD, &st);
+		}
+		if( Bank_int_MapStore( (st.st_size - sizeof(tFileHeader)) / sizeof(tFileUser) ) )
+			return -1;
+	}
+
+	// Open journal and apply anything that didn't make it to the file
+	strcpy(journalPath, Path);
+	strcat(journalPath, ".journal");
+	giBank_JournalFD = open(journalPath, O_RDWR|O_CREAT|O_APPEND, 0600);
+	if( giBank_JournalFD < 0 ) {
+		perror("Opening coke bank journal");
+		return -1;
+	}
+	if( Bank_int_ReplayJournal() )
+		return -1;
+
+	return gpBank_StoreHeader->NumRecords;
+}
+
+const tFileUser *Bank_int_GetStoredRecord(int ID)
+{
+	if( ID < 0 || (uint32_t)ID >= gpBank_StoreHeader->NumRecords )
+		return NULL;
+	return &gaBank_StoreRecords[ID];
+}
+
+int Bank_int_QueueStore(int ID, const tFileUser *Record)
+{
+	// Already queued, only the latest value needs writing
+	for( int i = 0; i < giBank_NumQueuedRecords; i ++ )
+	{
+		if( gaBank_QueuedRecords[i].ID == (uint32_t)ID ) {
+			gaBank_QueuedRecords[i].Record = *Record;
+			return 0;
+		}
+	}
+
+	// Full queue, write out what we have (loses atomicity, but not data)
+	if( giBank_NumQueuedRecords == MAX_QUEUED_RECORDS ) {
+		fprintf(stderr, "Bank_int_QueueStore: Transaction too large, committing early\n");
+		if( Bank_int_CommitStore() )
+			return 1;
+	}
+
+	gaBank_QueuedRecords[giBank_NumQueuedRecords].ID = ID;
+	gaBank_QueuedRecords[giBank_NumQueuedRecords].Record = *Record;
+	giBank_NumQueuedRecords ++;
+	return 0;
+}
+
+int Bank_int_CommitStore(void)
+{
+	uint64_t	seq;
+	size_t	len;
+	off_t	end;
+
+	if( giBank_NumQueuedRecords == 0 )
+		return 0;
+
+	// Journal the whole batch with a single write
+	seq = gpBank_StoreHeader->Sequence + giBank_JournalEntries + 1;
+	for( int i = 0; i < giBank_NumQueuedRecords; i ++ )
+	{
+		tJournalEntry	*ent = &gaBank_QueuedRecords[i];
+		ent->Sequence = seq;
+		ent->Count = giBank_NumQueuedRecords;
+		ent->Reserved = 0;
+		ent->Checksum = 0;
+		ent->Checksum = Bank_int_JournalChecksum(ent);
+	}
+	len = giBank_NumQueuedRecords * sizeof(tJournalEntry);
+	end = lseek(giBank_JournalFD, 0, SEEK_END);
+	if( write(giBank_JournalFD, gaBank_QueuedRecords, len) != (ssize_t)len ) {
+		perror("Bank_int_CommitStore - Journal write");
+		// Don't leave a partial batch for later ones to be appended after
+		ftruncate(giBank_JournalFD, end);
+		giBank_NumQueuedRecords = 0;
+		return 1;
+	}
+	fdatasync(giBank_JournalFD);
+
+	// Then update the file (the kernel writes it back when it wants)
+	for( int i = 0; i < giBank_NumQueuedRecords; i ++ )
+		Bank_int_ApplyRecord(gaBank_QueuedRecords[i].ID, &gaBank_QueuedRecords[i].Record);
+	giBank_NumQueuedRecords = 0;
+
+	// Sequence numbers are per batch, entries per record
+	giBank_JournalEntries ++;
+	if( giBank_JournalEntries >= JOURNAL_CHECKPOINT )
+		Bank_int_Checkpoint();
+
+	return 0;
+}
+
+/**
+ * \brief Convert a headerless file to the current format (in place, via a temporary file)
+ */
+static int Bank_int_ConvertV1(const char *Path, int FD)
+{
+	char	tmpPath[strlen(Path) + sizeof(".new")];
+	struct stat	st;
+	tFileHeader	hdr;
+	tFileUserV1	old;
+	tFileUser	new;
+	 int	newFD, count;
+
+	fstat(FD, &st);
+	count = st.st_size / sizeof(tFileUserV1);
+
+	strcpy(tmpPath, Path);
+	strcat(tmpPath, ".new");
+	newFD = open(tmpPath, O_RDWR|O_CREAT|O_TRUNC, 0600);
+	if( newFD < 0 ) {
+		perror("Bank_int_ConvertV1");
+		return 1;
+	}
+
+	errno = 0;
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.Magic = STORE_MAGIC;
+	hdr.NumRecords = count;
+	hdr.Capacity = count;
+	if( write(newFD, &hdr, sizeof(hdr)) != sizeof(hdr) )
+		goto _error;
+
+	for( int i = 0; i < count; i ++ )
+	{
+		if( pread(FD, &old, sizeof(old), i * sizeof(old)) != sizeof(old) )
+			goto _error;
+		memset(&new, 0, sizeof(new));
+		new.UnixID = old.UnixID;
+		new.Balance = old.Balance;
+		new.Flags = old.Flags;
+		new.Pin = -1;
+		// The old format only had two pseudo accounts
+		if( old.UnixID == -1 )
+			strcpy(new.Name, COKEBANK_SALES_ACCT);
+		else if( old.UnixID == -2 )
+			strcpy(new.Name, COKEBANK_DEBT_ACCT);
+		if( write(newFD, &new, sizeof(new)) != sizeof(new) )
+			goto _error;
+	}
+
+	// Only replace the old file once the new one is complete
+	if( fsync(newFD) || rename(tmpPath, Path) )
+		goto _error;
+
+	// Use the new file from now on
+	dup2(newFD, FD);
+	close(newFD);
+	Log_Info("Converted coke bank '%s' to the journaled format (%i accounts)", Path, count);
+	return 0;
+
+_error:
+	fprintf(stderr, "Bank_int_ConvertV1: Unable to convert '%s' (left as it was): %s\n",
+		Path, errno ? strerror(errno) : "short write");
+	close(newFD);
+	unlink(tmpPath);
+	return 1;
+}
+
+/**
+ * \brief Map (or re-map, after growing) the record file
+ */
+static int Bank_int_MapStore(size_t Capacity)
+{
+	size_t	size = sizeof(tFileHeader) + Capacity * sizeof(tFileUser);
+	size_t	oldSize = 0;
+	void	*map;
+
+	if( gpBank_StoreHeader )
+		oldSize = sizeof(tFileHeader) + gpBank_StoreHeader->Capacity * sizeof(tFileUser);
+
+	if( size > oldSize && ftruncate(giBank_StoreFD, size) ) {
+		perror("Bank_int_MapStore - ftruncate");
+		return 1;
+	}
+
+	if( gpBank_StoreHeader )
+		map = mremap(gpBank_StoreHeader, oldSize, size, MREMAP_MAYMOVE);
+	else
+		map = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, giBank_StoreFD, 0);
+	if( map == MAP_FAILED ) {
+		perror("Bank_int_MapStore - mmap");
+		return 1;
+	}
+
+	gpBank_StoreHeader = map;
+	gaBank_StoreRecords = (void*)(gpBank_StoreHeader + 1);
+	gpBank_StoreHeader->Capacity = Capacity;
+	return 0;
+}
+
+/**
+ * \brief Write a record into the mapped file, growing it if needed
+ */
+static void Bank_int_ApplyRecord(uint32_t ID, const tFileUser *Record)
+{
+	if( ID >= gpBank_StoreHeader->Capacity )
+	{
+		size_t	newCap = gpBank_StoreHeader->Capacity * 2;
+		if( newCap <= ID )	newCap = ID + STORE_MIN_CAPACITY;
+		if( Bank_int_MapStore(newCap) ) {
+			// The journal still has it
+			fprintf(stderr, "Bank_int_ApplyRecord: Unable to grow file for record %u\n", ID);
+			return ;
+		}
+	}
+	gaBank_StoreRecords[ID] = *Record;
+	if( ID >= gpBank_StoreHeader->NumRecords )
+		gpBank_StoreHeader->NumRecords = ID + 1;
+}
+
+/**
+ * \brief Apply complete batches from the journal that are newer than the file
+ */
+static int Bank_int_ReplayJournal(void)
+{
+	tJournalEntry	batch[MAX_QUEUED_RECORDS];
+	 int	applied = 0;
+	off_t	ofs = 0;
+
+	for( ;; )
+	{
+		 int	count;
+
+		if( pread(giBank_JournalFD, &batch[0], sizeof(batch[0]), ofs) != sizeof(batch[0]) )
+			break;
+		count = batch[0].Count;
+		if( count < 1 || count > MAX_QUEUED_RECORDS )
+			break;
+		if( pread(giBank_JournalFD, batch, count*sizeof(batch[0]), ofs) != (ssize_t)(count*sizeof(batch[0])) )
+			break;	// Torn write at the end
+
+		// Check the whole batch before applying any of it
+		 int	i;
+		for( i = 0; i < count; i ++ )
+		{
+			uint32_t	sum = batch[i].Checksum;
+			batch[i].Checksum = 0;
+			if( Bank_int_JournalChecksum(&batch[i]) != sum )	break;
+			if( batch[i].Sequence != batch[0].Sequence )	break;
+		}
+		if( i != count )
+			break;
+
+		if( batch[0].Sequence > gpBank_StoreHeader->Sequence ) {
+			for( i = 0; i < count; i ++ )
+				Bank_int_ApplyRecord(batch[i].ID, &batch[i].Record);
+			applied ++;
+		}
+		ofs += count * sizeof(batch[0]);
+	}
+
+	if( applied )
+		Log_Info("Coke bank recovered %i transactions from the journal", applied);
+
+	// Everything is in the file now
+	giBank_JournalEntries = applied;
+	Bank_int_Checkpoint();
+	return 0;
+}
+
+/**
+ * \brief Flush the file to disk and empty the journal
+ */
+static void Bank_int_Checkpoint(void)
+{
+	size_t	size = sizeof(tFileHeader) + gpBank_StoreHeader->Capacity * sizeof(tFileUser);
+
+	if( msync(gpBank_StoreHeader, size, MS_SYNC) ) {
+		perror("Bank_int_Checkpoint - msync");
+		return ;	// Keep the journal
+	}
+	gpBank_StoreHeader->Sequence += giBank_JournalEntries;
+	msync(gpBank_StoreHeader, sizeof(tFileHeader), MS_SYNC);
+
+	if( ftruncate(giBank_JournalFD, 0) )
+		perror("Bank_int_Checkpoint - ftruncate");
+	giBank_JournalEntries = 0;
+}
+
+/**
+ * \brief FNV-1a hash of a journal entry (with Checksum zeroed)
+ */
+static uint32_t Bank_int_JournalChecksum(const tJournalEntry *Entry)
+{
+	const uint8_t	*data = (const void*)Entry;
+	uint32_t	hash = 2166136261u;
+	for( size_t i = 0; i < sizeof(*Entry); i ++ )
+	{
+		hash ^= data[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
@@ -12,11 +12,33 @@
 #include <limits.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
+#include <sys/random.h>
 #include "../cokebank.h"
 #include <sqlite3.h>
+#include <openssl/evp.h>
 
 #define DEBUG	0
 
+#define REQUEST_TTL	(24*60*60)	// Seconds a request ID is remembered for
+#define MAX_REQUESTS	10000	// Maximum number of remembered request IDs
+#define REQUEST_PRUNE_INTERVAL	64	// Saves between prunes of the request table
+
+// Password hashing (scrypt, N=2^14 r=8 uses 16MiB per check)
+#define PASSWORD_SCRYPT_LOGN	14
+#define PASSWORD_SCRYPT_R	8
+#define PASSWORD_SCRYPT_P	1
+#define PASSWORD_SALT_LEN	16
+#define PASSWORD_KEY_LEN	32
+#define PASSWORD_CRED_LEN	20	// SHA-1 sent by PASS
+
+// Card index (cards are looked up in memory, never by a query)
+#define CARD_ID_MAX_LEN	10	// Bytes in the longest card ID (triple size MIFARE UID)
+#define CARD_INDEX_MIN_SIZE	64	// Initial slots (power of two, grows at half full)
+
+#define MAX_TRANSACTION_DEPTH	8	// Nested Bank_StartTransaction calls
+
+// Initial layout (schema version 0), brought up to date by caBank_Migrations
 const char * const csBank_DatabaseSetup = 
 "CREATE TABLE IF NOT EXISTS accounts ("
 "	acct_id INTEGER PRIMARY KEY NOT NULL,"
@@ -51,27 +73,250 @@ const char * const csBank_DatabaseSetup =
 "INSERT INTO accounts (acct_name,acct_is_internal,acct_uid) VALUES ('"COKEBANK_FREE_ACCT"',1,-3);"
 ;
 
+// Tables added before schema versions were tracked (may already exist)
+const char * const csBank_Schema1 = 
+"CREATE TABLE IF NOT EXISTS requests ("
+"	acct_id INTEGER NOT NULL,"
+"	req_token STRING NOT NULL,"
+"	req_time INTEGER NOT NULL,"
+"	req_result STRING NOT NULL,"
+"	PRIMARY KEY (acct_id, req_token)"
+");"
+"CREATE INDEX IF NOT EXISTS requests_time ON requests (req_time);"
+;
+
+// Last seen times as integer UNIX timestamps (rebuilds accounts)
+const char * const csBank_Schema2 = 
+"CREATE TABLE accounts_new ("
+"	acct_id INTEGER PRIMARY KEY NOT NULL,"
+"	acct_balance INTEGER NOT NULL DEFAULT 0,"
+"	acct_last_seen INTEGER NOT NULL DEFAULT (CAST(strftime('%s','now') AS INTEGER)),"
+"	acct_name STRING UNIQUE,"
+"	acct_uid INTEGER UNIQUE DEFAULT NULL,"
+"	acct_pin INTEGER DEFAULT NULL,"
+"	acct_is_disabled BOOLEAN NOT NULL DEFAULT false,"
+"	acct_is_coke BOOLEAN NOT NULL DEFAULT false,"
+"	acct_is_admin BOOLEAN NOT NULL DEFAULT false,"
+"	acct_is_door BOOLEAN NOT NULL DEFAULT false,"
+"	acct_is_internal BOOLEAN NOT NULL DEFAULT false,"
+"	acct_password STRING DEFAULT NULL"
+");"
+"INSERT INTO accounts_new SELECT"
+"	acct_id,acct_balance,COALESCE(CAST(strftime('%s',acct_last_seen) AS INTEGER),0),"
+"	acct_name,acct_uid,acct_pin,"
+"	acct_is_disabled,acct_is_coke,acct_is_admin,acct_is_door,acct_is_internal,"
+"	acct_password"
+"	FROM accounts;"
+"DROP TABLE accounts;"
+"ALTER TABLE accounts_new RENAME TO accounts;"
+;
+
+// Indexes for ENUM_USERS (see Bank_IteratorAfter), one per sort order.
+// Each holds every column the iterator reads, so listings never touch the table.
+const char * const csBank_Schema3 = 
+"CREATE INDEX accounts_by_name ON accounts (acct_name,"
+"	acct_balance,acct_last_seen,"
+"	acct_is_disabled,acct_is_coke,acct_is_admin,acct_is_door,acct_is_internal);"
+"CREATE INDEX accounts_by_balance ON accounts (acct_balance,acct_id,"
+"	acct_name,acct_last_seen,"
+"	acct_is_disabled,acct_is_coke,acct_is_admin,acct_is_door,acct_is_internal);"
+"CREATE INDEX accounts_by_last_seen ON accounts (acct_last_seen,acct_id,"
+"	acct_name,acct_balance,"
+"	acct_is_disabled,acct_is_coke,acct_is_admin,acct_is_door,acct_is_internal);"
+;
+
+// Append-only record of transfers (written by Bank_Transfer).
+// HISTORY reads an account's entries from the per-account indexes alone.
+const char * const csBank_Schema4 = 
+"CREATE TABLE ledger ("
+"	ledger_seq INTEGER PRIMARY KEY NOT NULL,"
+"	ledger_time INTEGER NOT NULL,"
+"	ledger_src INTEGER NOT NULL,"
+"	ledger_dst INTEGER NOT NULL,"
+"	ledger_amount INTEGER NOT NULL,"
+"	ledger_actor INTEGER NOT NULL,"
+"	ledger_reason STRING NOT NULL"
+");"
+"CREATE INDEX ledger_by_src ON ledger (ledger_src,ledger_seq,"
+"	ledger_time,ledger_dst,ledger_amount,ledger_actor,ledger_reason);"
+"CREATE INDEX ledger_by_dst ON ledger (ledger_dst,ledger_seq,"
+"	ledger_time,ledger_src,ledger_amount,ledger_actor,ledger_reason);"
+"CREATE TRIGGER ledger_no_update BEFORE UPDATE ON ledger"
+"	BEGIN SELECT RAISE(ABORT, 'ledger is append-only'); END;"
+"CREATE TRIGGER ledger_no_delete BEFORE DELETE ON ledger"
+"	BEGIN SELECT RAISE(ABORT, 'ledger is append-only'); END;"
+;
+
+// Sequence number of each account's last change (\see Bank_ChangedSince)
+const char * const csBank_Schema5 = 
+"ALTER TABLE accounts ADD COLUMN acct_change_seq INTEGER NOT NULL DEFAULT 0;"
+"CREATE INDEX accounts_by_change ON accounts (acct_change_seq,acct_id,"
+"	acct_name,acct_balance,acct_last_seen,"
+"	acct_is_disabled,acct_is_coke,acct_is_admin,acct_is_door,acct_is_internal);"
+;
+
+// Hourly sales totals for each item and handler (\see Bank_SaveSalesRollup)
+// Rows only exist for hours with sales, and are keyed for range scans.
+const char * const csBank_Schema6 = 
+"CREATE TABLE sales_rollup ("
+"	sales_series STRING NOT NULL,"
+"	sales_hour INTEGER NOT NULL,"
+"	sales_count INTEGER NOT NULL,"
+"	sales_revenue INTEGER NOT NULL,"
+"	PRIMARY KEY (sales_series,sales_hour)"
+") WITHOUT ROWID;"
+;
+
+// Stock left of items in machines that can't tell (\see Bank_SetItemStock)
+const char * const csBank_Schema7 = 
+"CREATE TABLE item_stock ("
+"	stock_item STRING PRIMARY KEY NOT NULL,"
+"	stock_count INTEGER NOT NULL"
+") WITHOUT ROWID;"
+;
+
+// Money set aside for dispenses in progress (\see Bank_ReserveFunds)
+const char * const csBank_Schema8 = 
+"CREATE TABLE holds ("
+"	hold_id INTEGER PRIMARY KEY,"
+"	hold_acct INTEGER NOT NULL,"
+"	hold_amount INTEGER NOT NULL,"
+"	hold_time INTEGER NOT NULL"
+");"
+"CREATE INDEX holds_acct ON holds (hold_acct);"
+;
+
 // === TYPES ===
 struct sAcctIterator	// Unused really, just used as a void type
 {
 };
 
+typedef struct sCardKey
+{
+	uint8_t	Length;	// 0 = empty slot
+	uint8_t	Bytes[CARD_ID_MAX_LEN];
+}	tCardKey;
+
+typedef struct sCardEntry
+{
+	tCardKey	Key;
+	 int	AcctID;
+	 int	Flags;	// Copy of the account's flags (updated by Bank_SetFlags)
+	char	*AcctName;
+}	tCardEntry;
+
+typedef struct sPendingChange
+{
+	uint64_t	Seq;
+	 int	AcctID;
+	 int	Kind;
+}	tPendingChange;
+
+typedef struct sChangeListener
+{
+	tBankChangeCallback	Callback;
+	void	*Data;
+}	tChangeListener;
+
+/**
+ * \brief Step from one schema version to the next (\see caBank_Migrations)
+ */
+typedef struct sMigration
+{
+	const char	*Description;
+	const char	*SQL;	// Run first (NULL for none)
+	 int	(*Function)(void);	// Then called (NULL for none), returns boolean failure
+}	tMigration;
+
 // === PROTOYPES ===
  int	Bank_Initialise(const char *Argument);
- int	Bank_Transfer(int SourceAcct, int DestAcct, int Ammount, const char *Reason);
+ int	Bank_Transfer(int SourceAcct, int DestAcct, int Ammount, int Actor, const char *Reason);
+ int	Bank_StartTransaction(void);
+ int	Bank_CommitTransaction(void);
+void	Bank_AbortTransaction(void);
+ int	Bank_AddChangeListener(tBankChangeCallback Callback, void *Data);
+uint64_t	Bank_GetChangeSeq(void);
+tAcctIterator	*Bank_ChangedSince(uint64_t Seq);
+void	Bank_int_QueueChange(int AcctID, int Kind, uint64_t Seq);
+void	Bank_int_SendChanges(void);
  int	Bank_GetFlags(int AcctID);
  int	Bank_SetFlags(int AcctID, int Mask, int Value);
+unsigned int	Bank_GetFlagsEpoch(void);
+unsigned int	Bank_GetDataVersion(void);
  int	Bank_GetBalance(int AcctID);
 char	*Bank_GetAcctName(int AcctID);
  int	Bank_IsPinValid(int AcctID, int Pin);
 void	Bank_SetPin(int AcctID, int Pin);
+ int	Bank_IteratorNextRecord(tAcctIterator *It, tAcctRecord *Record);
+tAcctIterator	*Bank_IteratorAfter(int FlagMask, int FlagValues, int Flags, int MinMaxBalance, time_t LastSeen, const tAcctRecord *After);
+tLedgerIterator	*Bank_HistoryIterator(int AcctID, time_t Since, int Limit);
+ int	Bank_HistoryNext(tLedgerIterator *It, tLedgerEntry *Entry);
+void	Bank_DelHistoryIterator(tLedgerIterator *It);
+ int	Bank_SaveSalesRollup(const char *Series, time_t Hour, int Count, int Revenue);
+tSalesIterator	*Bank_SalesIterator(void);
+ int	Bank_SalesNext(tSalesIterator *It, tSalesRollup *Rollup);
+void	Bank_DelSalesIterator(tSalesIterator *It);
+ int	Bank_GetItemStock(const char *Item);
+ int	Bank_SetItemStock(const char *Item, int Count);
+ int	Bank_ReserveFunds(int AcctID, int Ammount, int MinBalance);
+ int	Bank_CommitHold(int HoldID, int DestAcct, int Actor, const char *Reason);
+void	Bank_ReleaseHold(int HoldID);
+ int	Bank_GetHeldFunds(int AcctID);
+char	*Bank_GetRequestResult(int AcctID, const char *Token);
+ int	Bank_SaveRequestResult(int AcctID, const char *Token, const char *Result);
+ int	Bank_SetPassword(int AcctID, const char *Password);
+ int	Bank_GetCardLogin(const char *CardID, int *Flags, char **Name);
+ int	Bank_int_HashPassword(const uint8_t *Cred, const uint8_t *Salt, int LogN, int R, int P, uint8_t *Key);
+ int	Bank_int_HexDecode(uint8_t *Dest, int Length, const char *Src);
+void	Bank_int_HexEncode(char *Dest, const uint8_t *Src, int Length);
+ int	Bank_int_GetRowFlags(sqlite3_stmt *Statement, int Column);
+ int	Bank_int_LoadCards(void);
+ int	Bank_int_ParseCardID(tCardKey *Key, const char *CardID);
+tCardEntry	*Bank_int_FindCard(const tCardKey *Key);
+ int	Bank_int_IndexCard(const tCardKey *Key, int AcctID, int Flags, char *AcctName);
 sqlite3_stmt	*Bank_int_MakeStatemnt(sqlite3 *Database, const char *Query);
+ int	Bank_int_Migrate(void);
+ int	Bank_int_AddPasswordColumn(void);
  int	Bank_int_QueryNone(sqlite3 *Database, const char *Query, char **ErrorMessage);
 sqlite3_stmt	*Bank_int_QuerySingle(sqlite3 *Database, const char *Query);
  int	Bank_int_IsValidName(const char *Name);
 
+// === CONSTANTS ===
+// Entry N takes a database from schema version N to N+1 (PRAGMA user_version)
+const tMigration	caBank_Migrations[] = {
+	{"request results and password hashes", csBank_Schema1, Bank_int_AddPasswordColumn},
+	{"integer last seen times", csBank_Schema2, NULL},
+	{"account listing indexes", csBank_Schema3, NULL},
+	{"transfer ledger", csBank_Schema4, NULL},
+	{"change sequence", csBank_Schema5, NULL},
+	{"sales rollups", csBank_Schema6, NULL},
+	{"item stock", csBank_Schema7, NULL},
+	{"funds holds", csBank_Schema8, NULL},
+};
+#define NUM_MIGRATIONS	((int)(sizeof(caBank_Migrations)/sizeof(caBank_Migrations[0])))
+
 // === GLOBALS ===
 sqlite3	*gBank_Database;
+sqlite3	*gBank_AuthDatabase;	// Read-only connection for Bank_GetUserAuth (runs on other threads)
+tCardEntry	*gaBank_Cards;	// Open addressed hash of card IDs
+ int	giBank_CardIndexSize;
+ int	giBank_NumCards;
+unsigned int	giBank_FlagsEpoch;	// Bumped by Bank_SetFlags
+sqlite3_stmt	*gBank_DataVersionStatement;	// PRAGMA data_version (kept prepared, it's polled often)
+sqlite3_stmt	*gBank_LedgerStatement;	// INSERT INTO ledger (kept prepared, used by every transfer)
+sqlite3_stmt	*gBank_SalesStatement;	// INSERT INTO sales_rollup (kept prepared once used)
+sqlite3_stmt	*gBank_StockStatement;	// INSERT INTO item_stock (kept prepared, used by every counted dispense)
+ int	giBank_NumHolds;	// Holds made by this process and not yet removed
+ int	giBank_TransactionDepth;	// Savepoints currently open
+ int	gaBank_ChangeStart[MAX_TRANSACTION_DEPTH];	// Pending change position of each savepoint
+tPendingChange	*gaBank_PendingChanges;	// Made, but not yet committed
+ int	giBank_PendingChangesSize;
+ int	giBank_NumPendingChanges;
+tChangeListener	*gaBank_ChangeListeners;
+ int	giBank_NumChangeListeners;
+uint64_t	giBank_ChangeSeq;	// Last seq handed out (stored in acct_change_seq with the change)
+uint64_t	giBank_CommittedSeq;	// Last seq committed (returned by Bank_GetChangeSeq)
+sqlite3_stmt	*gBank_ChangeStatement;	// Reads an account's state for a change (kept prepared)
 
 // === CODE ===
 int Bank_Initialise(const char *Argument)
@@ -114,26 +359,144 @@ int Bank_Initialise(const char *Argument)
 		sqlite3_free(errmsg);
 		return 1;
 	}
+	
+	// Apply schema changes
+	if( Bank_int_Migrate() )
+		return 1;
+	
+	// Carry on the change sequence
+	{
+		sqlite3_stmt	*statement = Bank_int_QuerySingle(gBank_Database,
+			"SELECT MAX(acct_change_seq) FROM accounts");
+		if( statement ) {
+			giBank_ChangeSeq = sqlite3_column_int64(statement, 0);
+			sqlite3_finalize(statement);
+		}
+		giBank_CommittedSeq = giBank_ChangeSeq;
+	}
+	
+	// Holds belong to dispenses in progress, any left are from a crash
+	if( Bank_int_QueryNone(gBank_Database, "DELETE FROM holds", NULL) == SQLITE_OK
+	 && sqlite3_changes(gBank_Database) > 0 )
+	{
+		Log_Info("Released %i funds holds left by the last run", sqlite3_changes(gBank_Database));
+	}
+	
+	// Open the connection used by password checks
+	rv = sqlite3_open_v2(Argument, &gBank_AuthDatabase, SQLITE_OPEN_READONLY|SQLITE_OPEN_FULLMUTEX, NULL);
+	if(rv != 0)
+	{
+		fprintf(stderr, "CokeBank: Unable to open database '%s' for authentication\n", Argument);
+		fprintf(stderr, "Reason: %s\n", sqlite3_errmsg(gBank_AuthDatabase));
+		sqlite3_close(gBank_AuthDatabase);
+		return 1;
+	}
+	sqlite3_busy_timeout(gBank_AuthDatabase, 1000);	// Wait out commits on the main connection
+
+	// Load cards
+	if( Bank_int_LoadCards() )
+		return 1;
+
+	return 0;
+}
+
+/**
+ * \brief Bring the database up to the current schema version
+ * \return Boolean failure
+ * \note Each step is applied in its own transaction along with the new version
+ */
+int Bank_int_Migrate(void)
+{
+	sqlite3_stmt	*statement;
+	 int	version, rv;
+	char	*errmsg, *query;
+	
+	statement = Bank_int_QuerySingle(gBank_Database, "PRAGMA user_version");
+	if( !statement ) {
+		fprintf(stderr, "Bank_int_Migrate - Unable to read schema version\n");
+		return 1;
+	}
+	version = sqlite3_column_int(statement, 0);
+	sqlite3_finalize(statement);
+	
+	if( version > NUM_MIGRATIONS ) {
+		fprintf(stderr, "Bank_int_Migrate - Database schema %i is newer than this server (%i)\n",
+			version, NUM_MIGRATIONS);
+		return 1;
+	}
+	
+	for( ; version < NUM_MIGRATIONS; version ++ )
+	{
+		const tMigration	*mig = &caBank_Migrations[version];
+		
+		rv = Bank_int_QueryNone(gBank_Database, "BEGIN", &errmsg);
+		if( rv == SQLITE_OK && mig->SQL )
+			rv = Bank_int_QueryNone(gBank_Database, mig->SQL, &errmsg);
+		if( rv == SQLITE_OK && mig->Function && mig->Function() ) {
+			rv = SQLITE_ERROR;
+			errmsg = NULL;
+		}
+		if( rv == SQLITE_OK ) {
+			query = mkstr("PRAGMA user_version = %i", version + 1);
+			rv = Bank_int_QueryNone(gBank_Database, query, &errmsg);
+			free(query);
+		}
+		if( rv == SQLITE_OK )
+			rv = Bank_int_QueryNone(gBank_Database, "COMMIT", &errmsg);
+		
+		if( rv != SQLITE_OK ) {
+			fprintf(stderr, "Bank_int_Migrate - Schema %i (%s) failed: %s\n",
+				version + 1, mig->Description, errmsg ? errmsg : "");
+			sqlite3_free(errmsg);
+			Bank_int_QueryNone(gBank_Database, "ROLLBACK", NULL);
+			return 1;
+		}
+		Log_Info("SQLite database upgraded to schema %i (%s)", version + 1, mig->Description);
+	}
+	
+	return 0;
+}
 
+/**
+ * \brief Schema 1 - Add acct_password (if an older server didn't already)
+ */
+int Bank_int_AddPasswordColumn(void)
+{
+	char	*errmsg;
+	 int	rv;
+	
+	rv = Bank_int_QueryNone(gBank_Database, "SELECT acct_password FROM accounts LIMIT 1", &errmsg);
+	if( rv == SQLITE_OK )
+		return 0;
+	sqlite3_free(errmsg);
+	
+	rv = Bank_int_QueryNone(gBank_Database, "ALTER TABLE accounts ADD COLUMN acct_password STRING DEFAULT NULL", &errmsg);
+	if( rv != SQLITE_OK ) {
+		fprintf(stderr, "Bank_int_AddPasswordColumn - SQLite Error: %s\n", errmsg);
+		sqlite3_free(errmsg);
+		return 1;
+	}
 	return 0;
 }
 
 /*
  * Move Money
  */
-int Bank_Transfer(int SourceUser, int DestUser, int Ammount, const char *Reason __attribute__((unused)))
+int Bank_Transfer(int SourceUser, int DestUser, int Ammount, int Actor, const char *Reason)
 {
 	char	*query;
 	 int	rv;
 	char	*errmsg;
-	
-	Reason = "";	// Shut GCC up
+	uint64_t	srcSeq, dstSeq;
 	
 	// Begin SQL Transaction
-	Bank_int_QueryNone(gBank_Database, "BEGIN TRANSACTION", NULL);
+	if( Bank_StartTransaction() )
+		return 1;
 
 	// Take from the source
-	query = mkstr("UPDATE accounts SET acct_balance=acct_balance%+i,acct_last_seen=datetime('now') WHERE acct_id=%i", -Ammount, SourceUser);
+	srcSeq = ++ giBank_ChangeSeq;
+	query = mkstr("UPDATE accounts SET acct_balance=acct_balance%+i,acct_last_seen=CAST(strftime('%%s','now') AS INTEGER),"
+		"acct_change_seq=%"PRIu64" WHERE acct_id=%i", -Ammount, srcSeq, SourceUser);
 //	printf("query = \"%s\"\n", query);
 	rv = Bank_int_QueryNone(gBank_Database, query, &errmsg);
 	free(query);
@@ -141,12 +504,14 @@ int Bank_Transfer(int SourceUser, int DestUser, int Ammount, const char *Reason
 	{
 		fprintf(stderr, "Bank_Transfer - SQLite Error: %s\n", errmsg);
 		sqlite3_free(errmsg);
-		Bank_int_QueryNone(gBank_Database, "ROLLBACK",  NULL);
+		Bank_AbortTransaction();
 		return 1;
 	}
 
 	// Give to the destination
-	query = mkstr("UPDATE accounts SET acct_balance=acct_balance%+i,acct_last_seen=datetime('now') WHERE acct_id=%i", Ammount, DestUser);
+	dstSeq = ++ giBank_ChangeSeq;
+	query = mkstr("UPDATE accounts SET acct_balance=acct_balance%+i,acct_last_seen=CAST(strftime('%%s','now') AS INTEGER),"
+		"acct_change_seq=%"PRIu64" WHERE acct_id=%i", Ammount, dstSeq, DestUser);
 //	printf("query = \"%s\"\n", query);
 	rv = Bank_int_QueryNone(gBank_Database, query, &errmsg);
 	free(query);
@@ -154,16 +519,200 @@ int Bank_Transfer(int SourceUser, int DestUser, int Ammount, const char *Reason
 	{
 		fprintf(stderr, "Bank_Transfer - SQLite Error: %s\n", errmsg);
 		sqlite3_free(errmsg);
-		Bank_int_QueryNone(gBank_Database, "ROLLBACK", NULL);
+		Bank_AbortTransaction();
+		return 1;
+	}
+	
+	// Record it
+	if( !gBank_LedgerStatement ) {
+		gBank_LedgerStatement = Bank_int_MakeStatemnt(gBank_Database,
+			"INSERT INTO ledger (ledger_time,ledger_src,ledger_dst,ledger_amount,ledger_actor,ledger_reason)"
+			" VALUES (CAST(strftime('%s','now') AS INTEGER),?,?,?,?,?)");
+		if( !gBank_LedgerStatement ) {
+			Bank_AbortTransaction();
+			return 1;
+		}
+	}
+	sqlite3_bind_int(gBank_LedgerStatement, 1, SourceUser);
+	sqlite3_bind_int(gBank_LedgerStatement, 2, DestUser);
+	sqlite3_bind_int(gBank_LedgerStatement, 3, Ammount);
+	sqlite3_bind_int(gBank_LedgerStatement, 4, Actor);
+	sqlite3_bind_text(gBank_LedgerStatement, 5, Reason ? Reason : "", -1, SQLITE_STATIC);
+	rv = sqlite3_step(gBank_LedgerStatement);
+	sqlite3_reset(gBank_LedgerStatement);
+	sqlite3_clear_bindings(gBank_LedgerStatement);
+	if( rv != SQLITE_DONE )
+	{
+		fprintf(stderr, "Bank_Transfer - SQLite Error: %s\n", sqlite3_errmsg(gBank_Database));
+		Bank_AbortTransaction();
 		return 1;
 	}
+	
+	Bank_int_QueueChange(SourceUser, BANK_CHANGE_BALANCE, srcSeq);
+	Bank_int_QueueChange(DestUser, BANK_CHANGE_BALANCE, dstSeq);
 
 	// Commit transaction
-	Bank_int_QueryNone(gBank_Database, "COMMIT", NULL);
+	return Bank_CommitTransaction();
+}
+
+/*
+ * Transactions
+ * - Savepoints are used so that Bank_Transfer (and others) can be called
+ *   within a larger transaction started by the server.
+ * - Changes are queued for the listeners as they are made, and sent once
+ *   the outermost savepoint is released.
+ * - Each change stores the next sequence number in the account's
+ *   acct_change_seq (in the same statement). Numbers used by rolled back
+ *   changes are not reused, so there may be gaps.
+ */
+int Bank_StartTransaction(void)
+{
+	 int	rv;
+	char	*errmsg;
+	
+	if( giBank_TransactionDepth == MAX_TRANSACTION_DEPTH )
+		return 1;
+	
+	rv = Bank_int_QueryNone(gBank_Database, "SAVEPOINT bank", &errmsg);
+	if( rv != SQLITE_OK )
+	{
+		fprintf(stderr, "Bank_StartTransaction - SQLite Error: %s\n", errmsg);
+		sqlite3_free(errmsg);
+		return 1;
+	}
+	gaBank_ChangeStart[giBank_TransactionDepth++] = giBank_NumPendingChanges;
+	return 0;
+}
+
+int Bank_CommitTransaction(void)
+{
+	 int	rv;
+	char	*errmsg;
+	
+	rv = Bank_int_QueryNone(gBank_Database, "RELEASE bank", &errmsg);
+	if( rv != SQLITE_OK )
+	{
+		fprintf(stderr, "Bank_CommitTransaction - SQLite Error: %s\n", errmsg);
+		sqlite3_free(errmsg);
+		Bank_AbortTransaction();
+		return 1;
+	}
+	if( giBank_TransactionDepth > 0 )
+		giBank_TransactionDepth --;
+	if( giBank_TransactionDepth == 0 )
+		Bank_int_SendChanges();
+	return 0;
+}
 
+void Bank_AbortTransaction(void)
+{
+	sqlite3_stmt	*statement;
+	
+	Bank_int_QueryNone(gBank_Database, "ROLLBACK TO bank; RELEASE bank", NULL);
+	if( giBank_TransactionDepth > 0 )
+		giBank_NumPendingChanges = gaBank_ChangeStart[--giBank_TransactionDepth];
+	
+	// A hold committed in the rolled back part is back
+	statement = Bank_int_QuerySingle(gBank_Database, "SELECT COUNT(*) FROM holds");
+	if( statement ) {
+		giBank_NumHolds = sqlite3_column_int(statement, 0);
+		sqlite3_finalize(statement);
+	}
+}
+
+/*
+ * Change listeners
+ */
+int Bank_AddChangeListener(tBankChangeCallback Callback, void *Data)
+{
+	void	*tmp = realloc(gaBank_ChangeListeners, (giBank_NumChangeListeners+1)*sizeof(tChangeListener));
+	if( !tmp )	return 1;
+	gaBank_ChangeListeners = tmp;
+	gaBank_ChangeListeners[giBank_NumChangeListeners].Callback = Callback;
+	gaBank_ChangeListeners[giBank_NumChangeListeners].Data = Data;
+	giBank_NumChangeListeners ++;
 	return 0;
 }
 
+uint64_t Bank_GetChangeSeq(void)
+{
+	return giBank_CommittedSeq;
+}
+
+/**
+ * \brief Remember a change, sent now if not in a transaction
+ */
+void Bank_int_QueueChange(int AcctID, int Kind, uint64_t Seq)
+{
+	if( giBank_NumChangeListeners == 0 ) {
+		if( giBank_TransactionDepth == 0 )
+			giBank_CommittedSeq = giBank_ChangeSeq;
+		return ;
+	}
+	
+	if( giBank_NumPendingChanges == giBank_PendingChangesSize )
+	{
+		 int	newSize = giBank_PendingChangesSize ? giBank_PendingChangesSize * 2 : 16;
+		void	*tmp = realloc(gaBank_PendingChanges, newSize * sizeof(tPendingChange));
+		if( !tmp ) {
+			perror("Bank_int_QueueChange");
+			return ;
+		}
+		gaBank_PendingChanges = tmp;
+		giBank_PendingChangesSize = newSize;
+	}
+	gaBank_PendingChanges[giBank_NumPendingChanges].Seq = Seq;
+	gaBank_PendingChanges[giBank_NumPendingChanges].AcctID = AcctID;
+	gaBank_PendingChanges[giBank_NumPendingChanges].Kind = Kind;
+	giBank_NumPendingChanges ++;
+	
+	if( giBank_TransactionDepth == 0 )
+		Bank_int_SendChanges();
+}
+
+/**
+ * \brief Pass committed changes to the listeners
+ */
+void Bank_int_SendChanges(void)
+{
+	 int	num = giBank_NumPendingChanges;
+	
+	giBank_CommittedSeq = giBank_ChangeSeq;
+	if( num == 0 )	return ;
+	
+	if( !gBank_ChangeStatement ) {
+		gBank_ChangeStatement = Bank_int_MakeStatemnt(gBank_Database,
+			"SELECT acct_balance,acct_is_disabled,acct_is_coke,acct_is_admin,acct_is_door,acct_is_internal"
+			" FROM accounts WHERE acct_id=?");
+		if( !gBank_ChangeStatement ) {
+			giBank_NumPendingChanges = 0;
+			return ;
+		}
+	}
+	
+	// Cleared first, so listeners can make changes of their own
+	giBank_NumPendingChanges = 0;
+	for( int i = 0; i < num; i ++ )
+	{
+		tBankChange	change;
+		
+		change.Seq = gaBank_PendingChanges[i].Seq;
+		change.Kind = gaBank_PendingChanges[i].Kind;
+		change.AcctID = gaBank_PendingChanges[i].AcctID;
+		change.Balance = 0;
+		change.Flags = 0;
+		sqlite3_bind_int(gBank_ChangeStatement, 1, change.AcctID);
+		if( sqlite3_step(gBank_ChangeStatement) == SQLITE_ROW ) {
+			change.Balance = sqlite3_column_int(gBank_ChangeStatement, 0);
+			change.Flags = Bank_int_GetRowFlags(gBank_ChangeStatement, 1);
+		}
+		sqlite3_reset(gBank_ChangeStatement);
+		
+		for( int j = 0; j < giBank_NumChangeListeners; j ++ )
+			gaBank_ChangeListeners[j].Callback(gaBank_ChangeListeners[j].Data, &change);
+	}
+}
+
 /*
  * Get user flags
  */
@@ -183,18 +732,7 @@ int Bank_GetFlags(int UserID)
 	free(query);
 	if( !statement )	return -1;
 
-	// Get Flags
-	ret = 0;
-	// - Disabled
-	if( sqlite3_column_int(statement, 0) )	ret |= USER_FLAG_DISABLED;
-	// - Coke
-	if( sqlite3_column_int(statement, 1) )	ret |= USER_FLAG_COKE;
-	// - Wheel
-	if( sqlite3_column_int(statement, 2) )	ret |= USER_FLAG_ADMIN;
-	// - Door
-	if( sqlite3_column_int(statement, 3) )	ret |= USER_FLAG_DOORGROUP;
-	// - Internal
-	if( sqlite3_column_int(statement, 4) )	ret |= USER_FLAG_INTERNAL;
+	ret = Bank_int_GetRowFlags(statement, 0);
 	
 	// Destroy and return
 	sqlite3_finalize(statement);
@@ -210,10 +748,12 @@ int Bank_SetFlags(int UserID, int Mask, int Value)
 	char	*query;
 	 int	rv;
 	char	*errmsg;
+	uint64_t	seq = ++ giBank_ChangeSeq;
 
 	#define MAP_FLAG(name, flag)	(Mask&(flag)?(Value&(flag)?","name"=1":","name"=0"):"")
 	query = mkstr(
-		"UPDATE accounts SET acct_id=acct_id%s%s%s%s%s WHERE acct_id=%i",// LIMIT 1",
+		"UPDATE accounts SET acct_change_seq=%"PRIu64"%s%s%s%s%s WHERE acct_id=%i",// LIMIT 1",
+		seq,
 		MAP_FLAG("acct_is_coke", USER_FLAG_COKE),
 		MAP_FLAG("acct_is_admin", USER_FLAG_ADMIN),
 		MAP_FLAG("acct_is_door", USER_FLAG_DOORGROUP),
@@ -238,10 +778,46 @@ int Bank_SetFlags(int UserID, int Mask, int Value)
 		return -1;
 	}
 	free(query);
+	giBank_FlagsEpoch ++;
+	Bank_int_QueueChange(UserID, BANK_CHANGE_FLAGS, seq);
+	
+	// Keep the card index's copy current
+	for( int i = 0; i < giBank_CardIndexSize; i ++ )
+	{
+		if( gaBank_Cards[i].Key.Length && gaBank_Cards[i].AcctID == UserID )
+			gaBank_Cards[i].Flags = (gaBank_Cards[i].Flags & ~Mask) | (Value & Mask);
+	}
 	
 	return 0;
 }
 
+/*
+ * Get the flags epoch
+ */
+unsigned int Bank_GetFlagsEpoch(void)
+{
+	return giBank_FlagsEpoch;
+}
+
+/*
+ * Get the data version (changes when another connection commits)
+ */
+unsigned int Bank_GetDataVersion(void)
+{
+	unsigned int	ret = 0;
+	
+	if( !gBank_DataVersionStatement ) {
+		gBank_DataVersionStatement = Bank_int_MakeStatemnt(gBank_Database, "PRAGMA data_version");
+		if( !gBank_DataVersionStatement )	return 0;
+	}
+	
+	if( sqlite3_step(gBank_DataVersionStatement) == SQLITE_ROW )
+		ret = sqlite3_column_int(gBank_DataVersionStatement, 0);
+	sqlite3_reset(gBank_DataVersionStatement);
+	
+	return ret;
+}
+
 /*
  * Get user balance
  */
@@ -330,15 +906,18 @@ int Bank_CreateAcct(const char *Name)
 	char	*query;
 	char	*errmsg;
 	 int	rv;
+	uint64_t	seq;
 	
 	if( Name )
 	{
 		if( !Bank_int_IsValidName(Name) )	return -1;
-		query = mkstr("INSERT INTO accounts (acct_name) VALUES ('%s')", Name);
+		seq = ++ giBank_ChangeSeq;
+		query = mkstr("INSERT INTO accounts (acct_name,acct_change_seq) VALUES ('%s',%"PRIu64")", Name, seq);
 	}
 	else
 	{
-		query = strdup("INSERT INTO accounts (acct_name) VALUES (NULL)");
+		seq = ++ giBank_ChangeSeq;
+		query = mkstr("INSERT INTO accounts (acct_name,acct_change_seq) VALUES (NULL,%"PRIu64")", seq);
 	}
 		
 	rv = Bank_int_QueryNone(gBank_Database, query, &errmsg);
@@ -353,7 +932,9 @@ int Bank_CreateAcct(const char *Name)
 	
 	free(query);
 	
-	return sqlite3_last_insert_rowid(gBank_Database);
+	rv = sqlite3_last_insert_rowid(gBank_Database);
+	Bank_int_QueueChange(rv, BANK_CHANGE_CREATE, seq);
+	return rv;
 }
 
 int Bank_IsPinValid(int AcctID, int Pin)
@@ -372,7 +953,8 @@ int Bank_IsPinValid(int AcctID, int Pin)
 void Bank_SetPin(int AcctID, int Pin)
 {
 	char *errmsg;
-	char *query = mkstr("UPDATE accounts SET acct_pin=%i WHERE acct_id=%i", Pin, AcctID);
+	uint64_t seq = ++ giBank_ChangeSeq;
+	char *query = mkstr("UPDATE accounts SET acct_pin=%i,acct_change_seq=%"PRIu64" WHERE acct_id=%i", Pin, seq, AcctID);
 	int rv = Bank_int_QueryNone(gBank_Database, query, &errmsg);
 	if( rv != SQLITE_OK )
 	{
@@ -383,17 +965,28 @@ void Bank_SetPin(int AcctID, int Pin)
 		return ;
 	}
 	free(query);
+	Bank_int_QueueChange(AcctID, BANK_CHANGE_PIN, seq);
 }
 /*
  * Create an iterator for user accounts
  */
 tAcctIterator *Bank_Iterator(int FlagMask, int FlagValues, int Flags, int MinMaxBalance, time_t LastSeen)
+{
+	return Bank_IteratorAfter(FlagMask, FlagValues, Flags, MinMaxBalance, LastSeen, NULL);
+}
+
+/*
+ * Create an iterator for user accounts, starting after an account
+ */
+tAcctIterator *Bank_IteratorAfter(int FlagMask, int FlagValues, int Flags, int MinMaxBalance, time_t LastSeen, const tAcctRecord *After)
 {
 	char	*query;
+	char	*afterClause;
 	const char	*balanceClause;
 	const char	*lastSeenClause;
-	const char	*orderClause;
-	const char	*revSort;
+	const char	*orderColumn;
+	const char	*revSort, *cmp;
+	 int	bTieBreak;
 	sqlite3_stmt	*ret;
 	
 	// Balance condtion
@@ -412,41 +1005,65 @@ tAcctIterator *Bank_Iterator(int FlagMask, int FlagValues, int Flags, int MinMax
 	else if( Flags & BANK_ITFLAG_SEENBEFORE )
 		lastSeenClause = " AND acct_last_seen<=";
 	else {
-		lastSeenClause = " AND datetime(-1,'unixepoch')!=";
+		lastSeenClause = " AND -1!=";
+		LastSeen = 0;
 	}
 	
-	// Sorting clause
+	// Sort column (ties are broken by acct_id, so the order is total and
+	// can be resumed from any row. Names are unique already.)
 	switch( Flags & BANK_ITFLAG_SORTMASK )
 	{
 	case BANK_ITFLAG_SORT_NONE:
-		orderClause = "";
-		revSort = "";
+		orderColumn = NULL;
 		break;
 	case BANK_ITFLAG_SORT_NAME:
-		orderClause = "ORDER BY acct_name";
-		revSort = " DESC";
+		orderColumn = "acct_name";
 		break;
 	case BANK_ITFLAG_SORT_BAL:
-		orderClause = "ORDER BY acct_balance";
-		revSort = " DESC";
+		orderColumn = "acct_balance";
 		break;
 	case BANK_ITFLAG_SORT_LASTSEEN:
-		orderClause = "ORDER BY acct_balance";
-		revSort = " DESC";
+		orderColumn = "acct_last_seen";
 		break;
 	default:
 		fprintf(stderr, "BUG: Unknown sort (%x) in SQLite CokeBank\n", Flags & BANK_ITFLAG_SORTMASK);
 		return NULL;
 	}
-	if( !(Flags & BANK_ITFLAG_REVSORT) )
+	bTieBreak = orderColumn && strcmp(orderColumn, "acct_name") != 0;
+	if( orderColumn && (Flags & BANK_ITFLAG_REVSORT) ) {
+		revSort = " DESC";
+		cmp = "<";
+	}
+	else {
 		revSort = "";
+		cmp = ">";
+	}
+	
+	// Keyset condition (name is bound as ?1, it could contain anything)
+	if( !After )
+		afterClause = strdup("");
+	else if( !orderColumn )
+		afterClause = mkstr(" AND acct_id>%i", After->AcctID);
+	else if( strcmp(orderColumn, "acct_name") == 0 )
+		afterClause = mkstr(" AND acct_name%s?1", cmp);
+	else if( strcmp(orderColumn, "acct_balance") == 0 )
+		afterClause = mkstr(" AND (acct_balance,acct_id)%s(%i,%i)",
+			cmp, After->Balance, After->AcctID);
+	else
+		afterClause = mkstr(" AND (acct_last_seen,acct_id)%s(%"PRIi64",%i)",
+			cmp, (int64_t)After->LastSeen, After->AcctID);
 	
 	#define MAP_FLAG(name, flag)	(FlagMask&(flag)?(FlagValues&(flag)?" AND "name"=1":" AND "name"=0"):"")
-	query = mkstr("SELECT acct_id FROM accounts WHERE 1=1"
+	// Columns are read by Bank_IteratorNextRecord
+	query = mkstr("SELECT acct_id,acct_name,acct_balance,"
+		"acct_is_disabled,acct_is_coke,acct_is_admin,acct_is_door,acct_is_internal,"
+		"acct_last_seen"
+		" FROM accounts WHERE 1=1"
 		"%s%s%s%s%s"	// Flags
 		"%s%i"	// Balance
-		"%sdatetime(%"PRIu64",'unixepoch')"	// Last seen
-		"%s%s"	// Sort and direction
+		"%s%"PRIi64	// Last seen
+		"%s"	// After
+		" ORDER BY %s%s%s%s"	// Sort and direction
 		,
 		MAP_FLAG("acct_is_coke", USER_FLAG_COKE),
 		MAP_FLAG("acct_is_admin", USER_FLAG_ADMIN),
@@ -454,16 +1071,21 @@ tAcctIterator *Bank_Iterator(int FlagMask, int FlagValues, int Flags, int MinMax
 		MAP_FLAG("acct_is_internal", USER_FLAG_INTERNAL),
 		MAP_FLAG("acct_is_disabled", USER_FLAG_DISABLED),
 		balanceClause, MinMaxBalance,
-		lastSeenClause, (uint64_t)LastSeen,
-		orderClause, revSort
+		lastSeenClause, (int64_t)LastSeen,
+		afterClause,
+		orderColumn ? orderColumn : "acct_id", revSort,
+		bTieBreak ? ",acct_id" : "", bTieBreak ? revSort : ""
 		);
 	//printf("query = \"%s\"\n", query);
 	#undef MAP_FLAG
+	free(afterClause);
 	
 	ret = Bank_int_MakeStatemnt(gBank_Database, query);
+	free(query);
 	if( !ret )	return NULL;
 	
-	free(query);
+	if( After && orderColumn && strcmp(orderColumn, "acct_name") == 0 )
+		sqlite3_bind_text(ret, 1, After->Name ? After->Name : "", -1, SQLITE_TRANSIENT);
 	
 	return (void*)ret;
 }
@@ -486,76 +1108,519 @@ int Bank_IteratorNext(tAcctIterator *It)
 }
 
 /*
- * Free an interator
+ * Get the next account in an iterator (all of it)
  */
-void Bank_DelIterator(tAcctIterator *It)
+int Bank_IteratorNextRecord(tAcctIterator *It, tAcctRecord *Record)
 {
-	sqlite3_finalize( (sqlite3_stmt*)It );
+	sqlite3_stmt	*statement = (sqlite3_stmt*)It;
+	 int	ret;
+	
+	ret = Bank_IteratorNext(It);
+	if( ret == -1 )	return -1;
+	
+	Record->AcctID = ret;
+	Record->Name = (const char*)sqlite3_column_text(statement, 1);
+	Record->Balance = sqlite3_column_int(statement, 2);
+	Record->Flags = Bank_int_GetRowFlags(statement, 3);
+	Record->LastSeen = sqlite3_column_int64(statement, 8);
+	// Only Bank_ChangedSince reads the change sequence
+	if( sqlite3_column_count(statement) > 9 )
+		Record->ChangeSeq = sqlite3_column_int64(statement, 9);
+	else
+		Record->ChangeSeq = 0;
+	
+	return ret;
 }
 
 /*
- * Check user authentication token
+ * Iterate over accounts changed after a sequence number (in change order)
  */
-int Bank_GetUserAuth(const char *Salt, const char *Username, const char *Password)
+tAcctIterator *Bank_ChangedSince(uint64_t Seq)
 {
-	Salt = Password = Username;	// Shut up GCC
-	Password = Salt;
-	// DEBUG HACKS!
-	#if 0
-	return Bank_GetAcctByName(Username);
-	#else
-	return -1;
-	#endif
+	sqlite3_stmt	*ret;
+	
+	if( Seq > giBank_CommittedSeq )
+		return NULL;
+	
+	// Same columns as Bank_IteratorAfter, read from accounts_by_change alone
+	ret = Bank_int_MakeStatemnt(gBank_Database,
+		"SELECT acct_id,acct_name,acct_balance,"
+		"acct_is_disabled,acct_is_coke,acct_is_admin,acct_is_door,acct_is_internal,"
+		"acct_last_seen,acct_change_seq"
+		" FROM accounts WHERE acct_change_seq>?1 AND acct_change_seq<=?2"
+		" ORDER BY acct_change_seq"
+		);
+	if( !ret )	return NULL;
+	
+	// Changes made after this (e.g. in an open transaction) are left for next time
+	sqlite3_bind_int64(ret, 1, Seq);
+	sqlite3_bind_int64(ret, 2, giBank_CommittedSeq);
+	
+	return (void*)ret;
 }
 
 /*
- * Get an account number given a card ID
- * NOTE: Actually ends up just being an alternate authentication token,
- *       as no checking is done on the ID's validity, save for SQL sanity.
+ * Free an interator
  */
-int Bank_GetAcctByCard(const char *CardID)
+void Bank_DelIterator(tAcctIterator *It)
 {
-	char	*query;
-	sqlite3_stmt	*statement;
-	 int	ret;
-	
-	if( !Bank_int_IsValidName(CardID) )
+	sqlite3_finalize( (sqlite3_stmt*)It );
+}
+
+/*
+ * Iterate over an account's ledger entries (newest first)
+ */
+tLedgerIterator *Bank_HistoryIterator(int AcctID, time_t Since, int Limit)
+{
+	sqlite3_stmt	*ret;
+	
+	// Each half reads one index in sequence order, and SQLite merges them
+	ret = Bank_int_MakeStatemnt(gBank_Database,
+		"SELECT ledger_seq,ledger_time,ledger_src,ledger_dst,ledger_amount,ledger_actor,ledger_reason"
+		" FROM ledger WHERE ledger_src=?1 AND ledger_time>=?2"
+		" UNION ALL"
+		" SELECT ledger_seq,ledger_time,ledger_src,ledger_dst,ledger_amount,ledger_actor,ledger_reason"
+		" FROM ledger WHERE ledger_dst=?1 AND ledger_src!=?1 AND ledger_time>=?2"
+		" ORDER BY 1 DESC LIMIT ?3"
+		);
+	if( !ret )	return NULL;
+	
+	sqlite3_bind_int(ret, 1, AcctID);
+	sqlite3_bind_int64(ret, 2, Since);
+	sqlite3_bind_int(ret, 3, Limit);
+	
+	return (void*)ret;
+}
+
+int Bank_HistoryNext(tLedgerIterator *It, tLedgerEntry *Entry)
+{
+	sqlite3_stmt	*statement = (sqlite3_stmt*)It;
+	 int	rv;
+	
+	rv = sqlite3_step(statement);
+	if( rv == SQLITE_DONE )	return 1;
+	if( rv != SQLITE_ROW ) {
+		fprintf(stderr, "Bank_HistoryNext - SQLite Error: %s\n", sqlite3_errmsg(gBank_Database));
+		return 1;
+	}
+	
+	Entry->Seq = sqlite3_column_int64(statement, 0);
+	Entry->Time = sqlite3_column_int64(statement, 1);
+	Entry->SourceAcct = sqlite3_column_int(statement, 2);
+	Entry->DestAcct = sqlite3_column_int(statement, 3);
+	Entry->Ammount = sqlite3_column_int(statement, 4);
+	Entry->Actor = sqlite3_column_int(statement, 5);
+	Entry->Reason = (const char*)sqlite3_column_text(statement, 6);
+	return 0;
+}
+
+void Bank_DelHistoryIterator(tLedgerIterator *It)
+{
+	sqlite3_finalize( (sqlite3_stmt*)It );
+}
+
+/*
+ * Store one hour of sales totals
+ */
+int Bank_SaveSalesRollup(const char *Series, time_t Hour, int Count, int Revenue)
+{
+	 int	rv;
+	
+	if( !gBank_SalesStatement )
+	{
+		gBank_SalesStatement = Bank_int_MakeStatemnt(gBank_Database,
+			"INSERT OR REPLACE INTO sales_rollup (sales_series,sales_hour,sales_count,sales_revenue)"
+			" VALUES (?,?,?,?)");
+		if( !gBank_SalesStatement )	return 1;
+	}
+	
+	sqlite3_bind_text(gBank_SalesStatement, 1, Series, -1, SQLITE_STATIC);
+	sqlite3_bind_int64(gBank_SalesStatement, 2, Hour);
+	sqlite3_bind_int(gBank_SalesStatement, 3, Count);
+	sqlite3_bind_int(gBank_SalesStatement, 4, Revenue);
+	rv = sqlite3_step(gBank_SalesStatement);
+	sqlite3_reset(gBank_SalesStatement);
+	sqlite3_clear_bindings(gBank_SalesStatement);
+	if( rv != SQLITE_DONE ) {
+		fprintf(stderr, "Bank_SaveSalesRollup - SQLite Error: %s\n", sqlite3_errmsg(gBank_Database));
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Iterate over the stored sales rollups (in primary key order)
+ */
+tSalesIterator *Bank_SalesIterator(void)
+{
+	return (void*)Bank_int_MakeStatemnt(gBank_Database,
+		"SELECT sales_series,sales_hour,sales_count,sales_revenue FROM sales_rollup"
+		" ORDER BY sales_series,sales_hour");
+}
+
+int Bank_SalesNext(tSalesIterator *It, tSalesRollup *Rollup)
+{
+	sqlite3_stmt	*statement = (sqlite3_stmt*)It;
+	 int	rv;
+	
+	rv = sqlite3_step(statement);
+	if( rv == SQLITE_DONE )	return 1;
+	if( rv != SQLITE_ROW ) {
+		fprintf(stderr, "Bank_SalesNext - SQLite Error: %s\n", sqlite3_errmsg(gBank_Database));
+		return 1;
+	}
+	
+	Rollup->Series = (const char*)sqlite3_column_text(statement, 0);
+	Rollup->Hour = sqlite3_column_int64(statement, 1);
+	Rollup->Count = sqlite3_column_int(statement, 2);
+	Rollup->Revenue = sqlite3_column_int(statement, 3);
+	return 0;
+}
+
+void Bank_DelSalesIterator(tSalesIterator *It)
+{
+	sqlite3_finalize( (sqlite3_stmt*)It );
+}
+
+/*
+ * Get an item's stock count
+ */
+int Bank_GetItemStock(const char *Item)
+{
+	sqlite3_stmt	*statement;
+	 int	ret = -1;
+	
+	statement = Bank_int_MakeStatemnt(gBank_Database,
+		"SELECT stock_count FROM item_stock WHERE stock_item=?");
+	if( !statement )	return -1;
+	sqlite3_bind_text(statement, 1, Item, -1, SQLITE_STATIC);
+	if( sqlite3_step(statement) == SQLITE_ROW )
+		ret = sqlite3_column_int(statement, 0);
+	sqlite3_finalize(statement);
+	return ret;
+}
+
+/*
+ * Store an item's stock count
+ */
+int Bank_SetItemStock(const char *Item, int Count)
+{
+	 int	rv;
+	
+	if( !gBank_StockStatement )
+	{
+		gBank_StockStatement = Bank_int_MakeStatemnt(gBank_Database,
+			"INSERT OR REPLACE INTO item_stock (stock_item,stock_count) VALUES (?,?)");
+		if( !gBank_StockStatement )	return 1;
+	}
+	
+	sqlite3_bind_text(gBank_StockStatement, 1, Item, -1, SQLITE_STATIC);
+	sqlite3_bind_int(gBank_StockStatement, 2, Count);
+	rv = sqlite3_step(gBank_StockStatement);
+	sqlite3_reset(gBank_StockStatement);
+	sqlite3_clear_bindings(gBank_StockStatement);
+	if( rv != SQLITE_DONE ) {
+		fprintf(stderr, "Bank_SetItemStock - SQLite Error: %s\n", sqlite3_errmsg(gBank_Database));
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Set aside funds (checked against the balance less existing holds, in
+ * the same statement)
+ */
+int Bank_ReserveFunds(int AcctID, int Ammount, int MinBalance)
+{
+	sqlite3_stmt	*statement;
+	 int	rv, ret;
+	
+	if( Bank_StartTransaction() )
 		return -1;
 	
-	query = mkstr("SELECT acct_id FROM cards WHERE card_name='%s' LIMIT 1", CardID);
+	statement = Bank_int_MakeStatemnt(gBank_Database,
+		"INSERT INTO holds (hold_acct,hold_amount,hold_time)"
+		" SELECT acct_id,?2,CAST(strftime('%s','now') AS INTEGER) FROM accounts WHERE acct_id=?1"
+		" AND acct_balance - ?2 - (SELECT IFNULL(SUM(hold_amount),0) FROM holds WHERE hold_acct=?1) >= ?3");
+	if( !statement ) {
+		Bank_AbortTransaction();
+		return -1;
+	}
+	sqlite3_bind_int(statement, 1, AcctID);
+	sqlite3_bind_int(statement, 2, Ammount);
+	sqlite3_bind_int(statement, 3, MinBalance);
+	rv = sqlite3_step(statement);
+	sqlite3_finalize(statement);
+	if( rv != SQLITE_DONE ) {
+		fprintf(stderr, "Bank_ReserveFunds - SQLite Error: %s\n", sqlite3_errmsg(gBank_Database));
+		Bank_AbortTransaction();
+		return -1;
+	}
+	if( sqlite3_changes(gBank_Database) == 0 ) {
+		Bank_AbortTransaction();
+		return -1;	// Can't cover it
+	}
+	ret = sqlite3_last_insert_rowid(gBank_Database);
+	
+	if( Bank_CommitTransaction() )
+		return -1;
+	giBank_NumHolds ++;
+	return ret;
+}
+
+/*
+ * Take held funds
+ */
+int Bank_CommitHold(int HoldID, int DestAcct, int Actor, const char *Reason)
+{
+	sqlite3_stmt	*statement;
+	char	*query;
+	 int	acct, ammount;
+	
+	if( Bank_StartTransaction() )
+		return 1;
+	
+	query = mkstr("SELECT hold_acct,hold_amount FROM holds WHERE hold_id=%i", HoldID);
 	statement = Bank_int_QuerySingle(gBank_Database, query);
 	free(query);
-	if( !statement )	return -1;
+	if( !statement ) {
+		Bank_AbortTransaction();
+		return 1;
+	}
+	acct = sqlite3_column_int(statement, 0);
+	ammount = sqlite3_column_int(statement, 1);
+	sqlite3_finalize(statement);
 	
+	query = mkstr("DELETE FROM holds WHERE hold_id=%i", HoldID);
+	if( Bank_int_QueryNone(gBank_Database, query, NULL) != SQLITE_OK
+	 || Bank_Transfer(acct, DestAcct, ammount, Actor, Reason) )
+	{
+		free(query);
+		Bank_AbortTransaction();
+		return 1;
+	}
+	free(query);
+	
+	if( Bank_CommitTransaction() )
+		return 1;
+	giBank_NumHolds --;
+	return 0;
+}
+
+/*
+ * Drop a hold
+ */
+void Bank_ReleaseHold(int HoldID)
+{
+	char	*query = mkstr("DELETE FROM holds WHERE hold_id=%i", HoldID);
+	if( Bank_int_QueryNone(gBank_Database, query, NULL) == SQLITE_OK
+	 && sqlite3_changes(gBank_Database) > 0 )
+	{
+		giBank_NumHolds --;
+	}
+	free(query);
+}
+
+/*
+ * Get the funds held against an account
+ */
+int Bank_GetHeldFunds(int AcctID)
+{
+	sqlite3_stmt	*statement;
+	char	*query;
+	 int	ret;
+	
+	// Nearly always none (only held during a dispense)
+	if( giBank_NumHolds == 0 )
+		return 0;
+	
+	query = mkstr("SELECT IFNULL(SUM(hold_amount),0) FROM holds WHERE hold_acct=%i", AcctID);
+	statement = Bank_int_QuerySingle(gBank_Database, query);
+	free(query);
+	if( !statement )	return 0;
 	ret = sqlite3_column_int(statement, 0);
+	sqlite3_finalize(statement);
+	return ret;
+}
+
+/*
+ * Check user authentication token
+ */
+int Bank_GetUserAuth(const char *Salt, const char *Username, const char *Password)
+{
+	sqlite3_stmt	*statement;
+	uint8_t	cred[PASSWORD_CRED_LEN];
+	uint8_t	salt[PASSWORD_SALT_LEN] = {0};
+	uint8_t	stored[PASSWORD_KEY_LEN] = {0};
+	uint8_t	key[PASSWORD_KEY_LEN];
+	uint8_t	diff = 0;
+	 int	logN = PASSWORD_SCRYPT_LOGN, r = PASSWORD_SCRYPT_R, p = PASSWORD_SCRYPT_P;
+	 int	ret = -1;
+	
+	// The stored hash is of the unsalted PASS hash, so a salted one can't be checked
+	if( Salt[0] != '\0' ) {
+		fprintf(stderr, "Bank_GetUserAuth: Salted PASS is not supported\n");
+		return -1;
+	}
+	if( Bank_int_HexDecode(cred, sizeof(cred), Password) )
+		return -1;
 	
+	statement = Bank_int_MakeStatemnt(gBank_AuthDatabase,
+		"SELECT acct_id,acct_password FROM accounts WHERE acct_name=? AND acct_password IS NOT NULL");
+	if( !statement )	return -1;
+	sqlite3_bind_text(statement, 1, Username, -1, SQLITE_STATIC);
+	if( sqlite3_step(statement) == SQLITE_ROW )
+	{
+		const char	*hash = (const char*)sqlite3_column_text(statement, 1);
+		char	saltHex[PASSWORD_SALT_LEN*2+1], keyHex[PASSWORD_KEY_LEN*2+1];
+		
+		// $scrypt$<log2 N>$<r>$<p>$<salt>$<key>
+		if( sscanf(hash, "$scrypt$%d$%d$%d$%32[0-9a-f]$%64[0-9a-f]", &logN, &r, &p, saltHex, keyHex) == 5
+		 && logN > 0 && logN < 24 && r > 0 && p > 0
+		 && !Bank_int_HexDecode(salt, sizeof(salt), saltHex)
+		 && !Bank_int_HexDecode(stored, sizeof(stored), keyHex) )
+		{
+			ret = sqlite3_column_int(statement, 0);
+		}
+		else
+		{
+			fprintf(stderr, "Bank_GetUserAuth: Malformed password for '%s'\n", Username);
+			logN = PASSWORD_SCRYPT_LOGN; r = PASSWORD_SCRYPT_R; p = PASSWORD_SCRYPT_P;
+		}
+	}
 	sqlite3_finalize(statement);
 	
+	// Always hash (even with no password to check), so timing doesn't reveal valid accounts
+	if( Bank_int_HashPassword(cred, salt, logN, r, p, key) )
+		return -1;
+	for( int i = 0; i < PASSWORD_KEY_LEN; i ++ )
+		diff |= key[i] ^ stored[i];
+	if( diff )
+		return -1;
+	
 	return ret;
 }
 
+/*
+ * Set the password checked by Bank_GetUserAuth
+ */
+int Bank_SetPassword(int AcctID, const char *Password)
+{
+	sqlite3_stmt	*statement;
+	uint8_t	cred[PASSWORD_CRED_LEN];
+	uint8_t	salt[PASSWORD_SALT_LEN];
+	uint8_t	key[PASSWORD_KEY_LEN];
+	char	saltHex[PASSWORD_SALT_LEN*2+1], keyHex[PASSWORD_KEY_LEN*2+1];
+	char	*hash;
+	 int	rv;
+	
+	if( Bank_int_HexDecode(cred, sizeof(cred), Password) )
+		return 1;
+	if( getrandom(salt, sizeof(salt), 0) != sizeof(salt) ) {
+		perror("Bank_SetPassword - getrandom");
+		return 1;
+	}
+	if( Bank_int_HashPassword(cred, salt, PASSWORD_SCRYPT_LOGN, PASSWORD_SCRYPT_R, PASSWORD_SCRYPT_P, key) )
+		return 1;
+	
+	Bank_int_HexEncode(saltHex, salt, sizeof(salt));
+	Bank_int_HexEncode(keyHex, key, sizeof(key));
+	hash = mkstr("$scrypt$%i$%i$%i$%s$%s", PASSWORD_SCRYPT_LOGN, PASSWORD_SCRYPT_R, PASSWORD_SCRYPT_P,
+		saltHex, keyHex);
+	
+	statement = Bank_int_MakeStatemnt(gBank_Database, "UPDATE accounts SET acct_password=? WHERE acct_id=?");
+	if( !statement ) {
+		free(hash);
+		return 1;
+	}
+	sqlite3_bind_text(statement, 1, hash, -1, SQLITE_STATIC);
+	sqlite3_bind_int(statement, 2, AcctID);
+	rv = sqlite3_step(statement);
+	sqlite3_finalize(statement);
+	free(hash);
+	if( rv != SQLITE_DONE ) {
+		fprintf(stderr, "Bank_SetPassword - SQLite Error: %s\n", sqlite3_errmsg(gBank_Database));
+		return 1;
+	}
+	
+	return sqlite3_changes(gBank_Database) == 0;
+}
+
+/*
+ * Get an account number given a card ID
+ * NOTE: Actually ends up just being an alternate authentication token,
+ *       as no checking is done on the ID's validity.
+ */
+int Bank_GetAcctByCard(const char *CardID)
+{
+	tCardKey	key;
+	tCardEntry	*ent;
+	
+	if( Bank_int_ParseCardID(&key, CardID) )
+		return -1;
+	
+	ent = Bank_int_FindCard(&key);
+	if( !ent->Key.Length )
+		return -1;
+	return ent->AcctID;
+}
+
+/*
+ * Get everything needed to log in with a card (from the index only)
+ */
+int Bank_GetCardLogin(const char *CardID, int *Flags, char **Name)
+{
+	tCardKey	key;
+	tCardEntry	*ent;
+	
+	if( Bank_int_ParseCardID(&key, CardID) )
+		return -1;
+	
+	ent = Bank_int_FindCard(&key);
+	if( !ent->Key.Length )
+		return -1;
+	
+	*Name = strdup(ent->AcctName);
+	if( !*Name )
+		return -1;
+	*Flags = ent->Flags;
+	return ent->AcctID;
+}
+
 /*
  * Add a card to an account
  */
 int Bank_AddAcctCard(int AcctID, const char *CardID)
 {
-	char	*query;
-	 int	rv;
+	tCardKey	key;
+	char	hex[CARD_ID_MAX_LEN*2+1];
+	char	*query, *name;
+	 int	rv, flags;
 	char	*errmsg;
 	
-	if( !Bank_int_IsValidName(CardID) )
+	if( Bank_int_ParseCardID(&key, CardID) )
 		return -1;
 	
-	// TODO: Check the AcctID too
+	if( Bank_int_FindCard(&key)->Key.Length )
+		return 2;	// Card in use
 	
-	// Insert card
+	flags = Bank_GetFlags(AcctID);
+	if( flags < 0 )
+		return 1;
+	name = Bank_GetAcctName(AcctID);
+	if( !name )
+		return 1;
+	
+	// Insert card (always stored as lower case hex)
+	Bank_int_HexEncode(hex, key.Bytes, key.Length);
 	query = mkstr("INSERT INTO cards (acct_id,card_name) VALUES (%i,'%s')",
-		AcctID, CardID);
+		AcctID, hex);
 	rv = Bank_int_QueryNone(gBank_Database, query, &errmsg);
 	if( rv == SQLITE_CONSTRAINT )
 	{
 		sqlite3_free(errmsg);
 		free(query);
+		free(name);
 		return 2;	// Card in use
 	}
 	if( rv != SQLITE_OK )
@@ -564,10 +1629,266 @@ int Bank_AddAcctCard(int AcctID, const char *CardID)
 		fprintf(stderr, "Query = '%s'\n", query);
 		sqlite3_free(errmsg);
 		free(query);
+		free(name);
 		return -1;
 	}
 	free(query);
 	
+	if( Bank_int_IndexCard(&key, AcctID, flags, name) ) {
+		fprintf(stderr, "Bank_AddAcctCard - Out of memory indexing card %s\n", hex);
+		free(name);
+	}
+	
+	return 0;
+}
+
+/*
+ * Get the stored reply for a request ID
+ */
+char *Bank_GetRequestResult(int AcctID, const char *Token)
+{
+	sqlite3_stmt	*statement;
+	char	*ret = NULL;
+	
+	statement = Bank_int_MakeStatemnt(gBank_Database,
+		"SELECT req_result FROM requests WHERE acct_id=? AND req_token=? AND req_time>=?");
+	if( !statement )	return NULL;
+	sqlite3_bind_int(statement, 1, AcctID);
+	sqlite3_bind_text(statement, 2, Token, -1, SQLITE_STATIC);
+	sqlite3_bind_int64(statement, 3, time(NULL) - REQUEST_TTL);
+	
+	if( sqlite3_step(statement) == SQLITE_ROW )
+		ret = strdup( (const char*)sqlite3_column_text(statement, 0) );
+	
+	sqlite3_finalize(statement);
+	return ret;
+}
+
+/*
+ * Store the reply for a request ID
+ * - The table is pruned of expired (and the oldest, if over the limit)
+ *   entries every REQUEST_PRUNE_INTERVAL saves.
+ */
+int Bank_SaveRequestResult(int AcctID, const char *Token, const char *Result)
+{
+	static int	siSavesSincePrune;
+	sqlite3_stmt	*statement;
+	 int	rv;
+	
+	statement = Bank_int_MakeStatemnt(gBank_Database,
+		"INSERT OR REPLACE INTO requests (acct_id,req_token,req_time,req_result) VALUES (?,?,?,?)");
+	if( !statement )	return 1;
+	sqlite3_bind_int(statement, 1, AcctID);
+	sqlite3_bind_text(statement, 2, Token, -1, SQLITE_STATIC);
+	sqlite3_bind_int64(statement, 3, time(NULL));
+	sqlite3_bind_text(statement, 4, Result, -1, SQLITE_STATIC);
+	rv = sqlite3_step(statement);
+	sqlite3_finalize(statement);
+	if( rv != SQLITE_DONE ) {
+		fprintf(stderr, "Bank_SaveRequestResult - SQLite Error: %s\n", sqlite3_errmsg(gBank_Database));
+		return 1;
+	}
+	
+	if( ++siSavesSincePrune >= REQUEST_PRUNE_INTERVAL )
+	{
+		char	*query;
+		query = mkstr("DELETE FROM requests WHERE req_time<%lli;"
+			"DELETE FROM requests WHERE rowid IN"
+			" (SELECT rowid FROM requests ORDER BY req_time DESC LIMIT -1 OFFSET %i)",
+			(long long)(time(NULL) - REQUEST_TTL), MAX_REQUESTS);
+		Bank_int_QueryNone(gBank_Database, query, NULL);
+		free(query);
+		siSavesSincePrune = 0;
+	}
+	
+	return 0;
+}
+
+/*
+ * Derive the stored key from the hash sent by PASS
+ */
+int Bank_int_HashPassword(const uint8_t *Cred, const uint8_t *Salt, int LogN, int R, int P, uint8_t *Key)
+{
+	// Allow for the larger parameters that old hashes could have been made with
+	uint64_t	maxmem = (uint64_t)129 * R * ((uint64_t)1 << LogN) + (1 << 20);
+	
+	if( !EVP_PBE_scrypt((const char*)Cred, PASSWORD_CRED_LEN, Salt, PASSWORD_SALT_LEN,
+			(uint64_t)1 << LogN, R, P, maxmem, Key, PASSWORD_KEY_LEN) )
+	{
+		fprintf(stderr, "Bank_int_HashPassword: scrypt failed\n");
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Decode exactly \a Length bytes of hex
+ */
+int Bank_int_HexDecode(uint8_t *Dest, int Length, const char *Src)
+{
+	for( int i = 0; i < Length*2; i ++ )
+	{
+		char	c = Src[i];
+		 int	val;
+		if( '0' <= c && c <= '9' )	val = c - '0';
+		else if( 'a' <= c && c <= 'f' )	val = c - 'a' + 10;
+		else if( 'A' <= c && c <= 'F' )	val = c - 'A' + 10;
+		else	return 1;
+		if( i % 2 == 0 )
+			Dest[i/2] = val << 4;
+		else
+			Dest[i/2] |= val;
+	}
+	return Src[Length*2] != '\0';
+}
+
+void Bank_int_HexEncode(char *Dest, const uint8_t *Src, int Length)
+{
+	for( int i = 0; i < Length; i ++ )
+		sprintf(Dest + i*2, "%02x", Src[i]);
+}
+
+/*
+ * Convert the flag columns of a row (disabled,coke,admin,door,internal) to USER_FLAG_*
+ */
+int Bank_int_GetRowFlags(sqlite3_stmt *Statement, int Column)
+{
+	 int	ret = 0;
+	// - Disabled
+	if( sqlite3_column_int(Statement, Column+0) )	ret |= USER_FLAG_DISABLED;
+	// - Coke
+	if( sqlite3_column_int(Statement, Column+1) )	ret |= USER_FLAG_COKE;
+	// - Wheel
+	if( sqlite3_column_int(Statement, Column+2) )	ret |= USER_FLAG_ADMIN;
+	// - Door
+	if( sqlite3_column_int(Statement, Column+3) )	ret |= USER_FLAG_DOORGROUP;
+	// - Internal
+	if( sqlite3_column_int(Statement, Column+4) )	ret |= USER_FLAG_INTERNAL;
+	return ret;
+}
+
+/*
+ * Build the card index from the cards table
+ */
+int Bank_int_LoadCards(void)
+{
+	sqlite3_stmt	*statement;
+	 int	rv;
+	
+	statement = Bank_int_MakeStatemnt(gBank_Database,
+		"SELECT card_name,cards.acct_id,acct_name,"
+		" acct_is_disabled,acct_is_coke,acct_is_admin,acct_is_door,acct_is_internal"
+		" FROM cards JOIN accounts ON cards.acct_id=accounts.acct_id"
+		);
+	if( !statement )	return 1;
+	
+	while( (rv = sqlite3_step(statement)) == SQLITE_ROW )
+	{
+		const char	*cardID = (const char*)sqlite3_column_text(statement, 0);
+		const char	*name = (const char*)sqlite3_column_text(statement, 2);
+		tCardKey	key;
+		char	*nameCopy;
+		
+		if( !cardID || !name || Bank_int_ParseCardID(&key, cardID) ) {
+			fprintf(stderr, "Bank_int_LoadCards - Ignoring invalid card ID '%s'\n", cardID ? cardID : "");
+			continue ;
+		}
+		if( Bank_int_FindCard(&key)->Key.Length ) {
+			fprintf(stderr, "Bank_int_LoadCards - Ignoring duplicate card ID '%s'\n", cardID);
+			continue ;
+		}
+		nameCopy = strdup(name);
+		if( !nameCopy || Bank_int_IndexCard(&key, sqlite3_column_int(statement, 1), Bank_int_GetRowFlags(statement, 3), nameCopy) ) {
+			fprintf(stderr, "Bank_int_LoadCards - Out of memory\n");
+			free(nameCopy);
+			sqlite3_finalize(statement);
+			return 1;
+		}
+	}
+	if( rv != SQLITE_DONE ) {
+		fprintf(stderr, "Bank_int_LoadCards - SQLite Error: %s\n", sqlite3_errmsg(gBank_Database));
+		sqlite3_finalize(statement);
+		return 1;
+	}
+	sqlite3_finalize(statement);
+	
+	return 0;
+}
+
+/*
+ * Parse a hex card ID into a key
+ * \return Boolean failure
+ */
+int Bank_int_ParseCardID(tCardKey *Key, const char *CardID)
+{
+	size_t	len = strlen(CardID);
+	
+	if( len == 0 || len % 2 != 0 || len > CARD_ID_MAX_LEN*2 )
+		return 1;
+	
+	memset(Key, 0, sizeof(*Key));
+	if( Bank_int_HexDecode(Key->Bytes, len/2, CardID) )
+		return 1;
+	Key->Length = len/2;
+	return 0;
+}
+
+/*
+ * Find the slot for a card (the empty slot it would go in, if not indexed)
+ */
+tCardEntry *Bank_int_FindCard(const tCardKey *Key)
+{
+	static tCardEntry	emptyEntry;
+	uint32_t	hash = 2166136261u;	// FNV-1a
+	 int	i;
+	
+	if( giBank_CardIndexSize == 0 )
+		return &emptyEntry;
+	
+	for( i = 0; i < Key->Length; i ++ )
+		hash = (hash ^ Key->Bytes[i]) * 16777619u;
+	
+	for( i = hash & (giBank_CardIndexSize-1); ; i = (i + 1) & (giBank_CardIndexSize-1) )
+	{
+		tCardEntry	*ent = &gaBank_Cards[i];
+		if( !ent->Key.Length || memcmp(&ent->Key, Key, sizeof(*Key)) == 0 )
+			return ent;
+	}
+}
+
+/*
+ * Add a card to the index (growing it if needed)
+ * \param AcctName	Heap string, owned by the index on success
+ * \return Boolean failure
+ */
+int Bank_int_IndexCard(const tCardKey *Key, int AcctID, int Flags, char *AcctName)
+{
+	tCardEntry	*ent;
+	
+	if( (giBank_NumCards + 1) * 2 > giBank_CardIndexSize )
+	{
+		tCardEntry	*oldCards = gaBank_Cards;
+		 int	oldSize = giBank_CardIndexSize;
+		 int	newSize = oldSize ? oldSize * 2 : CARD_INDEX_MIN_SIZE;
+		tCardEntry	*newCards = calloc(newSize, sizeof(tCardEntry));
+		
+		if( !newCards )	return 1;
+		gaBank_Cards = newCards;
+		giBank_CardIndexSize = newSize;
+		for( int i = 0; i < oldSize; i ++ )
+		{
+			if( oldCards[i].Key.Length )
+				*Bank_int_FindCard(&oldCards[i].Key) = oldCards[i];
+		}
+		free(oldCards);
+	}
+	
+	ent = Bank_int_FindCard(Key);
+	ent->Key = *Key;
+	ent->AcctID = AcctID;
+	ent->Flags = Flags;
+	ent->AcctName = AcctName;
+	giBank_NumCards ++;
 	return 0;
 }
 
@@ -0,0 +1,42 @@
+#!/usr/bin/env python3
+#
+# OpenDispense 2
+# ENUM_USERS timing
+# > Times ENUM_USERS against a running server (e.g. on a bank filled by
+#   gen_accounts.sh), printing the best and median of several runs.
+#
+# Usage: enum_users_timing.py <port> ["<ENUM_USERS arguments>"] [runs]
+#   e.g. enum_users_timing.py 11020 "min_balance:0 sort:balance-desc"
+#
+import socket, sys, time
+
+def run(port, args):
+	s = socket.create_connection(("127.0.0.1", port))
+	start = time.time()
+	s.sendall(("ENUM_USERS %s\n" % args).encode())
+	buf = b''
+	while not buf.endswith(b'200 List End\n'):
+		d = s.recv(1 << 20)
+		if not d:
+			break
+		buf += d
+	elapsed = time.time() - start
+	s.close()
+	return elapsed, buf.count(b'\n')
+
+def main():
+	if len(sys.argv) < 2:
+		print("Usage: %s <port> [\"<ENUM_USERS arguments>\"] [runs]" % sys.argv[0], file=sys.stderr)
+		return 2
+	port = int(sys.argv[1])
+	args = sys.argv[2] if len(sys.argv) > 2 else ''
+	runs = int(sys.argv[3]) if len(sys.argv) > 3 else 5
+	
+	results = [run(port, args) for _ in range(runs)]
+	times = sorted(r[0] for r in results)
+	print("ENUM_USERS %s: %d lines, best %.1fms, median %.1fms"
+		% (args, results[0][1], times[0]*1000, times[len(times)//2]*1000))
+	return 0
+
+if __name__ == '__main__':
+	sys.exit(main())
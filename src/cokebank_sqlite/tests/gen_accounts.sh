@@ -0,0 +1,36 @@
+#!/bin/sh
+#
+# OpenDispense 2
+# SQLite Coke Bank - Test account generator
+# > Adds <count> (default 10000) accounts named testNNNNN, with a spread of
+#   balances, last seen times and flags, for timing ENUM_USERS.
+#
+# Usage: gen_accounts.sh <database> [count]
+#   The database should be at the current schema (run tests/migrate on it,
+#   or start the server on it once).
+#
+
+DB="$1"
+COUNT="${2:-10000}"
+
+if [ -z "$DB" ]; then
+	echo "Usage: $0 <database> [count]" >&2
+	exit 2
+fi
+
+sqlite3 "$DB" <<SQL || exit 1
+BEGIN;
+WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i+1 FROM n WHERE i < $COUNT)
+INSERT INTO accounts (acct_name, acct_balance, acct_last_seen,
+	acct_is_coke, acct_is_door, acct_is_disabled)
+SELECT printf('test%05d', i),
+	(i * 7919) % 20000 - 2000,	-- -20.00 to 179.99
+	CAST(strftime('%s','now') AS INTEGER) - (i * 104729) % (86400*365),
+	i % 50 = 0,
+	i % 10 = 0,
+	i % 97 = 0
+FROM n;
+COMMIT;
+SQL
+
+echo "$COUNT accounts added to $DB"
@@ -0,0 +1,61 @@
+/*
+ * OpenDispense 2 
+ * UCC (University [of WA] Computer Club) Electronic Accounting System
+ *
+ * SQLite Coke Bank - Schema check driver
+ * > Opens (creating if needed) a database, bringing it up to the current
+ *   schema. Used by `make check` before looking at the query plans.
+ *
+ * This file is licenced under the 3-clause BSD Licence. See the file
+ * COPYING for full details.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include "../../cokebank.h"
+
+// === CODE ===
+int main(int argc, char *argv[])
+{
+	if( argc != 2 ) {
+		fprintf(stderr, "Usage: %s <database>\n", argv[0]);
+		return 2;
+	}
+	
+	if( Bank_Initialise(argv[1]) ) {
+		fprintf(stderr, "%s: Unable to open '%s'\n", argv[0], argv[1]);
+		return 1;
+	}
+	return 0;
+}
+
+// --- Provided by the server ---
+char *mkstr(const char *Format, ...)
+{
+	va_list	args;
+	 int	len;
+	char	*ret;
+
+	va_start(args, Format);
+	len = vsnprintf(NULL, 0, Format, args);
+	va_end(args);
+
+	ret = malloc( len + 1 );
+	if(!ret)	return NULL;
+
+	va_start(args, Format);
+	vsprintf(ret, Format, args);
+	va_end(args);
+	
+	return ret;
+}
+
+void Log_Info(const char *Format, ...)
+{
+	va_list	args;
+	
+	va_start(args, Format);
+	vfprintf(stderr, Format, args);
+	va_end(args);
+	fprintf(stderr, "\n");
+}
@@ -0,0 +1,55 @@
+#!/bin/sh
+#
+# OpenDispense 2
+# SQLite Coke Bank - Query plan check
+# > Checks that account listings (ENUM_USERS) and name lookups are answered
+#   from the indexes, and never by a full scan of the accounts table.
+#
+# Usage: query_plans.sh <database>
+#
+
+DB="$1"
+RV=0
+
+# Columns read by Bank_IteratorNextRecord
+COLS="acct_id,acct_name,acct_balance,acct_is_disabled,acct_is_coke,acct_is_admin,acct_is_door,acct_is_internal,acct_last_seen"
+LIST="SELECT $COLS FROM accounts WHERE 1=1"
+
+# check <expected plan> <query>
+check()
+{
+	plan=$(sqlite3 "$DB" "EXPLAIN QUERY PLAN $2") || { RV=1; return; }
+	case "$plan" in
+	*"$1"*)
+		;;
+	*)
+		echo "FAIL: $2"
+		echo "  expected: $1"
+		echo "$plan" | sed 's/^/  got: /'
+		RV=1
+		return
+		;;
+	esac
+	# A scan of the table itself (not an index), or a sort the index didn't give
+	if echo "$plan" | grep -Eq 'SCAN accounts$|TEMP B-TREE'; then
+		echo "FAIL: $2"
+		echo "$plan" | sed 's/^/  got: /'
+		RV=1
+	fi
+}
+
+# ENUM_USERS (Bank_IteratorAfter), first page and resumed
+check "COVERING INDEX accounts_by_name" "$LIST AND 1!=0 AND -1!=0 ORDER BY acct_name"
+check "COVERING INDEX accounts_by_name" "$LIST AND acct_is_coke=1 AND 1!=0 AND -1!=0 AND acct_name>'bob' ORDER BY acct_name"
+check "COVERING INDEX accounts_by_name" "$LIST AND 1!=0 AND -1!=0 ORDER BY acct_name DESC"
+check "COVERING INDEX accounts_by_balance" "$LIST AND 1!=0 AND -1!=0 ORDER BY acct_balance,acct_id"
+check "COVERING INDEX accounts_by_balance" "$LIST AND acct_balance>=100 AND -1!=0 AND (acct_balance,acct_id)<(500,7) ORDER BY acct_balance DESC,acct_id DESC"
+check "COVERING INDEX accounts_by_last_seen" "$LIST AND 1!=0 AND acct_last_seen>=0 ORDER BY acct_last_seen,acct_id"
+check "COVERING INDEX accounts_by_last_seen" "$LIST AND 1!=0 AND -1!=0 AND (acct_last_seen,acct_id)>(0,5) ORDER BY acct_last_seen,acct_id"
+
+# Name lookups (Bank_GetAcctByName, Bank_GetUserAuth)
+check "COVERING INDEX" "SELECT acct_id FROM accounts WHERE acct_name='bob' LIMIT 1"
+check "SEARCH accounts USING" "SELECT acct_id,acct_password FROM accounts WHERE acct_name='bob' AND acct_password IS NOT NULL"
+
+[ $RV -eq 0 ] && echo "Query plans OK"
+exit $RV
@@ -0,0 +1,425 @@
+/*
+ * OpenDispense 2
+ * UCC (University [of WA] Computer Club) Electronic Accounting System
+ *
+ * serialsim/main.c - Serial device simulator
+ * > Creates pseudo-terminals that behave like the door relay and the snack
+ *   machine, and links them to the paths given (point door_serial_port, or
+ *   the snack port, at them). Lets the serial code be run without hardware.
+ * > Door relay: "\xff\x01\x01" unlocks, "\xff\x01\x00" locks, no reply.
+ * > Snack machine: "Vnn" vends slot nn, answered with a three digit code
+ *   and a message ("100 Vend OK\n").
+ * > Replies can be delayed (-l) and commands can fail (-f). A failed door
+ *   command hangs up the pty (a new one is linked a second later), a failed
+ *   vend gets an error reply.
+ *
+ * This file is licenced under the 3-clause BSD Licence. See the file
+ * COPYING for full details.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <termios.h>
+#include <pty.h>
+
+#define MAX_PENDING	32	// Snack replies waiting on the latency
+#define REOPEN_DELAY	1000	// ms before a hung up device is linked again
+#define NUM_SNACK_SLOTS	100	// Vnn, 00 to 99
+
+// === TYPES ===
+enum eDeviceTypes
+{
+	DEV_DOOR,
+	DEV_SNACK
+};
+
+typedef struct sDevice
+{
+	 int	Type;
+	const char	*LinkPath;
+	 int	MasterFD;	// -1 while hung up
+	 int	SlaveFD;	// Kept open, so the master doesn't see a hang up between users
+	long long	ReopenTime;	// When to link a new pty (while hung up)
+	char	Buffer[16];	// Partial command
+	 int	BufferLen;
+	unsigned long	NumCommands;
+	unsigned long	NumFailed;
+}	tDevice;
+
+typedef struct sPendingReply
+{
+	tDevice	*Device;
+	long long	DueTime;
+	char	Reply[32];
+}	tPendingReply;
+
+// === PROTOTYPES ===
+ int	main(int argc, char *argv[]);
+void	ShowUsage(const char *ProgName);
+void	SigHandler(int Signum);
+long long	GetTimeMS(void);
+ int	Device_Open(tDevice *Device);
+void	Device_HangUp(tDevice *Device);
+void	Device_HandleInput(tDevice *Device);
+void	Door_HandleByte(tDevice *Device, unsigned char Byte);
+void	Snack_HandleByte(tDevice *Device, unsigned char Byte);
+ int	ShouldFail(void);
+void	QueueReply(tDevice *Device, const char *Reply);
+void	SendDueReplies(void);
+void	PrintStats(void);
+
+// === GLOBALS ===
+tDevice	gaDevices[2];
+ int	giNumDevices;
+ int	giLatency;	// ms before a reply is sent
+ int	giFailPercent;	// Chance of a command failing
+ int	gbQuiet;
+ int	gaSnack_Stock[NUM_SNACK_SLOTS];	// -1 = not limited
+tPendingReply	gaPendingReplies[MAX_PENDING];
+ int	giNumPendingReplies;
+volatile int	gbRunning = 1;
+
+// === CODE ===
+int main(int argc, char *argv[])
+{
+	 int	initialStock = -1;
+
+	for( int i = 1; i < argc; i ++ )
+	{
+		const char	*arg = argv[i];
+		if( arg[0] != '-' || arg[1] == '\0' || arg[2] != '\0' || i + 1 >= argc ) {
+			if( strcmp(arg, "-q") == 0 ) {
+				gbQuiet = 1;
+				continue;
+			}
+			ShowUsage(argv[0]);
+			return 1;
+		}
+		switch( arg[1] )
+		{
+		case 'd':
+		case 's':
+			if( giNumDevices == 2 ) {
+				ShowUsage(argv[0]);
+				return 1;
+			}
+			gaDevices[giNumDevices].Type = (arg[1] == 'd') ? DEV_DOOR : DEV_SNACK;
+			gaDevices[giNumDevices].LinkPath = argv[++i];
+			giNumDevices ++;
+			break;
+		case 'l':	giLatency = atoi(argv[++i]);	break;
+		case 'f':	giFailPercent = atoi(argv[++i]);	break;
+		case 'n':	initialStock = atoi(argv[++i]);	break;
+		default:
+			ShowUsage(argv[0]);
+			return 1;
+		}
+	}
+	if( giNumDevices == 0 || giLatency < 0 || giFailPercent < 0 || giFailPercent > 100 ) {
+		ShowUsage(argv[0]);
+		return 1;
+	}
+
+	for( int i = 0; i < NUM_SNACK_SLOTS; i ++ )
+		gaSnack_Stock[i] = initialStock;
+
+	srand(time(NULL) ^ getpid());
+	signal(SIGINT, SigHandler);
+	signal(SIGTERM, SigHandler);
+
+	for( int i = 0; i < giNumDevices; i ++ )
+	{
+		if( Device_Open(&gaDevices[i]) )
+			return 1;
+	}
+
+	while( gbRunning )
+	{
+		struct pollfd	fds[2];
+		tDevice	*fdDevices[2];
+		 int	nfds = 0;
+		 int	timeout = -1;
+		long long	now = GetTimeMS();
+
+		for( int i = 0; i < giNumDevices; i ++ )
+		{
+			tDevice	*dev = &gaDevices[i];
+			if( dev->MasterFD == -1 )
+			{
+				if( now >= dev->ReopenTime ) {
+					if( Device_Open(dev) )
+						return 1;
+				}
+				else {
+					 int	wait = dev->ReopenTime - now;
+					if( timeout == -1 || wait < timeout )	timeout = wait;
+					continue;
+				}
+			}
+			fds[nfds].fd = dev->MasterFD;
+			fds[nfds].events = POLLIN;
+			fdDevices[nfds] = dev;
+			nfds ++;
+		}
+		for( int i = 0; i < giNumPendingReplies; i ++ )
+		{
+			 int	wait = gaPendingReplies[i].DueTime - now;
+			if( wait < 0 )	wait = 0;
+			if( timeout == -1 || wait < timeout )	timeout = wait;
+		}
+
+		if( poll(fds, nfds, timeout) < 0 )
+		{
+			if( errno == EINTR )	continue;
+			perror("poll");
+			return 1;
+		}
+
+		for( int i = 0; i < nfds; i ++ )
+		{
+			if( fds[i].revents & POLLIN )
+				Device_HandleInput(fdDevices[i]);
+		}
+		SendDueReplies();
+	}
+
+	PrintStats();
+	for( int i = 0; i < giNumDevices; i ++ )
+		unlink(gaDevices[i].LinkPath);
+	return 0;
+}
+
+void ShowUsage(const char *ProgName)
+{
+	fprintf(stderr,
+		"Usage: %s [-d <door_link>] [-s <snack_link>] [-l <latency_ms>] [-f <fail_percent>] [-n <stock>] [-q]\n"
+		"\n"
+		"  -d <door_link>    Link a door relay pty here\n"
+		"  -s <snack_link>   Link a snack machine pty here\n"
+		"  -l <latency_ms>   Delay before each snack reply (default 0)\n"
+		"  -f <fail_percent> Chance of a command failing (default 0)\n"
+		"  -n <stock>        Items in each snack slot (default unlimited)\n"
+		"  -q                Don't print each command\n"
+		"\n"
+		"Counts are printed on exit (SIGINT/SIGTERM).\n",
+		ProgName);
+}
+
+void SigHandler(int Signum)
+{
+	(void)Signum;
+	gbRunning = 0;
+}
+
+long long GetTimeMS(void)
+{
+	struct timespec	ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * \brief Create a pty for a device and link its slave to the device's path
+ * \return Boolean failure
+ */
+int Device_Open(tDevice *Device)
+{
+	struct termios	info;
+	 int	master, slave;
+	char	name[64];
+
+	if( openpty(&master, &slave, name, NULL, NULL) ) {
+		perror("openpty");
+		return 1;
+	}
+	// Raw, so the relay's binary commands come through untouched
+	tcgetattr(slave, &info);
+	cfmakeraw(&info);
+	tcsetattr(slave, TCSANOW, &info);
+	fcntl(master, F_SETFL, O_NONBLOCK);
+
+	unlink(Device->LinkPath);
+	if( symlink(name, Device->LinkPath) ) {
+		fprintf(stderr, "Unable to link '%s' to %s: %s\n", Device->LinkPath, name, strerror(errno));
+		close(master);
+		close(slave);
+		return 1;
+	}
+
+	Device->MasterFD = master;
+	Device->SlaveFD = slave;
+	Device->BufferLen = 0;
+	if( !gbQuiet )
+		printf("%s: %s -> %s\n", Device->Type == DEV_DOOR ? "door" : "snack", Device->LinkPath, name);
+	return 0;
+}
+
+/**
+ * \brief Simulate the device being unplugged (it comes back after REOPEN_DELAY)
+ */
+void Device_HangUp(tDevice *Device)
+{
+	close(Device->MasterFD);
+	close(Device->SlaveFD);
+	Device->MasterFD = -1;
+	Device->ReopenTime = GetTimeMS() + REOPEN_DELAY;
+	unlink(Device->LinkPath);
+
+	// Replies to the old pty are lost
+	for( int i = 0; i < giNumPendingReplies; )
+	{
+		if( gaPendingReplies[i].Device == Device ) {
+			gaPendingReplies[i] = gaPendingReplies[--giNumPendingReplies];
+			continue;
+		}
+		i ++;
+	}
+}
+
+void Device_HandleInput(tDevice *Device)
+{
+	unsigned char	buf[64];
+	 int	len;
+
+	len = read(Device->MasterFD, buf, sizeof(buf));
+	if( len <= 0 )
+		return ;
+
+	for( int i = 0; i < len && Device->MasterFD != -1; i ++ )
+	{
+		if( Device->Type == DEV_DOOR )
+			Door_HandleByte(Device, buf[i]);
+		else
+			Snack_HandleByte(Device, buf[i]);
+	}
+}
+
+/**
+ * \brief Door relay, three byte commands (0xFF 0x01 <state>)
+ */
+void Door_HandleByte(tDevice *Device, unsigned char Byte)
+{
+	// Resynchronise on the 0xFF lead byte
+	if( Device->BufferLen == 0 && Byte != 0xFF )
+		return ;
+	Device->Buffer[Device->BufferLen++] = Byte;
+	if( Device->BufferLen < 3 )
+		return ;
+	Device->BufferLen = 0;
+
+	if( Device->Buffer[1] != 0x01 || (Device->Buffer[2] != 0x00 && Device->Buffer[2] != 0x01) ) {
+		if( !gbQuiet )
+			printf("door: bad command %02x %02x %02x\n", 0xFF,
+				(unsigned char)Device->Buffer[1], (unsigned char)Device->Buffer[2]);
+		return ;
+	}
+
+	Device->NumCommands ++;
+	if( ShouldFail() ) {
+		Device->NumFailed ++;
+		if( !gbQuiet )	printf("door: hanging up\n");
+		Device_HangUp(Device);
+		return ;
+	}
+	if( !gbQuiet )
+		printf("door: %s\n", Device->Buffer[2] ? "unlocked" : "locked");
+}
+
+/**
+ * \brief Snack machine, "Vnn" commands (line endings are ignored)
+ */
+void Snack_HandleByte(tDevice *Device, unsigned char Byte)
+{
+	 int	slot;
+
+	if( Byte == '\r' || Byte == '\n' || Byte == ' ' )
+		return ;
+	if( Device->BufferLen == 0 && Byte != 'V' ) {
+		QueueReply(Device, "500 Unknown command\n");
+		return ;
+	}
+	Device->Buffer[Device->BufferLen++] = Byte;
+	if( Device->BufferLen < 3 )
+		return ;
+	Device->BufferLen = 0;
+
+	Device->NumCommands ++;
+	if( Device->Buffer[1] < '0' || Device->Buffer[1] > '9' || Device->Buffer[2] < '0' || Device->Buffer[2] > '9' ) {
+		QueueReply(Device, "151 Invalid slot\n");
+		return ;
+	}
+	slot = (Device->Buffer[1] - '0') * 10 + (Device->Buffer[2] - '0');
+
+	if( gaSnack_Stock[slot] == 0 ) {
+		QueueReply(Device, "153 Slot empty\n");
+		return ;
+	}
+	if( ShouldFail() ) {
+		Device->NumFailed ++;
+		QueueReply(Device, "152 Motor jammed\n");
+		return ;
+	}
+	if( gaSnack_Stock[slot] > 0 )
+		gaSnack_Stock[slot] --;
+	QueueReply(Device, "100 Vend OK\n");
+}
+
+int ShouldFail(void)
+{
+	return giFailPercent > 0 && rand() % 100 < giFailPercent;
+}
+
+void QueueReply(tDevice *Device, const char *Reply)
+{
+	tPendingReply	*pr;
+
+	if( giNumPendingReplies == MAX_PENDING ) {
+		fprintf(stderr, "%s: reply dropped (too many pending)\n", Device->LinkPath);
+		return ;
+	}
+	pr = &gaPendingReplies[giNumPendingReplies++];
+	pr->Device = Device;
+	pr->DueTime = GetTimeMS() + giLatency;
+	snprintf(pr->Reply, sizeof(pr->Reply), "%s", Reply);
+	if( !gbQuiet )
+		printf("snack: %.*s\n", (int)strlen(Reply) - 1, Reply);
+}
+
+/**
+ * \brief Send replies whose latency is up (oldest first)
+ */
+void SendDueReplies(void)
+{
+	long long	now = GetTimeMS();
+
+	for( int i = 0; i < giNumPendingReplies; )
+	{
+		tPendingReply	*pr = &gaPendingReplies[i];
+		 int	len = strlen(pr->Reply);
+		if( pr->DueTime > now ) {
+			i ++;
+			continue;
+		}
+		if( write(pr->Device->MasterFD, pr->Reply, len) != len )
+			fprintf(stderr, "%s: reply not sent: %s\n", pr->Device->LinkPath, strerror(errno));
+		memmove(pr, pr + 1, (giNumPendingReplies - i - 1) * sizeof(*pr));
+		giNumPendingReplies --;
+	}
+	fflush(stdout);
+}
+
+void PrintStats(void)
+{
+	for( int i = 0; i < giNumDevices; i ++ )
+	{
+		printf("%s: %lu commands, %lu failed\n",
+			gaDevices[i].Type == DEV_DOOR ? "door" : "snack",
+			gaDevices[i].NumCommands, gaDevices[i].NumFailed);
+	}
+}
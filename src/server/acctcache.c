@@ -0,0 +1,517 @@
+/*
+ * OpenDispense 2
+ * UCC (University [of WA] Computer Club) Electronic Accounting System
+ *
+ * acctcache.c - Account cache
+ * > Sits between the server and the cokebank, remembering account names,
+ *   balances and flags (and which names don't exist). Changes made by the
+ *   server are passed to the bank and then applied to the cache, so
+ *   nothing needs to be asked twice.
+ * > The bank reports each committed change (Bank_AddChangeListener), and
+ *   the new balance/flags replace the cached ones.
+ * > If other programs change the bank (e.g. editing the database), set
+ *   `acct_cache_coherent` and the whole cache is dropped whenever the
+ *   bank's data version changes.
+ *
+ * This file is licenced under the 3-clause BSD Licence. See the file
+ * COPYING for full details.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+#include "common.h"
+#include "../common/config.h"
+
+#define ACCTCACHE_MIN_SIZE	256	// Initial slots in each table (power of two, grows at half full)
+#define ACCTCACHE_STATS_INTERVAL	3600	// Seconds between hit rate log entries
+
+// === TYPES ===
+enum eAcctCacheValid
+{
+	ACCTCACHE_NAME	= 0x1,
+	ACCTCACHE_BALANCE	= 0x2,
+	ACCTCACHE_FLAGS	= 0x4
+};
+
+enum eAcctCacheStats
+{
+	STAT_BYNAME,
+	STAT_NAME,
+	STAT_BALANCE,
+	STAT_FLAGS,
+	NUM_STATS
+};
+
+typedef struct sCachedAcct
+{
+	 int	AcctID;	// -1 = empty slot
+	 int	Valid;	// eAcctCacheValid
+	char	*Name;
+	 int	Balance;
+	 int	Flags;
+}	tCachedAcct;
+
+typedef struct sCachedName
+{
+	char	*Name;	// NULL = empty slot
+	 int	AcctID;	// -1 = no such account
+}	tCachedName;
+
+// === PROTOTYPES ===
+void	AcctCache_Initialise(void);
+void	AcctCache_Sync(void);
+ int	AcctCache_GetAcctByName(const char *Name, int bCreate);
+const char	*AcctCache_GetAcctName(int AcctID);
+ int	AcctCache_GetBalance(int AcctID);
+ int	AcctCache_GetFlags(int AcctID);
+ int	AcctCache_SetFlags(int AcctID, int Mask, int Value);
+ int	AcctCache_CreateAcct(const char *Name);
+ int	AcctCache_Transfer(int SourceAcct, int DestAcct, int Ammount, int Actor, const char *Reason);
+ int	AcctCache_CommitHold(int HoldID, int SourceAcct, int DestAcct, int Ammount, int Actor, const char *Reason);
+ int	AcctCache_CommitTransaction(void);
+void	AcctCache_AbortTransaction(void);
+static tCachedAcct	*AcctCache_int_GetAcct(int AcctID);
+static tCachedName	*AcctCache_int_FindName(const char *Name);
+static void	AcctCache_int_SetName(const char *Name, int AcctID);
+static void	AcctCache_int_Invalidate(int Mask);
+static void	AcctCache_int_BankChanged(void *Unused, const tBankChange *Change);
+static void	AcctCache_int_Flush(void);
+static void	AcctCache_int_LogStats(void);
+
+// === CONSTANTS ===
+const char	*casAcctCache_StatNames[NUM_STATS] = {"name->id", "id->name", "balance", "flags"};
+
+// === GLOBALS ===
+ int	gbAcctCache_Coherent;	// Check Bank_GetDataVersion before each command
+tCachedAcct	*gaAcctCache_Accts;
+ int	giAcctCache_AcctsSize;
+ int	giAcctCache_NumAccts;
+tCachedName	*gaAcctCache_Names;
+ int	giAcctCache_NamesSize;
+ int	giAcctCache_NumNames;
+tCachedAcct	*gaAcctCache_Retired;	// Dropped by a flush, names may still be in use until the next sync
+ int	giAcctCache_RetiredSize;
+unsigned int	giAcctCache_FlagsEpoch;
+unsigned int	giAcctCache_DataVersion;
+unsigned long	giAcctCache_NumChanges;	// Changes reported by the bank
+unsigned long	gaAcctCache_Hits[NUM_STATS];
+unsigned long	gaAcctCache_Misses[NUM_STATS];
+time_t	gAcctCache_LastStats;
+
+// === CODE ===
+void AcctCache_Initialise(void)
+{
+	if( Config_GetValueCount("acct_cache_coherent") > 0 )
+		gbAcctCache_Coherent = (Config_GetValue_Bool("acct_cache_coherent", 0) == 1);
+
+	giAcctCache_FlagsEpoch = Bank_GetFlagsEpoch();
+	if( Bank_AddChangeListener(AcctCache_int_BankChanged, NULL) )
+		Log_Error("Account cache: Unable to listen for bank changes");
+	if( gbAcctCache_Coherent )
+		giAcctCache_DataVersion = Bank_GetDataVersion();
+	gAcctCache_LastStats = time(NULL);
+}
+
+/**
+ * \brief Called by the main loop between commands
+ *
+ * Frees names retired by the last flush (no command can still hold them),
+ * and checks for changes made outside the server.
+ */
+void AcctCache_Sync(void)
+{
+	if( gaAcctCache_Retired )
+	{
+		for( int i = 0; i < giAcctCache_RetiredSize; i ++ )
+			free(gaAcctCache_Retired[i].Name);
+		free(gaAcctCache_Retired);
+		gaAcctCache_Retired = NULL;
+		giAcctCache_RetiredSize = 0;
+	}
+
+	if( gbAcctCache_Coherent )
+	{
+		unsigned int	version = Bank_GetDataVersion();
+		if( version != giAcctCache_DataVersion ) {
+			AcctCache_int_Flush();
+			giAcctCache_DataVersion = version;
+		}
+	}
+
+	if( time(NULL) - gAcctCache_LastStats >= ACCTCACHE_STATS_INTERVAL )
+		AcctCache_int_LogStats();
+}
+
+/**
+ * \brief Bank_GetAcctByName, remembering unknown names too
+ */
+int AcctCache_GetAcctByName(const char *Name, int bCreate)
+{
+	tCachedName	*ent = AcctCache_int_FindName(Name);
+	 int	ret;
+
+	if( ent && ent->Name && (ent->AcctID != -1 || !bCreate) ) {
+		gaAcctCache_Hits[STAT_BYNAME] ++;
+		return ent->AcctID;
+	}
+	gaAcctCache_Misses[STAT_BYNAME] ++;
+
+	ret = Bank_GetAcctByName(Name, bCreate);
+	AcctCache_int_SetName(Name, ret);
+	return ret;
+}
+
+/**
+ * \brief Get the name of an account
+ * \return Name owned by the cache (valid until the command completes), or NULL
+ */
+const char *AcctCache_GetAcctName(int AcctID)
+{
+	tCachedAcct	*ent = AcctCache_int_GetAcct(AcctID);
+	char	*name;
+
+	if( ent && (ent->Valid & ACCTCACHE_NAME) ) {
+		gaAcctCache_Hits[STAT_NAME] ++;
+		return ent->Name;
+	}
+	gaAcctCache_Misses[STAT_NAME] ++;
+
+	if( !ent )
+		return NULL;
+	name = Bank_GetAcctName(AcctID);
+	if( !name )
+		return NULL;
+	ent->Name = name;
+	ent->Valid |= ACCTCACHE_NAME;
+	return name;
+}
+
+int AcctCache_GetBalance(int AcctID)
+{
+	tCachedAcct	*ent = AcctCache_int_GetAcct(AcctID);
+
+	if( ent && (ent->Valid & ACCTCACHE_BALANCE) ) {
+		gaAcctCache_Hits[STAT_BALANCE] ++;
+		return ent->Balance;
+	}
+	gaAcctCache_Misses[STAT_BALANCE] ++;
+
+	if( !ent )
+		return Bank_GetBalance(AcctID);
+	ent->Balance = Bank_GetBalance(AcctID);
+	ent->Valid |= ACCTCACHE_BALANCE;
+	return ent->Balance;
+}
+
+int AcctCache_GetFlags(int AcctID)
+{
+	tCachedAcct	*ent;
+	unsigned int	epoch = Bank_GetFlagsEpoch();
+
+	// Flags changed by something else (e.g. group membership)
+	if( epoch != giAcctCache_FlagsEpoch ) {
+		AcctCache_int_Invalidate(ACCTCACHE_FLAGS);
+		giAcctCache_FlagsEpoch = epoch;
+	}
+
+	ent = AcctCache_int_GetAcct(AcctID);
+	if( ent && (ent->Valid & ACCTCACHE_FLAGS) ) {
+		gaAcctCache_Hits[STAT_FLAGS] ++;
+		return ent->Flags;
+	}
+	gaAcctCache_Misses[STAT_FLAGS] ++;
+
+	if( !ent )
+		return Bank_GetFlags(AcctID);
+	ent->Flags = Bank_GetFlags(AcctID);
+	ent->Valid |= ACCTCACHE_FLAGS;
+	return ent->Flags;
+}
+
+/**
+ * \brief Bank_SetFlags, then refresh the cached flags
+ * \note The flags are read back (not computed), as the bank may add flags
+ *       of its own (e.g. unix groups)
+ */
+int AcctCache_SetFlags(int AcctID, int Mask, int Value)
+{
+	unsigned int	epoch = Bank_GetFlagsEpoch();
+	unsigned long	changes = giAcctCache_NumChanges;
+	tCachedAcct	*ent;
+	 int	rv;
+
+	rv = Bank_SetFlags(AcctID, Mask, Value);
+
+	// Only this change happened, no need to drop everyone else's flags
+	if( giAcctCache_FlagsEpoch == epoch )
+		giAcctCache_FlagsEpoch = Bank_GetFlagsEpoch();
+
+	// Already updated by the change report
+	if( giAcctCache_NumChanges != changes )
+		return rv;
+
+	ent = AcctCache_int_GetAcct(AcctID);
+	if( ent ) {
+		ent->Flags = Bank_GetFlags(AcctID);
+		ent->Valid |= ACCTCACHE_FLAGS;
+	}
+	return rv;
+}
+
+int AcctCache_CreateAcct(const char *Name)
+{
+	 int	ret = Bank_CreateAcct(Name);
+	tCachedAcct	*ent;
+
+	if( ret == -1 )
+		return -1;
+
+	AcctCache_int_SetName(Name, ret);
+	// Forget anything looked up for this ID before it existed
+	ent = AcctCache_int_GetAcct(ret);
+	if( ent )
+		ent->Valid &= ACCTCACHE_NAME;
+	return ret;
+}
+
+/**
+ * \brief Bank_Transfer, applied to the cached balances if it succeeds
+ * \note In a transaction the bank only reports the change at commit, so
+ *       the cached balances are moved here to be seen by later commands.
+ */
+int AcctCache_Transfer(int SourceAcct, int DestAcct, int Ammount, int Actor, const char *Reason)
+{
+	tCachedAcct	*src, *dst;
+	unsigned long	changes = giAcctCache_NumChanges;
+	 int	rv;
+
+	rv = Bank_Transfer(SourceAcct, DestAcct, Ammount, Actor, Reason);
+	if( rv == 0 && giAcctCache_NumChanges != changes )
+		return 0;	// Committed, and already applied by the change report
+
+	src = AcctCache_int_GetAcct(SourceAcct);
+	dst = AcctCache_int_GetAcct(DestAcct);
+	if( rv ) {
+		if(src)	src->Valid &= ~ACCTCACHE_BALANCE;
+		if(dst)	dst->Valid &= ~ACCTCACHE_BALANCE;
+		return rv;
+	}
+	if(src)	src->Balance -= Ammount;
+	if(dst)	dst->Balance += Ammount;
+	return 0;
+}
+
+/**
+ * \brief Bank_CommitHold, moving the cached balances like AcctCache_Transfer
+ * \param SourceAcct	Account the hold was made on
+ * \param Ammount	Cents held
+ */
+int AcctCache_CommitHold(int HoldID, int SourceAcct, int DestAcct, int Ammount, int Actor, const char *Reason)
+{
+	tCachedAcct	*src, *dst;
+	unsigned long	changes = giAcctCache_NumChanges;
+	 int	rv;
+
+	rv = Bank_CommitHold(HoldID, DestAcct, Actor, Reason);
+	if( rv == 0 && giAcctCache_NumChanges != changes )
+		return 0;
+
+	src = AcctCache_int_GetAcct(SourceAcct);
+	dst = AcctCache_int_GetAcct(DestAcct);
+	if( rv ) {
+		if(src)	src->Valid &= ~ACCTCACHE_BALANCE;
+		if(dst)	dst->Valid &= ~ACCTCACHE_BALANCE;
+		return rv;
+	}
+	if(src)	src->Balance -= Ammount;
+	if(dst)	dst->Balance += Ammount;
+	return 0;
+}
+
+/**
+ * \brief Bank_CommitTransaction (a failed commit rolls back the balances)
+ */
+int AcctCache_CommitTransaction(void)
+{
+	if( Bank_CommitTransaction() ) {
+		AcctCache_int_Invalidate(ACCTCACHE_BALANCE);
+		return 1;
+	}
+	return 0;
+}
+
+void AcctCache_AbortTransaction(void)
+{
+	Bank_AbortTransaction();
+	AcctCache_int_Invalidate(ACCTCACHE_BALANCE);
+}
+
+/**
+ * \brief Find (or add) the entry for an account
+ * \return Entry, or NULL for invalid IDs (or if out of memory)
+ */
+static tCachedAcct *AcctCache_int_GetAcct(int AcctID)
+{
+	 int	i;
+
+	if( AcctID < 0 )
+		return NULL;
+
+	if( (giAcctCache_NumAccts + 1) * 2 > giAcctCache_AcctsSize )
+	{
+		tCachedAcct	*old = gaAcctCache_Accts;
+		 int	oldSize = giAcctCache_AcctsSize;
+		 int	newSize = oldSize ? oldSize * 2 : ACCTCACHE_MIN_SIZE;
+		tCachedAcct	*new = malloc(newSize * sizeof(tCachedAcct));
+
+		if( !new ) {
+			// Keep using the current table while it has room
+			if( giAcctCache_NumAccts + 1 >= giAcctCache_AcctsSize )
+				return NULL;
+			goto _find;
+		}
+		for( i = 0; i < newSize; i ++ )
+			new[i].AcctID = -1;
+		gaAcctCache_Accts = new;
+		giAcctCache_AcctsSize = newSize;
+		for( int j = 0; j < oldSize; j ++ )
+		{
+			if( old[j].AcctID == -1 )	continue ;
+			for( i = old[j].AcctID & (newSize-1); new[i].AcctID != -1; i = (i + 1) & (newSize-1) )
+				;
+			new[i] = old[j];
+		}
+		free(old);
+	}
+
+_find:
+	for( i = AcctID & (giAcctCache_AcctsSize-1); ; i = (i + 1) & (giAcctCache_AcctsSize-1) )
+	{
+		tCachedAcct	*ent = &gaAcctCache_Accts[i];
+		if( ent->AcctID == AcctID )
+			return ent;
+		if( ent->AcctID == -1 ) {
+			ent->AcctID = AcctID;
+			ent->Valid = 0;
+			ent->Name = NULL;
+			giAcctCache_NumAccts ++;
+			return ent;
+		}
+	}
+}
+
+/**
+ * \brief Find the slot for a name (empty if not cached)
+ * \return Slot, or NULL if the table hasn't been created
+ */
+static tCachedName *AcctCache_int_FindName(const char *Name)
+{
+	unsigned int	hash = 5381;
+	 int	i;
+
+	if( giAcctCache_NamesSize == 0 )
+		return NULL;
+
+	for( const char *p = Name; *p; p ++ )
+		hash = hash * 33 + (unsigned char)*p;
+
+	for( i = hash & (giAcctCache_NamesSize-1); ; i = (i + 1) & (giAcctCache_NamesSize-1) )
+	{
+		tCachedName	*ent = &gaAcctCache_Names[i];
+		if( !ent->Name || strcmp(ent->Name, Name) == 0 )
+			return ent;
+	}
+}
+
+static void AcctCache_int_SetName(const char *Name, int AcctID)
+{
+	tCachedName	*ent;
+
+	if( (giAcctCache_NumNames + 1) * 2 > giAcctCache_NamesSize )
+	{
+		tCachedName	*old = gaAcctCache_Names;
+		 int	oldSize = giAcctCache_NamesSize;
+		 int	newSize = oldSize ? oldSize * 2 : ACCTCACHE_MIN_SIZE;
+		tCachedName	*new = calloc(newSize, sizeof(tCachedName));
+
+		if( !new )	return ;
+		gaAcctCache_Names = new;
+		giAcctCache_NamesSize = newSize;
+		for( int i = 0; i < oldSize; i ++ )
+		{
+			if( old[i].Name )
+				*AcctCache_int_FindName(old[i].Name) = old[i];
+		}
+		free(old);
+	}
+
+	ent = AcctCache_int_FindName(Name);
+	if( !ent->Name ) {
+		ent->Name = strdup(Name);
+		if( !ent->Name )	return ;
+		giAcctCache_NumNames ++;
+	}
+	ent->AcctID = AcctID;
+}
+
+/**
+ * \brief Forget a field of every cached account
+ */
+static void AcctCache_int_Invalidate(int Mask)
+{
+	for( int i = 0; i < giAcctCache_AcctsSize; i ++ )
+		gaAcctCache_Accts[i].Valid &= ~Mask;
+}
+
+/**
+ * \brief Change listener, takes the committed balance and flags
+ */
+static void AcctCache_int_BankChanged(void *Unused, const tBankChange *Change)
+{
+	tCachedAcct	*ent;
+
+	(void)Unused;
+	giAcctCache_NumChanges ++;
+
+	ent = AcctCache_int_GetAcct(Change->AcctID);
+	if( !ent )	return ;
+	ent->Balance = Change->Balance;
+	ent->Flags = Change->Flags;
+	ent->Valid |= ACCTCACHE_BALANCE|ACCTCACHE_FLAGS;
+}
+
+/**
+ * \brief Forget everything (the bank was changed by another program)
+ */
+static void AcctCache_int_Flush(void)
+{
+	// Names may have been returned by AcctCache_GetAcctName, free them later
+	gaAcctCache_Retired = gaAcctCache_Accts;
+	giAcctCache_RetiredSize = giAcctCache_AcctsSize;
+	gaAcctCache_Accts = NULL;
+	giAcctCache_AcctsSize = 0;
+	giAcctCache_NumAccts = 0;
+
+	for( int i = 0; i < giAcctCache_NamesSize; i ++ )
+		free(gaAcctCache_Names[i].Name);
+	free(gaAcctCache_Names);
+	gaAcctCache_Names = NULL;
+	giAcctCache_NamesSize = 0;
+	giAcctCache_NumNames = 0;
+}
+
+static void AcctCache_int_LogStats(void)
+{
+	for( int i = 0; i < NUM_STATS; i ++ )
+	{
+		unsigned long	total = gaAcctCache_Hits[i] + gaAcctCache_Misses[i];
+		Log_Info("Account cache: %s %lu/%lu hits (%lu%%)",
+			casAcctCache_StatNames[i], gaAcctCache_Hits[i], total,
+			total ? gaAcctCache_Hits[i] * 100 / total : 0
+			);
+		gaAcctCache_Hits[i] = 0;
+		gaAcctCache_Misses[i] = 0;
+	}
+	gAcctCache_LastStats = time(NULL);
+}
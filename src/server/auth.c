@@ -0,0 +1,190 @@
+/*
+ * OpenDispense 2
+ * UCC (University [of WA] Computer Club) Electronic Accounting System
+ *
+ * auth.c - Password authentication workers
+ * > Password checks are slow on purpose, so they are run by a fixed number
+ *   of worker threads instead of the main loop. The main loop is woken
+ *   through a pipe when a check completes.
+ *
+ * This file is licenced under the 3-clause BSD Licence. See the file
+ * COPYING for full details.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include "common.h"
+#include "../cokebank.h"
+#include "../common/config.h"
+
+#define DEF_AUTH_WORKERS	2	// Threads checking passwords
+#define DEF_AUTH_QUEUE_DEPTH	16	// Checks allowed to wait for a worker
+
+// === TYPES ===
+typedef struct sAuthJob
+{
+	struct sAuthJob	*Next;
+	 int	ClientID;
+	char	*Salt;
+	char	*Username;
+	char	*Password;
+	 int	Result;	// Account ID, or -1
+}	tAuthJob;
+
+// === PROTOTYPES ===
+ int	Auth_Initialise(void);
+ int	Auth_GetNotifyFD(void);
+ int	Auth_Queue(int ClientID, const char *Salt, const char *Username, const char *Password);
+ int	Auth_GetResult(int *ClientID, int *AcctID);
+void	*Auth_int_Worker(void *Unused);
+
+// === GLOBALS ===
+ int	giAuth_NumWorkers = DEF_AUTH_WORKERS;
+ int	giAuth_MaxQueued = DEF_AUTH_QUEUE_DEPTH;
+pthread_mutex_t	gAuth_Lock = PTHREAD_MUTEX_INITIALIZER;	// Protects the queues
+pthread_cond_t	gAuth_QueueCond = PTHREAD_COND_INITIALIZER;
+tAuthJob	*gpAuth_Queue, *gpAuth_QueueTail;	// Waiting for a worker
+ int	giAuth_NumQueued;
+tAuthJob	*gpAuth_Done;	// Finished, waiting for the main loop
+ int	gaAuth_NotifyPipe[2];
+
+// === CODE ===
+/**
+ * \brief Start the worker threads
+ * \return Boolean failure
+ */
+int Auth_Initialise(void)
+{
+	if( Config_GetValueCount("auth_workers") > 0 )
+		giAuth_NumWorkers = Config_GetValue_Int("auth_workers", 0);
+	if( Config_GetValueCount("auth_queue_depth") > 0 )
+		giAuth_MaxQueued = Config_GetValue_Int("auth_queue_depth", 0);
+	if( giAuth_NumWorkers < 1 )
+		giAuth_NumWorkers = 1;
+
+	if( pipe(gaAuth_NotifyPipe) ) {
+		perror("Auth_Initialise - pipe");
+		return 1;
+	}
+	fcntl(gaAuth_NotifyPipe[0], F_SETFL, O_NONBLOCK);
+	fcntl(gaAuth_NotifyPipe[1], F_SETFL, O_NONBLOCK);
+
+	for( int i = 0; i < giAuth_NumWorkers; i ++ )
+	{
+		pthread_t	thread;
+		if( pthread_create(&thread, NULL, Auth_int_Worker, NULL) ) {
+			perror("Auth_Initialise - pthread_create");
+			return 1;
+		}
+		pthread_detach(thread);
+	}
+	return 0;
+}
+
+/**
+ * \brief Get the descriptor that becomes readable when a check completes
+ */
+int Auth_GetNotifyFD(void)
+{
+	return gaAuth_NotifyPipe[0];
+}
+
+/**
+ * \brief Queue a password check
+ * \return Boolean failure (queue is full)
+ */
+int Auth_Queue(int ClientID, const char *Salt, const char *Username, const char *Password)
+{
+	tAuthJob	*job;
+
+	pthread_mutex_lock(&gAuth_Lock);
+	if( giAuth_NumQueued >= giAuth_MaxQueued ) {
+		pthread_mutex_unlock(&gAuth_Lock);
+		return 1;
+	}
+
+	job = calloc(1, sizeof(tAuthJob));
+	job->ClientID = ClientID;
+	job->Salt = strdup(Salt);
+	job->Username = strdup(Username);
+	job->Password = strdup(Password);
+
+	if( gpAuth_QueueTail )
+		gpAuth_QueueTail->Next = job;
+	else
+		gpAuth_Queue = job;
+	gpAuth_QueueTail = job;
+	giAuth_NumQueued ++;
+
+	pthread_cond_signal(&gAuth_QueueCond);
+	pthread_mutex_unlock(&gAuth_Lock);
+	return 0;
+}
+
+/**
+ * \brief Get a completed check
+ * \param ClientID	Client that queued the check
+ * \param AcctID	Result of Bank_GetUserAuth
+ * \return 1 if a result was returned, 0 if none are waiting
+ */
+int Auth_GetResult(int *ClientID, int *AcctID)
+{
+	tAuthJob	*job;
+	char	buf[64];
+
+	// Clear wakeups (one is written per job, extras are harmless)
+	while( read(gaAuth_NotifyPipe[0], buf, sizeof(buf)) > 0 )
+		;
+
+	pthread_mutex_lock(&gAuth_Lock);
+	job = gpAuth_Done;
+	if( job )
+		gpAuth_Done = job->Next;
+	pthread_mutex_unlock(&gAuth_Lock);
+
+	if( !job )	return 0;
+
+	*ClientID = job->ClientID;
+	*AcctID = job->Result;
+	free(job);
+	return 1;
+}
+
+void *Auth_int_Worker(void *Unused)
+{
+	(void)Unused;
+	for( ;; )
+	{
+		tAuthJob	*job;
+
+		pthread_mutex_lock(&gAuth_Lock);
+		while( !gpAuth_Queue )
+			pthread_cond_wait(&gAuth_QueueCond, &gAuth_Lock);
+		job = gpAuth_Queue;
+		gpAuth_Queue = job->Next;
+		if( !gpAuth_Queue )
+			gpAuth_QueueTail = NULL;
+		giAuth_NumQueued --;
+		pthread_mutex_unlock(&gAuth_Lock);
+
+		job->Result = Bank_GetUserAuth(job->Salt, job->Username, job->Password);
+
+		free(job->Salt);
+		free(job->Username);
+		memset(job->Password, 0, strlen(job->Password));
+		free(job->Password);
+
+		pthread_mutex_lock(&gAuth_Lock);
+		job->Next = gpAuth_Done;
+		gpAuth_Done = job;
+		pthread_mutex_unlock(&gAuth_Lock);
+
+		if( write(gaAuth_NotifyPipe[1], "", 1) < 0 ) {
+			// Pipe full, the main loop already has wakeups pending
+		}
+	}
+	return NULL;
+}
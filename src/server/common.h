@@ -10,12 +10,15 @@
 #define _COMMON_H_
 
 #include <regex.h>
+#include <stdint.h>
 #include "../cokebank.h"
 
 // === CONSTANTS ===
 #define	DEFAULT_CONFIG_FILE	"/etc/opendispense/main.cfg"
 #define	DEFAULT_ITEM_FILE	"/etc/opendispense/items.cfg"
 
+#define	MAX_ITEM_STOCK	9999	// Most a counted item can be restocked to
+
 // === HELPER MACROS ===
 
 #define UNUSED(var)    unused__##var __attribute__((__unused__))
@@ -35,6 +38,9 @@ struct sItem
 	
 	tHandler	*Handler;	//!< Handler for the item
 	short	ID;	//!< Item ID
+	
+	 int	Status;	//!< Last reported status (0: avail, 1: sold, -1: error)
+	 int	Stock;	//!< Units left (-1 = not counted)
 };
 
 struct sUser
@@ -61,18 +67,42 @@ struct sHandler
 	 */
 	 int	(*CanDispense)(int User, int ID);
 	 int	(*DoDispense)(int User, int ID);
+	/**
+	 * \brief Check an item's state, whoever is asking (as CanDispense)
+	 * \note Only needed if CanDispense checks the user, it is then only
+	 *       called for a user's rights on top of this
+	 */
+	 int	(*GetStatus)(int ID);
+	/**
+	 * \brief The machine can't tell when a slot is empty, count its stock
+	 */
+	 int	bCountStock;
+	 int	SalesAcct;	//!< COKEBANK_SALES_PREFIX<Name> (set by Dispense_RegisterHandler)
 };
 
 // === GLOBALS ===
 extern tItem	*gaItems;
 extern int	giNumItems;
+extern int	giItems_Version;
 extern tHandler	*gaHandlers[];
 extern int	giNumHandlers;
 extern int	giDebugLevel;
 extern int	gbNoCostMode;
+extern const char	*gsCokebankPath;
 
 // === FUNCTIONS ===
 extern void	Items_UpdateFile(void);
+extern void	Items_MarkChanged(tItem *Item);
+extern int	Items_GetStatus(tItem *Item);
+extern int	Items_GetUserStatus(tItem *Item, int User, int Status);
+extern void	Items_RefreshStatus(void);
+extern int	Items_GetChangeCount(void);
+extern tItem	*Items_GetChange(int Seq);
+extern void	Items_LoadStock(void);
+extern int	Items_AdjustStock(tItem *Item, int Delta);
+extern int	Items_Restock(tItem *Item, int Count);
+extern void	Items_HoldStock(void);
+extern void	Items_ReleaseStock(int bCommit);
 
 // --- Helpers --
 extern void	StartPeriodicThread(void);
@@ -83,6 +113,9 @@ extern int	InitSerial(const char *Path, int BaudRate);
 extern char	*mkstr(const char *Format, ...);
 
 // --- Dispense ---
+extern int	giDispense_RootAcct;
+extern void	Dispense_Initialise(void);
+extern void	Dispense_RegisterHandler(tHandler *Handler);
 extern int	DispenseItem(int ActualUser, int User, tItem *Item);
 extern int	DispenseRefund(int ActualUser, int DestUser, tItem *Item, int OverridePrice);
 extern int	DispenseGive(int ActualUser, int SrcUser, int DestUser, int Ammount, const char *ReasonGiven);
@@ -90,6 +123,51 @@ extern int	DispenseAdd(int ActualUser, int User, int Ammount, const char *Reason
 extern int	DispenseSet(int ActualUser, int User, int Balance, const char *ReasonGiven, int *OrigBalance);
 extern int	DispenseDonate(int ActualUser, int User, int Ammount, const char *ReasonGiven);
 extern int	DispenseUpdateItem(int User, tItem *Item, const char *NewName, int NewPrice);
+extern void	DispenseBatchStart(void);
+extern int	DispenseBatchCount(void);
+extern void	DispenseBatchFinish(int bCommit, int *Results);
+
+// --- Auth workers ---
+extern int	Auth_Initialise(void);
+extern int	Auth_GetNotifyFD(void);
+extern int	Auth_Queue(int ClientID, const char *Salt, const char *Username, const char *Password);
+extern int	Auth_GetResult(int *ClientID, int *AcctID);
+
+// --- Account cache ---
+extern void	AcctCache_Initialise(void);
+extern void	AcctCache_Sync(void);
+extern int	AcctCache_GetAcctByName(const char *Name, int bCreate);
+extern const char	*AcctCache_GetAcctName(int AcctID);
+extern int	AcctCache_GetBalance(int AcctID);
+extern int	AcctCache_GetFlags(int AcctID);
+extern int	AcctCache_SetFlags(int AcctID, int Mask, int Value);
+extern int	AcctCache_CreateAcct(const char *Name);
+extern int	AcctCache_Transfer(int SourceAcct, int DestAcct, int Ammount, int Actor, const char *Reason);
+extern int	AcctCache_CommitHold(int HoldID, int SourceAcct, int DestAcct, int Ammount, int Actor, const char *Reason);
+extern int	AcctCache_CommitTransaction(void);
+extern void	AcctCache_AbortTransaction(void);
+
+// --- PIN attempt limiting ---
+extern int	PinLimit_Check(int AcctID, uint32_t Addr);
+extern void	PinLimit_Failure(int AcctID, uint32_t Addr);
+extern void	PinLimit_Success(int AcctID, uint32_t Addr);
+
+// --- Event stream ---
+extern void	Events_Post(const char *Format, ...);
+extern void	Events_Hold(void);
+extern void	Events_Release(int bCommit);
+extern uint64_t	Events_GetNextSeq(void);
+extern uint64_t	Events_GetFirstSeq(void);
+extern const char	*Events_Get(uint64_t Seq, int *Length);
+
+// --- Sales rollups ---
+extern void	Sales_Initialise(void);
+extern void	Sales_Record(tItem *Item, int Count, int Revenue);
+extern void	Sales_Hold(void);
+extern void	Sales_Release(int bCommit);
+extern void	Sales_Flush(void);
+extern const char	*Sales_GetSeries(int Index);
+extern void	Sales_GetTotals(int Index, time_t From, time_t To, int *Count, int *Revenue);
 
 // --- Logging ---
 // to syslog
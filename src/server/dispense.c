@@ -1,16 +1,70 @@
 /**
  */
 #include "common.h"
+#include "../common/config.h"
 #include <stdlib.h>
+#include <stdio.h>
 #include <limits.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 
  int	_GetMinBalance(int Account);
  int	_CanTransfer(int Source, int Destination, int Ammount);
- int	_Transfer(int Source, int Destination, int Ammount, const char *Reason);
- int	_GetSalesAcct(tItem *Item);
+ int	_Transfer(int Source, int Destination, int Ammount, int Actor, const char *Reason);
+ int	_CommitDispense(int ActualUser, int User, tItem *Item, int Hold, const char *Reason);
+ int	_CommitRefund(int ActualUser, int User, tItem *Item, int Price, const char *Reason);
+void	_LogDispense(int ActualUser, int User, tItem *Item);
+ int	_RecordUnpaid(int ActualUser, int User, tItem *Item);
+
+// === TYPES ===
+typedef struct sDeferredDispense
+{
+	 int	ActualUser;
+	 int	User;
+	tItem	*Item;
+}	tDeferredDispense;
+
+// === GLOBALS ===
+// - Internal accounts (looked up once, by Dispense_Initialise)
+ int	giDispense_RootAcct = -1;
+ int	giDispense_AddSrcAcct = -1;
+ int	giDispense_DebtAcct = -1;
+ int	giDispense_DonateAcct = -1;
+ int	gbDispense_Batching;	// Defer hardware dispenses (see DispenseBatchStart)
+ int	giDispense_NumDeferred;
+ int	giDispense_MaxDeferred;
+tDeferredDispense	*gaDispense_Deferred;
+char	*gsDispense_UnpaidFile;	// Dispenses the bank couldn't charge (see _RecordUnpaid)
 
 // === CODE ===
+/**
+ * \brief Look up the internal accounts (creating them if needed)
+ * \note Called once the bank is up, account IDs don't change after that
+ */
+void Dispense_Initialise(void)
+{
+	giDispense_RootAcct = Bank_GetAcctByName(COKEBANK_ROOT_ACCT, 0);
+	giDispense_AddSrcAcct = Bank_GetAcctByName(COKEBANK_ADDSRC_ACCT, 1);
+	giDispense_DebtAcct = Bank_GetAcctByName(COKEBANK_DEBT_ACCT, 1);
+	giDispense_DonateAcct = Bank_GetAcctByName(COKEBANK_DONATE_ACCT, 1);
+	
+	if( Config_GetValueCount("unpaid_dispense_file") > 0 )
+		gsDispense_UnpaidFile = strdup( Config_GetValue("unpaid_dispense_file", 0) );
+	else
+		gsDispense_UnpaidFile = mkstr("%s.unpaid", gsCokebankPath);
+}
+
+/**
+ * \brief Look up (or create) a handler's sales account
+ */
+void Dispense_RegisterHandler(tHandler *Handler)
+{
+	char	*name = mkstr("%s%s", COKEBANK_SALES_PREFIX, Handler->Name);
+	Handler->SalesAcct = Bank_GetAcctByName(name, 1);
+	free(name);
+}
+
 /**
  * \brief Dispense an item for a user
  * 
@@ -18,13 +72,13 @@
  */
 int DispenseItem(int ActualUser, int User, tItem *Item)
 {
-	 int	ret, salesAcct;
+	 int	ret, salesAcct, hold = -1, bPaid = 1;
 	tHandler	*handler;
-	char	*username, *actualUsername;
+	const char	*username;
 	
 	handler = Item->Handler;
 	
-	salesAcct = _GetSalesAcct(Item);
+	salesAcct = handler->SalesAcct;
 
 	// Check if the user can afford it
 	if( Item->Price && !_CanTransfer(User, salesAcct, Item->Price) )
@@ -36,14 +90,54 @@ int DispenseItem(int ActualUser, int User, tItem *Item)
 	if( strcmp(Item->Name, "dead") == 0 )
 		return 1;
 	
+	// Counted stock ran out (for machines that can't tell)
+	if( Item->Stock == 0 )
+		return 1;
+	
 	// Check if the dispense is possible
 	if( handler->CanDispense ) {
 		ret = handler->CanDispense( User, Item->ID );
 		if(ret)	return 1;	// 1: Unable to dispense
 	}
 	
+	// Batched - charge now, drop once the batch is committed
+	if( gbDispense_Batching )
+	{
+		if( giDispense_NumDeferred == giDispense_MaxDeferred )
+		{
+			 int	newMax = giDispense_MaxDeferred ? giDispense_MaxDeferred * 2 : 8;
+			void	*tmp = realloc(gaDispense_Deferred, newMax * sizeof(tDeferredDispense));
+			if( !tmp )	return -1;
+			gaDispense_Deferred = tmp;
+			giDispense_MaxDeferred = newMax;
+		}
+		if( Item->Price )
+		{
+			char	*reason;
+			reason = mkstr("Dispense - %s:%i %s", handler->Name, Item->ID, Item->Name);
+			ret = _Transfer( User, salesAcct, Item->Price, ActualUser, reason );
+			free(reason);
+			if(ret)	return 2;
+		}
+		Items_AdjustStock(Item, -1);
+		gaDispense_Deferred[giDispense_NumDeferred].ActualUser = ActualUser;
+		gaDispense_Deferred[giDispense_NumDeferred].User = User;
+		gaDispense_Deferred[giDispense_NumDeferred].Item = Item;
+		giDispense_NumDeferred ++;
+		return 0;
+	}
+	
 	// Get username for debugging
-	username = Bank_GetAcctName(User);
+	username = AcctCache_GetAcctName(User);
+	
+	// Set the money aside (the hardware can be slow, and no bank
+	// transaction is kept open while it works)
+	if( Item->Price )
+	{
+		hold = Bank_ReserveFunds(User, Item->Price, _GetMinBalance(User));
+		if( hold == -1 )
+			return 2;
+	}
 	
 	// Actually do the dispense
 	if( handler->DoDispense ) {
@@ -51,42 +145,188 @@ int DispenseItem(int ActualUser, int User, tItem *Item)
 		if(ret) {
 			Log_Error("Dispense failed (%s dispensing %s:%i '%s')",
 				username, Item->Handler->Name, Item->ID, Item->Name);
-			free( username );
+			if( hold != -1 )
+				Bank_ReleaseHold(hold);
 			return -1;	// 1: Unknown Error again
 		}
 	}
 	
-	// Take away money
-	if( Item->Price )
+	// Take away money (and count the stock)
 	{
 		char	*reason;
 		reason = mkstr("Dispense - %s:%i %s", handler->Name, Item->ID, Item->Name);
-		_Transfer( User, salesAcct, Item->Price, reason );
+		// The item has dropped, so retry, then charge without the hold
+		if( _CommitDispense(ActualUser, User, Item, hold, reason)
+		 && _CommitDispense(ActualUser, User, Item, hold, reason) )
+		{
+			Items_AdjustStock(Item, -1);
+			if( hold != -1 )
+			{
+				bPaid = AcctCache_Transfer( User, salesAcct, Item->Price, ActualUser, reason ) == 0;
+				if( bPaid )
+					Bank_ReleaseHold(hold);
+			}
+		}
 		free(reason);
 	}
 	
-	actualUsername = Bank_GetAcctName(ActualUser);
-	
 	// And log that it happened
-	if( gbNoCostMode )
-	{
-		// Special format for zero cost dispenses
-		Log_Info("test dispense '%s' (%s:%i) for %s by %s [no change]",
-			Item->Name, handler->Name, Item->ID,
-			username, actualUsername
-			);
+	if( !bPaid ) {
+		// Don't leave the user's money blocked, the dispense is settled by hand
+		Bank_ReleaseHold(hold);
+		if( _RecordUnpaid(ActualUser, User, Item) == 0 )
+			Log_Error("dispense '%s' (%s:%i) for %s NOT CHARGED (%i, recorded in %s)",
+				Item->Name, handler->Name, Item->ID, username, Item->Price, gsDispense_UnpaidFile);
+		else
+			Log_Error("dispense '%s' (%s:%i) for %s NOT CHARGED (%i, NOT RECORDED)",
+				Item->Name, handler->Name, Item->ID, username, Item->Price);
+		return 0;
 	}
+	_LogDispense(ActualUser, User, Item);
+	Sales_Record(Item, 1, Item->Price);
+	
+	return 0;	// 0: EOK
+}
+
+/**
+ * \brief Take a dispense's held money and count its stock, in one transaction
+ * \param Hold	Hold from Bank_ReserveFunds (-1 for a free item)
+ * \return Boolean failure (nothing is changed)
+ */
+int _CommitDispense(int ActualUser, int User, tItem *Item, int Hold, const char *Reason)
+{
+	 int	ret = 0;
+	
+	if( Bank_StartTransaction() )
+		return 1;
+	Items_HoldStock();
+	
+	if( Hold != -1 )
+		ret = AcctCache_CommitHold( Hold, User, Item->Handler->SalesAcct, Item->Price, ActualUser, Reason );
+	if( ret == 0 )
+		Items_AdjustStock(Item, -1);
+	
+	if( ret == 0 )
+		ret = AcctCache_CommitTransaction();
+	else
+		AcctCache_AbortTransaction();
+	Items_ReleaseStock(ret == 0);
+	return ret;
+}
+
+/**
+ * \brief Give a dispense's money back and return its stock, in one transaction
+ * \return Boolean failure (nothing is changed)
+ * \note Not for use inside a batch (the stock hold isn't nested)
+ */
+int _CommitRefund(int ActualUser, int User, tItem *Item, int Price, const char *Reason)
+{
+	 int	ret = 0;
+	
+	if( Bank_StartTransaction() )
+		return 1;
+	Items_HoldStock();
+	
+	if( Price )
+		ret = AcctCache_Transfer( Item->Handler->SalesAcct, User, Price, ActualUser, Reason );
+	if( ret == 0 )
+		Items_AdjustStock(Item, 1);
+	
+	if( ret == 0 )
+		ret = AcctCache_CommitTransaction();
 	else
+		AcctCache_AbortTransaction();
+	Items_ReleaseStock(ret == 0);
+	return ret;
+}
+
+/**
+ * \brief Append a dispense that couldn't be charged to the unpaid file
+ * \return Boolean failure
+ *
+ * One line per dispense (time, user, actual user, item, price, name), kept
+ * apart from the bank so it survives whatever stopped the charge. The
+ * treasurer settles each line (e.g. with GIVE/ADD) and removes it.
+ */
+int _RecordUnpaid(int ActualUser, int User, tItem *Item)
+{
+	FILE	*fp;
+	 int	ret;
+	
+	fp = fopen(gsDispense_UnpaidFile, "a");
+	if( !fp )
+		return 1;
+	fprintf(fp, "%li\t%s\t%s\t%s:%i\t%i\t%s\n",
+		(long)time(NULL), AcctCache_GetAcctName(User), AcctCache_GetAcctName(ActualUser),
+		Item->Handler->Name, Item->ID, Item->Price, Item->Name);
+	ret = fflush(fp) != 0 || fsync(fileno(fp)) != 0;
+	if( fclose(fp) != 0 )
+		ret = 1;
+	return ret;
+}
+
+/**
+ * \brief Start deferring hardware dispenses
+ *
+ * Used by MULTI/EXEC, DispenseItem still does all checks and takes the
+ * money (so the bank transaction can be rolled back), but the item is
+ * only dropped by DispenseBatchFinish once the transaction is committed.
+ */
+void DispenseBatchStart(void)
+{
+	gbDispense_Batching = 1;
+	giDispense_NumDeferred = 0;
+	Events_Hold();
+	Sales_Hold();
+	Items_HoldStock();
+}
+
+/**
+ * \brief Get the number of dispenses deferred so far in this batch
+ */
+int DispenseBatchCount(void)
+{
+	return giDispense_NumDeferred;
+}
+
+/**
+ * \brief End a batch, dropping the deferred items if \a bCommit is set
+ * \param bCommit	Bank transaction was committed
+ * \param Results	Per-dispense result (0: OK, -1: failed and refunded), can be NULL
+ */
+void DispenseBatchFinish(int bCommit, int *Results)
+{
+	gbDispense_Batching = 0;
+	Events_Release(bCommit);
+	Sales_Release(bCommit);
+	Items_ReleaseStock(bCommit);
+	
+	for( int i = 0; bCommit && i < giDispense_NumDeferred; i ++ )
 	{
-		Log_Info("dispense '%s' (%s:%i) for %s by %s [cost %i, balance %i]",
-			Item->Name, handler->Name, Item->ID,
-			username, actualUsername, Item->Price, Bank_GetBalance(User)
-			);
+		tDeferredDispense	*dd = &gaDispense_Deferred[i];
+		tHandler	*handler = dd->Item->Handler;
+		 int	ret = 0;
+		
+		if( handler->DoDispense )
+			ret = handler->DoDispense( dd->User, dd->Item->ID );
+		if( Results )
+			Results[i] = ret ? -1 : 0;
+		if( ret == 0 ) {
+			_LogDispense(dd->ActualUser, dd->User, dd->Item);
+			Sales_Record(dd->Item, 1, dd->Item->Price);
+			continue ;
+		}
+		
+		// Drop failed, give the money back
+		{
+			const char	*username = AcctCache_GetAcctName(dd->User);
+			Log_Error("Dispense failed (%s dispensing %s:%i '%s'), refunded",
+				username, handler->Name, dd->Item->ID, dd->Item->Name);
+		}
+		_CommitRefund( dd->ActualUser, dd->User, dd->Item, dd->Item->Price, "Dispense failed - refund" );
 	}
 	
-	free( username );
-	free( actualUsername );
-	return 0;	// 0: EOK
+	giDispense_NumDeferred = 0;
 }
 
 /**
@@ -96,28 +336,39 @@ int DispenseRefund(int ActualUser, int DestUser, tItem *Item, int OverridePrice)
 {
 	 int	ret;
 	 int	src_acct, price;
-	char	*username, *actualUsername;
+	const char	*username, *actualUsername;
 
-	src_acct = _GetSalesAcct(Item);
+	src_acct = Item->Handler->SalesAcct;
 
 	if( OverridePrice > 0 )
 		price = OverridePrice;
 	else
 		price = Item->Price;
 
-	ret = _Transfer( src_acct, DestUser, price, "Refund");
+	if( !_CanTransfer(src_acct, DestUser, price) )
+		return 1;
+	if( gbDispense_Batching ) {
+		// The batch's transaction (and stock hold) covers both
+		ret = AcctCache_Transfer( src_acct, DestUser, price, ActualUser, "Refund" );
+		if( ret == 0 )
+			Items_AdjustStock(Item, 1);
+	}
+	else
+		ret = _CommitRefund( ActualUser, DestUser, Item, price, "Refund" );
 	if(ret)	return ret;
+	Sales_Record(Item, -1, -price);
 
-	username = Bank_GetAcctName(DestUser);
-	actualUsername = Bank_GetAcctName(ActualUser);
+	username = AcctCache_GetAcctName(DestUser);
+	actualUsername = AcctCache_GetAcctName(ActualUser);
 	
 	Log_Info("refund '%s' (%s:%i) to %s by %s [cost %i, balance %i]",
 		Item->Name, Item->Handler->Name, Item->ID,
-		username, actualUsername, price, Bank_GetBalance(DestUser)
+		username, actualUsername, price, AcctCache_GetBalance(DestUser)
+		);
+	Events_Post("refund %s:%i %s %s %i %i %s",
+		Item->Handler->Name, Item->ID, username, actualUsername,
+		price, AcctCache_GetBalance(DestUser), Item->Name
 		);
-
-	free(username);
-	free(actualUsername);
 
 	return 0;
 }
@@ -128,8 +379,8 @@ int DispenseRefund(int ActualUser, int DestUser, tItem *Item, int OverridePrice)
 int DispenseGive(int ActualUser, int SrcUser, int DestUser, int Ammount, const char *ReasonGiven)
 {
 	 int	ret;
-	char	*actualUsername;
-	char	*srcName, *dstName;
+	const char	*actualUsername;
+	const char	*srcName, *dstName;
 	
 	// HACK: Naming a slot "dead" disables it (catch for snack)
 	if( strcmp(ReasonGiven, "dead") == 0 )
@@ -137,23 +388,24 @@ int DispenseGive(int ActualUser, int SrcUser, int DestUser, int Ammount, const c
 	
 	if( Ammount < 0 )	return 1;	// Um... negative give? Not on my watch!
 	
-	ret = _Transfer( SrcUser, DestUser, Ammount, ReasonGiven );
+	ret = _Transfer( SrcUser, DestUser, Ammount, ActualUser, ReasonGiven );
 	if(ret)	return 2;	// No Balance
 	
 	
-	actualUsername = Bank_GetAcctName(ActualUser);
-	srcName = Bank_GetAcctName(SrcUser);
-	dstName = Bank_GetAcctName(DestUser);
+	actualUsername = AcctCache_GetAcctName(ActualUser);
+	srcName = AcctCache_GetAcctName(SrcUser);
+	dstName = AcctCache_GetAcctName(DestUser);
 	
 	Log_Info("give %i from %s to %s by %s [balances %i, %i] - %s",
 		Ammount, srcName, dstName, actualUsername,
-		Bank_GetBalance(SrcUser), Bank_GetBalance(DestUser),
+		AcctCache_GetBalance(SrcUser), AcctCache_GetBalance(DestUser),
+		ReasonGiven
+		);
+	Events_Post("give %s %s %s %i %i %i %s",
+		srcName, dstName, actualUsername, Ammount,
+		AcctCache_GetBalance(SrcUser), AcctCache_GetBalance(DestUser),
 		ReasonGiven
 		);
-	
-	free(srcName);
-	free(dstName);
-	free(actualUsername);
 	
 	return 0;
 }
@@ -172,7 +424,7 @@ int DispenseTransfer(int ActualUser, int SrcUser, int DestUser, int Ammount, con
 	if( !(Bank_GetFlags(ActualUser) & USER_FLAG_ADMIN) )
 		return 1;
 	
-	ret = _Transfer( SrcUser, DestUser, Ammount, ReasonGiven );
+	ret = _Transfer( SrcUser, DestUser, Ammount, ActualUser, ReasonGiven );
 	if(ret)	return 2;	// No Balance
 	
 	
@@ -200,45 +452,46 @@ int DispenseTransfer(int ActualUser, int SrcUser, int DestUser, int Ammount, con
 int DispenseAdd(int ActualUser, int User, int Ammount, const char *ReasonGiven)
 {
 	 int	ret;
-	char	*dstName, *byName;
+	const char	*dstName, *byName;
 	
 #if DISPENSE_ADD_BELOW_MIN
-	ret = _Transfer( Bank_GetAcctByName(COKEBANK_ADDSRC_ACCT,1), User, Ammount, ReasonGiven );
+	ret = _Transfer( giDispense_AddSrcAcct, User, Ammount, ActualUser, ReasonGiven );
 #else
-	ret = Bank_Transfer( Bank_GetAcctByName(COKEBANK_ADDSRC_ACCT,1), User, Ammount, ReasonGiven );
+	ret = AcctCache_Transfer( giDispense_AddSrcAcct, User, Ammount, ActualUser, ReasonGiven );
 #endif
 	if(ret)	return 2;
 	
-	byName = Bank_GetAcctName(ActualUser);
-	dstName = Bank_GetAcctName(User);
+	byName = AcctCache_GetAcctName(ActualUser);
+	dstName = AcctCache_GetAcctName(User);
 	
 	Log_Info("add %i to %s by %s [balance %i] - %s",
-		Ammount, dstName, byName, Bank_GetBalance(User), ReasonGiven
+		Ammount, dstName, byName, AcctCache_GetBalance(User), ReasonGiven
+		);
+	Events_Post("add %s %s %i %i %s",
+		dstName, byName, Ammount, AcctCache_GetBalance(User), ReasonGiven
 		);
-	
-	free(byName);
-	free(dstName);
 	
 	return 0;
 }
 
 int DispenseSet(int ActualUser, int User, int Balance, const char *ReasonGiven, int *OrigBalance)
 {
-	 int	curBal = Bank_GetBalance(User);
-	char	*byName, *dstName;
+	 int	curBal = AcctCache_GetBalance(User);
+	const char	*byName, *dstName;
 	
-	_Transfer( Bank_GetAcctByName(COKEBANK_DEBT_ACCT,1), User, Balance-curBal, ReasonGiven );
+	_Transfer( giDispense_DebtAcct, User, Balance-curBal, ActualUser, ReasonGiven );
 	
-	byName = Bank_GetAcctName(ActualUser);
-	dstName = Bank_GetAcctName(User);
+	byName = AcctCache_GetAcctName(ActualUser);
+	dstName = AcctCache_GetAcctName(User);
 	
 	Log_Info("set balance of %s to %i by %s [was %i, balance %i] - %s",
-		dstName, Balance, byName, curBal, Bank_GetBalance(User), ReasonGiven
+		dstName, Balance, byName, curBal, AcctCache_GetBalance(User), ReasonGiven
+		);
+	Events_Post("set %s %s %i %i %s",
+		dstName, byName, curBal, AcctCache_GetBalance(User), ReasonGiven
 		);
 	
 	*OrigBalance = curBal;
-	free(byName);
-	free(dstName);
 	
 	return 0;
 }
@@ -249,29 +502,29 @@ int DispenseSet(int ActualUser, int User, int Balance, const char *ReasonGiven,
 int DispenseDonate(int ActualUser, int User, int Ammount, const char *ReasonGiven)
 {
 	 int	ret;
-	char	*srcName, *byName;
+	const char	*srcName, *byName;
 	
 	if( Ammount < 0 )	return 2;
 	
-	ret = _Transfer( User, Bank_GetAcctByName(COKEBANK_DONATE_ACCT,1), Ammount, ReasonGiven );
+	ret = _Transfer( User, giDispense_DonateAcct, Ammount, ActualUser, ReasonGiven );
 	if(ret)	return 2;
 	
-	byName = Bank_GetAcctName(ActualUser);
-	srcName = Bank_GetAcctName(User);
+	byName = AcctCache_GetAcctName(ActualUser);
+	srcName = AcctCache_GetAcctName(User);
 	
 	Log_Info("donate %i from %s by %s [balance %i] - %s",
-		Ammount, srcName, byName, Bank_GetBalance(User), ReasonGiven
+		Ammount, srcName, byName, AcctCache_GetBalance(User), ReasonGiven
+		);
+	Events_Post("donate %s %s %i %i %s",
+		srcName, byName, Ammount, AcctCache_GetBalance(User), ReasonGiven
 		);
-	
-	free(byName);
-	free(srcName);
 	
 	return 0;
 }
 
 int DispenseUpdateItem(int User, tItem *Item, const char *NewName, int NewPrice)
 {
-	char	*username;
+	const char	*username;
 	
 	// Sanity checks
 	if( NewPrice < 0 )	return 2;
@@ -282,15 +535,18 @@ int DispenseUpdateItem(int User, tItem *Item, const char *NewName, int NewPrice)
 	free(Item->Name);
 	Item->Name = strdup(NewName);
 	Item->Price = NewPrice;
+	Items_MarkChanged(Item);
 	
-	username = Bank_GetAcctName(User);
+	username = AcctCache_GetAcctName(User);
 	
 	Log_Info("item %s:%i updated to '%s' %i by %s",
 		Item->Handler->Name, Item->ID,
 		NewName, NewPrice, username
 		);
+	Events_Post("item %s:%i %s %i %s",
+		Item->Handler->Name, Item->ID, username, NewPrice, NewName
+		);
 	
-	free(username);
 	
 	// Update item file
 	Items_UpdateFile();
@@ -301,20 +557,13 @@ int DispenseUpdateItem(int User, tItem *Item, const char *NewName, int NewPrice)
 // --- Internal Functions ---
 int _GetMinBalance(int Account)
 {
-	 int	flags = Bank_GetFlags(Account);
+	 int	flags = AcctCache_GetFlags(Account);
 	
 	// Evil little piece of HACK:
 	// root's balance cannot be changed by any of the above functions
 	// - Stops dispenses as root by returning insufficent balance.
-	{
-		char	*username = Bank_GetAcctName(Account);
-		if( strcmp(username, "root") == 0 )
-		{
-			free(username);
-			return INT_MAX;
-		}
-		free(username);
-	}
+	if( Account == giDispense_RootAcct )
+		return INT_MAX;
 	
 	// - Internal accounts have no lower bound
 	if( flags & USER_FLAG_INTERNAL )	return INT_MIN;
@@ -339,28 +588,51 @@ int _CanTransfer(int Source, int Destination, int Ammount)
 //		return 0;
 	if( Ammount > 0 )
 	{
-		if( Bank_GetBalance(Source) - Ammount < _GetMinBalance(Source) )
+		// Money held for a dispense in progress can't be spent
+		if( (long long)AcctCache_GetBalance(Source) - Bank_GetHeldFunds(Source) - Ammount < _GetMinBalance(Source) )
 			return 0;
 	}
 	else
 	{
-		if( Bank_GetBalance(Destination) + Ammount < _GetMinBalance(Destination) )
+		if( AcctCache_GetBalance(Destination) + Ammount < _GetMinBalance(Destination) )
 			return 0;
 	}
 	return 1;
 }
 
-int _Transfer(int Source, int Destination, int Ammount, const char *Reason)
+int _Transfer(int Source, int Destination, int Ammount, int Actor, const char *Reason)
 {
 	if( !_CanTransfer(Source, Destination, Ammount) )
 		return 1;
-	return Bank_Transfer(Source, Destination, Ammount, Reason);
+	return AcctCache_Transfer(Source, Destination, Ammount, Actor, Reason);
 }
 
-int _GetSalesAcct(tItem *Item)
+void _LogDispense(int ActualUser, int User, tItem *Item)
 {
-	char string[sizeof(COKEBANK_SALES_PREFIX)+strlen(Item->Handler->Name)];
-	strcpy(string, COKEBANK_SALES_PREFIX);
-	strcat(string, Item->Handler->Name);
-	return Bank_GetAcctByName(string, 1);
+	const char	*username = AcctCache_GetAcctName(User);
+	const char	*actualUsername = AcctCache_GetAcctName(ActualUser);
+	
+	if( gbNoCostMode )
+	{
+		// Special format for zero cost dispenses
+		Log_Info("test dispense '%s' (%s:%i) for %s by %s [no change]",
+			Item->Name, Item->Handler->Name, Item->ID,
+			username, actualUsername
+			);
+	}
+	else
+	{
+		Log_Info("dispense '%s' (%s:%i) for %s by %s [cost %i, balance %i]",
+			Item->Name, Item->Handler->Name, Item->ID,
+			username, actualUsername, Item->Price, AcctCache_GetBalance(User)
+			);
+	}
+	
+	if( strcmp(Item->Handler->Name, "door") == 0 )
+		Events_Post("door %s %s", username, actualUsername);
+	else
+		Events_Post("dispense %s:%i %s %s %i %i %s",
+			Item->Handler->Name, Item->ID, username, actualUsername,
+			gbNoCostMode ? 0 : Item->Price, AcctCache_GetBalance(User), Item->Name
+			);
 }
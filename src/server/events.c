@@ -0,0 +1,149 @@
+/*
+ * OpenDispense 2
+ * UCC (University [of WA] Computer Club) Electronic Accounting System
+ *
+ * events.c - Structured event log for SUBSCRIBE EVENTS
+ * > Each event is formatted once into a fixed ring. Subscribers only keep
+ *   the seq of the next event they need, so a slow subscriber costs nothing
+ *   when an event is posted. One that falls more than EVENT_RING_SIZE
+ *   behind loses the oldest events (and is told how many).
+ * > While a bank transaction is open (see Events_Hold) events are kept
+ *   aside, and only posted if it commits.
+ *
+ * This file is licenced under the 3-clause BSD Licence. See the file
+ * COPYING for full details.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <time.h>
+#include "common.h"
+
+#define EVENT_RING_SIZE	256	// Events kept for subscribers (power of two)
+#define MAX_HELD_EVENTS	64	// Events kept aside during a transaction
+
+// === PROTOTYPES ===
+void	Events_Post(const char *Format, ...);
+void	Events_Hold(void);
+void	Events_Release(int bCommit);
+uint64_t	Events_GetNextSeq(void);
+uint64_t	Events_GetFirstSeq(void);
+const char	*Events_Get(uint64_t Seq, int *Length);
+static void	Events_int_Append(char *Line, int Length);
+
+// === GLOBALS ===
+char	*gaEvents_Ring[EVENT_RING_SIZE];
+ int	gaEvents_RingLen[EVENT_RING_SIZE];
+uint64_t	giEvents_NextSeq = 1;	// Seq of the next event posted
+ int	gbEvents_Holding;
+ int	giEvents_NumHeld;
+char	*gaEvents_Held[MAX_HELD_EVENTS];
+
+// === CODE ===
+/**
+ * \brief Post an event to subscribers
+ * \param Format	Event type and fields (e.g. "give %s %s ...")
+ *
+ * The line sent is "100 Event <seq> <unix_timestamp> <type> <fields>"
+ */
+void Events_Post(const char *Format, ...)
+{
+	va_list	args;
+	char	*body, *line;
+	 int	len;
+
+	va_start(args, Format);
+	len = vsnprintf(NULL, 0, Format, args);
+	va_end(args);
+	if( len < 0 )	return ;
+	body = malloc(len + 1);
+	if( !body )	return ;
+	va_start(args, Format);
+	vsnprintf(body, len + 1, Format, args);
+	va_end(args);
+
+	if( gbEvents_Holding )
+	{
+		if( giEvents_NumHeld == MAX_HELD_EVENTS ) {
+			Log_Error("Event dropped (too many in one transaction): %s", body);
+			free(body);
+			return ;
+		}
+		gaEvents_Held[giEvents_NumHeld++] = body;
+		return ;
+	}
+
+	line = mkstr("100 Event %"PRIu64" %lli %s\n", giEvents_NextSeq, (long long)time(NULL), body);
+	free(body);
+	if( line )
+		Events_int_Append(line, strlen(line));
+}
+
+/**
+ * \brief Keep events aside until Events_Release (bank transaction started)
+ */
+void Events_Hold(void)
+{
+	gbEvents_Holding = 1;
+}
+
+/**
+ * \brief Post (or throw away) the events kept since Events_Hold
+ * \param bCommit	Transaction was committed
+ */
+void Events_Release(int bCommit)
+{
+	gbEvents_Holding = 0;
+	for( int i = 0; i < giEvents_NumHeld; i ++ )
+	{
+		if( bCommit )
+			Events_Post("%s", gaEvents_Held[i]);
+		free(gaEvents_Held[i]);
+	}
+	giEvents_NumHeld = 0;
+}
+
+/**
+ * \brief Seq the next event will get (subscribers are up to date at this)
+ */
+uint64_t Events_GetNextSeq(void)
+{
+	return giEvents_NextSeq;
+}
+
+/**
+ * \brief Oldest event still in the ring
+ */
+uint64_t Events_GetFirstSeq(void)
+{
+	if( giEvents_NextSeq <= EVENT_RING_SIZE )
+		return 1;
+	return giEvents_NextSeq - EVENT_RING_SIZE;
+}
+
+/**
+ * \brief Get a formatted event line
+ * \return Line (owned by the ring), or NULL if it has been overwritten
+ */
+const char *Events_Get(uint64_t Seq, int *Length)
+{
+	 int	slot = Seq & (EVENT_RING_SIZE - 1);
+
+	if( Seq < Events_GetFirstSeq() || Seq >= giEvents_NextSeq )
+		return NULL;
+	*Length = gaEvents_RingLen[slot];
+	return gaEvents_Ring[slot];
+}
+
+static void Events_int_Append(char *Line, int Length)
+{
+	 int	slot = giEvents_NextSeq & (EVENT_RING_SIZE - 1);
+
+	free(gaEvents_Ring[slot]);
+	gaEvents_Ring[slot] = Line;
+	gaEvents_RingLen[slot] = Length;
+	giEvents_NextSeq ++;
+}
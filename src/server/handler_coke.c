@@ -43,10 +43,10 @@ static int	_WriteBit(int BitNum, uint8_t Value);
 
 // === GLOBALS ===
 tHandler	gCoke_Handler = {
-	"coke",
-	Coke_InitHandler,
-	Coke_CanDispense,
-	Coke_DoDispense
+	.Name = "coke",
+	.Init = Coke_InitHandler,
+	.CanDispense = Coke_CanDispense,
+	.DoDispense = Coke_DoDispense
 };
 const char	*gsCoke_ModbusAddress = "130.95.13.73";
  int		giCoke_ModbusPort = 502;
@@ -1,16 +1,25 @@
 /*
- * OpenDispense 2 
+ * OpenDispense 2
  * UCC (University [of WA] Computer Club) Electronic Accounting System
  *
  * handler_door.c - Door Relay code
+ * > The relay port is opened once and kept open (reopened if a write
+ *   fails). A door thread owns it, and runs a small state machine woken
+ *   by unlock requests (an eventfd) and a timerfd.
+ * > An unlock while the door is already unlocked just restarts the timer,
+ *   so quick dispenses keep the door open instead of queueing cycles.
+ * > If the port is lost, the door is reported as an error (item status),
+ *   and the thread keeps trying to reopen it (and lock the door).
  *
  * This file is licenced under the 3-clause BSD Licence. See the file
  * COPYING for full details.
  */
-#define	DEBUG	1
+#define	DEBUG	0
 
 #include "common.h"
+#include "../common/config.h"
 #include <stdio.h>
+#include <stdint.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/stat.h>
@@ -18,12 +27,22 @@
 #include <signal.h>
 #include <unistd.h>
 #include <pty.h>
+#include <poll.h>
 #include <pthread.h>
-#include <semaphore.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
 #include <errno.h>
-#include <stdbool.h>
 
-#define DOOR_UNLOCKED_DELAY	10	// Time in seconds before the door re-locks
+#define DEF_DOOR_UNLOCKED_DELAY	10	// Time in seconds before the door re-locks (door_unlocked_delay)
+#define DOOR_RECONNECT_DELAY	5	// Time in seconds between attempts to reopen the relay port
+
+// === TYPES ===
+enum eDoorStates
+{
+	DOOR_LOCKED,	// Relay off
+	DOOR_UNLOCKED,	// Relay on, locks when the timer fires
+	DOOR_OFFLINE	// Port lost, retried when the timer fires (then locked)
+};
 
 // === IMPORTS ===
 
@@ -32,65 +51,94 @@ void*	Door_Lock(void* Unused);
  int	Door_InitHandler();
  int	Door_CanDispense(int User, int Item);
  int	Door_DoDispense(int User, int Item);
+ int	Door_GetStatus(int Item);
+static void	Door_int_CreateThread(void);
+static void	Door_int_StartThread(void);
+static void	Door_int_HandleUnlock(void);
+static void	Door_int_HandleTimer(void);
+static int	Door_int_SetRelay(int bOn);
+static void	Door_int_SetTimer(int Seconds);
 
 // === GLOBALS ===
 tHandler	gDoor_Handler = {
-	"door",
-	Door_InitHandler,
-	Door_CanDispense,
-	Door_DoDispense
+	.Name = "door",
+	.Init = Door_InitHandler,
+	.CanDispense = Door_CanDispense,
+	.DoDispense = Door_DoDispense,
+	.GetStatus = Door_GetStatus
 };
 char	*gsDoor_SerialPort;	// Set from config in main.c
-sem_t	gDoor_UnlockSemaphore;
+ int	giDoor_UnlockedDelay = DEF_DOOR_UNLOCKED_DELAY;
+ int	giDoor_SerialFD = -1;	// Owned by the door thread once it has started
+ int	giDoor_WakeFD = -1;	// eventfd, counts unlock requests
+ int	giDoor_TimerFD = -1;
+ int	giDoor_State = DOOR_OFFLINE;	// Only changed by the door thread (after Door_InitHandler)
 pthread_t	gDoor_LockThread;
-bool	gbDoor_LockThreadStarted;
+pthread_once_t	gDoor_LockThreadOnce = PTHREAD_ONCE_INIT;
 
 // === CODE ===
+/**
+ * \brief Door thread, runs the state machine
+ */
 void* Door_Lock(void* Unused __attribute__((unused)))
 {
-	while(1)
-	{
-		sem_wait(&gDoor_UnlockSemaphore);
-
-		int door_serial_handle = InitSerial(gsDoor_SerialPort, 9600);
-		if(door_serial_handle < 0)
-		{
-			fprintf(stderr, "Unable to open door serial '%s'\n", gsDoor_SerialPort);
-			perror("Opening door port");
-		}
-
-		// Disable local echo
-		{
-			struct termios	info;
-			tcgetattr(door_serial_handle, &info);
-			info.c_cflag &= ~CLOCAL;
-			tcsetattr(door_serial_handle, TCSANOW, &info);
-		}
-
-		if(write(door_serial_handle, "\xff\x01\x01", 3) != 3)	// Relay ON
-		{
-			fprintf(stderr, "Failed to write Relay ON (unlock) command, errstr: %s", strerror(errno));
-		}
+	struct pollfd	fds[2];
 
-		sleep(DOOR_UNLOCKED_DELAY);
+	// Catch up on a reconnect set up before the thread was started
+	if( giDoor_State == DOOR_OFFLINE )
+		Door_int_SetTimer(DOOR_RECONNECT_DELAY);
 
-		if(write(door_serial_handle, "\xff\x01\x00", 3) != 3)	// Relay OFF
+	fds[0].fd = giDoor_WakeFD;
+	fds[0].events = POLLIN;
+	fds[1].fd = giDoor_TimerFD;
+	fds[1].events = POLLIN;
+	for( ;; )
+	{
+		if( poll(fds, 2, -1) < 0 )
 		{
-			fprintf(stderr, "Failed to write Relay OFF (lock) command, errstr: %s", strerror(errno));
+			if( errno == EINTR )	continue;
+			perror("Door_Lock - poll");
+			sleep(1);
+			continue;
 		}
 
-		close(door_serial_handle);
+		if( fds[0].revents & POLLIN )
+			Door_int_HandleUnlock();
+		if( fds[1].revents & POLLIN )
+			Door_int_HandleTimer();
 	}
+	return NULL;
 }
 
 int Door_InitHandler(void)
 {
-	// Thread started later
+	if( Config_GetValueCount("door_unlocked_delay") > 0 )
+	{
+		giDoor_UnlockedDelay = Config_GetValue_Int("door_unlocked_delay", 0);
+		if( giDoor_UnlockedDelay <= 0 )
+			giDoor_UnlockedDelay = DEF_DOOR_UNLOCKED_DELAY;
+	}
+
+	// Opened before the server forks (the thread is started later)
+	giDoor_WakeFD = eventfd(0, EFD_NONBLOCK);
+	giDoor_TimerFD = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+	if( giDoor_WakeFD == -1 || giDoor_TimerFD == -1 )
+	{
+		perror("Door_InitHandler - eventfd/timerfd");
+		return 1;
+	}
+
+	// Start locked
+	if( Door_int_SetRelay(0) == 0 )
+		giDoor_State = DOOR_LOCKED;
 
 	return 0;
 }
 
 /**
+ * \brief Check if the door can be opened
+ * \param User	User opening it
+ * \return 0 if it can, 1 if the user isn't allowed, -1 if the relay can't be reached
  */
 int Door_CanDispense(int User, int Item)
 {
@@ -99,55 +147,61 @@ int Door_CanDispense(int User, int Item)
 	#endif
 	// Sanity please
 	if( Item != 0 )	return -1;
-	
-	if( !(Bank_GetFlags(User) & (USER_FLAG_DOORGROUP|USER_FLAG_ADMIN)) )
+
+	// Door thread spun up here because program is forked after init
+	// (it also keeps retrying an offline port)
+	Door_int_StartThread();
+
+	if( !(AcctCache_GetFlags(User) & (USER_FLAG_DOORGROUP|USER_FLAG_ADMIN)) )
 	{
 		#if DEBUG
 		printf("Door_CanDispense: User %i not in door\n", User);
 		#endif
 		return 1;
 	}
-	
+
+	if( giDoor_State == DOOR_OFFLINE )
+		return -1;
+
 	#if DEBUG
 	printf("Door_CanDispense: User %i can open the door\n", User);
 	#endif
-	
+
 	return 0;
 }
 
 /**
- * \brief Actually do a dispense from the coke machine
+ * \brief Ask for the door to be unlocked (or kept unlocked for longer)
+ * \note Returns straight away, the door thread works the relay
  */
 int Door_DoDispense(int User, int Item)
-{	
+{
+	uint64_t	one = 1;
+
 	#if DEBUG
 	printf("Door_DoDispense: (User=%i,Item=%i)\n", User, Item);
 	#endif
 
 	// Sanity please
 	if( Item != 0 )	return -1;
-	
+
 	// Check if user is in door
-	if( !(Bank_GetFlags(User) & (USER_FLAG_DOORGROUP|USER_FLAG_ADMIN)) )
+	if( !(AcctCache_GetFlags(User) & (USER_FLAG_DOORGROUP|USER_FLAG_ADMIN)) )
 	{
 		#if DEBUG
 		printf("Door_CanDispense: User %i not in door\n", User);
 		#endif
 		return 1;
 	}
-	
-	// Door thread spun up here because program is forked after thread created
-	if( !gbDoor_LockThreadStarted )
-	{
-		// Initialize semaphore, triggers door lock release if semaphore is greater than 0
-		sem_init(&gDoor_UnlockSemaphore, 0, 0);	
 
-		pthread_create(&gDoor_LockThread, NULL, &Door_Lock, NULL);
-	}
+	Door_int_StartThread();
+
+	if( giDoor_State == DOOR_OFFLINE )
+		return -1;
 
-	if(sem_post(&gDoor_UnlockSemaphore))
+	if( write(giDoor_WakeFD, &one, sizeof(one)) != sizeof(one) )
 	{
-		perror("Failed to post \"Unlock Door\" semaphore, sem_post returned");
+		perror("Failed to post \"Unlock Door\" request, write returned");
 		return -1;
 	}
 
@@ -157,3 +211,137 @@ int Door_DoDispense(int User, int Item)
 
 	return 0;
 }
+
+/**
+ * \brief Check if the relay can be reached (whoever is asking)
+ * \return 0 if it can, -1 if not
+ */
+int Door_GetStatus(int Item)
+{
+	if( Item != 0 )	return -1;
+
+	Door_int_StartThread();
+
+	return giDoor_State == DOOR_OFFLINE ? -1 : 0;
+}
+
+static void Door_int_CreateThread(void)
+{
+	if( pthread_create(&gDoor_LockThread, NULL, &Door_Lock, NULL) )
+		perror("Door - pthread_create");
+}
+
+static void Door_int_StartThread(void)
+{
+	pthread_once(&gDoor_LockThreadOnce, Door_int_CreateThread);
+}
+
+/**
+ * \brief Unlock requests came in (any number, they are all the same)
+ */
+static void Door_int_HandleUnlock(void)
+{
+	uint64_t	count;
+
+	if( read(giDoor_WakeFD, &count, sizeof(count)) != sizeof(count) )
+		return ;
+
+	switch( giDoor_State )
+	{
+	case DOOR_UNLOCKED:
+		// Already open, just keep it open for longer
+		break;
+	case DOOR_LOCKED:
+		if( Door_int_SetRelay(1) ) {
+			Log_Error("Door relay port '%s' lost, door not unlocked", gsDoor_SerialPort);
+			giDoor_State = DOOR_OFFLINE;
+			Door_int_SetTimer(DOOR_RECONNECT_DELAY);
+			return ;
+		}
+		giDoor_State = DOOR_UNLOCKED;
+		break;
+	case DOOR_OFFLINE:
+		// Left for the reconnect timer
+		return ;
+	}
+	Door_int_SetTimer(giDoor_UnlockedDelay);
+}
+
+/**
+ * \brief Timer fired, lock the door (or retry an offline port)
+ */
+static void Door_int_HandleTimer(void)
+{
+	uint64_t	expirations;
+
+	if( read(giDoor_TimerFD, &expirations, sizeof(expirations)) != sizeof(expirations) )
+		return ;
+
+	switch( giDoor_State )
+	{
+	case DOOR_LOCKED:
+		break;
+	case DOOR_UNLOCKED:
+	case DOOR_OFFLINE:
+		if( Door_int_SetRelay(0) ) {
+			if( giDoor_State != DOOR_OFFLINE )
+				Log_Error("Door relay port '%s' lost, door may not be locked", gsDoor_SerialPort);
+			giDoor_State = DOOR_OFFLINE;
+			Door_int_SetTimer(DOOR_RECONNECT_DELAY);
+			break;
+		}
+		if( giDoor_State == DOOR_OFFLINE )
+			Log_Info("Door relay port '%s' back, door locked", gsDoor_SerialPort);
+		giDoor_State = DOOR_LOCKED;
+		break;
+	}
+}
+
+/**
+ * \brief Switch the relay, (re)opening the port if needed
+ * \return Boolean failure
+ */
+static int Door_int_SetRelay(int bOn)
+{
+	const char	*cmd = bOn ? "\xff\x01\x01" : "\xff\x01\x00";
+
+	// One retry, in case the port was unplugged and is back
+	for( int tries = 0; tries < 2; tries ++ )
+	{
+		if( giDoor_SerialFD == -1 )
+		{
+			if( !gsDoor_SerialPort )
+				return 1;
+			giDoor_SerialFD = InitSerial(gsDoor_SerialPort, 9600);
+			if( giDoor_SerialFD == -1 )
+				return 1;
+
+			// Enable modem control lines
+			{
+				struct termios	info;
+				tcgetattr(giDoor_SerialFD, &info);
+				info.c_cflag &= ~CLOCAL;
+				tcsetattr(giDoor_SerialFD, TCSANOW, &info);
+			}
+		}
+
+		if( write(giDoor_SerialFD, cmd, 3) == 3 )
+			return 0;
+
+		fprintf(stderr, "Failed to write Relay %s command, errstr: %s\n",
+			bOn ? "ON (unlock)" : "OFF (lock)", strerror(errno));
+		close(giDoor_SerialFD);
+		giDoor_SerialFD = -1;
+	}
+	return 1;
+}
+
+/**
+ * \brief (Re)start the timer, replacing any time left
+ */
+static void Door_int_SetTimer(int Seconds)
+{
+	struct itimerspec	spec = {.it_value = {.tv_sec = Seconds}};
+	if( timerfd_settime(giDoor_TimerFD, 0, &spec, NULL) )
+		perror("Door - timerfd_settime");
+}
@@ -25,10 +25,11 @@
 
 // === GLOBALS ===
 tHandler	gSnack_Handler = {
-	"snack",
-	Snack_InitHandler,
-	Snack_CanDispense,
-	Snack_DoDispense
+	.Name = "snack",
+	.Init = Snack_InitHandler,
+	.CanDispense = Snack_CanDispense,
+	.DoDispense = Snack_DoDispense,
+	.bCountStock = 1	// Slots can't be sensed
 };
 char	*gsSnack_SerialPort = "/dev/ttyS1";
 #if 0
@@ -55,7 +56,8 @@ int Snack_CanDispense(int UNUSED(User), int Item)
 	// Sanity please
 	if( Item < 0 || Item > 99 )	return -1;
 	
-	// Hmm... could we implement slot statuses?
+	// Slots can't be sensed, empty ones are found by the stock count
+	// (bCountStock, checked before this is called)
 	
 	return 0;
 }
@@ -15,8 +15,11 @@
 #include <regex.h>
 #include <sys/stat.h>
 #include <time.h>
+#include <pthread.h>
 
 #define DUMP_ITEMS	0
+#define ITEM_CHANGELOG_SIZE	64	// Changes kept for WATCH_ITEMS fan-out
+#define MAX_HELD_STOCK	64	// Stock changes kept to undo during a transaction
 
 // === IMPORTS ===
 extern tHandler	gCoke_Handler;
@@ -27,13 +30,41 @@ extern tHandler	gDoor_Handler;
 void	Init_Handlers(void);
 void	Load_Itemlist(void);
 void	Items_ReadFromFile(void);
+void	Items_MarkChanged(tItem *Item);
+ int	Items_GetStatus(tItem *Item);
+ int	Items_GetUserStatus(tItem *Item, int User, int Status);
+static int	Items_int_MapStatus(int CanDispenseRet);
+void	Items_RefreshStatus(void);
+ int	Items_GetChangeCount(void);
+tItem	*Items_GetChange(int Seq);
+void	Items_LoadStock(void);
+ int	Items_AdjustStock(tItem *Item, int Delta);
+ int	Items_Restock(tItem *Item, int Count);
+void	Items_HoldStock(void);
+void	Items_ReleaseStock(int bCommit);
+static int	Items_int_NoteStock(tItem *Item, int NewStock);
 char	*trim(char *__str);
 
 // === GLOBALS ===
  int	giNumItems = 0;
 tItem	*gaItems = NULL;
 time_t	gItems_LastUpdated;
-tHandler	gPseudo_Handler = {.Name="pseudo"};
+ int	giItems_Version;	// Changes whenever an item (or its status) changes
+// - Ring of recent changes (Handler NULL means "whole table")
+struct {
+	tHandler	*Handler;
+	 int	ID;
+}	gaItems_ChangeLog[ITEM_CHANGELOG_SIZE];
+ int	giItems_ChangeCount;	// Total number of changes logged
+pthread_mutex_t	gItems_ChangeLogLock = PTHREAD_MUTEX_INITIALIZER;
+// - Stock changes made in the current transaction (undone if it is aborted)
+struct {
+	tItem	*Item;
+	 int	Delta;
+}	gaItems_HeldStock[MAX_HELD_STOCK];
+ int	giItems_NumHeldStock;
+ int	gbItems_HoldingStock;
+tHandler	gPseudo_Handler = {.Name="pseudo", .bCountStock=1};
 tHandler	gMembership_Handler = {.Name="membership"};
 tHandler	*gaHandlers[] = {
 	&gPseudo_Handler, &gMembership_Handler,
@@ -53,6 +84,7 @@ void Init_Handlers()
 	{
 		if( gaHandlers[i]->Init )
 			gaHandlers[i]->Init(0, NULL);	// TODO: Arguments
+		Dispense_RegisterHandler(gaHandlers[i]);
 	}
 	
 	// Use inotify to watch the snack config file
@@ -102,6 +134,7 @@ void Load_Itemlist(void)
 	}
 	
 	Items_ReadFromFile();
+	Items_LoadStock();
 	
 	// Re-read the item file periodically
 	// TODO: Be less lazy here and check the timestamp
@@ -216,9 +249,23 @@ void Items_ReadFromFile(void)
 			items[numItems].Price = price;
 		items[numItems].Name = strdup(desc);
 		items[numItems].bHidden = (line[0] == '-');
+		items[numItems].Status = 0;
+		items[numItems].Stock = -1;
 		numItems ++;
 	}
 	
+	// Keep the stock counts (they are only read from the bank at startup)
+	for( i = 0; i < numItems; i ++ )
+	{
+		for( int j = 0; j < giNumItems; j ++ )
+		{
+			if( gaItems[j].Handler != items[i].Handler || gaItems[j].ID != items[i].ID )
+				continue;
+			items[i].Stock = gaItems[j].Stock;
+			break;
+		}
+	}
+	
 	// Clean up old
 	if( giNumItems )
 	{
@@ -233,6 +280,248 @@ void Items_ReadFromFile(void)
 	gaItems = items;
 	
 	gItems_LastUpdated = time(NULL);
+	Items_MarkChanged(NULL);
+}
+
+/**
+ * \brief Mark an item (or the whole table) as changed
+ * \param Item	Changed item, or NULL if the whole table was replaced
+ *
+ * Bumps the item table version and records the change for WATCH_ITEMS
+ * subscribers. The version is seeded from the clock so that it keeps
+ * increasing across server restarts (clients cache the item list against it).
+ */
+void Items_MarkChanged(tItem *Item)
+{
+	 int	now = time(NULL);
+	 int	slot;
+	
+	pthread_mutex_lock(&gItems_ChangeLogLock);
+	
+	if( giItems_Version < now )
+		giItems_Version = now;
+	else
+		giItems_Version ++;
+	
+	slot = giItems_ChangeCount % ITEM_CHANGELOG_SIZE;
+	gaItems_ChangeLog[slot].Handler = Item ? Item->Handler : NULL;
+	gaItems_ChangeLog[slot].ID = Item ? Item->ID : 0;
+	giItems_ChangeCount ++;
+	
+	pthread_mutex_unlock(&gItems_ChangeLogLock);
+}
+
+/**
+ * \brief Get the number of changes logged so far
+ */
+int Items_GetChangeCount(void)
+{
+	return giItems_ChangeCount;
+}
+
+/**
+ * \brief Get the item affected by a logged change
+ * \param Seq	Change number (from 0 to Items_GetChangeCount()-1)
+ * \return Changed item, or NULL if the whole list needs to be resent
+ */
+tItem *Items_GetChange(int Seq)
+{
+	tHandler	*handler;
+	 int	id, i;
+	
+	pthread_mutex_lock(&gItems_ChangeLogLock);
+	// Fallen out of the log?
+	if( giItems_ChangeCount - Seq > ITEM_CHANGELOG_SIZE ) {
+		pthread_mutex_unlock(&gItems_ChangeLogLock);
+		return NULL;
+	}
+	handler = gaItems_ChangeLog[Seq % ITEM_CHANGELOG_SIZE].Handler;
+	id = gaItems_ChangeLog[Seq % ITEM_CHANGELOG_SIZE].ID;
+	pthread_mutex_unlock(&gItems_ChangeLogLock);
+	
+	if( !handler )	return NULL;
+	
+	for( i = 0; i < giNumItems; i ++ )
+	{
+		if( gaItems[i].Handler == handler && gaItems[i].ID == id )
+			return &gaItems[i];
+	}
+	return NULL;
+}
+
+/**
+ * \brief Get the current status of an item (the same for every user)
+ * \param Item	Item to check
+ * \return 0: Available, 1: Sold out, -1: Error
+ * 
+ * Also updates the cached status of shown items, logging a change if it
+ * differs from the last one reported.
+ */
+int Items_GetStatus(tItem *Item)
+{
+	 int	status = 0;
+	
+	if( Item->Handler->GetStatus )
+		status = Items_int_MapStatus( Item->Handler->GetStatus(Item->ID) );
+	else if( Item->Handler->CanDispense )
+		status = Items_int_MapStatus( Item->Handler->CanDispense(-1, Item->ID) );
+	
+	// Counted stock ran out
+	if( Item->Stock == 0 )
+		status = 1;
+	
+	if( !gbNoCostMode && Item->Price == 0 )
+		status = -1;
+	// KNOWN HACK: Naming a slot 'dead' disables it
+	if( strcmp(Item->Name, "dead") == 0 )
+		status = 1;	// Another status?
+	
+	if( !Item->bHidden && Item->Status != status ) {
+		Item->Status = status;
+		Items_MarkChanged(Item);
+	}
+	
+	return status;
+}
+
+/**
+ * \brief Narrow an item's status down to what a user can do
+ * \param Status	Status from Items_GetStatus (or the cached one)
+ * \note Doesn't change the cached status
+ */
+int Items_GetUserStatus(tItem *Item, int User, int Status)
+{
+	// Only handlers with a separate status check have per-user rights
+	if( Status != 0 || !Item->Handler->GetStatus || !Item->Handler->CanDispense )
+		return Status;
+	return Items_int_MapStatus( Item->Handler->CanDispense(User, Item->ID) );
+}
+
+static int Items_int_MapStatus(int CanDispenseRet)
+{
+	switch(CanDispenseRet)
+	{
+	case  0:	return 0;
+	case  1:	return 1;
+	default:
+	case -1:	return -1;
+	}
+}
+
+/**
+ * \brief Re-check the availability of all shown items
+ */
+void Items_RefreshStatus(void)
+{
+	for( int i = 0; i < giNumItems; i ++ )
+	{
+		if( gaItems[i].bHidden )	continue;
+		Items_GetStatus( &gaItems[i] );
+	}
+}
+
+/**
+ * \brief Read the stock counts of counted items from the bank
+ */
+void Items_LoadStock(void)
+{
+	for( int i = 0; i < giNumItems; i ++ )
+	{
+		char	name[64];
+		if( !gaItems[i].Handler->bCountStock )	continue;
+		snprintf(name, sizeof(name), "%s:%i", gaItems[i].Handler->Name, gaItems[i].ID);
+		gaItems[i].Stock = Bank_GetItemStock(name);
+	}
+}
+
+/**
+ * \brief Change the stock count of an item (dispensed, refunded)
+ * \return New count, or -1 if the item's stock isn't counted
+ * \note Items are only counted once they have been restocked
+ */
+int Items_AdjustStock(tItem *Item, int Delta)
+{
+	char	name[64];
+	 int	stock;
+	
+	if( !Item->Handler->bCountStock || Item->Stock == -1 )
+		return -1;
+	
+	stock = Item->Stock + Delta;
+	if( stock < 0 )	stock = 0;
+	
+	if( Items_int_NoteStock(Item, stock) )
+		return Item->Stock;
+	Item->Stock = stock;
+	
+	// Saved in the caller's transaction (if any), so it's undone along with it
+	snprintf(name, sizeof(name), "%s:%i", Item->Handler->Name, Item->ID);
+	Bank_SetItemStock(name, stock);
+	
+	// Let watchers know when it runs out (or comes back)
+	Items_GetStatus(Item);
+	return stock;
+}
+
+/**
+ * \brief Add stock to an item, starting to count it if it wasn't
+ * \return New count, or -1 if the item's machine isn't counted
+ */
+int Items_Restock(tItem *Item, int Count)
+{
+	if( !Item->Handler->bCountStock )
+		return -1;
+	if( Item->Stock == -1 )
+	{
+		// Noted too, so an aborted restock goes back to not counting
+		if( Items_int_NoteStock(Item, 0) )
+			return -1;
+		Item->Stock = 0;
+	}
+	return Items_AdjustStock(Item, Count);
+}
+
+/**
+ * \brief Note a stock change to undo if the transaction is aborted
+ * \return Boolean failure (the change must not be made)
+ */
+static int Items_int_NoteStock(tItem *Item, int NewStock)
+{
+	if( !gbItems_HoldingStock )
+		return 0;
+	if( giItems_NumHeldStock == MAX_HELD_STOCK ) {
+		Log_Error("Stock of %s:%i not changed (too many in one transaction)",
+			Item->Handler->Name, Item->ID);
+		return 1;
+	}
+	gaItems_HeldStock[giItems_NumHeldStock].Item = Item;
+	gaItems_HeldStock[giItems_NumHeldStock].Delta = NewStock - Item->Stock;
+	giItems_NumHeldStock ++;
+	return 0;
+}
+
+/**
+ * \brief Keep a note of stock changes until Items_ReleaseStock
+ */
+void Items_HoldStock(void)
+{
+	gbItems_HoldingStock = 1;
+}
+
+/**
+ * \brief Forget (or undo, if \a bCommit is clear) stock changes since Items_HoldStock
+ * \note The bank's copy is rolled back with the transaction
+ */
+void Items_ReleaseStock(int bCommit)
+{
+	gbItems_HoldingStock = 0;
+	for( int i = giItems_NumHeldStock; !bCommit && i --; )
+	{
+		tItem	*item = gaItems_HeldStock[i].Item;
+		item->Stock -= gaItems_HeldStock[i].Delta;
+		Items_GetStatus(item);
+	}
+	giItems_NumHeldStock = 0;
 }
 
 /**
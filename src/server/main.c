@@ -144,6 +144,7 @@ int main(int argc, char *argv[])
 	if( Bank_Initialise(gsCokebankPath) )
 		return -1;
 
+	Dispense_Initialise();
 	Init_Handlers();
 
 	Load_Itemlist();
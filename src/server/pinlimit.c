@@ -0,0 +1,269 @@
+/*
+ * OpenDispense 2
+ * UCC (University [of WA] Computer Club) Electronic Accounting System
+ *
+ * pinlimit.c - PIN attempt limiting
+ * > Wrong PINs are counted per (account, source address), so one person's
+ *   mistakes never slow down anyone else. Each failure doubles the wait
+ *   before the next attempt, and failures are forgotten over time.
+ * > The table is split into shards, each a small hash with its own LRU
+ *   list. A full shard forgets its least recently used entry, so memory is
+ *   fixed no matter how many accounts/addresses are tried.
+ *
+ * This file is licenced under the 3-clause BSD Licence. See the file
+ * COPYING for full details.
+ */
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include "common.h"
+
+#define PIN_NUM_SHARDS	16
+#define PIN_SHARD_SIZE	256	// Entries per shard
+#define PIN_SHARD_BUCKETS	128	// Hash buckets per shard (power of two)
+#define PIN_MAX_BACKOFF	300	// Longest wait between attempts (seconds)
+#define PIN_DECAY_TIME	600	// Seconds for one failure to be forgotten
+
+// === TYPES ===
+typedef struct sPinEntry
+{
+	 int	AcctID;
+	uint32_t	Addr;
+	 int	Failures;
+	time_t	LastFailure;
+	 int	HashNext;	// Next entry in bucket (-1 = end)
+	 int	LRUPrev;	// More recently used (-1 = head)
+	 int	LRUNext;	// Less recently used (-1 = tail)
+}	tPinEntry;
+
+typedef struct sPinShard
+{
+	 int	Buckets[PIN_SHARD_BUCKETS];	// First entry in each bucket (-1 = empty)
+	tPinEntry	Entries[PIN_SHARD_SIZE];
+	 int	NumUsed;	// Entries [0, NumUsed) have been handed out
+	 int	FreeList;	// Released entries (linked by HashNext)
+	 int	LRUHead, LRUTail;
+}	tPinShard;
+
+// === PROTOTYPES ===
+ int	PinLimit_Check(int AcctID, uint32_t Addr);
+void	PinLimit_Failure(int AcctID, uint32_t Addr);
+void	PinLimit_Success(int AcctID, uint32_t Addr);
+static tPinShard	*PinLimit_int_GetShard(int AcctID, uint32_t Addr, int *Bucket);
+static int	PinLimit_int_Find(tPinShard *Shard, int Bucket, int AcctID, uint32_t Addr);
+static void	PinLimit_int_Remove(tPinShard *Shard, int Bucket, int Index);
+static void	PinLimit_int_Touch(tPinShard *Shard, int Index);
+static void	PinLimit_int_Unlink(tPinShard *Shard, int Index);
+static int	PinLimit_int_Decay(tPinShard *Shard, int Bucket, int Index, time_t Now);
+static int	PinLimit_int_Backoff(int Failures);
+
+// === GLOBALS ===
+tPinShard	gaPinLimit_Shards[PIN_NUM_SHARDS];
+ int	gbPinLimit_Initialised;
+
+// === CODE ===
+/**
+ * \brief Check if a PIN attempt is allowed
+ * \return Seconds until the next attempt is allowed (0 = now)
+ */
+int PinLimit_Check(int AcctID, uint32_t Addr)
+{
+	tPinShard	*shard;
+	 int	bucket, idx;
+	time_t	now = time(NULL);
+	 int	wait;
+
+	shard = PinLimit_int_GetShard(AcctID, Addr, &bucket);
+	idx = PinLimit_int_Find(shard, bucket, AcctID, Addr);
+	if( idx == -1 )
+		return 0;
+	if( PinLimit_int_Decay(shard, bucket, idx, now) )
+		return 0;
+
+	wait = shard->Entries[idx].LastFailure + PinLimit_int_Backoff(shard->Entries[idx].Failures) - now;
+	return wait > 0 ? wait : 0;
+}
+
+/**
+ * \brief Record a wrong PIN
+ */
+void PinLimit_Failure(int AcctID, uint32_t Addr)
+{
+	tPinShard	*shard;
+	tPinEntry	*ent;
+	 int	bucket, idx;
+	time_t	now = time(NULL);
+
+	shard = PinLimit_int_GetShard(AcctID, Addr, &bucket);
+	idx = PinLimit_int_Find(shard, bucket, AcctID, Addr);
+	if( idx != -1 && PinLimit_int_Decay(shard, bucket, idx, now) )
+		idx = -1;
+
+	if( idx == -1 )
+	{
+		// Get a free entry, or forget the least recently used one
+		if( shard->FreeList != -1 ) {
+			idx = shard->FreeList;
+			shard->FreeList = shard->Entries[idx].HashNext;
+		}
+		else if( shard->NumUsed < PIN_SHARD_SIZE ) {
+			idx = shard->NumUsed ++;
+		}
+		else {
+			 int	oldBucket;
+			idx = shard->LRUTail;
+			PinLimit_int_GetShard(shard->Entries[idx].AcctID, shard->Entries[idx].Addr, &oldBucket);
+			PinLimit_int_Remove(shard, oldBucket, idx);
+			shard->FreeList = shard->Entries[idx].HashNext;
+		}
+
+		ent = &shard->Entries[idx];
+		ent->AcctID = AcctID;
+		ent->Addr = Addr;
+		ent->Failures = 0;
+		ent->HashNext = shard->Buckets[bucket];
+		shard->Buckets[bucket] = idx;
+		ent->LRUPrev = -1;
+		ent->LRUNext = shard->LRUHead;
+		if( shard->LRUHead != -1 )
+			shard->Entries[shard->LRUHead].LRUPrev = idx;
+		else
+			shard->LRUTail = idx;
+		shard->LRUHead = idx;
+	}
+	else
+		PinLimit_int_Touch(shard, idx);
+
+	ent = &shard->Entries[idx];
+	ent->Failures ++;
+	ent->LastFailure = now;
+}
+
+/**
+ * \brief Forget wrong PINs after a correct one
+ */
+void PinLimit_Success(int AcctID, uint32_t Addr)
+{
+	tPinShard	*shard;
+	 int	bucket, idx;
+
+	shard = PinLimit_int_GetShard(AcctID, Addr, &bucket);
+	idx = PinLimit_int_Find(shard, bucket, AcctID, Addr);
+	if( idx != -1 )
+		PinLimit_int_Remove(shard, bucket, idx);
+}
+
+/**
+ * \brief Get the shard (and bucket within it) for a key
+ */
+static tPinShard *PinLimit_int_GetShard(int AcctID, uint32_t Addr, int *Bucket)
+{
+	uint32_t	hash;
+
+	if( !gbPinLimit_Initialised )
+	{
+		for( int i = 0; i < PIN_NUM_SHARDS; i ++ )
+		{
+			tPinShard	*shard = &gaPinLimit_Shards[i];
+			for( int j = 0; j < PIN_SHARD_BUCKETS; j ++ )
+				shard->Buckets[j] = -1;
+			shard->FreeList = -1;
+			shard->LRUHead = shard->LRUTail = -1;
+		}
+		gbPinLimit_Initialised = 1;
+	}
+
+	hash = ((uint32_t)AcctID * 2654435761u) ^ (Addr * 2246822519u);
+	hash ^= hash >> 15;
+	*Bucket = (hash >> 4) & (PIN_SHARD_BUCKETS - 1);
+	return &gaPinLimit_Shards[hash % PIN_NUM_SHARDS];
+}
+
+static int PinLimit_int_Find(tPinShard *Shard, int Bucket, int AcctID, uint32_t Addr)
+{
+	for( int idx = Shard->Buckets[Bucket]; idx != -1; idx = Shard->Entries[idx].HashNext )
+	{
+		if( Shard->Entries[idx].AcctID == AcctID && Shard->Entries[idx].Addr == Addr )
+			return idx;
+	}
+	return -1;
+}
+
+/**
+ * \brief Take an entry out of its bucket and the LRU list, and free it
+ */
+static void PinLimit_int_Remove(tPinShard *Shard, int Bucket, int Index)
+{
+	 int	*link;
+
+	for( link = &Shard->Buckets[Bucket]; *link != Index; link = &Shard->Entries[*link].HashNext )
+		;
+	*link = Shard->Entries[Index].HashNext;
+
+	PinLimit_int_Unlink(Shard, Index);
+
+	Shard->Entries[Index].HashNext = Shard->FreeList;
+	Shard->FreeList = Index;
+}
+
+/**
+ * \brief Move an entry to the front of the LRU list
+ */
+static void PinLimit_int_Touch(tPinShard *Shard, int Index)
+{
+	if( Shard->LRUHead == Index )
+		return ;
+	PinLimit_int_Unlink(Shard, Index);
+	Shard->Entries[Index].LRUPrev = -1;
+	Shard->Entries[Index].LRUNext = Shard->LRUHead;
+	if( Shard->LRUHead != -1 )
+		Shard->Entries[Shard->LRUHead].LRUPrev = Index;
+	else
+		Shard->LRUTail = Index;
+	Shard->LRUHead = Index;
+}
+
+static void PinLimit_int_Unlink(tPinShard *Shard, int Index)
+{
+	tPinEntry	*ent = &Shard->Entries[Index];
+	if( ent->LRUPrev != -1 )
+		Shard->Entries[ent->LRUPrev].LRUNext = ent->LRUNext;
+	else
+		Shard->LRUHead = ent->LRUNext;
+	if( ent->LRUNext != -1 )
+		Shard->Entries[ent->LRUNext].LRUPrev = ent->LRUPrev;
+	else
+		Shard->LRUTail = ent->LRUPrev;
+}
+
+/**
+ * \brief Forget failures older than PIN_DECAY_TIME
+ * \return Boolean "Entry was removed"
+ */
+static int PinLimit_int_Decay(tPinShard *Shard, int Bucket, int Index, time_t Now)
+{
+	tPinEntry	*ent = &Shard->Entries[Index];
+	 int	decayed = (Now - ent->LastFailure) / PIN_DECAY_TIME;
+
+	if( decayed <= 0 )
+		return 0;
+	if( decayed >= ent->Failures ) {
+		PinLimit_int_Remove(Shard, Bucket, Index);
+		return 1;
+	}
+	ent->Failures -= decayed;
+	ent->LastFailure += decayed * PIN_DECAY_TIME;
+	return 0;
+}
+
+/**
+ * \brief Seconds to wait after \a Failures wrong PINs (1, 2, 4, ...)
+ */
+static int PinLimit_int_Backoff(int Failures)
+{
+	if( Failures <= 0 )
+		return 0;
+	if( Failures > 9 )	// 2^9 > PIN_MAX_BACKOFF
+		return PIN_MAX_BACKOFF;
+	return (1 << (Failures - 1)) < PIN_MAX_BACKOFF ? (1 << (Failures - 1)) : PIN_MAX_BACKOFF;
+}
@@ -0,0 +1,330 @@
+/*
+ * OpenDispense 2
+ * UCC (University [of WA] Computer Club) Electronic Accounting System
+ *
+ * sales.c - Hourly sales totals (SALES_STATS)
+ * > Every item and every handler has a series of hourly buckets (only
+ *   hours with sales have one), kept in memory oldest first. A sale
+ *   normally just adds to the last bucket, and a time range is answered by
+ *   a binary search then a walk over the buckets in it.
+ * > Changed buckets are written to the bank by Sales_Flush, which the
+ *   server calls periodically. Losing the last few minutes on a crash is
+ *   fine, the ledger still has every transfer.
+ *
+ * This file is licenced under the 3-clause BSD Licence. See the file
+ * COPYING for full details.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "common.h"
+
+#define SALES_BUCKET_SIZE	3600	// Seconds in a bucket
+#define MAX_HELD_SALES	64	// Sales kept aside during a transaction
+
+// === TYPES ===
+typedef struct sSalesBucket
+{
+	time_t	Hour;
+	 int	Count;
+	 int	Revenue;
+}	tSalesBucket;
+
+typedef struct sSalesSeries
+{
+	char	*Name;	// "<handler>:<id>" or "<handler>"
+	 int	NumBuckets, MaxBuckets;
+	tSalesBucket	*Buckets;	// Oldest first
+	 int	FirstDirty;	// Buckets from here on are not saved (NumBuckets = all saved)
+}	tSalesSeries;
+
+typedef struct sHeldSale
+{
+	tItem	*Item;
+	 int	Count;
+	 int	Revenue;
+	time_t	Time;
+}	tHeldSale;
+
+// === PROTOTYPES ===
+void	Sales_Initialise(void);
+void	Sales_Record(tItem *Item, int Count, int Revenue);
+void	Sales_Hold(void);
+void	Sales_Release(int bCommit);
+void	Sales_Flush(void);
+const char	*Sales_GetSeries(int Index);
+void	Sales_GetTotals(int Index, time_t From, time_t To, int *Count, int *Revenue);
+static tSalesSeries	*Sales_int_GetSeries(const char *Name, int bCreate);
+static int	Sales_int_FindBucket(tSalesSeries *Series, time_t Hour);
+static tSalesBucket	*Sales_int_GetBucket(tSalesSeries *Series, time_t Hour);
+static void	Sales_int_Add(const char *Name, time_t Time, int Count, int Revenue);
+
+// === GLOBALS ===
+tSalesSeries	**gaSales_Series;	// Sorted by name
+ int	giSales_NumSeries;
+ int	giSales_MaxSeries;
+ int	gbSales_Stored;	// The bank keeps rollups
+ int	gbSales_Holding;
+ int	giSales_NumHeld;
+tHeldSale	gaSales_Held[MAX_HELD_SALES];
+
+// === CODE ===
+/**
+ * \brief Load the stored totals from the bank
+ */
+void Sales_Initialise(void)
+{
+	tSalesIterator	*it;
+	tSalesRollup	rollup;
+	tSalesSeries	*series = NULL;
+
+	it = Bank_SalesIterator();
+	if( !it )
+		return ;	// Totals are only kept for this run
+	gbSales_Stored = 1;
+
+	// Rows come by series then hour, so each is appended to the end
+	while( !Bank_SalesNext(it, &rollup) )
+	{
+		tSalesBucket	*bucket;
+		if( !series || strcmp(series->Name, rollup.Series) != 0 )
+			series = Sales_int_GetSeries(rollup.Series, 1);
+		if( !series )	break;
+		bucket = Sales_int_GetBucket(series, rollup.Hour);
+		if( !bucket )	break;
+		bucket->Count = rollup.Count;
+		bucket->Revenue = rollup.Revenue;
+		series->FirstDirty = series->NumBuckets;
+	}
+	Bank_DelSalesIterator(it);
+}
+
+/**
+ * \brief Count a sale (or a refund, with negative values)
+ * \param Item	Item sold
+ * \param Count	Number sold
+ * \param Revenue	Cents taken
+ */
+void Sales_Record(tItem *Item, int Count, int Revenue)
+{
+	char	name[64];
+	time_t	now = time(NULL);
+
+	if( gbSales_Holding )
+	{
+		if( giSales_NumHeld == MAX_HELD_SALES ) {
+			Log_Error("Sale of %s:%i not counted (too many in one transaction)",
+				Item->Handler->Name, Item->ID);
+			return ;
+		}
+		gaSales_Held[giSales_NumHeld].Item = Item;
+		gaSales_Held[giSales_NumHeld].Count = Count;
+		gaSales_Held[giSales_NumHeld].Revenue = Revenue;
+		gaSales_Held[giSales_NumHeld].Time = now;
+		giSales_NumHeld ++;
+		return ;
+	}
+
+	snprintf(name, sizeof(name), "%s:%i", Item->Handler->Name, Item->ID);
+	Sales_int_Add(name, now, Count, Revenue);
+	Sales_int_Add(Item->Handler->Name, now, Count, Revenue);
+}
+
+/**
+ * \brief Keep sales aside until Sales_Release (bank transaction started)
+ */
+void Sales_Hold(void)
+{
+	gbSales_Holding = 1;
+}
+
+/**
+ * \brief Count (or throw away) the sales kept since Sales_Hold
+ * \param bCommit	Transaction was committed
+ */
+void Sales_Release(int bCommit)
+{
+	gbSales_Holding = 0;
+	for( int i = 0; bCommit && i < giSales_NumHeld; i ++ )
+	{
+		tHeldSale	*sale = &gaSales_Held[i];
+		char	name[64];
+		snprintf(name, sizeof(name), "%s:%i", sale->Item->Handler->Name, sale->Item->ID);
+		Sales_int_Add(name, sale->Time, sale->Count, sale->Revenue);
+		Sales_int_Add(sale->Item->Handler->Name, sale->Time, sale->Count, sale->Revenue);
+	}
+	giSales_NumHeld = 0;
+}
+
+/**
+ * \brief Write changed buckets to the bank (in one transaction)
+ */
+void Sales_Flush(void)
+{
+	 int	bHaveDirty = 0;
+
+	if( !gbSales_Stored )
+		return ;
+
+	for( int i = 0; i < giSales_NumSeries && !bHaveDirty; i ++ )
+		bHaveDirty = (gaSales_Series[i]->FirstDirty < gaSales_Series[i]->NumBuckets);
+	if( !bHaveDirty )
+		return ;
+
+	if( Bank_StartTransaction() ) {
+		Log_Error("Unable to save sales totals (transaction)");
+		return ;
+	}
+	for( int i = 0; i < giSales_NumSeries; i ++ )
+	{
+		tSalesSeries	*series = gaSales_Series[i];
+		for( int j = series->FirstDirty; j < series->NumBuckets; j ++ )
+		{
+			tSalesBucket	*bucket = &series->Buckets[j];
+			if( Bank_SaveSalesRollup(series->Name, bucket->Hour, bucket->Count, bucket->Revenue) ) {
+				Bank_AbortTransaction();
+				Log_Error("Unable to save sales totals for %s", series->Name);
+				return ;
+			}
+		}
+	}
+	if( Bank_CommitTransaction() ) {
+		Log_Error("Unable to save sales totals (commit)");
+		return ;
+	}
+
+	for( int i = 0; i < giSales_NumSeries; i ++ )
+		gaSales_Series[i]->FirstDirty = gaSales_Series[i]->NumBuckets;
+}
+
+/**
+ * \brief Get the name of a series (in name order, a handler comes before its items)
+ * \return Name, or NULL past the last series
+ */
+const char *Sales_GetSeries(int Index)
+{
+	if( Index < 0 || Index >= giSales_NumSeries )
+		return NULL;
+	return gaSales_Series[Index]->Name;
+}
+
+/**
+ * \brief Add up a series' sales from \a From (rounded down to the hour) until \a To
+ */
+void Sales_GetTotals(int Index, time_t From, time_t To, int *Count, int *Revenue)
+{
+	tSalesSeries	*series = gaSales_Series[Index];
+
+	*Count = 0;
+	*Revenue = 0;
+	for( int i = Sales_int_FindBucket(series, From - From % SALES_BUCKET_SIZE); i < series->NumBuckets; i ++ )
+	{
+		if( series->Buckets[i].Hour >= To )	break;
+		*Count += series->Buckets[i].Count;
+		*Revenue += series->Buckets[i].Revenue;
+	}
+}
+
+/**
+ * \brief Find a series by name (binary search)
+ */
+static tSalesSeries *Sales_int_GetSeries(const char *Name, int bCreate)
+{
+	 int	lo = 0, hi = giSales_NumSeries;
+	tSalesSeries	*series;
+
+	while( lo < hi )
+	{
+		 int	mid = (lo + hi) / 2;
+		 int	cmp = strcmp(gaSales_Series[mid]->Name, Name);
+		if( cmp == 0 )	return gaSales_Series[mid];
+		if( cmp < 0 )	lo = mid + 1;
+		else	hi = mid;
+	}
+	if( !bCreate )
+		return NULL;
+
+	if( giSales_NumSeries == giSales_MaxSeries )
+	{
+		 int	newMax = giSales_MaxSeries ? giSales_MaxSeries * 2 : 16;
+		void	*tmp = realloc(gaSales_Series, newMax * sizeof(*gaSales_Series));
+		if( !tmp )	return NULL;
+		gaSales_Series = tmp;
+		giSales_MaxSeries = newMax;
+	}
+	series = calloc(1, sizeof(tSalesSeries));
+	if( !series )	return NULL;
+	series->Name = strdup(Name);
+
+	memmove(&gaSales_Series[lo+1], &gaSales_Series[lo], (giSales_NumSeries - lo) * sizeof(*gaSales_Series));
+	gaSales_Series[lo] = series;
+	giSales_NumSeries ++;
+	return series;
+}
+
+/**
+ * \brief Get the index of the first bucket at or after \a Hour
+ */
+static int Sales_int_FindBucket(tSalesSeries *Series, time_t Hour)
+{
+	 int	lo = 0, hi = Series->NumBuckets;
+	while( lo < hi )
+	{
+		 int	mid = (lo + hi) / 2;
+		if( Series->Buckets[mid].Hour < Hour )	lo = mid + 1;
+		else	hi = mid;
+	}
+	return lo;
+}
+
+/**
+ * \brief Get (or add) the bucket for an hour
+ */
+static tSalesBucket *Sales_int_GetBucket(tSalesSeries *Series, time_t Hour)
+{
+	 int	pos;
+
+	// Almost always the current hour
+	if( Series->NumBuckets && Series->Buckets[Series->NumBuckets-1].Hour == Hour )
+		pos = Series->NumBuckets - 1;
+	else
+		pos = Sales_int_FindBucket(Series, Hour);
+	if( pos < Series->NumBuckets && Series->Buckets[pos].Hour == Hour )
+		return &Series->Buckets[pos];
+
+	if( Series->NumBuckets == Series->MaxBuckets )
+	{
+		 int	newMax = Series->MaxBuckets ? Series->MaxBuckets * 2 : 32;
+		void	*tmp = realloc(Series->Buckets, newMax * sizeof(tSalesBucket));
+		if( !tmp )	return NULL;
+		Series->Buckets = tmp;
+		Series->MaxBuckets = newMax;
+	}
+	// Only out of order if the clock went backwards
+	memmove(&Series->Buckets[pos+1], &Series->Buckets[pos], (Series->NumBuckets - pos) * sizeof(tSalesBucket));
+	Series->NumBuckets ++;
+	if( Series->FirstDirty >= pos )
+		Series->FirstDirty ++;
+	Series->Buckets[pos].Hour = Hour;
+	Series->Buckets[pos].Count = 0;
+	Series->Buckets[pos].Revenue = 0;
+	return &Series->Buckets[pos];
+}
+
+static void Sales_int_Add(const char *Name, time_t Time, int Count, int Revenue)
+{
+	tSalesSeries	*series = Sales_int_GetSeries(Name, 1);
+	tSalesBucket	*bucket;
+	 int	pos;
+
+	if( !series )	return ;
+	bucket = Sales_int_GetBucket(series, Time - Time % SALES_BUCKET_SIZE);
+	if( !bucket )	return ;
+	bucket->Count += Count;
+	bucket->Revenue += Revenue;
+
+	pos = bucket - series->Buckets;
+	if( pos < series->FirstDirty )
+		series->FirstDirty = pos;
+}
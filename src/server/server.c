@@ -9,6 +9,7 @@
  */
 #include <stdio.h>
 #include <stdlib.h>
+#include <inttypes.h>
 #include "common.h"
 #include "../common/config.h"
 #include <sys/socket.h>
@@ -23,6 +24,8 @@
 #include <ident.h>	// AUTHIDENT
 #include <time.h>	// time(2)
 #include <ctype.h>
+#include <errno.h>
+#include <sys/select.h>
 
 #define	DEBUG_TRACE_CLIENT	0
 #define HACK_NO_REFUNDS	1
@@ -33,6 +36,13 @@
 #define MAX_CONNECTION_QUEUE	5
 #define INPUT_BUFFER_SIZE	256
 #define CLIENT_TIMEOUT	10	// Seconds
+#define ITEM_POLL_INTERVAL	5	// Seconds between availability checks (when watched)
+#define MAX_BATCH_COMMANDS	32	// Commands allowed between MULTI and EXEC
+#define MAX_REQUEST_ID_LEN	64	// Longest accepted ID:<token>
+#define REPLY_ARENA_CHUNK	(32*1024)	// Size of each block of a reply arena
+#define ENUM_STREAM_CHUNK	4096	// Bytes of ENUM_USERS produced between sends
+#define DEF_HISTORY_LIMIT	100	// Entries returned by HISTORY without limit:
+#define SALES_FLUSH_INTERVAL	60	// Seconds between saves of the sales totals
 
 #define HASH_TYPE	SHA1
 #define HASH_LENGTH	20
@@ -43,11 +53,40 @@
 #define IDENT_TRUSTED_NETMASK 0xFFFFFFC0
 
 // === TYPES ===
+/**
+ * \brief Paged ENUM_USERS being streamed to a client
+ *
+ * Lines are produced only when the previous ones have been sent. When the
+ * socket is full the iterator is closed, and re-created after the last
+ * account looked at (see Bank_IteratorAfter) once the client catches up.
+ */
+typedef struct sEnumState
+{
+	 int	FlagMask, FlagValue;	// Arguments to Bank_IteratorAfter
+	 int	ItFlags, BalValue;
+	time_t	TimeValue;
+	 int	MinBal, MaxBal;	// Checked here (the iterator only takes one)
+	 int	Remaining;	// Lines left in the page (-1 = no limit)
+	 int	bHaveCursor;
+	tAcctRecord	Cursor;	// Last account looked at (Name is owned)
+	char	*PageEnd;	// Cursor of the last line in a full page
+	 int	bDone;	// End line has been produced
+	char	*OutBuf;	// Produced, not yet sent
+	 int	OutPos, OutLen, OutSpace;
+}	tEnumState;
+
 typedef struct sClient
 {
+	struct sClient	*Next;
 	 int	Socket;	// Client socket ID
 	 int	ID;	// Client ID
+	
+	char	InBuf[INPUT_BUFFER_SIZE];	// Partial command line
+	 int	InLen;
+	time_t	LastActive;	// For idle timeouts
+	 int	bClosing;	// Drop the connection at the end of this loop
 	 
+	uint32_t	SourceAddr;	// Client's IPv4 address (host order)
 	 int	bTrustedHost;
 	 int	bCanAutoAuth;	// Is the connection from a trusted host/port
 	
@@ -57,20 +96,77 @@ typedef struct sClient
 	 int	UID;
 	 int	EffectiveUID;
 	 int	bIsAuthed;
+	
+	// Flags of UID and EffectiveUID (valid while FlagsEpoch is current)
+	unsigned int	FlagsEpoch;
+	 int	FlagsUID, FlagsEUID;	// Accounts the cached flags are for (-2 = none)
+	 int	UserFlags, EffectiveFlags;
+	 int	bAuthPending;	// PASS is being checked, input is held until it finishes
+	
+	 int	bWatchItems;	// Subscribed to item updates (WATCH_ITEMS)
+	 int	bItemsMissed;	// Item updates were skipped during an ENUM_USERS stream
+	 int	bWatchUsers;	// Account changes are pushed (USERS_SINCE <seq> stream)
+	uint64_t	UsersSeq;	// Bank change seq sent to the client so far
+	 int	bWatchEvents;	// Subscribed to the event stream (SUBSCRIBE EVENTS)
+	uint64_t	EventsSeq;	// Next event to send
+	char	*EventsPartial;	// Rest of an event line the socket had no room for, input is held until it is sent
+	 int	EventsPartialLen;
+	
+	tEnumState	*Enum;	// ENUM_USERS being streamed, input is held until it finishes
+	
+	 int	bInBatch;	// Between MULTI and EXEC
+	 int	bBatchInvalid;	// A bad command was queued, EXEC will discard
+	 int	bRunningBatch;	// EXEC is running the queued commands
+	char	*BatchToken;	// Request ID of the command EXEC is running (set by Server_int_RunRequest)
+	 int	BatchLen;
+	char	*Batch[MAX_BATCH_COMMANDS];	// Queued command lines
 }	tClient;
 
+/**
+ * \brief Block of reply lines built up by one request
+ */
+typedef struct sArenaBlock
+{
+	struct sArenaBlock	*Next;
+	size_t	Used, Space;
+	char	Data[];
+}	tArenaBlock;
+
+/**
+ * \brief Reply arena (lines are appended, then sent and freed together)
+ */
+typedef struct sReplyArena
+{
+	tArenaBlock	*First, *Last;
+}	tReplyArena;
+
 // === PROTOTYPES ===
 void	Server_Start(void);
 void	Server_Cleanup(void);
-void	Server_HandleClient(int Socket, int bTrustedHost, int bRootPort);
+void	Server_int_AcceptClient(void);
+ int	Server_int_ReadClient(tClient *Client);
+void	Server_int_RunClientLines(tClient *Client);
+void	Server_int_FinishAuths(void);
+void	Server_int_CloseClient(tClient *Client);
+void	Server_int_PushItemChanges(void);
+void	Server_int_PushUserChanges(void);
+void	Server_int_PushEvents(void);
+ int	Server_int_PushEventLine(tClient *Client, const char *Line, int Length);
 void	Server_ParseClientCommand(tClient *Client, char *CommandString);
+void	Server_int_QueueCommand(tClient *Client, char *CommandString);
+void	Server_int_ClearBatch(tClient *Client);
+ int	Server_int_IsAcctCommand(const char *Name, int Length);
+char	*Server_int_StripRequestID(char *Args);
+void	Server_int_RunRequest(tClient *Client, void (*Function)(tClient*,char*), char *Args, const char *Token);
 // --- Commands ---
 void	Server_Cmd_USER(tClient *Client, char *Args);
 void	Server_Cmd_PASS(tClient *Client, char *Args);
 void	Server_Cmd_AUTOAUTH(tClient *Client, char *Args);
 void	Server_Cmd_AUTHIDENT(tClient *Client, char *Args);
+void	Server_Cmd_MIFARE(tClient *Client, char *Args);
 void	Server_Cmd_SETEUSER(tClient *Client, char *Args);
 void	Server_Cmd_ENUMITEMS(tClient *Client, char *Args);
+void	Server_Cmd_WATCHITEMS(tClient *Client, char *Args);
 void	Server_Cmd_ITEMINFO(tClient *Client, char *Args);
 void	Server_Cmd_DISPENSE(tClient *Client, char *Args);
 void	Server_Cmd_REFUND(tClient *Client, char *Args);
@@ -78,19 +174,48 @@ void	Server_Cmd_GIVE(tClient *Client, char *Args);
 void	Server_Cmd_DONATE(tClient *Client, char *Args);
 void	Server_Cmd_ADD(tClient *Client, char *Args);
 void	Server_Cmd_SET(tClient *Client, char *Args);
+void	Server_Cmd_MULTI(tClient *Client, char *Args);
+void	Server_Cmd_EXEC(tClient *Client, char *Args);
+void	Server_Cmd_DISCARD(tClient *Client, char *Args);
 void	Server_Cmd_ENUMUSERS(tClient *Client, char *Args);
 void	Server_Cmd_USERINFO(tClient *Client, char *Args);
+void	Server_Cmd_HISTORY(tClient *Client, char *Args);
+void	Server_Cmd_USERSSINCE(tClient *Client, char *Args);
+void	Server_Cmd_SUBSCRIBE(tClient *Client, char *Args);
+void	Server_Cmd_SALESSTATS(tClient *Client, char *Args);
 void	_SendUserInfo(tClient *Client, int UserID);
+void	Server_int_FormatUserType(char *Buf, size_t Size, int Flags);
 void	Server_Cmd_USERADD(tClient *Client, char *Args);
 void	Server_Cmd_USERFLAGS(tClient *Client, char *Args);
 void	Server_Cmd_UPDATEITEM(tClient *Client, char *Args);
+void	Server_Cmd_RESTOCK(tClient *Client, char *Args);
 void	Server_Cmd_PINCHECK(tClient *Client, char *Args);
 void	Server_Cmd_PINSET(tClient *Client, char *Args);
+void	Server_Cmd_PASSSET(tClient *Client, char *Args);
+void	Server_Cmd_ADDCARD(tClient *Client, char *Args);
 // --- Helpers ---
 void	Debug(tClient *Client, const char *Format, ...);
  int	sendf(int Socket, const char *Format, ...);
+ int	Server_int_SendRaw(int Socket, const char *Data, int Length);
+ int	Arena_Printf(tReplyArena *Arena, const char *Format, ...);
+void	Arena_Send(tReplyArena *Arena, int Socket);
+ int	Arena_Push(tReplyArena *Arena, int Socket);
+void	Arena_Free(tReplyArena *Arena);
+void	Server_int_BeginCapture(int Socket);
+char	*Server_int_EndCapture(void);
  int	Server_int_ParseArgs(int bUseLongArg, char *ArgStr, ...);
  int	Server_int_ParseFlags(tClient *Client, const char *Str, int *Mask, int *Value);
+ int	Server_int_GetUserFlags(tClient *Client);
+ int	Server_int_GetEffectiveFlags(tClient *Client);
+char	*Server_int_FormatItem(tItem *Item, int Status);
+void	Server_int_SendItemList(tClient *Client);
+ int	Server_int_FormatChanges(tReplyArena *Arena, uint64_t Since, int *bFull);
+ int	Server_int_ContinueEnum(tClient *Client);
+void	Server_int_ProduceEnum(tEnumState *State, tAcctIterator *It);
+void	Server_int_EnumPrintf(tEnumState *State, const char *Format, ...);
+char	*Server_int_FormatCursor(int Sort, const tAcctRecord *Record);
+ int	Server_int_ParseCursor(const char *Str, int Sort, tAcctRecord *Record);
+void	Server_int_FreeEnum(tEnumState *State);
 
 // === CONSTANTS ===
 // - Commands
@@ -102,8 +227,10 @@ const struct sClientCommand {
 	{"PASS", Server_Cmd_PASS},
 	{"AUTOAUTH", Server_Cmd_AUTOAUTH},
 	{"AUTHIDENT", Server_Cmd_AUTHIDENT},
+	{"MIFARE", Server_Cmd_MIFARE},
 	{"SETEUSER", Server_Cmd_SETEUSER},
 	{"ENUM_ITEMS", Server_Cmd_ENUMITEMS},
+	{"WATCH_ITEMS", Server_Cmd_WATCHITEMS},
 	{"ITEM_INFO", Server_Cmd_ITEMINFO},
 	{"DISPENSE", Server_Cmd_DISPENSE},
 	{"REFUND", Server_Cmd_REFUND},
@@ -111,13 +238,23 @@ const struct sClientCommand {
 	{"DONATE", Server_Cmd_DONATE},
 	{"ADD", Server_Cmd_ADD},
 	{"SET", Server_Cmd_SET},
+	{"MULTI", Server_Cmd_MULTI},
+	{"EXEC", Server_Cmd_EXEC},
+	{"DISCARD", Server_Cmd_DISCARD},
 	{"ENUM_USERS", Server_Cmd_ENUMUSERS},
 	{"USER_INFO", Server_Cmd_USERINFO},
+	{"HISTORY", Server_Cmd_HISTORY},
+	{"USERS_SINCE", Server_Cmd_USERSSINCE},
+	{"SUBSCRIBE", Server_Cmd_SUBSCRIBE},
+	{"SALES_STATS", Server_Cmd_SALESSTATS},
 	{"USER_ADD", Server_Cmd_USERADD},
 	{"USER_FLAGS", Server_Cmd_USERFLAGS},
 	{"UPDATE_ITEM", Server_Cmd_UPDATEITEM},
+	{"RESTOCK", Server_Cmd_RESTOCK},
 	{"PIN_CHECK", Server_Cmd_PINCHECK},
-	{"PIN_SET", Server_Cmd_PINSET}
+	{"PIN_SET", Server_Cmd_PINSET},
+	{"PASS_SET", Server_Cmd_PASSSET},
+	{"ADD_CARD", Server_Cmd_ADDCARD}
 };
 #define NUM_COMMANDS	((int)(sizeof(gaServer_Commands)/sizeof(gaServer_Commands[0])))
 
@@ -132,6 +269,18 @@ struct in_addr	*gaServer_TrustedHosts;
 // - State variables
  int	giServer_Socket;	// Server socket
  int	giServer_NextClientID = 1;	// Debug client ID
+tClient	*gpServer_Clients;	// Open connections
+ int	giServer_ItemChangesPushed;	// Item changes sent to watchers so far
+// - Reply capture (see Server_int_BeginCapture)
+ int	giServer_CaptureSocket = -1;
+char	*gsServer_CaptureBuf;
+ int	giServer_CaptureLen;
+ 
+// - Commands that move money (can be queued by MULTI and take ID:<token>)
+const char	*casServer_AcctCommands[] = {
+	"DISPENSE", "GIVE", "ADD", "SET", "DONATE", "REFUND"
+};
+#define NUM_ACCT_COMMANDS	((int)(sizeof(casServer_AcctCommands)/sizeof(casServer_AcctCommands[0])))
  
 
 // === CODE ===
@@ -140,8 +289,7 @@ struct in_addr	*gaServer_TrustedHosts;
  */
 void Server_Start(void)
 {
-	 int	client_socket;
-	struct sockaddr_in	server_addr, client_addr;
+	struct sockaddr_in	server_addr;
 
 	// Parse trusted hosts list
 	giServer_NumTrustedHosts = Config_GetValueCount("trusted_host");
@@ -213,6 +361,15 @@ void Server_Start(void)
 	// Start the helper thread
 	StartPeriodicThread();
 	
+	AcctCache_Initialise();
+	Sales_Initialise();
+	
+	// Start the password checking threads
+	if( Auth_Initialise() ) {
+		fprintf(stderr, "ERROR: Unable to start auth workers\n");
+		return ;
+	}
+	
 	// Listen
 	if( listen(giServer_Socket, MAX_CONNECTION_QUEUE) < 0 ) {
 		fprintf(stderr, "ERROR: Unable to listen to socket\n");
@@ -233,83 +390,215 @@ void Server_Start(void)
 
 	for(;;)
 	{
-		uint	len = sizeof(client_addr);
-		 int	bTrusted = 0;
-		 int	bRootPort = 0;
+		fd_set	readfds, writefds;
+		 int	maxfd = giServer_Socket;
+		struct timeval	tv;
+		tClient	*client, **prev;
+		time_t	now;
+		static time_t	lastItemPoll;
+		static time_t	lastSalesFlush;
+		
+		FD_ZERO(&readfds);
+		FD_ZERO(&writefds);
+		FD_SET(giServer_Socket, &readfds);
+		FD_SET(Auth_GetNotifyFD(), &readfds);
+		if( Auth_GetNotifyFD() > maxfd )	maxfd = Auth_GetNotifyFD();
+		for( client = gpServer_Clients; client; client = client->Next )
+		{
+			// Waiting on PASS, leave further input in the socket
+			if( client->bAuthPending )	continue;
+			if( client->Socket > maxfd )	maxfd = client->Socket;
+			// Streaming, wait for room to send more
+			if( client->Enum ) {
+				FD_SET(client->Socket, &writefds);
+				// Still read (to notice a disconnect) until held input fills the buffer
+				if( client->InLen == INPUT_BUFFER_SIZE - 1 )	continue;
+			}
+			// Events waiting for room in the socket
+			else if( client->bWatchEvents && (client->EventsPartial || client->EventsSeq != Events_GetNextSeq()) ) {
+				FD_SET(client->Socket, &writefds);
+				// Replies can't go out mid-line, so the same goes for a partly sent event
+				if( client->EventsPartial && client->InLen == INPUT_BUFFER_SIZE - 1 )	continue;
+			}
+			FD_SET(client->Socket, &readfds);
+		}
 		
-		// Accept a connection
-		client_socket = accept(giServer_Socket, (struct sockaddr *) &client_addr, &len);
-		if(client_socket < 0) {
-			fprintf(stderr, "ERROR: Unable to accept client connection\n");
+		// Wake up every second to handle timeouts and item polling
+		tv.tv_sec = 1;
+		tv.tv_usec = 0;
+		if( select(maxfd + 1, &readfds, &writefds, NULL, &tv) < 0 ) {
+			if( errno == EINTR )	continue;
+			perror("select");
 			return ;
 		}
 		
-		// Set a timeout on the user conneciton
+		// Pick up outside changes to the bank before running anything
+		AcctCache_Sync();
+		
+		// Handle commands from existing connections
+		now = time(NULL);
+		for( client = gpServer_Clients; client; client = client->Next )
 		{
-			struct timeval tv;
-			tv.tv_sec = CLIENT_TIMEOUT;
-			tv.tv_usec = 0;
-			if( setsockopt(client_socket, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) )
+			if( client->bClosing || client->bAuthPending )	continue;
+			if( FD_ISSET(client->Socket, &readfds) ) {
+				if( Server_int_ReadClient(client) ) {
+					client->bClosing = 1;
+					continue ;
+				}
+			}
+			else if( !client->bWatchItems && !client->bWatchUsers && !client->bWatchEvents && now - client->LastActive >= CLIENT_TIMEOUT ) {
+				if(giDebugLevel >= 2)
+					Debug(client, "Timed out");
+				client->bClosing = 1;
+				continue ;
+			}
+			
+			if( client->Enum && FD_ISSET(client->Socket, &writefds) )
 			{
-				perror("setsockopt");
-				return ;
+				if( Server_int_ContinueEnum(client) ) {
+					client->bClosing = 1;
+					continue ;
+				}
+				if( !client->Enum ) {
+					// Catch up on item changes skipped while streaming
+					if( client->bItemsMissed ) {
+						client->bItemsMissed = 0;
+						Server_int_SendItemList(client);
+					}
+					// Run commands sent during the stream
+					Server_int_RunClientLines(client);
+				}
 			}
 		}
 		
-		// Debug: Print the connection string
-		if(giDebugLevel >= 2) {
-			char	ipstr[INET_ADDRSTRLEN];
-			inet_ntop(AF_INET, &client_addr.sin_addr, ipstr, INET_ADDRSTRLEN);
-			Debug_Debug("Client connection from %s:%i",
-				ipstr, ntohs(client_addr.sin_port));
+		// Finished password checks
+		if( FD_ISSET(Auth_GetNotifyFD(), &readfds) )
+			Server_int_FinishAuths();
+		
+		// New connection
+		if( FD_ISSET(giServer_Socket, &readfds) )
+			Server_int_AcceptClient();
+		
+		// Poll item availability while someone is watching
+		if( now - lastItemPoll >= ITEM_POLL_INTERVAL )
+		{
+			for( client = gpServer_Clients; client; client = client->Next )
+				if( client->bWatchItems && !client->bClosing )	break;
+			if( client )
+				Items_RefreshStatus();
+			lastItemPoll = now;
 		}
+		Server_int_PushItemChanges();
+		Server_int_PushUserChanges();
+		Server_int_PushEvents();
 		
-		// Doesn't matter what, localhost is trusted
-		if( ntohl( client_addr.sin_addr.s_addr ) == 0x7F000001 )
-			bTrusted = 1;
-	
-		// Check if the host is on the trusted list	
-		for( int i = 0; i < giServer_NumTrustedHosts; i ++ )
+		// Save the sales totals every so often (not on every sale)
+		if( now - lastSalesFlush >= SALES_FLUSH_INTERVAL )
 		{
-			if( memcmp(&client_addr.sin_addr, &gaServer_TrustedHosts[i], sizeof(struct in_addr)) == 0 )
-			{
-				bTrusted = 1;
-				break;
-			}
+			if( lastSalesFlush )
+				Sales_Flush();
+			lastSalesFlush = now;
 		}
-
-		// Root port (can AUTOAUTH if also a trusted machine
-		if( ntohs(client_addr.sin_port) < 1024 )
-			bRootPort = 1;
 		
-		#if 0
+		// Clean up closed connections
+		for( prev = &gpServer_Clients; (client = *prev); )
 		{
-			// TODO: Make this runtime configurable
-			switch( ntohl( client_addr.sin_addr.s_addr ) )
-			{
-			case 0x7F000001:	// 127.0.0.1	localhost
-		//	case 0x825F0D00:	// 130.95.13.0
-			case 0x825F0D04:	// 130.95.13.4  merlo
-		//	case 0x825F0D05:	// 130.95.13.5  heathred (MR)
-			case 0x825F0D07:	// 130.95.13.7	motsugo
-			case 0x825F0D11:	// 130.95.13.17	mermaid
-			case 0x825F0D12:	// 130.95.13.18	mussel
-			case 0x825F0D17:	// 130.95.13.23	martello
-			case 0x825F0D2A:	// 130.95.13.42 meersau
-		//	case 0x825F0D42:	// 130.95.13.66	heathred (Clubroom)
-				bTrusted = 1;
-				break;
-			default:
-				break;
+			if( client->bClosing ) {
+				*prev = client->Next;
+				Server_int_CloseClient(client);
 			}
+			else
+				prev = &client->Next;
 		}
-		#endif
-		
-		// TODO: Multithread this?
-		Server_HandleClient(client_socket, bTrusted, bRootPort);
-		
+	}
+}
+
+/**
+ * \brief Accept a new connection and add it to the client list
+ */
+void Server_int_AcceptClient(void)
+{
+	 int	client_socket;
+	struct sockaddr_in	client_addr;
+	uint	len = sizeof(client_addr);
+	 int	bTrusted = 0;
+	 int	bRootPort = 0;
+	tClient	*client;
+	
+	// Accept a connection
+	client_socket = accept(giServer_Socket, (struct sockaddr *) &client_addr, &len);
+	if(client_socket < 0) {
+		fprintf(stderr, "ERROR: Unable to accept client connection\n");
+		return ;
+	}
+	if( client_socket >= FD_SETSIZE ) {
+		fprintf(stderr, "ERROR: Too many connections, dropping client\n");
 		close(client_socket);
+		return ;
+	}
+	
+	// Debug: Print the connection string
+	if(giDebugLevel >= 2) {
+		char	ipstr[INET_ADDRSTRLEN];
+		inet_ntop(AF_INET, &client_addr.sin_addr, ipstr, INET_ADDRSTRLEN);
+		Debug_Debug("Client connection from %s:%i",
+			ipstr, ntohs(client_addr.sin_port));
+	}
+	
+	// Doesn't matter what, localhost is trusted
+	if( ntohl( client_addr.sin_addr.s_addr ) == 0x7F000001 )
+		bTrusted = 1;
+
+	// Check if the host is on the trusted list	
+	for( int i = 0; i < giServer_NumTrustedHosts; i ++ )
+	{
+		if( memcmp(&client_addr.sin_addr, &gaServer_TrustedHosts[i], sizeof(struct in_addr)) == 0 )
+		{
+			bTrusted = 1;
+			break;
+		}
+	}
+
+	// Root port (can AUTOAUTH if also a trusted machine
+	if( ntohs(client_addr.sin_port) < 1024 )
+		bRootPort = 1;
+	
+	#if 0
+	{
+		// TODO: Make this runtime configurable
+		switch( ntohl( client_addr.sin_addr.s_addr ) )
+		{
+		case 0x7F000001:	// 127.0.0.1	localhost
+	//	case 0x825F0D00:	// 130.95.13.0
+		case 0x825F0D04:	// 130.95.13.4  merlo
+	//	case 0x825F0D05:	// 130.95.13.5  heathred (MR)
+		case 0x825F0D07:	// 130.95.13.7	motsugo
+		case 0x825F0D11:	// 130.95.13.17	mermaid
+		case 0x825F0D12:	// 130.95.13.18	mussel
+		case 0x825F0D17:	// 130.95.13.23	martello
+		case 0x825F0D2A:	// 130.95.13.42 meersau
+	//	case 0x825F0D42:	// 130.95.13.66	heathred (Clubroom)
+			bTrusted = 1;
+			break;
+		default:
+			break;
+		}
 	}
+	#endif
+	
+	// Initialise Client info
+	client = calloc(1, sizeof(tClient));
+	client->Socket = client_socket;
+	client->ID = giServer_NextClientID ++;
+	client->SourceAddr = ntohl(client_addr.sin_addr.s_addr);
+	client->bTrustedHost = bTrusted;
+	client->bCanAutoAuth = bTrusted && bRootPort;
+	client->EffectiveUID = -1;
+	client->FlagsUID = client->FlagsEUID = -2;
+	client->LastActive = time(NULL);
+	
+	client->Next = gpServer_Clients;
+	gpServer_Clients = client;
 }
 
 void Server_Cleanup(void)
@@ -320,79 +609,318 @@ void Server_Cleanup(void)
 }
 
 /**
- * \brief Reads from a client socket and parses the command strings
- * \param Socket	Client socket number/handle
- * \param bTrusted	Is the client trusted?
+ * \brief Reads from a client socket and runs any complete commands
+ * \param Client	Client with data waiting
+ * \return Boolean "Connection closed"
+ *
+ * A line can span several calls to recv(), incomplete lines are kept in
+ * the client's input buffer until the rest arrives.
  */
-void Server_HandleClient(int Socket, int bTrusted, int bRootPort)
+int Server_int_ReadClient(tClient *Client)
 {
-	char	inbuf[INPUT_BUFFER_SIZE];
-	char	*buf = inbuf;
-	 int	remspace = INPUT_BUFFER_SIZE-1;
-	 int	bytes = -1;
-	tClient	clientInfo;
+	 int	bytes;
+	
+	bytes = recv(Client->Socket, Client->InBuf + Client->InLen, INPUT_BUFFER_SIZE - 1 - Client->InLen, 0);
+	if( bytes < 0 ) {
+		fprintf(stderr, "ERROR: Unable to recieve from client on socket %i\n", Client->Socket);
+		return 1;
+	}
+	if( bytes == 0 )
+		return 1;
 	
-	memset(&clientInfo, 0, sizeof(clientInfo));
+	Client->LastActive = time(NULL);
+	Client->InLen += bytes;
 	
-	// Initialise Client info
-	clientInfo.Socket = Socket;
-	clientInfo.ID = giServer_NextClientID ++;
-	clientInfo.bTrustedHost = bTrusted;
-	clientInfo.bCanAutoAuth = bTrusted && bRootPort;
-	clientInfo.EffectiveUID = -1;
-	
-	// Read from client
-	/*
-	 * Notes:
-	 * - The `buf` and `remspace` variables allow a line to span several
-	 *   calls to recv(), if a line is not completed in one recv() call
-	 *   it is saved to the beginning of `inbuf` and `buf` is updated to
-	 *   the end of it.
-	 */
-	// TODO: Use select() instead (to give a timeout)
-	while( (bytes = recv(Socket, buf, remspace, 0)) > 0 )
-	{
-		char	*eol, *start;
-		buf[bytes] = '\0';	// Allow us to use stdlib string functions on it
+	Server_int_RunClientLines(Client);
+	
+	return 0;
+}
+
+/**
+ * \brief Run the complete lines in a client's input buffer
+ * \note Stops early if a command has to wait (PASS, streamed ENUM_USERS, a partly
+ *       sent event line), the rest are run when it finishes
+ */
+void Server_int_RunClientLines(tClient *Client)
+{
+	char	*eol, *start;
+	
+	Client->InBuf[Client->InLen] = '\0';	// Allow us to use stdlib string functions on it
+	
+	// Split by lines
+	start = Client->InBuf;
+	while( !Client->bAuthPending && !Client->Enum && !Client->EventsPartial && (eol = strchr(start, '\n')) )
+	{
+		*eol = '\0';
+		
+		Server_ParseClientCommand(Client, start);
+		
+		start = eol + 1;
+	}
+	
+	// Keep any incomplete line
+	Client->InLen -= start - Client->InBuf;
+	memmove(Client->InBuf, start, Client->InLen);
+	if( !Client->bAuthPending && !Client->Enum && !Client->EventsPartial && Client->InLen == INPUT_BUFFER_SIZE - 1 ) {
+		send(Client->Socket, MSG_STR_TOO_LONG, sizeof(MSG_STR_TOO_LONG), 0);
+		Client->InLen = 0;
+	}
+}
+
+/**
+ * \brief Reply to clients whose password checks have finished
+ */
+void Server_int_FinishAuths(void)
+{
+	 int	clientID, uid, flags;
+	tClient	*client;
+	
+	while( Auth_GetResult(&clientID, &uid) )
+	{
+		for( client = gpServer_Clients; client; client = client->Next )
+			if( client->ID == clientID )	break;
+		// Disconnected while waiting
+		if( !client || client->bClosing )
+			continue ;
+		
+		client->bAuthPending = 0;
+		client->LastActive = time(NULL);
+		
+		if( uid == -1 ) {
+			sendf(client->Socket, "401 Auth Failure\n");
+		}
+		else if( (flags = AcctCache_GetFlags(uid)) & USER_FLAG_DISABLED ) {
+			sendf(client->Socket, "403 Account Disabled\n");
+		}
+		else if( flags & USER_FLAG_INTERNAL ) {
+			sendf(client->Socket, "403 Internal account\n");
+		}
+		else {
+			client->UID = uid;
+			client->bIsAuthed = 1;
+			sendf(client->Socket, "200 Auth OK\n");
+		}
+		
+		// Run anything sent after the PASS
+		Server_int_RunClientLines(client);
+	}
+}
+
+/**
+ * \brief Close a client connection and release its state
+ */
+void Server_int_CloseClient(tClient *Client)
+{
+	if(giDebugLevel >= 2) {
+		printf("Client %i: Disconnected\n", Client->ID);
+	}
+	close(Client->Socket);
+	Server_int_ClearBatch(Client);
+	if( Client->Enum )
+		Server_int_FreeEnum(Client->Enum);
+	free(Client->EventsPartial);
+	free(Client->Username);
+	free(Client);
+}
+
+/**
+ * \brief Send logged item changes to all WATCH_ITEMS subscribers
+ *
+ * Each change is formatted once and written to every watcher, so the cost
+ * is proportional to the number of changes (not the size of the item list)
+ */
+void Server_int_PushItemChanges(void)
+{
+	 int	changeCount = Items_GetChangeCount();
+	tClient	*client;
+	
+	for( ; giServer_ItemChangesPushed < changeCount; giServer_ItemChangesPushed ++ )
+	{
+		tItem	*item = Items_GetChange(giServer_ItemChangesPushed);
+		char	*line;
+		 int	len;
 		
-		// Split by lines
-		start = inbuf;
-		while( (eol = strchr(start, '\n')) )
+		// Table reloaded (or the log overflowed), resend everything
+		if( !item )
 		{
-			*eol = '\0';
-			
-			Server_ParseClientCommand(&clientInfo, start);
+			for( client = gpServer_Clients; client; client = client->Next )
+			{
+				if( !client->bWatchItems || client->bClosing )	continue;
+				if( client->Enum )
+					client->bItemsMissed = 1;
+				else
+					Server_int_SendItemList(client);
+			}
+			giServer_ItemChangesPushed = changeCount;
+			break;
+		}
+		
+		line = Server_int_FormatItem(item, item->Status);
+		len = strlen(line);
+		for( client = gpServer_Clients; client; client = client->Next )
+		{
+			char	*userLine = NULL, *out = line;
+			 int	status, outLen = len;
 			
-			start = eol + 1;
+			if( !client->bWatchItems || client->bClosing )	continue;
+			// Can't interleave with a stream, the whole list is resent after it
+			if( client->Enum ) {
+				client->bItemsMissed = 1;
+				continue;
+			}
+			// The user's rights can narrow the status down (e.g. the door)
+			status = Items_GetUserStatus(item, client->UID, item->Status);
+			if( status != item->Status ) {
+				out = userLine = Server_int_FormatItem(item, status);
+				outLen = strlen(userLine);
+			}
+			// Don't block on a watcher that isn't reading
+			if( send(client->Socket, out, outLen, MSG_DONTWAIT) != outLen ) {
+				if(giDebugLevel)
+					Debug(client, "Dropping stalled watcher");
+				client->bClosing = 1;
+			}
+			free(userLine);
 		}
+		free(line);
+	}
+}
+
+/**
+ * \brief Send committed account changes to USERS_SINCE streams
+ *
+ * Watchers are normally all at the same seq, so the changes are formatted
+ * once. One that fell behind (e.g. during an ENUM_USERS stream) gets its own.
+ */
+void Server_int_PushUserChanges(void)
+{
+	uint64_t	seq = Bank_GetChangeSeq();
+	tReplyArena	arena = {NULL, NULL};
+	uint64_t	arenaSince = 0;
+	 int	bHaveArena = 0;
+	tClient	*client;
+	
+	for( client = gpServer_Clients; client; client = client->Next )
+	{
+		if( !client->bWatchUsers || client->bClosing || client->Enum )	continue;
+		if( client->UsersSeq == seq )	continue;
 		
-		// Check if there was an incomplete line
-		if( *start != '\0' ) {
-			 int	tailBytes = bytes - (start-buf);
-			// Roll back in buffer
-			memcpy(inbuf, start, tailBytes);
-			remspace -= tailBytes;
-			if(remspace == 0) {
-				send(Socket, MSG_STR_TOO_LONG, sizeof(MSG_STR_TOO_LONG), 0);
-				buf = inbuf;
-				remspace = INPUT_BUFFER_SIZE - 1;
+		if( !bHaveArena || arenaSince != client->UsersSeq )
+		{
+			 int	bFull;
+			Arena_Free(&arena);
+			arenaSince = client->UsersSeq;
+			bHaveArena = 1;
+			if( Server_int_FormatChanges(&arena, arenaSince, &bFull) < 0
+			 || Arena_Printf(&arena, "100 Seq %"PRIu64"\n", seq) )
+			{
+				Arena_Free(&arena);
+				bHaveArena = 0;
+				continue ;
 			}
 		}
-		else {
-			buf = inbuf;
-			remspace = INPUT_BUFFER_SIZE - 1;
+		
+		// Don't block on a watcher that isn't reading
+		if( Arena_Push(&arena, client->Socket) ) {
+			if(giDebugLevel)
+				Debug(client, "Dropping stalled watcher");
+			client->bClosing = 1;
+			continue ;
 		}
+		client->UsersSeq = seq;
 	}
+	Arena_Free(&arena);
+}
+
+/**
+ * \brief Send new events to SUBSCRIBE EVENTS subscribers
+ *
+ * Never blocks. Events a subscriber has no room for stay in the event ring,
+ * if it falls further behind than the ring holds the oldest are dropped.
+ */
+void Server_int_PushEvents(void)
+{
+	uint64_t	next = Events_GetNextSeq();
+	uint64_t	first = Events_GetFirstSeq();
+	tClient	*client;
 	
-	// Check for errors
-	if( bytes < 0 ) {
-		fprintf(stderr, "ERROR: Unable to recieve from client on socket %i\n", Socket);
-		return ;
+	for( client = gpServer_Clients; client; client = client->Next )
+	{
+		 int	rv = 0;
+		
+		if( !client->bWatchEvents || client->bClosing || client->Enum )	continue;
+		
+		// Finish off a partly sent line
+		if( client->EventsPartial )
+		{
+			ssize_t	sent = send(client->Socket, client->EventsPartial, client->EventsPartialLen, MSG_DONTWAIT);
+			if( sent < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR )
+				rv = -1;
+			else if( sent > 0 ) {
+				client->EventsPartialLen -= sent;
+				memmove(client->EventsPartial, client->EventsPartial + sent, client->EventsPartialLen);
+			}
+			if( rv == 0 && client->EventsPartialLen == 0 ) {
+				free(client->EventsPartial);
+				client->EventsPartial = NULL;
+				// Run commands held while the line was part sent
+				Server_int_RunClientLines(client);
+				if( client->bClosing || client->Enum || !client->bWatchEvents )	continue;
+			}
+		}
+		
+		if( rv == 0 && !client->EventsPartial && client->EventsSeq < first )
+		{
+			char	line[64];
+			 int	len = snprintf(line, sizeof(line), "100 Events dropped %"PRIu64"\n", first - client->EventsSeq);
+			rv = Server_int_PushEventLine(client, line, len);
+			// Unless nothing was sent (then the count is redone next time)
+			if( rv == 0 || client->EventsPartial )
+				client->EventsSeq = first;
+		}
+		
+		while( rv == 0 && !client->EventsPartial && client->EventsSeq < next )
+		{
+			 int	len;
+			const char	*line = Events_Get(client->EventsSeq, &len);
+			rv = Server_int_PushEventLine(client, line, len);
+			if( rv == 0 || client->EventsPartial )
+				client->EventsSeq ++;
+		}
+		
+		if( rv == -1 ) {
+			if(giDebugLevel)
+				Debug(client, "Dropping event subscriber (send failed)");
+			client->bClosing = 1;
+		}
 	}
+}
+
+/**
+ * \brief Send an event line without blocking
+ * \return 0 if sent, 1 if the socket is full (any unsent part is kept in
+ *         EventsPartial), -1 on error
+ */
+int Server_int_PushEventLine(tClient *Client, const char *Line, int Length)
+{
+	ssize_t	rv;
 	
-	if(giDebugLevel >= 2) {
-		printf("Client %i: Disconnected\n", clientInfo.ID);
+	rv = send(Client->Socket, Line, Length, MSG_DONTWAIT);
+	if( rv < 0 ) {
+		if( errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR )
+			return -1;
+		return 1;
 	}
+	if( rv == Length )
+		return 0;
+	
+	// Copy the rest, the line can be overwritten in the ring before there is room
+	Client->EventsPartial = malloc(Length - rv);
+	if( !Client->EventsPartial )
+		return -1;
+	memcpy(Client->EventsPartial, Line + rv, Length - rv);
+	Client->EventsPartialLen = Length - rv;
+	return 1;
 }
 
 /**
@@ -409,6 +937,13 @@ void Server_ParseClientCommand(tClient *Client, char *CommandString)
 	if( giDebugLevel >= 2 )
 		Debug(Client, "Server_ParseClientCommand: (CommandString = '%s')", CommandString);
 	
+	// Inside MULTI, everything but EXEC/DISCARD is queued
+	if( Client->bInBatch && strcmp(CommandString, "EXEC") != 0 && strcmp(CommandString, "DISCARD") != 0 )
+	{
+		Server_int_QueueCommand(Client, CommandString);
+		return ;
+	}
+	
 	if( Server_int_ParseArgs(1, CommandString, &command, &args, NULL) )
 	{
 		if( command == NULL )	return ;
@@ -420,9 +955,15 @@ void Server_ParseClientCommand(tClient *Client, char *CommandString)
 	for( i = 0; i < NUM_COMMANDS; i++ )
 	{
 		if(strcmp(command, gaServer_Commands[i].Name) == 0) {
+			char	*token = NULL;
 			if( giDebugLevel >= 2 )
 				Debug(Client, "CMD %s - \"%s\"", command, args);
-			gaServer_Commands[i].Function(Client, args);
+			if( Server_int_IsAcctCommand(command, strlen(command)) )
+				token = Server_int_StripRequestID(args);
+			if( token )
+				Server_int_RunRequest(Client, gaServer_Commands[i].Function, args, token);
+			else
+				gaServer_Commands[i].Function(Client, args);
 			return ;
 		}
 	}
@@ -430,90 +971,263 @@ void Server_ParseClientCommand(tClient *Client, char *CommandString)
 	sendf(Client->Socket, "400 Unknown Command\n");
 }
 
-// ---
-// Commands
-// ---
 /**
- * \brief Set client username
- * 
- * Usage: USER <username>
+ * \brief Add a command to the client's MULTI batch
+ *
+ * Only the account manipulation commands can be batched, anything else (or
+ * a batch that is too long) marks the batch as invalid so that EXEC discards it.
  */
-void Server_Cmd_USER(tClient *Client, char *Args)
+void Server_int_QueueCommand(tClient *Client, char *CommandString)
 {
-	char	*username;
+	 int	len;
 	
-	if( Server_int_ParseArgs(0, Args, &username, NULL) )
-	{
-		sendf(Client->Socket, "407 USER takes 1 argument\n");
+	len = strcspn(CommandString, " ");
+	if( !Server_int_IsAcctCommand(CommandString, len) ) {
+		sendf(Client->Socket, "407 Command %.*s not allowed in MULTI\n", len, CommandString);
+		Client->bBatchInvalid = 1;
 		return ;
 	}
 	
-	// Debug!
-	if( giDebugLevel )
-		Debug(Client, "Authenticating as '%s'", username);
-	
-	// Save username
-	if(Client->Username)
-		free(Client->Username);
-	Client->Username = strdup(username);
+	if( !Client->bIsAuthed ) {
+		sendf(Client->Socket, "401 Not Authenticated\n");
+		Client->bBatchInvalid = 1;
+		return ;
+	}
 	
-	#if USE_SALT
-	// Create a salt (that changes if the username is changed)
-	// Yes, I know, I'm a little paranoid, but who isn't?
-	Client->Salt[0] = 0x21 + (rand()&0x3F);
-	Client->Salt[1] = 0x21 + (rand()&0x3F);
-	Client->Salt[2] = 0x21 + (rand()&0x3F);
-	Client->Salt[3] = 0x21 + (rand()&0x3F);
-	Client->Salt[4] = 0x21 + (rand()&0x3F);
-	Client->Salt[5] = 0x21 + (rand()&0x3F);
-	Client->Salt[6] = 0x21 + (rand()&0x3F);
-	Client->Salt[7] = 0x21 + (rand()&0x3F);
+	if( Client->BatchLen == MAX_BATCH_COMMANDS ) {
+		sendf(Client->Socket, "407 Too many commands in MULTI (limit %i)\n", MAX_BATCH_COMMANDS);
+		Client->bBatchInvalid = 1;
+		return ;
+	}
 	
-	// TODO: Also send hash type to use, (SHA1 or crypt according to [DAA])
-	sendf(Client->Socket, "100 SALT %s\n", Client->Salt);
-	#else
-	sendf(Client->Socket, "100 User Set\n");
-	#endif
+	Client->Batch[Client->BatchLen++] = strdup(CommandString);
+	sendf(Client->Socket, "100 Queued %i\n", Client->BatchLen);
 }
 
 /**
- * \brief Authenticate as a user
- * 
- * Usage: PASS <hash>
+ * \brief Check if the first \a Length characters of \a Name are a money moving command
  */
-void Server_Cmd_PASS(tClient *Client, char *Args)
+int Server_int_IsAcctCommand(const char *Name, int Length)
 {
-	char	*passhash;
-	 int	flags;
-
-	if( Server_int_ParseArgs(0, Args, &passhash, NULL) )
+	for( int i = 0; i < NUM_ACCT_COMMANDS; i ++ )
 	{
-		sendf(Client->Socket, "407 PASS takes 1 argument\n");
-		return ;
+		if( strncmp(Name, casServer_AcctCommands[i], Length) == 0
+		 && casServer_AcctCommands[i][Length] == '\0' )
+			return 1;
 	}
-	
-	// Pass on to cokebank
-	Client->UID = Bank_GetUserAuth(Client->Salt, Client->Username, passhash);
+	return 0;
+}
 
-	if( Client->UID == -1 ) {
-		sendf(Client->Socket, "401 Auth Failure\n");
+/**
+ * \brief Remove a trailing " ID:<token>" from a command's arguments
+ * \return Pointer to the token (in \a Args), or NULL if there was none
+ */
+char *Server_int_StripRequestID(char *Args)
+{
+	char	*pos;
+	
+	if( !Args )	return NULL;
+	
+	if( strncmp(Args, "ID:", 3) == 0 )
+		pos = Args;
+	else {
+		pos = strrchr(Args, ' ');
+		if( !pos || strncmp(pos+1, "ID:", 3) != 0 )
+			return NULL;
+		*pos++ = '\0';
+	}
+	*pos = '\0';	// Leaves an empty argument string if ID: was alone
+	return pos + 3;
+}
+
+/**
+ * \brief Run a command carrying a request ID (at most once)
+ *
+ * If the ID has been seen for this user, the stored reply is sent again.
+ * Otherwise the command is run, and its reply is stored in the same bank
+ * transaction as its changes. As in EXEC, the hardware dispense happens
+ * after the commit (and is refunded if it fails).
+ */
+void Server_int_RunRequest(tClient *Client, void (*Function)(tClient*,char*), char *Args, const char *Token)
+{
+	char	*reply;
+	 int	len, captureStart = 0, bOwnCapture;
+	 int	dispenseResult = 0, bFailed = 0;
+	
+	// Validate token
+	len = strspn(Token, "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_.");
+	if( len == 0 || len > MAX_REQUEST_ID_LEN || Token[len] != '\0' ) {
+		sendf(Client->Socket, "407 Bad request ID\n");
+		return ;
+	}
+	
+	if( !Client->bIsAuthed ) {
+		sendf(Client->Socket, "401 Not Authenticated\n");
+		return ;
+	}
+	
+	// Replay?
+	reply = Bank_GetRequestResult(Client->UID, Token);
+	if( reply ) {
+		if( giDebugLevel )
+			Debug(Client, "Replaying request '%s'", Token);
+		sendf(Client->Socket, "%s", reply);
+		free(reply);
+		return ;
+	}
+	
+	if( Bank_StartTransaction() ) {
+		sendf(Client->Socket, "500 Unable to start transaction\n");
+		return ;
+	}
+	
+	// Inside EXEC the reply is already being captured (and the dispense deferred,
+	// EXEC re-saves the result if the drop fails)
+	bOwnCapture = !Client->bRunningBatch;
+	if( bOwnCapture ) {
+		DispenseBatchStart();
+		Server_int_BeginCapture(Client->Socket);
+	}
+	else {
+		captureStart = giServer_CaptureLen;
+	}
+	
+	Function(Client, Args);
+	
+	if( bOwnCapture )
+		reply = Server_int_EndCapture();
+	else
+		reply = gsServer_CaptureBuf ? strdup(gsServer_CaptureBuf + captureStart) : NULL;
+	if( !reply )
+		reply = strdup("500 No reply\n");
+	
+	if( Bank_SaveRequestResult(Client->UID, Token, reply) ) {
+		AcctCache_AbortTransaction();
+		bFailed = 1;
+	}
+	else if( AcctCache_CommitTransaction() ) {
+		bFailed = 1;	// Already rolled back
+	}
+	
+	if( bFailed )
+	{
+		free(reply);
+		if( bOwnCapture ) {
+			DispenseBatchFinish(0, NULL);
+			sendf(Client->Socket, "500 Unable to save request\n");
+		}
+		else {
+			// Make EXEC roll back
+			giServer_CaptureLen = captureStart;
+			sendf(Client->Socket, "500 Unable to save request\n");
+		}
 		return ;
 	}
+	
+	if( !bOwnCapture )
+	{
+		free(Client->BatchToken);
+		Client->BatchToken = strdup(Token);
+	}
+	else
+	{
+		DispenseBatchFinish(1, &dispenseResult);
+		if( dispenseResult != 0 ) {
+			free(reply);
+			reply = strdup("500 Dispense Error (refunded)\n");
+			Bank_SaveRequestResult(Client->UID, Token, reply);
+		}
+		sendf(Client->Socket, "%s", reply);
+	}
+	free(reply);
+}
 
-	flags = Bank_GetFlags(Client->UID);
-	if( flags & USER_FLAG_DISABLED ) {
-		Client->UID = -1;
-		sendf(Client->Socket, "403 Account Disabled\n");
+/**
+ * \brief Leave MULTI mode and free any queued commands
+ */
+void Server_int_ClearBatch(tClient *Client)
+{
+	for( int i = 0; i < Client->BatchLen; i ++ )
+		free(Client->Batch[i]);
+	Client->BatchLen = 0;
+	Client->bInBatch = 0;
+	Client->bBatchInvalid = 0;
+}
+
+// ---
+// Commands
+// ---
+/**
+ * \brief Set client username
+ * 
+ * Usage: USER <username>
+ */
+void Server_Cmd_USER(tClient *Client, char *Args)
+{
+	char	*username;
+	
+	if( Server_int_ParseArgs(0, Args, &username, NULL) )
+	{
+		sendf(Client->Socket, "407 USER takes 1 argument\n");
 		return ;
 	}
-	if( flags & USER_FLAG_INTERNAL ) {
-		Client->UID = -1;
-		sendf(Client->Socket, "403 Internal account\n");
+	
+	// Debug!
+	if( giDebugLevel )
+		Debug(Client, "Authenticating as '%s'", username);
+	
+	// Save username
+	if(Client->Username)
+		free(Client->Username);
+	Client->Username = strdup(username);
+	
+	#if USE_SALT
+	// Create a salt (that changes if the username is changed)
+	// Yes, I know, I'm a little paranoid, but who isn't?
+	Client->Salt[0] = 0x21 + (rand()&0x3F);
+	Client->Salt[1] = 0x21 + (rand()&0x3F);
+	Client->Salt[2] = 0x21 + (rand()&0x3F);
+	Client->Salt[3] = 0x21 + (rand()&0x3F);
+	Client->Salt[4] = 0x21 + (rand()&0x3F);
+	Client->Salt[5] = 0x21 + (rand()&0x3F);
+	Client->Salt[6] = 0x21 + (rand()&0x3F);
+	Client->Salt[7] = 0x21 + (rand()&0x3F);
+	
+	// TODO: Also send hash type to use, (SHA1 or crypt according to [DAA])
+	sendf(Client->Socket, "100 SALT %s\n", Client->Salt);
+	#else
+	sendf(Client->Socket, "100 User Set\n");
+	#endif
+}
+
+/**
+ * \brief Authenticate as a user
+ * 
+ * Usage: PASS <hash>
+ */
+void Server_Cmd_PASS(tClient *Client, char *Args)
+{
+	char	*passhash;
+
+	if( Server_int_ParseArgs(0, Args, &passhash, NULL) )
+	{
+		sendf(Client->Socket, "407 PASS takes 1 argument\n");
 		return ;
 	}
 	
-	Client->bIsAuthed = 1;
-	sendf(Client->Socket, "200 Auth OK\n");
+	if( !Client->Username ) {
+		sendf(Client->Socket, "401 Auth Failure\n");
+		return ;
+	}
+	
+	// Pass on to cokebank (on an auth worker, the reply is sent by Server_int_FinishAuths)
+	Client->UID = -1;
+	Client->bIsAuthed = 0;
+	if( Auth_Queue(Client->ID, Client->Salt, Client->Username, passhash) ) {
+		sendf(Client->Socket, "501 Too many logins in progress, try again\n");
+		return ;
+	}
+	Client->bAuthPending = 1;
 }
 
 /**
@@ -541,7 +1255,7 @@ void Server_Cmd_AUTOAUTH(tClient *Client, char *Args)
 	}
 	
 	// Get UID
-	Client->UID = Bank_GetAcctByName( username, 0 );	
+	Client->UID = AcctCache_GetAcctByName( username, 0 );	
 	if( Client->UID < 0 ) {
 		if(giDebugLevel)
 			Debug(Client, "Unknown user '%s'", username);
@@ -549,7 +1263,7 @@ void Server_Cmd_AUTOAUTH(tClient *Client, char *Args)
 		return ;
 	}
 	
-	userflags = Bank_GetFlags(Client->UID);
+	userflags = Server_int_GetUserFlags(Client);
 	// You can't be an internal account
 	if( userflags & USER_FLAG_INTERNAL ) {
 		if(giDebugLevel)
@@ -612,7 +1326,7 @@ void Server_Cmd_AUTHIDENT(tClient *Client, char *Args)
 	}
 
 	// Get UID
-	Client->UID = Bank_GetAcctByName( username, 0 );
+	Client->UID = AcctCache_GetAcctByName( username, 0 );
 	if( Client->UID < 0 ) {
 		if(giDebugLevel)
 			Debug(Client, "Unknown user '%s'", username);
@@ -621,7 +1335,7 @@ void Server_Cmd_AUTHIDENT(tClient *Client, char *Args)
 		return ;
 	}
 
-	userflags = Bank_GetFlags(Client->UID);
+	userflags = Server_int_GetUserFlags(Client);
 	// You can't be an internal account
 	if( userflags & USER_FLAG_INTERNAL ) {
 		if(giDebugLevel)
@@ -654,6 +1368,66 @@ void Server_Cmd_AUTHIDENT(tClient *Client, char *Args)
 	sendf(Client->Socket, "200 Auth OK\n");
 }
 
+/**
+ * \brief Authenticate using a MIFARE card
+ *
+ * Usage: MIFARE <card_id_hex>
+ * Only allowed from trusted hosts (the card reader is trusted to have read the card)
+ */
+void Server_Cmd_MIFARE(tClient *Client, char *Args)
+{
+	char	*cardid, *username;
+	 int	uid, userflags;
+	
+	if( Server_int_ParseArgs(0, Args, &cardid, NULL) )
+	{
+		sendf(Client->Socket, "407 MIFARE takes 1 argument\n");
+		return ;
+	}
+	
+	if( !Client->bTrustedHost ) {
+		if(giDebugLevel)
+			Debug(Client, "Untrusted client attempting to MIFARE");
+		sendf(Client->Socket, "401 Untrusted\n");
+		return ;
+	}
+	
+	// Card index is in memory, so this doesn't touch the database
+	uid = Bank_GetCardLogin(cardid, &userflags, &username);
+	if( uid < 0 ) {
+		if(giDebugLevel)
+			Debug(Client, "Unknown card '%s'", cardid);
+		sendf(Client->Socket, "404 Bad Card ID\n");
+		return ;
+	}
+	
+	// You can't be an internal account
+	if( userflags & USER_FLAG_INTERNAL ) {
+		free(username);
+		sendf(Client->Socket, "403 Account is internal\n");
+		return ;
+	}
+	
+	// Disabled accounts
+	if( userflags & USER_FLAG_DISABLED ) {
+		free(username);
+		sendf(Client->Socket, "403 Account disabled\n");
+		return ;
+	}
+	
+	// Save username
+	if(Client->Username)
+		free(Client->Username);
+	Client->Username = username;
+	Client->UID = uid;
+	Client->bIsAuthed = 1;
+	
+	if(giDebugLevel)
+		Debug(Client, "MIFARE authenticated as '%s' (%i)", username, uid);
+	
+	sendf(Client->Socket, "200 Auth OK as %s\n", username);
+}
+
 /**
  * \brief Set effective user
  */
@@ -680,22 +1454,22 @@ void Server_Cmd_SETEUSER(tClient *Client, char *Args)
 	}
 
 	// Check user permissions
-	userFlags = Bank_GetFlags(Client->UID);
+	userFlags = Server_int_GetUserFlags(Client);
 	if( !(userFlags & (USER_FLAG_COKE|USER_FLAG_ADMIN)) ) {
 		sendf(Client->Socket, "403 Not in coke\n");
 		return ;
 	}
 	
 	// Set id
-	Client->EffectiveUID = Bank_GetAcctByName(username, 0);
+	Client->EffectiveUID = AcctCache_GetAcctByName(username, 0);
 	if( Client->EffectiveUID == -1 ) {
 		sendf(Client->Socket, "404 User not found\n");
 		return ;
 	}
+	eUserFlags = Server_int_GetEffectiveFlags(Client);
 	// You can't be an internal account (unless you're an admin)
 	if( !(userFlags & USER_FLAG_ADMIN) )
 	{
-		eUserFlags = Bank_GetFlags(Client->EffectiveUID);
 		if( eUserFlags & USER_FLAG_INTERNAL ) {
 			Client->EffectiveUID = -1;
 			sendf(Client->Socket, "404 User not found\n");
@@ -716,66 +1490,124 @@ void Server_Cmd_SETEUSER(tClient *Client, char *Args)
 }
 
 /**
- * \brief Send an item status to the client
- * \param Client	Who to?
- * \param Item	Item to send
+ * \brief Format an item line (as sent by ITEM_INFO)
+ * \return Heap string
  */
-void Server_int_SendItem(tClient *Client, tItem *Item)
+char *Server_int_FormatItem(tItem *Item, int Status)
 {
-	char	*status = "avail";
+	const char	*status;
 	
-	if( Item->Handler->CanDispense )
+	switch(Status)
 	{
-		switch(Item->Handler->CanDispense(Client->UID, Item->ID))
-		{
-		case  0:	status = "avail";	break;
-		case  1:	status = "sold";	break;
-		default:
-		case -1:	status = "error";	break;
-		}
+	case 0:	status = "avail";	break;
+	case 1:	status = "sold";	break;
+	default:	status = "error";	break;
 	}
 	
-	if( !gbNoCostMode && Item->Price == 0 )
-		status = "error";
-	// KNOWN HACK: Naming a slot 'dead' disables it
-	if( strcmp(Item->Name, "dead") == 0 )
-		status = "sold";	// Another status?
-	
-	sendf(Client->Socket,
-		"202 Item %s:%i %s %i %s\n",
+	return mkstr("202 Item %s:%i %s %i %s\n",
 		Item->Handler->Name, Item->ID, status, Item->Price, Item->Name
 		);
 }
 
 /**
- * \brief Enumerate the items that the server knows about
+ * \brief Send an item status to the client
+ * \param Client	Who to?
+ * \param Item	Item to send
  */
-void Server_Cmd_ENUMITEMS(tClient *Client, char *Args)
+void Server_int_SendItem(tClient *Client, tItem *Item)
 {
-	 int	i, count;
+	char	*line = Server_int_FormatItem( Item, Items_GetUserStatus(Item, Client->UID, Items_GetStatus(Item)) );
+	sendf(Client->Socket, "%s", line);
+	free(line);
+}
 
-	if( Args != NULL && strlen(Args) ) {
-		sendf(Client->Socket, "407 ENUM_ITEMS takes no arguments\n");
-		return ;
-	}
+/**
+ * \brief Send the list of shown items (using their cached status)
+ * \note The cached status is the same for everyone, the client's rights
+ *       are applied as each line is formatted
+ */
+void Server_int_SendItemList(tClient *Client)
+{
+	 int	i, count;
 	
-	// Count shown items
 	count = 0;
 	for( i = 0; i < giNumItems; i ++ ) {
 		if( gaItems[i].bHidden )	continue;
 		count ++;
 	}
 
-	sendf(Client->Socket, "201 Items %i\n", count);
+	sendf(Client->Socket, "201 Items %i %i\n", count, giItems_Version);
 
 	for( i = 0; i < giNumItems; i ++ ) {
+		char	*line;
 		if( gaItems[i].bHidden )	continue;
-		Server_int_SendItem( Client, &gaItems[i] );
+		line = Server_int_FormatItem( &gaItems[i], Items_GetUserStatus(&gaItems[i], Client->UID, gaItems[i].Status) );
+		sendf(Client->Socket, "%s", line);
+		free(line);
 	}
 
 	sendf(Client->Socket, "200 List end\n");
 }
 
+/**
+ * \brief Enumerate the items that the server knows about
+ *
+ * Usage: ENUM_ITEMS [IF_NEWER <version>]
+ */
+void Server_Cmd_ENUMITEMS(tClient *Client, char *Args)
+{
+	 int	i;
+	 int	knownVersion = -1;
+	char	*mode, *version;
+
+	if( Args != NULL && strlen(Args) )
+	{
+		if( Server_int_ParseArgs(0, Args, &mode, &version, NULL) || strcmp(mode, "IF_NEWER") != 0 ) {
+			sendf(Client->Socket, "407 ENUM_ITEMS takes no arguments or IF_NEWER <version>\n");
+			return ;
+		}
+		knownVersion = atoi(version);
+	}
+	
+	// Refresh the status of shown items (which may bump the version)
+	// - Only the shared status, so the version doesn't change with who asks
+	for( i = 0; i < giNumItems; i ++ ) {
+		if( gaItems[i].bHidden )	continue;
+		Items_GetStatus( &gaItems[i] );
+	}
+
+	// Client's cached copy is still current
+	if( knownVersion != -1 && knownVersion >= giItems_Version ) {
+		sendf(Client->Socket, "200 Not Modified %i\n", giItems_Version);
+		return ;
+	}
+
+	Server_int_SendItemList(Client);
+}
+
+/**
+ * \brief Subscribe to item updates
+ *
+ * Usage: WATCH_ITEMS
+ *
+ * Sends the item list, then pushes an item line whenever an item changes
+ * (or the whole list again if the table is reloaded)
+ */
+void Server_Cmd_WATCHITEMS(tClient *Client, char *Args)
+{
+	if( Args != NULL && strlen(Args) ) {
+		sendf(Client->Socket, "407 WATCH_ITEMS takes no arguments\n");
+		return ;
+	}
+	
+	// Make sure the initial list is current (changes from here on are pushed)
+	Items_RefreshStatus();
+	Server_int_PushItemChanges();
+	
+	Server_int_SendItemList(Client);
+	Client->bWatchItems = 1;
+}
+
 tItem *_GetItemFromString(char *String)
 {
 	tHandler	*handler;
@@ -910,12 +1742,12 @@ void Server_Cmd_REFUND(tClient *Client, char *Args)
 	}
 
 	// Check user permissions
-	if( !(Bank_GetFlags(Client->UID) & (USER_FLAG_COKE|USER_FLAG_ADMIN))  ) {
+	if( !(Server_int_GetUserFlags(Client) & (USER_FLAG_COKE|USER_FLAG_ADMIN))  ) {
 		sendf(Client->Socket, "403 Not in coke\n");
 		return ;
 	}
 
-	uid = Bank_GetAcctByName(username, 0);
+	uid = AcctCache_GetAcctByName(username, 0);
 	if( uid == -1 ) {
 		sendf(Client->Socket, "404 Unknown user\n");
 		return ;
@@ -963,7 +1795,7 @@ void Server_Cmd_GIVE(tClient *Client, char *Args)
 	}
 
 	// Get recipient
-	uid = Bank_GetAcctByName(recipient, 0);
+	uid = AcctCache_GetAcctByName(recipient, 0);
 	if( uid == -1 ) {
 		sendf(Client->Socket, "404 Invalid target user\n");
 		return ;
@@ -1068,13 +1900,13 @@ void Server_Cmd_ADD(tClient *Client, char *Args)
 	}
 
 	// Check user permissions
-	if( !(Bank_GetFlags(Client->UID) & (USER_FLAG_COKE|USER_FLAG_ADMIN))  ) {
+	if( !(Server_int_GetUserFlags(Client) & (USER_FLAG_COKE|USER_FLAG_ADMIN))  ) {
 		sendf(Client->Socket, "403 Not in coke\n");
 		return ;
 	}
 
 	#if !ROOT_CAN_ADD
-	if( strcmp( Client->Username, "root" ) == 0 ) {
+	if( Client->UID == giDispense_RootAcct ) {
 		// Allow adding for new users
 		if( strcmp(reason, "treasurer: new user") != 0 ) {
 			sendf(Client->Socket, "403 Root may not add\n");
@@ -1092,16 +1924,16 @@ void Server_Cmd_ADD(tClient *Client, char *Args)
 	#endif
 
 	// Get recipient
-	uid = Bank_GetAcctByName(user, 0);
+	uid = AcctCache_GetAcctByName(user, 0);
 	if( uid == -1 ) {
 		sendf(Client->Socket, "404 Invalid user\n");
 		return ;
 	}
 	
 	// You can't alter an internal account
-	if( !(Bank_GetFlags(Client->UID) & USER_FLAG_ADMIN) )
+	if( !(Server_int_GetUserFlags(Client) & USER_FLAG_ADMIN) )
 	{
-		if( Bank_GetFlags(uid) & USER_FLAG_INTERNAL ) {
+		if( AcctCache_GetFlags(uid) & USER_FLAG_INTERNAL ) {
 			sendf(Client->Socket, "403 Admin only\n");
 			return ;
 		}
@@ -1147,13 +1979,13 @@ void Server_Cmd_SET(tClient *Client, char *Args)
 	}
 
 	// Check user permissions
-	if( !(Bank_GetFlags(Client->UID) & USER_FLAG_ADMIN)  ) {
+	if( !(Server_int_GetUserFlags(Client) & USER_FLAG_ADMIN)  ) {
 		sendf(Client->Socket, "403 Not an admin\n");
 		return ;
 	}
 
 	// Get recipient
-	uid = Bank_GetAcctByName(user, 0);
+	uid = AcctCache_GetAcctByName(user, 0);
 	if( uid == -1 ) {
 		sendf(Client->Socket, "404 Invalid user\n");
 		return ;
@@ -1179,35 +2011,215 @@ void Server_Cmd_SET(tClient *Client, char *Args)
 	}
 }
 
-void Server_Cmd_ENUMUSERS(tClient *Client, char *Args)
+/**
+ * \brief Start queueing commands for a single transaction
+ *
+ * Usage: MULTI
+ */
+void Server_Cmd_MULTI(tClient *Client, char *Args)
 {
-	 int	i, numRet = 0;
-	tAcctIterator	*it;
-	 int	maxBal = INT_MAX, minBal = INT_MIN;
-	 int	flagMask = 0, flagVal = 0;
-	 int	sort = BANK_ITFLAG_SORT_NAME;
-	time_t	lastSeenAfter=0, lastSeenBefore=0;
+	if( Args != NULL && strlen(Args) ) {
+		sendf(Client->Socket, "407 MULTI takes no arguments\n");
+		return ;
+	}
 	
-	 int	flags;	// Iterator flags
-	 int	balValue;	// Balance value for iterator
-	time_t	timeValue;	// Time value for iterator
+	if( !Client->bIsAuthed ) {
+		sendf(Client->Socket, "401 Not Authenticated\n");
+		return ;
+	}
 	
-	// Parse arguments
-	if( Args && strlen(Args) )
-	{
-		char	*space = Args, *type, *val;
-		do
-		{
-			type = space;
-			while(*type == ' ')	type ++;
-			// Get next space
-			space = strchr(space, ' ');
-			if(space)	*space = '\0';
-			
-			// Get type
-			val = strchr(type, ':');
-			if( val ) {
-				*val = '\0';
+	if( Client->bInBatch ) {
+		sendf(Client->Socket, "407 Already in MULTI\n");
+		return ;
+	}
+	
+	Client->bInBatch = 1;
+	sendf(Client->Socket, "200 Batch started\n");
+}
+
+/**
+ * \brief Run all commands queued since MULTI in one bank transaction
+ *
+ * Usage: EXEC
+ *
+ * Each command's reply is sent (in order) followed by a status line, all as
+ * one write. If any command fails the whole batch is rolled back, the
+ * remaining commands are not run. Hardware dispenses are deferred until
+ * after the commit, and refunded if the drop fails.
+ */
+void Server_Cmd_EXEC(tClient *Client, char *Args)
+{
+	char	*replies[MAX_BATCH_COMMANDS];
+	char	*tokens[MAX_BATCH_COMMANDS] = {0};	// Request ID of each command (if it had one)
+	 int	dispenseCmd[MAX_BATCH_COMMANDS];	// Command index for each deferred dispense
+	 int	dispenseResults[MAX_BATCH_COMMANDS];
+	 int	i, failedCmd = -1, numDispenses, dispensesFailed = 0;
+	
+	if( Args != NULL && strlen(Args) ) {
+		sendf(Client->Socket, "407 EXEC takes no arguments\n");
+		return ;
+	}
+	
+	if( !Client->bInBatch ) {
+		sendf(Client->Socket, "407 EXEC without MULTI\n");
+		return ;
+	}
+	
+	if( Client->bBatchInvalid ) {
+		sendf(Client->Socket, "407 Batch discarded (invalid command queued)\n");
+		Server_int_ClearBatch(Client);
+		return ;
+	}
+	Client->bInBatch = 0;	// So the queued commands are actually run
+	
+	if( Bank_StartTransaction() ) {
+		sendf(Client->Socket, "500 Unable to start transaction\n");
+		Server_int_ClearBatch(Client);
+		return ;
+	}
+	DispenseBatchStart();
+	
+	for( i = 0; i < Client->BatchLen; i ++ )
+	{
+		 int	prevDispenses = DispenseBatchCount();
+		
+		if( failedCmd != -1 ) {
+			replies[i] = strdup("501 Not run (batch rolled back)\n");
+			continue ;
+		}
+		
+		Server_int_BeginCapture(Client->Socket);
+		Client->bRunningBatch = 1;
+		Server_ParseClientCommand(Client, Client->Batch[i]);
+		Client->bRunningBatch = 0;
+		replies[i] = Server_int_EndCapture();
+		tokens[i] = Client->BatchToken;
+		Client->BatchToken = NULL;
+		
+		if( !replies[i] || replies[i][0] != '2' )
+			failedCmd = i;
+		else if( DispenseBatchCount() != prevDispenses )
+			dispenseCmd[prevDispenses] = i;
+	}
+	
+	// All or nothing
+	if( failedCmd == -1 && AcctCache_CommitTransaction() == 0 )
+	{
+		numDispenses = DispenseBatchCount();
+		DispenseBatchFinish(1, dispenseResults);
+		for( i = 0; i < numDispenses; i ++ )
+		{
+			if( dispenseResults[i] == 0 )	continue ;
+			free(replies[dispenseCmd[i]]);
+			replies[dispenseCmd[i]] = strdup("500 Dispense Error (refunded)\n");
+			if( tokens[dispenseCmd[i]] )
+				Bank_SaveRequestResult(Client->UID, tokens[dispenseCmd[i]], replies[dispenseCmd[i]]);
+			dispensesFailed ++;
+		}
+	}
+	else
+	{
+		if( failedCmd == -1 )
+			failedCmd = Client->BatchLen;	// Commit failed
+		else
+			AcctCache_AbortTransaction();
+		DispenseBatchFinish(0, NULL);
+		if( giDebugLevel )
+			Debug(Client, "Batch rolled back at command %i", failedCmd+1);
+	}
+	
+	// Send all replies in one go
+	{
+		 int	len = 0, ofs = 0;
+		char	*buf;
+		char	*status;
+		
+		if( failedCmd != -1 )
+			status = mkstr("501 Batch rolled back at %i\n", failedCmd+1);
+		else if( dispensesFailed )
+			status = mkstr("500 Batch committed, %i dispenses failed\n", dispensesFailed);
+		else
+			status = mkstr("200 Batch committed %i\n", Client->BatchLen);
+		
+		for( i = 0; i < Client->BatchLen; i ++ )
+			len += replies[i] ? strlen(replies[i]) : 0;
+		len += strlen(status);
+		
+		buf = malloc(len + 1);
+		for( i = 0; i < Client->BatchLen; i ++ )
+		{
+			if( !replies[i] )	continue ;
+			strcpy(buf + ofs, replies[i]);
+			ofs += strlen(replies[i]);
+			free(replies[i]);
+		}
+		strcpy(buf + ofs, status);
+		free(status);
+		
+		send(Client->Socket, buf, len, 0);
+		free(buf);
+	}
+	
+	for( i = 0; i < Client->BatchLen; i ++ )
+		free(tokens[i]);
+	Server_int_ClearBatch(Client);
+}
+
+/**
+ * \brief Throw away the commands queued since MULTI
+ *
+ * Usage: DISCARD
+ */
+void Server_Cmd_DISCARD(tClient *Client, char *Args)
+{
+	if( Args != NULL && strlen(Args) ) {
+		sendf(Client->Socket, "407 DISCARD takes no arguments\n");
+		return ;
+	}
+	
+	if( !Client->bInBatch ) {
+		sendf(Client->Socket, "407 DISCARD without MULTI\n");
+		return ;
+	}
+	
+	Server_int_ClearBatch(Client);
+	sendf(Client->Socket, "200 Batch discarded\n");
+}
+
+void Server_Cmd_ENUMUSERS(tClient *Client, char *Args)
+{
+	 int	numRet = 0;
+	tAcctIterator	*it;
+	tAcctRecord	rec;
+	tReplyArena	arena = {NULL, NULL};
+	 int	maxBal = INT_MAX, minBal = INT_MIN;
+	 int	flagMask = 0, flagVal = 0;
+	 int	sort = BANK_ITFLAG_SORT_NAME;
+	time_t	lastSeenAfter=0, lastSeenBefore=0;
+	 int	limit = -1;
+	const char	*after = NULL;	// Cursor (in Args)
+	 int	afterLen = 0;
+	
+	 int	flags;	// Iterator flags
+	 int	balValue;	// Balance value for iterator
+	time_t	timeValue;	// Time value for iterator
+	
+	// Parse arguments
+	if( Args && strlen(Args) )
+	{
+		char	*space = Args, *type, *val;
+		do
+		{
+			type = space;
+			while(*type == ' ')	type ++;
+			// Get next space
+			space = strchr(space, ' ');
+			if(space)	*space = '\0';
+			
+			// Get type
+			val = strchr(type, ':');
+			if( val ) {
+				*val = '\0';
 				val ++;
 				
 				// Types
@@ -1226,12 +2238,25 @@ void Server_Cmd_ENUMUSERS(tClient *Client, char *Args)
 				}
 				// - Last seen before timestamp
 				else if( strcmp(type, "last_seen_before") == 0 ) {
-					lastSeenAfter = atoll(val);
+					lastSeenBefore = atoll(val);
 				}
 				// - Last seen after timestamp
 				else if( strcmp(type, "last_seen_after") == 0 ) {
 					lastSeenAfter = atoll(val);
 				}
+				// - Page size
+				else if( strcmp(type, "limit") == 0 ) {
+					limit = atoi(val);
+					if( limit <= 0 ) {
+						sendf(Client->Socket, "407 Bad limit '%s'\n", val);
+						return ;
+					}
+				}
+				// - Continue from a cursor (parsed once the sort is known)
+				else if( strcmp(type, "after") == 0 ) {
+					after = val;
+					afterLen = strlen(val);
+				}
 				// - Sorting 
 				else if( strcmp(type, "sort") == 0 ) {
 					char	*dash = strchr(val, '-');
@@ -1309,104 +2334,615 @@ void Server_Cmd_ENUMUSERS(tClient *Client, char *Args)
 	else {
 		timeValue = 0;
 	}
+	
+	// Paged, streamed as the client reads
+	if( limit != -1 || after )
+	{
+		tEnumState	*state = calloc(1, sizeof(tEnumState));
+		
+		if( !state ) {
+			sendf(Client->Socket, "500 Out of memory\n");
+			return ;
+		}
+		if( after ) {
+			char	cursor[afterLen + 1];
+			memcpy(cursor, after, afterLen);
+			cursor[afterLen] = '\0';
+			if( Server_int_ParseCursor(cursor, sort, &state->Cursor) ) {
+				free(state);
+				sendf(Client->Socket, "407 Bad cursor '%s'\n", cursor);
+				return ;
+			}
+			state->bHaveCursor = 1;
+		}
+		state->FlagMask = flagMask;
+		state->FlagValue = flagVal;
+		state->ItFlags = flags;
+		state->BalValue = balValue;
+		state->TimeValue = timeValue;
+		state->MinBal = minBal;
+		state->MaxBal = maxBal;
+		state->Remaining = limit;
+		
+		Client->Enum = state;
+		Server_int_EnumPrintf(state, "203 Users paged\n");
+		// Send what fits now, the main loop sends the rest
+		if( Server_int_ContinueEnum(Client) )
+			Client->bClosing = 1;
+		return ;
+	}
+	
 	it = Bank_Iterator(flagMask, flagVal, flags, balValue, timeValue);
+	if( !it ) {
+		sendf(Client->Socket, "500 Unable to list users\n");
+		return ;
+	}
 	
-	// Get return number
-	while( (i = Bank_IteratorNext(it)) != -1 )
+	// One pass over the accounts, lines are held until the count is known
+	while( Bank_IteratorNextRecord(it, &rec) != -1 )
 	{
-		int bal = Bank_GetBalance(i);
+		char	type[64];
 		
-		if( bal == INT_MIN )	continue;
+		if( rec.Balance == INT_MIN )	continue;
 		
-		if( bal < minBal )	continue;
-		if( bal > maxBal )	continue;
+		if( rec.Balance < minBal )	continue;
+		if( rec.Balance > maxBal )	continue;
 		
+		Server_int_FormatUserType(type, sizeof(type), rec.Flags);
+		if( Arena_Printf(&arena, "202 User %s %i %s\n", rec.Name, rec.Balance, type) ) {
+			Bank_DelIterator(it);
+			Arena_Free(&arena);
+			sendf(Client->Socket, "500 Out of memory\n");
+			return ;
+		}
 		numRet ++;
 	}
 	
-	Bank_DelIterator(it);
-	
-	// Send count
-	sendf(Client->Socket, "201 Users %i\n", numRet);
-	
-	
-	// Create iterator
-	it = Bank_Iterator(flagMask, flagVal, flags, balValue, timeValue);
+	Bank_DelIterator(it);
+	
+	sendf(Client->Socket, "201 Users %i\n", numRet);
+	Arena_Send(&arena, Client->Socket);
+	Arena_Free(&arena);
+	
+	sendf(Client->Socket, "200 List End\n");
+}
+
+void Server_Cmd_USERINFO(tClient *Client, char *Args)
+{
+	 int	uid;
+	char	*user;
+	
+	// Parse arguments
+	if( Server_int_ParseArgs(0, Args, &user, NULL) ) {
+		sendf(Client->Socket, "407 USER_INFO takes 1 argument\n");
+		return ;
+	}
+	
+	if( giDebugLevel )	Debug(Client, "User Info '%s'", user);
+	
+	// Get recipient
+	uid = AcctCache_GetAcctByName(user, 0);
+	
+	if( giDebugLevel >= 2 )	Debug(Client, "uid = %i", uid);
+	if( uid == -1 ) {
+		sendf(Client->Socket, "404 Invalid user\n");
+		return ;
+	}
+	
+	_SendUserInfo(Client, uid);
+}
+
+/**
+ * \brief List transfers into and out of an account (newest first)
+ */
+void Server_Cmd_HISTORY(tClient *Client, char *Args)
+{
+	char	*user, *opts, *opt;
+	 int	uid;
+	time_t	since = 0;
+	 int	limit = DEF_HISTORY_LIMIT;
+	 int	numRet = 0;
+	tLedgerIterator	*it;
+	tLedgerEntry	ent;
+	tReplyArena	arena = {NULL, NULL};
+	
+	// Parse arguments
+	user = Args;
+	while( user && *user == ' ' )	user ++;
+	if( !user || *user == '\0' ) {
+		sendf(Client->Socket, "407 HISTORY takes a user and optional since:/limit:\n");
+		return ;
+	}
+	opts = strchr(user, ' ');
+	if( opts )	*opts++ = '\0';
+	for( opt = opts ? strtok(opts, " ") : NULL; opt; opt = strtok(NULL, " ") )
+	{
+		if( strncmp(opt, "since:", 6) == 0 ) {
+			since = atoll(opt + 6);
+		}
+		else if( strncmp(opt, "limit:", 6) == 0 ) {
+			limit = atoi(opt + 6);
+			if( limit <= 0 ) {
+				sendf(Client->Socket, "407 Bad limit '%s'\n", opt + 6);
+				return ;
+			}
+		}
+		else {
+			sendf(Client->Socket, "407 Unknown argument to HISTORY '%s'\n", opt);
+			return ;
+		}
+	}
+	
+	if( !Client->bIsAuthed ) {
+		sendf(Client->Socket, "401 Not Authenticated\n");
+		return ;
+	}
+	
+	uid = AcctCache_GetAcctByName(user, 0);
+	if( uid == -1 ) {
+		sendf(Client->Socket, "404 Invalid user\n");
+		return ;
+	}
+	
+	// Anyone can see their own history, other accounts need admin
+	if( uid != Client->UID && !(Server_int_GetUserFlags(Client) & USER_FLAG_ADMIN) ) {
+		sendf(Client->Socket, "403 Not an admin\n");
+		return ;
+	}
+	
+	it = Bank_HistoryIterator(uid, since, limit);
+	if( !it ) {
+		sendf(Client->Socket, "501 History not available\n");
+		return ;
+	}
+	
+	while( Bank_HistoryNext(it, &ent) == 0 )
+	{
+		 int	other, ammount;
+		const char	*otherName, *actorName;
+		
+		// Amounts are from the point of view of the listed account
+		if( ent.SourceAcct == uid ) {
+			other = ent.DestAcct;
+			ammount = -ent.Ammount;
+		}
+		else {
+			other = ent.SourceAcct;
+			ammount = ent.Ammount;
+		}
+		otherName = AcctCache_GetAcctName(other);
+		actorName = ent.Actor == -1 ? NULL : AcctCache_GetAcctName(ent.Actor);
+		
+		if( Arena_Printf(&arena, "202 Entry %lli %lli %i %s %s %s\n",
+				(long long)ent.Seq, (long long)ent.Time, ammount,
+				otherName ? otherName : "-", actorName ? actorName : "-",
+				ent.Reason) )
+		{
+			Bank_DelHistoryIterator(it);
+			Arena_Free(&arena);
+			sendf(Client->Socket, "500 Out of memory\n");
+			return ;
+		}
+		numRet ++;
+	}
+	Bank_DelHistoryIterator(it);
+	
+	sendf(Client->Socket, "201 History %i\n", numRet);
+	Arena_Send(&arena, Client->Socket);
+	Arena_Free(&arena);
+	
+	sendf(Client->Socket, "200 List End\n");
+}
+
+/**
+ * \brief Accounts changed since a bank change seq (optionally pushing later ones)
+ *
+ * Usage: USERS_SINCE <seq> [stream]
+ */
+void Server_Cmd_USERSSINCE(tClient *Client, char *Args)
+{
+	char	*seqStr, *mode, *end;
+	uint64_t	since, seq;
+	tReplyArena	arena = {NULL, NULL};
+	 int	count, bFull;
+	 int	bStream = 0;
+	
+	// Parse arguments
+	if( Server_int_ParseArgs(0, Args, &seqStr, &mode, NULL) ) {
+		// Only the mode is optional
+		if( !seqStr || mode ) {
+			sendf(Client->Socket, "407 USERS_SINCE takes a sequence number and optional 'stream'\n");
+			return ;
+		}
+	}
+	since = strtoull(seqStr, &end, 10);
+	if( *seqStr == '\0' || *end != '\0' ) {
+		sendf(Client->Socket, "407 Bad sequence number '%s'\n", seqStr);
+		return ;
+	}
+	if( mode ) {
+		if( strcmp(mode, "stream") != 0 ) {
+			sendf(Client->Socket, "407 Unknown argument to USERS_SINCE '%s'\n", mode);
+			return ;
+		}
+		bStream = 1;
+	}
+	
+	seq = Bank_GetChangeSeq();
+	count = Server_int_FormatChanges(&arena, since, &bFull);
+	if( count < 0 ) {
+		Arena_Free(&arena);
+		sendf(Client->Socket, "500 Unable to list users\n");
+		return ;
+	}
+	
+	// A full list replaces everything the client has
+	sendf(Client->Socket, "201 %s %i %"PRIu64"\n", bFull ? "Users" : "Changes", count, seq);
+	Arena_Send(&arena, Client->Socket);
+	Arena_Free(&arena);
+	sendf(Client->Socket, "200 List End\n");
+	
+	if( bStream ) {
+		Client->bWatchUsers = 1;
+		Client->UsersSeq = seq;
+	}
+}
+
+/**
+ * \brief Subscribe to a stream of pushed lines (admins only)
+ *
+ * Usage: SUBSCRIBE EVENTS
+ */
+void Server_Cmd_SUBSCRIBE(tClient *Client, char *Args)
+{
+	char	*stream;
+	
+	if( Server_int_ParseArgs(0, Args, &stream, NULL) ) {
+		sendf(Client->Socket, "407 SUBSCRIBE takes 1 argument\n");
+		return ;
+	}
+	
+	if( strcmp(stream, "EVENTS") != 0 ) {
+		sendf(Client->Socket, "407 Unknown stream '%s'\n", stream);
+		return ;
+	}
+	
+	if( !Client->bIsAuthed ) {
+		sendf(Client->Socket, "401 Not Authenticated\n");
+		return ;
+	}
+	
+	if( !(Server_int_GetUserFlags(Client) & USER_FLAG_ADMIN) ) {
+		sendf(Client->Socket, "403 Not an admin\n");
+		return ;
+	}
+	
+	if( !Client->bWatchEvents ) {
+		Client->bWatchEvents = 1;
+		Client->EventsSeq = Events_GetNextSeq();
+	}
+	sendf(Client->Socket, "200 Subscribed %"PRIu64"\n", Client->EventsSeq);
+}
+
+/**
+ * \brief Sales totals for a time range
+ *
+ * Usage: SALES_STATS [<item_id>|<handler>] [<from> [<to>]]
+ */
+void Server_Cmd_SALESSTATS(tClient *Client, char *Args)
+{
+	char	*args[3] = {NULL, NULL, NULL};
+	const char	*series = NULL, *name;
+	time_t	range[2] = {0, time(NULL) + 1};
+	 int	nTimes = 0, count, revenue, lines = 0;
+	size_t	seriesLen = 0;
+	tReplyArena	arena = {NULL, NULL};
+	
+	// Fewer is fine, more is not
+	if( Server_int_ParseArgs(0, Args, &args[0], &args[1], &args[2], NULL) && args[2] ) {
+		sendf(Client->Socket, "407 SALES_STATS takes [<item>|<handler>] [<from> [<to>]]\n");
+		return ;
+	}
+	
+	for( int i = 0; i < 3 && args[i]; i ++ )
+	{
+		char	*end;
+		long long	val;
+		
+		// The item/handler is the only argument that doesn't start with a digit
+		if( i == 0 && !isdigit((unsigned char)args[i][0]) ) {
+			series = args[i];
+			seriesLen = strlen(series);
+			continue ;
+		}
+		val = strtoll(args[i], &end, 10);
+		if( *end != '\0' || nTimes == 2 ) {
+			sendf(Client->Socket, "407 SALES_STATS takes [<item>|<handler>] [<from> [<to>]]\n");
+			return ;
+		}
+		range[nTimes++] = val;
+	}
+	
+	// A handler matches itself and its items, an item only itself
+	for( int i = 0; (name = Sales_GetSeries(i)); i ++ )
+	{
+		if( series ) {
+			if( strncmp(name, series, seriesLen) != 0 )	continue;
+			if( name[seriesLen] != '\0' && (name[seriesLen] != ':' || strchr(series, ':')) )
+				continue;
+		}
+		Sales_GetTotals(i, range[0], range[1], &count, &revenue);
+		if( count == 0 && revenue == 0 )	continue;
+		if( Arena_Printf(&arena, "202 Sales %s %i %i\n", name, count, revenue) ) {
+			Arena_Free(&arena);
+			sendf(Client->Socket, "500 Unable to list sales\n");
+			return ;
+		}
+		lines ++;
+	}
+	
+	sendf(Client->Socket, "201 Sales %i\n", lines);
+	Arena_Send(&arena, Client->Socket);
+	Arena_Free(&arena);
+	sendf(Client->Socket, "200 List End\n");
+}
+
+/**
+ * \brief Format "202 User" lines for accounts changed after \a Since
+ * \param bFull	Set if every account was listed instead (\a Since is 0, or unknown to the bank)
+ * \return Number of lines, or -1 on error
+ */
+int Server_int_FormatChanges(tReplyArena *Arena, uint64_t Since, int *bFull)
+{
+	tAcctIterator	*it = NULL;
+	tAcctRecord	rec;
+	 int	count = 0;
+	
+	if( Since )
+		it = Bank_ChangedSince(Since);
+	*bFull = (it == NULL);
+	if( !it )
+		it = Bank_Iterator(0, 0, BANK_ITFLAG_SORT_NAME, 0, 0);
+	if( !it )
+		return -1;
+	
+	while( Bank_IteratorNextRecord(it, &rec) != -1 )
+	{
+		char	type[64];
+		
+		if( rec.Balance == INT_MIN )	continue;
+		
+		Server_int_FormatUserType(type, sizeof(type), rec.Flags);
+		if( Arena_Printf(Arena, "202 User %s %i %s\n", rec.Name, rec.Balance, type) ) {
+			Bank_DelIterator(it);
+			return -1;
+		}
+		count ++;
+	}
+	Bank_DelIterator(it);
+	return count;
+}
+
+void _SendUserInfo(tClient *Client, int UserID)
+{
+	char	type[64];
+	
+	Server_int_FormatUserType(type, sizeof(type), AcctCache_GetFlags(UserID));
+	sendf(
+		Client->Socket, "202 User %s %i %s\n",
+		AcctCache_GetAcctName(UserID), AcctCache_GetBalance(UserID), type
+		);
+}
+
+/**
+ * \brief Format the type field of a "202 User" line (e.g. "coke,admin,door")
+ */
+void Server_int_FormatUserType(char *Buf, size_t Size, int Flags)
+{
+	const char	*type, *disabled="", *door="";
+	
+	if( Flags & USER_FLAG_INTERNAL ) {
+		type = "internal";
+	}
+	else if( Flags & USER_FLAG_COKE ) {
+		if( Flags & USER_FLAG_ADMIN )
+			type = "coke,admin";
+		else
+			type = "coke";
+	}
+	else if( Flags & USER_FLAG_ADMIN ) {
+		type = "admin";
+	}
+	else {
+		type = "user";
+	}
+	
+	if( Flags & USER_FLAG_DISABLED )
+		disabled = ",disabled";
+	if( Flags & USER_FLAG_DOORGROUP )
+		door = ",door";
+	
+	snprintf(Buf, Size, "%s%s%s", type, disabled, door);
+}
+
+/**
+ * \brief Send more of a streamed ENUM_USERS
+ * \return Boolean failure (connection lost)
+ * \note Frees Client->Enum once the end line has been sent
+ */
+int Server_int_ContinueEnum(tClient *Client)
+{
+	tEnumState	*state = Client->Enum;
+	tAcctIterator	*it = NULL;
+	 int	bCaptured = (Client->Socket == giServer_CaptureSocket);
+	
+	for( ;; )
+	{
+		// Send what has been produced, stop if the socket is full
+		while( state->OutPos < state->OutLen )
+		{
+			 int	len = state->OutLen - state->OutPos;
+			 int	rv;
+			if( bCaptured )
+				rv = Server_int_SendRaw(Client->Socket, state->OutBuf + state->OutPos, len);
+			else
+				rv = send(Client->Socket, state->OutBuf + state->OutPos, len, MSG_DONTWAIT);
+			if( rv < 0 ) {
+				if( errno == EINTR )	continue;
+				if( it )	Bank_DelIterator(it);
+				return !(errno == EAGAIN || errno == EWOULDBLOCK);
+			}
+			state->OutPos += rv;
+			Client->LastActive = time(NULL);
+		}
+		state->OutPos = state->OutLen = 0;
+		
+		if( state->bDone )
+			break;
+		
+		// Resume after the last account looked at
+		if( !it ) {
+			it = Bank_IteratorAfter(state->FlagMask, state->FlagValue, state->ItFlags,
+				state->BalValue, state->TimeValue, state->bHaveCursor ? &state->Cursor : NULL);
+			if( !it ) {
+				Server_int_EnumPrintf(state, "500 Unable to list users\n");
+				state->bDone = 1;
+				continue ;
+			}
+		}
+		Server_int_ProduceEnum(state, it);
+	}
+	
+	if( it )	Bank_DelIterator(it);
+	Server_int_FreeEnum(state);
+	Client->Enum = NULL;
+	return 0;
+}
+
+/**
+ * \brief Format the next ENUM_STREAM_CHUNK bytes of a streamed ENUM_USERS
+ */
+void Server_int_ProduceEnum(tEnumState *State, tAcctIterator *It)
+{
+	tAcctRecord	rec;
+	char	type[64];
 	
-	while( (i = Bank_IteratorNext(it)) != -1 )
+	while( State->OutLen < ENUM_STREAM_CHUNK )
 	{
-		int bal = Bank_GetBalance(i);
+		if( Bank_IteratorNextRecord(It, &rec) == -1 ) {
+			Server_int_EnumPrintf(State, "200 List End\n");
+			State->bDone = 1;
+			return ;
+		}
+		
+		// Remember where we are (the iterator may be closed after any row)
+		free( (char*)State->Cursor.Name );
+		State->Cursor = rec;
+		State->Cursor.Name = strdup(rec.Name ? rec.Name : "");
+		State->bHaveCursor = 1;
 		
-		if( bal == INT_MIN )	continue;
+		if( rec.Balance == INT_MIN )	continue;
+		if( rec.Balance < State->MinBal )	continue;
+		if( rec.Balance > State->MaxBal )	continue;
 		
-		if( bal < minBal )	continue;
-		if( bal > maxBal )	continue;
+		// Another match after a full page, tell the client where to continue
+		if( State->Remaining == 0 ) {
+			Server_int_EnumPrintf(State, "200 List End %s\n", State->PageEnd);
+			State->bDone = 1;
+			return ;
+		}
 		
-		_SendUserInfo(Client, i);
+		Server_int_FormatUserType(type, sizeof(type), rec.Flags);
+		Server_int_EnumPrintf(State, "202 User %s %i %s\n", rec.Name, rec.Balance, type);
+		if( State->Remaining > 0 && --State->Remaining == 0 )
+			State->PageEnd = Server_int_FormatCursor(State->ItFlags, &rec);
 	}
-	
-	Bank_DelIterator(it);
-	
-	sendf(Client->Socket, "200 List End\n");
 }
 
-void Server_Cmd_USERINFO(tClient *Client, char *Args)
+/**
+ * \brief Append a line to the stream's output buffer
+ */
+void Server_int_EnumPrintf(tEnumState *State, const char *Format, ...)
 {
-	 int	uid;
-	char	*user;
-	
-	// Parse arguments
-	if( Server_int_ParseArgs(0, Args, &user, NULL) ) {
-		sendf(Client->Socket, "407 USER_INFO takes 1 argument\n");
-		return ;
-	}
-	
-	if( giDebugLevel )	Debug(Client, "User Info '%s'", user);
+	va_list	args;
+	 int	len;
 	
-	// Get recipient
-	uid = Bank_GetAcctByName(user, 0);
+	va_start(args, Format);
+	len = vsnprintf(NULL, 0, Format, args);
+	va_end(args);
 	
-	if( giDebugLevel >= 2 )	Debug(Client, "uid = %i", uid);
-	if( uid == -1 ) {
-		sendf(Client->Socket, "404 Invalid user\n");
-		return ;
+	if( State->OutLen + len + 1 > State->OutSpace )
+	{
+		 int	space = State->OutLen + len + 1;
+		char	*tmp;
+		if( space < ENUM_STREAM_CHUNK * 2 )	space = ENUM_STREAM_CHUNK * 2;
+		tmp = realloc(State->OutBuf, space);
+		if( !tmp )	return ;	// Line is dropped
+		State->OutBuf = tmp;
+		State->OutSpace = space;
 	}
 	
-	_SendUserInfo(Client, uid);
+	va_start(args, Format);
+	vsnprintf(State->OutBuf + State->OutLen, len + 1, Format, args);
+	va_end(args);
+	State->OutLen += len;
 }
 
-void _SendUserInfo(tClient *Client, int UserID)
+/**
+ * \brief Format a paging cursor ("<id>:<sort key>")
+ * \return Heap string
+ */
+char *Server_int_FormatCursor(int Sort, const tAcctRecord *Record)
 {
-	char	*type, *disabled="", *door="";
-	 int	flags = Bank_GetFlags(UserID);
-	
-	if( flags & USER_FLAG_INTERNAL ) {
-		type = "internal";
-	}
-	else if( flags & USER_FLAG_COKE ) {
-		if( flags & USER_FLAG_ADMIN )
-			type = "coke,admin";
-		else
-			type = "coke";
-	}
-	else if( flags & USER_FLAG_ADMIN ) {
-		type = "admin";
-	}
-	else {
-		type = "user";
+	switch( Sort & BANK_ITFLAG_SORTMASK )
+	{
+	case BANK_ITFLAG_SORT_BAL:
+		return mkstr("%i:%i", Record->AcctID, Record->Balance);
+	case BANK_ITFLAG_SORT_LASTSEEN:
+		return mkstr("%i:%lld", Record->AcctID, (long long)Record->LastSeen);
+	default:
+		return mkstr("%i:%s", Record->AcctID, Record->Name ? Record->Name : "");
 	}
+}
+
+/**
+ * \brief Parse a cursor from Server_int_FormatCursor
+ * \param Record	Filled with the sort key (Name is a heap string)
+ * \return Boolean failure
+ */
+int Server_int_ParseCursor(const char *Str, int Sort, tAcctRecord *Record)
+{
+	char	*end;
 	
-	if( flags & USER_FLAG_DISABLED )
-		disabled = ",disabled";
-	if( flags & USER_FLAG_DOORGROUP )
-		door = ",door";
+	memset(Record, 0, sizeof(*Record));
+	Record->AcctID = strtol(Str, &end, 10);
+	if( end == Str || *end != ':' )
+		return 1;
+	Str = end + 1;
 	
-	// TODO: User flags/type
-	sendf(
-		Client->Socket, "202 User %s %i %s%s%s\n",
-		Bank_GetAcctName(UserID), Bank_GetBalance(UserID),
-		type, disabled, door
-		);
+	switch( Sort & BANK_ITFLAG_SORTMASK )
+	{
+	case BANK_ITFLAG_SORT_BAL:
+		Record->Balance = strtol(Str, &end, 10);
+		if( end == Str || *end != '\0' )	return 1;
+		break;
+	case BANK_ITFLAG_SORT_LASTSEEN:
+		Record->LastSeen = strtoll(Str, &end, 10);
+		if( end == Str || *end != '\0' )	return 1;
+		break;
+	default:
+		Record->Name = strdup(Str);
+		break;
+	}
+	return 0;
+}
+
+void Server_int_FreeEnum(tEnumState *State)
+{
+	free( (char*)State->Cursor.Name );
+	free(State->PageEnd);
+	free(State->OutBuf);
+	free(State);
 }
 
 void Server_Cmd_USERADD(tClient *Client, char *Args)
@@ -1426,22 +2962,18 @@ void Server_Cmd_USERADD(tClient *Client, char *Args)
 	}
 	
 	// Check permissions
-	if( !(Bank_GetFlags(Client->UID) & USER_FLAG_ADMIN) ) {
+	if( !(Server_int_GetUserFlags(Client) & USER_FLAG_ADMIN) ) {
 		sendf(Client->Socket, "403 Not a coke admin\n");
 		return ;
 	}
 	
 	// Try to create user
-	if( Bank_CreateAcct(username) == -1 ) {
+	if( AcctCache_CreateAcct(username) == -1 ) {
 		sendf(Client->Socket, "404 User exists\n");
 		return ;
 	}
 	
-	{
-		char	*thisName = Bank_GetAcctName(Client->UID);
-		Log_Info("Account '%s' created by '%s'", username, thisName);
-		free(thisName);
-	}
+	Log_Info("Account '%s' created by '%s'", username, AcctCache_GetAcctName(Client->UID));
 	
 	sendf(Client->Socket, "200 User Added\n");
 }
@@ -1468,13 +3000,13 @@ void Server_Cmd_USERFLAGS(tClient *Client, char *Args)
 	}
 	
 	// Check permissions
-	if( !(Bank_GetFlags(Client->UID) & USER_FLAG_ADMIN) ) {
+	if( !(Server_int_GetUserFlags(Client) & USER_FLAG_ADMIN) ) {
 		sendf(Client->Socket, "403 Not a coke admin\n");
 		return ;
 	}
 	
 	// Get UID
-	uid = Bank_GetAcctByName(username, 0);
+	uid = AcctCache_GetAcctByName(username, 0);
 	if( uid == -1 ) {
 		sendf(Client->Socket, "404 User '%s' not found\n", username);
 		return ;
@@ -1489,7 +3021,7 @@ void Server_Cmd_USERFLAGS(tClient *Client, char *Args)
 			uid, username, mask, value);
 	
 	// Apply flags
-	Bank_SetFlags(uid, mask, value);
+	AcctCache_SetFlags(uid, mask, value);
 
 	// Log the change
 	Log_Info("Updated '%s' with flag set '%s' by '%s' - Reason: %s",
@@ -1516,7 +3048,7 @@ void Server_Cmd_UPDATEITEM(tClient *Client, char *Args)
 	}
 
 	// Check user permissions
-	if( !(Bank_GetFlags(Client->UID) & (USER_FLAG_COKE|USER_FLAG_ADMIN))  ) {
+	if( !(Server_int_GetUserFlags(Client) & (USER_FLAG_COKE|USER_FLAG_ADMIN))  ) {
 		sendf(Client->Socket, "403 Not in coke\n");
 		return ;
 	}
@@ -1544,6 +3076,66 @@ void Server_Cmd_UPDATEITEM(tClient *Client, char *Args)
 	}
 }
 
+/**
+ * \brief Add stock to an item in a machine that can't sense it
+ *
+ * Usage: RESTOCK <item_id> <count>
+ */
+void Server_Cmd_RESTOCK(tClient *Client, char *Args)
+{
+	char	*itemname, *count_str, *end;
+	 int	count, stock;
+	long	lcount;
+	tItem	*item;
+	
+	if( Server_int_ParseArgs(0, Args, &itemname, &count_str, NULL) ) {
+		sendf(Client->Socket, "407 RESTOCK takes 2 arguments\n");
+		return ;
+	}
+	
+	if( !Client->bIsAuthed ) {
+		sendf(Client->Socket, "401 Not Authenticated\n");
+		return ;
+	}
+
+	// Check user permissions
+	if( !(Server_int_GetUserFlags(Client) & (USER_FLAG_COKE|USER_FLAG_ADMIN))  ) {
+		sendf(Client->Socket, "403 Not in coke\n");
+		return ;
+	}
+	
+	errno = 0;
+	lcount = strtol(count_str, &end, 10);
+	if( *count_str == '\0' || *end != '\0' || errno
+	 || lcount < -MAX_ITEM_STOCK || lcount > MAX_ITEM_STOCK ) {
+		sendf(Client->Socket, "407 Invalid count\n");
+		return ;
+	}
+	count = lcount;
+	
+	item = _GetItemFromString(itemname);
+	if( !item ) {
+		sendf(Client->Socket, "406 Bad Item ID\n");
+		return ;
+	}
+	
+	// Both are bounded, so this can't overflow
+	if( item->Handler->bCountStock && (item->Stock == -1 ? 0 : item->Stock) + count > MAX_ITEM_STOCK ) {
+		sendf(Client->Socket, "407 Invalid count (stock would be over "EXPSTR(MAX_ITEM_STOCK)")\n");
+		return ;
+	}
+	
+	stock = Items_Restock(item, count);
+	if( stock == -1 ) {
+		sendf(Client->Socket, "501 Stock not counted for %s\n", item->Handler->Name);
+		return ;
+	}
+	
+	Log_Info("restock %s:%i by %i to %i by %s",
+		item->Handler->Name, item->ID, count, stock, AcctCache_GetAcctName(Client->UID));
+	sendf(Client->Socket, "200 Stock %s:%i %i\n", item->Handler->Name, item->ID, stock);
+}
+
 void Server_Cmd_PINCHECK(tClient *Client, char *Args)
 {
 	char	*username, *pinstr;
@@ -1567,44 +3159,36 @@ void Server_Cmd_PINCHECK(tClient *Client, char *Args)
 	}
 	
 	// Get user
-	int uid = Bank_GetAcctByName(username, 0);
+	int uid = AcctCache_GetAcctByName(username, 0);
 	if( uid == -1 ) {
 		sendf(Client->Socket, "404 User '%s' not found\n", username);
 		return ;
 	}
 	
 	// Check user permissions
-	if( uid != Client->UID && !(Bank_GetFlags(Client->UID) & (USER_FLAG_COKE|USER_FLAG_ADMIN))  ) {
+	if( uid != Client->UID && !(Server_int_GetUserFlags(Client) & (USER_FLAG_COKE|USER_FLAG_ADMIN))  ) {
 		sendf(Client->Socket, "403 Not in coke\n");
 		return ;
 	}
 	
-	// Get the pin
-	static time_t	last_wrong_pin_time;
-	static int	backoff = 1;
-	if( time(NULL) - last_wrong_pin_time < backoff ) {
-		sendf(Client->Socket, "407 Rate limited (%i seconds remaining)\n",
-			backoff - (time(NULL) - last_wrong_pin_time));
+	// Limited per (account, address), see pinlimit.c
+	int wait = PinLimit_Check(uid, Client->SourceAddr);
+	if( wait > 0 ) {
+		sendf(Client->Socket, "407 Rate limited (%i seconds remaining)\n", wait);
 		return ;
-	}	
-	last_wrong_pin_time = time(NULL);
+	}
 	if( !Bank_IsPinValid(uid, pin) )
 	{
+		struct in_addr	addr = {htonl(Client->SourceAddr)};
+		char ipstr[INET_ADDRSTRLEN];
 		sendf(Client->Socket, "201 Pin incorrect\n");
-		struct sockaddr_storage	addr;
-		socklen_t len = sizeof(addr);
-		char ipstr[INET6_ADDRSTRLEN];
-		getpeername(Client->Socket, (void*)&addr, &len);
-		struct sockaddr_in *s = (struct sockaddr_in *)&addr;
-		inet_ntop(addr.ss_family, &s->sin_addr, ipstr, sizeof(ipstr));
+		inet_ntop(AF_INET, &addr, ipstr, sizeof(ipstr));
 		Debug_Notice("Bad pin from %s for %s by %i", ipstr, username, Client->UID);
-		if( backoff < 5)
-			backoff ++;
+		PinLimit_Failure(uid, Client->SourceAddr);
 		return ;
 	}
 
-	last_wrong_pin_time = 0;
-	backoff = 1;
+	PinLimit_Success(uid, Client->SourceAddr);
 	sendf(Client->Socket, "200 Pin correct\n");
 	return ;
 }
@@ -1639,6 +3223,84 @@ void Server_Cmd_PINSET(tClient *Client, char *Args)
 	return ;
 }
 
+/**
+ * \brief Set the password used by PASS
+ *
+ * Usage: PASS_SET <hash>
+ * <hash> is what PASS would send (with no salt) for the new password,
+ * it is set for the authenticated user
+ */
+void Server_Cmd_PASSSET(tClient *Client, char *Args)
+{
+	char	*passhash;
+	 int	uid;
+	
+	if( Server_int_ParseArgs(0, Args, &passhash, NULL) ) {
+		sendf(Client->Socket, "407 PASS_SET takes 1 argument\n");
+		return ;
+	}
+	
+	if( strlen(passhash) != HASH_LENGTH*2 || strspn(passhash, "0123456789abcdefABCDEF") != HASH_LENGTH*2 ) {
+		sendf(Client->Socket, "407 Password hash should be "EXPSTR(HASH_LENGTH)" hex-encoded bytes\n");
+		return ;
+	}
+	
+	if( !Client->bIsAuthed ) {
+		sendf(Client->Socket, "401 Not Authenticated\n");
+		return ;
+	}
+	
+	// Only the password of the user that logged in (not a SETEUSER user)
+	uid = Client->UID;
+	if( Bank_SetPassword(uid, passhash) ) {
+		sendf(Client->Socket, "501 Password can't be changed here\n");
+		return ;
+	}
+	sendf(Client->Socket, "200 Password updated\n");
+}
+
+/**
+ * \brief Register a MIFARE card to the (effective) user
+ *
+ * Usage: ADD_CARD <card_id_hex>
+ */
+void Server_Cmd_ADDCARD(tClient *Client, char *Args)
+{
+	char	*cardid;
+	 int	uid;
+	
+	if( Server_int_ParseArgs(0, Args, &cardid, NULL) ) {
+		sendf(Client->Socket, "407 ADD_CARD takes 1 argument\n");
+		return ;
+	}
+	
+	if( !Client->bIsAuthed ) {
+		sendf(Client->Socket, "401 Not Authenticated\n");
+		return ;
+	}
+	
+	uid = Client->EffectiveUID;
+	if(uid == -1)
+		uid = Client->UID;
+	
+	switch( Bank_AddAcctCard(uid, cardid) )
+	{
+	case 0:
+		Log_Info("Card %s registered to account %i by '%s'", cardid, uid, Client->Username);
+		sendf(Client->Socket, "200 User Updated\n");
+		break;
+	case 2:
+		sendf(Client->Socket, "405 Card already registered\n");
+		break;
+	case -1:
+		sendf(Client->Socket, "407 Bad Card ID\n");
+		break;
+	default:
+		sendf(Client->Socket, "500 Unable to add card\n");
+		break;
+	}
+}
+
 // --- INTERNAL HELPERS ---
 void Debug(tClient *Client, const char *Format, ...)
 {
@@ -1670,8 +3332,140 @@ int sendf(int Socket, const char *Format, ...)
 		printf("sendf: %s", buf);
 		#endif
 		
-		return send(Socket, buf, len, 0);
+		return Server_int_SendRaw(Socket, buf, len);
+	}
+}
+
+/**
+ * \brief Send preformatted reply text (honours capturing)
+ */
+int Server_int_SendRaw(int Socket, const char *Data, int Length)
+{
+	// Captured replies are kept for later
+	if( Socket == giServer_CaptureSocket )
+	{
+		char	*tmp = realloc(gsServer_CaptureBuf, giServer_CaptureLen + Length + 1);
+		if( !tmp )	return -1;
+		gsServer_CaptureBuf = tmp;
+		memcpy(gsServer_CaptureBuf + giServer_CaptureLen, Data, Length);
+		giServer_CaptureLen += Length;
+		gsServer_CaptureBuf[giServer_CaptureLen] = '\0';
+		return Length;
+	}
+	
+	return send(Socket, Data, Length, 0);
+}
+
+/**
+ * \brief Append a formatted line to a reply arena
+ * \return Boolean failure (out of memory)
+ */
+int Arena_Printf(tReplyArena *Arena, const char *Format, ...)
+{
+	va_list	args;
+	tArenaBlock	*blk = Arena->Last;
+	 int	len;
+	
+	va_start(args, Format);
+	len = vsnprintf(blk ? blk->Data + blk->Used : NULL, blk ? blk->Space - blk->Used : 0, Format, args);
+	va_end(args);
+	if( len < 0 )	return 1;
+	
+	// Didn't fit, start a new block and format again
+	if( !blk || blk->Used + len + 1 > blk->Space )
+	{
+		size_t	space = REPLY_ARENA_CHUNK;
+		if( (size_t)len + 1 > space )	space = len + 1;
+		
+		blk = malloc(sizeof(tArenaBlock) + space);
+		if( !blk )	return 1;
+		blk->Next = NULL;
+		blk->Used = 0;
+		blk->Space = space;
+		if( Arena->Last )
+			Arena->Last->Next = blk;
+		else
+			Arena->First = blk;
+		Arena->Last = blk;
+		
+		va_start(args, Format);
+		vsnprintf(blk->Data, blk->Space, Format, args);
+		va_end(args);
+	}
+	
+	blk->Used += len;
+	return 0;
+}
+
+/**
+ * \brief Send everything in a reply arena
+ */
+void Arena_Send(tReplyArena *Arena, int Socket)
+{
+	for( tArenaBlock *blk = Arena->First; blk; blk = blk->Next )
+	{
+		size_t	ofs = 0;
+		while( ofs < blk->Used )
+		{
+			 int	rv = Server_int_SendRaw(Socket, blk->Data + ofs, blk->Used - ofs);
+			if( rv <= 0 ) {
+				if( rv < 0 && errno == EINTR )	continue;
+				return ;
+			}
+			ofs += rv;
+		}
+	}
+}
+
+/**
+ * \brief Send a reply arena without blocking (for pushed lines)
+ * \return Boolean failure (socket error, or not all of it fit)
+ */
+int Arena_Push(tReplyArena *Arena, int Socket)
+{
+	for( tArenaBlock *blk = Arena->First; blk; blk = blk->Next )
+	{
+		if( send(Socket, blk->Data, blk->Used, MSG_DONTWAIT) != (ssize_t)blk->Used )
+			return 1;
+	}
+	return 0;
+}
+
+/**
+ * \brief Release all blocks in a reply arena
+ */
+void Arena_Free(tReplyArena *Arena)
+{
+	while( Arena->First )
+	{
+		tArenaBlock	*next = Arena->First->Next;
+		free(Arena->First);
+		Arena->First = next;
 	}
+	Arena->Last = NULL;
+}
+
+/**
+ * \brief Start capturing everything sent to \a Socket by sendf
+ */
+void Server_int_BeginCapture(int Socket)
+{
+	giServer_CaptureSocket = Socket;
+	gsServer_CaptureBuf = NULL;
+	giServer_CaptureLen = 0;
+}
+
+/**
+ * \brief Stop capturing and return the captured text
+ * \return Heap string (or NULL if nothing was sent)
+ */
+char *Server_int_EndCapture(void)
+{
+	char	*ret = gsServer_CaptureBuf;
+	giServer_CaptureSocket = -1;
+	gsServer_CaptureBuf = NULL;
+	giServer_CaptureLen = 0;
+	return ret;
 }
 
 // Takes a series of char *'s in
@@ -1731,7 +3525,9 @@ int Server_int_ParseArgs(int bUseLongLast, char *ArgStr, ...)
 		}
 		savedChar = *ArgStr;	// savedChar is used to un-mangle the last string
 		*ArgStr = '\0';
-		ArgStr ++;
+		// Don't step past the end (the input buffer may hold more lines)
+		if( savedChar )
+			ArgStr ++;
 	}
 	va_end(args);
 	
@@ -1741,7 +3537,7 @@ int Server_int_ParseArgs(int bUseLongLast, char *ArgStr, ...)
 	}
 	
 	// Un-mangle last
-	if(bUseLongLast) {
+	if(bUseLongLast && savedChar) {
 		ArgStr --;
 		*ArgStr = savedChar;
 	}
@@ -1816,3 +3612,41 @@ int Server_int_ParseFlags(tClient *Client, const char *Str, int *Mask, int *Valu
 	return 0;
 }
 
+/**
+ * \brief Forget cached flags if any account's flags have changed
+ */
+static void Server_int_CheckFlagsEpoch(tClient *Client)
+{
+	unsigned int	epoch = Bank_GetFlagsEpoch();
+	if( Client->FlagsEpoch != epoch ) {
+		Client->FlagsEpoch = epoch;
+		Client->FlagsUID = Client->FlagsEUID = -2;
+	}
+}
+
+/**
+ * \brief Get the flags of the authenticated user (Bank_GetFlags(Client->UID))
+ * \note Cached until the account changes or Bank_SetFlags is called on any account
+ */
+int Server_int_GetUserFlags(tClient *Client)
+{
+	Server_int_CheckFlagsEpoch(Client);
+	if( Client->FlagsUID != Client->UID ) {
+		Client->UserFlags = AcctCache_GetFlags(Client->UID);
+		Client->FlagsUID = Client->UID;
+	}
+	return Client->UserFlags;
+}
+
+/**
+ * \brief Get the flags of the effective user (Bank_GetFlags(Client->EffectiveUID))
+ */
+int Server_int_GetEffectiveFlags(tClient *Client)
+{
+	Server_int_CheckFlagsEpoch(Client);
+	if( Client->FlagsEUID != Client->EffectiveUID ) {
+		Client->EffectiveFlags = AcctCache_GetFlags(Client->EffectiveUID);
+		Client->FlagsEUID = Client->EffectiveUID;
+	}
+	return Client->EffectiveFlags;
+}